@@ -0,0 +1,82 @@
+#ifndef EXT2DRIVER_H
+#define EXT2DRIVER_H
+
+/*
+ * Read-only access to ext2 images from inside another process. Every call returns EXT2_OK or a negative
+ * ext2_error, a corrupted image or a failing device never ends the caller. Diagnostics still go to stderr.
+ *
+ * An image handle may be shared by threads. Structures are only ever extended at the end, check
+ * ext2_api_version() before using fields added after version 1.
+ */
+
+#include <stddef.h>
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#if defined(_WIN32)
+#define EXT2_EXPORT
+#else
+#define EXT2_EXPORT __attribute__((visibility("default")))
+#endif
+
+#define EXT2_API_VERSION 1
+
+#define EXT2_ROOT_INODE 2
+
+#define EXT2_OPEN_DIRECT       0x1 /* Bypass the page cache with O_DIRECT where the host filesystem allows it */
+#define EXT2_OPEN_SHARED_CACHE 0x2 /* Share metadata reads with the other processes of the user through shm */
+
+enum ext2_error {
+    EXT2_OK                  = 0,
+    EXT2_ERROR_IO            = -1, /* errno holds the cause */
+    EXT2_ERROR_NOT_FOUND     = -2,
+    EXT2_ERROR_NOT_DIRECTORY = -3,
+    EXT2_ERROR_IS_DIRECTORY  = -4,
+    EXT2_ERROR_INVALID       = -5, /* A bad argument, e.g. a relative path or an inode number out of range */
+    EXT2_ERROR_CORRUPTED     = -6, /* The image is inconsistent or uses unsupported features */
+    EXT2_ERROR_NO_MEMORY     = -7,
+};
+
+typedef struct ext2_image ext2_image;
+
+struct ext2_stat {
+    uint32_t inode;
+    uint32_t mode; /* File type and permission bits, as in st_mode */
+    uint32_t links;
+    uint32_t uid;
+    uint32_t gid;
+    uint64_t size;
+    uint64_t sectors; /* 512 byte units allocated, indirect blocks included */
+    int64_t  access_time;
+    int64_t  modification_time;
+    int64_t  change_time;
+};
+
+/* Returns a positive value to stop the iteration. The name is not NUL-terminated and only valid during the call */
+typedef int (*ext2_directory_callback)(const char* name, size_t name_length, uint32_t inode, void* context);
+
+EXT2_EXPORT uint32_t    ext2_api_version(void);
+EXT2_EXPORT const char* ext2_strerror(int error);
+
+EXT2_EXPORT int  ext2_open(const char* path, uint32_t flags, ext2_image** image);
+EXT2_EXPORT void ext2_close(ext2_image* image);
+
+/* The path must be absolute, symlinks are not followed */
+EXT2_EXPORT int ext2_lookup(ext2_image* image, const char* path, uint32_t* inode);
+/* Many paths at once, each directory they share is read once. inodes[i] is 0 when paths[i] isn't there */
+EXT2_EXPORT int ext2_lookup_paths(ext2_image* image, const char* const* paths, size_t count, uint32_t* inodes);
+EXT2_EXPORT int ext2_stat(ext2_image* image, uint32_t inode, struct ext2_stat* stat);
+/* Regular files only. Returns the number of bytes read, short only at the end of the file, or an ext2_error */
+EXT2_EXPORT int64_t ext2_read(ext2_image* image, uint32_t inode, uint64_t offset, void* buffer, uint64_t length);
+/* Every live entry, "." and ".." included, in on-disk order. Returns the callback's value if it stopped */
+EXT2_EXPORT int ext2_iterate_directory(ext2_image* image, uint32_t inode, ext2_directory_callback callback,
+                                       void* context);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
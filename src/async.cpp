@@ -0,0 +1,190 @@
+#include "async.hpp"
+
+#include "device.hpp"
+#include "filesystem.hpp"
+#include "helpers.hpp"
+#include "inode.hpp"
+
+void Task::FinalAwaiter::await_suspend(Handle handle) noexcept
+{
+    IoLoop* loop = handle.promise().loop;
+    handle.destroy();
+    loop->finish_task();
+}
+
+IoLoop::IoLoop(u32 io_threads)
+{
+    if (io_threads == 0) io_threads = 1;
+    for (u32 i = 0; i < io_threads; i++) this->workers.emplace_back(&IoLoop::worker, this);
+}
+
+IoLoop::~IoLoop()
+{
+    {
+        std::lock_guard<std::mutex> guard(this->lock);
+        this->stopping = true;
+    }
+
+    this->submitted.notify_all();
+    for (std::thread& thread : this->workers) thread.join();
+}
+
+void IoLoop::spawn(Task task)
+{
+    Task::Handle handle = task.handle;
+    task.handle         = NULL;
+
+    handle.promise().loop = this;
+
+    std::lock_guard<std::mutex> guard(this->lock);
+    this->running_tasks++;
+    this->ready.push_back(handle);
+}
+
+void IoLoop::run()
+{
+    std::unique_lock<std::mutex> guard(this->lock);
+
+    while (this->running_tasks > 0) {
+        this->completed.wait(guard, [this] { return !this->ready.empty() || this->running_tasks == 0; });
+        if (this->ready.empty()) break;
+
+        std::coroutine_handle<> handle = this->ready.front();
+        this->ready.pop_front();
+
+        guard.unlock();
+        handle.resume();
+        guard.lock();
+    }
+}
+
+void IoLoop::finish_task()
+{
+    std::lock_guard<std::mutex> guard(this->lock);
+    this->running_tasks--;
+}
+
+void IoLoop::worker()
+{
+    std::unique_lock<std::mutex> guard(this->lock);
+
+    while (true) {
+        this->submitted.wait(guard, [this] { return !this->submissions.empty() || this->stopping; });
+        if (this->submissions.empty()) return;
+
+        Request request = this->submissions.front();
+        this->submissions.pop_front();
+
+        guard.unlock();
+        request.device->read(request.offset, request.buffer, request.length);
+        guard.lock();
+
+        this->ready.push_back(request.waiter);
+        this->completed.notify_one();
+    }
+}
+
+void IoLoop::ReadAwaiter::await_suspend(std::coroutine_handle<> waiter)
+{
+    this->request.waiter = waiter;
+
+    {
+        std::lock_guard<std::mutex> guard(this->loop->lock);
+        this->loop->submissions.push_back(this->request);
+    }
+
+    this->loop->submitted.notify_one();
+}
+
+IoLoop::ReadAwaiter IoLoop::read_block(Filesystem& fs, u32 block_address, u8* buffer)
+{
+    return this->read(*fs.device, fs.block_offset(block_address), buffer, fs.block_size);
+}
+
+AsyncGenerator<std::span<u8>> async_blocks(IoLoop& loop, Filesystem& fs, Inode inode, u8* buffer)
+{
+    const u64 block_size         = fs.block_size;
+    const u64 pointers_per_block = block_size / 4;
+    const u64 file_size          = inode.size_in_bytes(&fs);
+    const u64 block_count        = (file_size + block_size - 1) / block_size;
+
+    /* One pointer block per indirection level, kept in the coroutine frame */
+    std::vector<u8> pointer_blocks(3 * block_size);
+    u64             logical_block = 0;
+
+    auto block_span = [&](u64 logical) {
+        const u64 remaining = file_size - logical * block_size;
+        return std::span<u8>(buffer, (remaining < block_size) ? remaining : block_size);
+    };
+
+    for (; logical_block < Inode::NDIR_BLOCKS && logical_block < block_count; logical_block++) {
+        const u32 pointer = inode.block_pointers[logical_block];
+
+        if (pointer)
+            co_await loop.read_block(fs, pointer, buffer);
+        else
+            memset(buffer, 0, block_size);
+
+        co_yield block_span(logical_block);
+    }
+
+    for (u32 depth = 0; depth < 3 && logical_block < block_count; depth++) {
+        u64 span = pointers_per_block;
+        for (u32 i = 0; i < depth; i++) span *= pointers_per_block;
+
+        const u32 root = inode.block_pointers[Inode::IND_BLOCK + depth];
+        if (!root) {
+            for (u64 end = logical_block + span; logical_block < end && logical_block < block_count; logical_block++) {
+                memset(buffer, 0, block_size);
+                co_yield block_span(logical_block);
+            }
+            continue;
+        }
+
+        u32* levels[3];
+        u64  indices[3] = {0, 0, 0};
+        for (u32 i = 0; i < 3; i++) levels[i] = (u32*)(pointer_blocks.data() + i * block_size);
+
+        co_await loop.read_block(fs, root, (u8*)levels[0]);
+
+        i32 level = 0;
+        while (level >= 0 && logical_block < block_count) {
+            if (indices[level] == pointers_per_block) {
+                level--;
+                continue;
+            }
+
+            const u32 pointer = levels[level][indices[level]++];
+
+            if ((u32)level == depth) {
+                if (pointer)
+                    co_await loop.read_block(fs, pointer, buffer);
+                else
+                    memset(buffer, 0, block_size);
+
+                co_yield block_span(logical_block++);
+            } else if (pointer) {
+                co_await loop.read_block(fs, pointer, (u8*)levels[level + 1]);
+                indices[++level] = 0;
+            } else {
+                memset(levels[level + 1], 0, block_size);
+                indices[++level] = 0;
+            }
+        }
+    }
+}
+
+AsyncGenerator<DirectoryEntry*> async_dir_entries(IoLoop& loop, Filesystem& fs, Inode inode, u8* buffer)
+{
+    AsyncGenerator<std::span<u8>> blocks = async_blocks(loop, fs, inode, buffer);
+
+    while (std::optional<std::span<u8>> block = co_await blocks.next()) {
+        for (u64 offset = 0; offset + 8 <= block->size();) {
+            DirectoryEntry* entry = (DirectoryEntry*)(block->data() + offset);
+            if (entry->total_entry_size == 0) break;
+
+            offset += entry->total_entry_size;
+            if (entry->inode != 0) co_yield entry;
+        }
+    }
+}
@@ -0,0 +1,184 @@
+#pragma once
+
+#include "helpers.hpp"
+
+#include <condition_variable>
+#include <coroutine>
+#include <deque>
+#include <exception>
+#include <mutex>
+#include <optional>
+#include <span>
+#include <thread>
+#include <vector>
+
+class BlockDevice;
+class Filesystem;
+class IoLoop;
+struct DirectoryEntry;
+struct Inode;
+
+/* A detached coroutine, started and owned by an IoLoop */
+class Task
+{
+  public:
+    struct promise_type;
+    using Handle = std::coroutine_handle<promise_type>;
+
+    struct FinalAwaiter {
+        bool await_ready() noexcept { return false; }
+        void await_suspend(Handle handle) noexcept;
+        void await_resume() noexcept {}
+    };
+
+    struct promise_type {
+        IoLoop* loop = NULL;
+
+        Task                get_return_object() { return Task(Handle::from_promise(*this)); }
+        std::suspend_always initial_suspend() noexcept { return {}; }
+        FinalAwaiter        final_suspend() noexcept { return {}; }
+        void                return_void() {}
+        void                unhandled_exception() { std::terminate(); }
+    };
+
+  private:
+    Handle handle;
+
+    explicit Task(Handle handle) : handle(handle) {}
+
+  public:
+    Task(Task&& other) noexcept : handle(other.handle) { other.handle = NULL; }
+    Task(const Task&) = delete;
+    ~Task()
+    {
+        if (this->handle) this->handle.destroy();
+    }
+
+    friend class IoLoop;
+};
+
+/*
+ * A generator that can co_await inside its body. Consumers pull values with
+ * `while (auto value = co_await generator.next())`, control is passed back and forth by symmetric transfer.
+ */
+template <typename T> class AsyncGenerator
+{
+  public:
+    struct promise_type;
+    using Handle = std::coroutine_handle<promise_type>;
+
+    struct TransferToConsumer {
+        bool                    await_ready() noexcept { return false; }
+        std::coroutine_handle<> await_suspend(Handle handle) noexcept { return handle.promise().consumer; }
+        void                    await_resume() noexcept {}
+    };
+
+    struct promise_type {
+        std::optional<T>        current;
+        std::coroutine_handle<> consumer;
+
+        AsyncGenerator      get_return_object() { return AsyncGenerator(Handle::from_promise(*this)); }
+        std::suspend_always initial_suspend() noexcept { return {}; }
+        TransferToConsumer  final_suspend() noexcept { return {}; }
+        void                return_void() { this->current.reset(); }
+        void                unhandled_exception() { std::terminate(); }
+
+        TransferToConsumer yield_value(T value)
+        {
+            this->current = std::move(value);
+            return {};
+        }
+    };
+
+    struct NextAwaiter {
+        Handle handle;
+
+        bool await_ready() noexcept { return this->handle.done(); }
+
+        std::coroutine_handle<> await_suspend(std::coroutine_handle<> consumer) noexcept
+        {
+            this->handle.promise().consumer = consumer;
+            this->handle.promise().current.reset();
+            return this->handle;
+        }
+
+        std::optional<T> await_resume() { return this->handle.promise().current; }
+    };
+
+  private:
+    Handle handle;
+
+    explicit AsyncGenerator(Handle handle) : handle(handle) {}
+
+  public:
+    AsyncGenerator(AsyncGenerator&& other) noexcept : handle(other.handle) { other.handle = NULL; }
+    AsyncGenerator(const AsyncGenerator&) = delete;
+    ~AsyncGenerator()
+    {
+        if (this->handle) this->handle.destroy();
+    }
+
+    /* Resolves to std::nullopt once the generator is exhausted */
+    NextAwaiter next() { return {this->handle}; }
+};
+
+/*
+ * Runs coroutines on the calling thread, while blocking reads are executed by a pool of I/O threads.
+ * A coroutine awaiting a read is resumed on the loop thread once the read completes, so a single
+ * thread can keep as many reads in flight as there are I/O threads.
+ */
+class IoLoop
+{
+  private:
+    struct Request {
+        BlockDevice*            device;
+        u64                     offset;
+        void*                   buffer;
+        usize                   length;
+        std::coroutine_handle<> waiter;
+    };
+
+    std::mutex                          lock;
+    std::condition_variable             submitted;
+    std::condition_variable             completed;
+    std::deque<Request>                 submissions;
+    std::deque<std::coroutine_handle<>> ready;
+    std::vector<std::thread>            workers;
+    usize                               running_tasks = 0;
+    bool                                stopping      = false;
+
+  public:
+    struct ReadAwaiter {
+        IoLoop* loop;
+        Request request;
+
+        bool await_ready() noexcept { return false; }
+        void await_suspend(std::coroutine_handle<> waiter);
+        void await_resume() noexcept {}
+    };
+
+    explicit IoLoop(u32 io_threads = 32);
+    ~IoLoop();
+
+    void spawn(Task task);
+    void run(); /* Returns once every spawned task has finished */
+
+    inline ReadAwaiter read(BlockDevice& device, u64 offset, void* buffer, usize length)
+    {
+        return {this, {&device, offset, buffer, length, NULL}};
+    }
+
+    ReadAwaiter read_block(Filesystem& fs, u32 block_address, u8* buffer);
+
+  private:
+    void worker();
+    void finish_task();
+
+    friend struct Task::FinalAwaiter;
+};
+
+/* Yields the data of a file block by block, holes are yielded as zeroed blocks. The buffer must be >= block_size */
+AsyncGenerator<std::span<u8>> async_blocks(IoLoop& loop, Filesystem& fs, Inode inode, u8* buffer);
+
+/* Yields the used entries of a directory. They point into the buffer, which must be >= block_size */
+AsyncGenerator<DirectoryEntry*> async_dir_entries(IoLoop& loop, Filesystem& fs, Inode inode, u8* buffer);
@@ -0,0 +1,72 @@
+#pragma once
+
+#include "helpers.hpp"
+
+#include <atomic>
+
+/*
+ * A thread-safe bitmap split in fixed-size chunks that are only allocated once a bit inside them is set.
+ * Untouched ranges cost a single pointer, which keeps whole-image bitmaps small on sparse images.
+ */
+class SparseBitmap
+{
+  private:
+    using Word = std::atomic<u64>;
+
+    u64                 bits_in_chunk;
+    u64                 chunk_count;
+    std::atomic<Word*>* chunks;
+
+  public:
+    SparseBitmap(u64 size, u64 bits_in_chunk) : bits_in_chunk((bits_in_chunk + 63) & ~63ULL)
+    {
+        this->chunk_count = (size + this->bits_in_chunk - 1) / this->bits_in_chunk;
+        this->chunks      = new std::atomic<Word*>[this->chunk_count];
+        for (u64 i = 0; i < this->chunk_count; i++) this->chunks[i] = NULL;
+    }
+
+    ~SparseBitmap()
+    {
+        for (u64 i = 0; i < this->chunk_count; i++) delete[] this->chunks[i].load();
+        delete[] this->chunks;
+    }
+
+    SparseBitmap(const SparseBitmap&)            = delete;
+    SparseBitmap& operator=(const SparseBitmap&) = delete;
+
+    /* Returns the previous value of the bit */
+    inline bool test_and_set(u64 bit)
+    {
+        Word*     chunk = this->get_chunk(bit / this->bits_in_chunk, true);
+        const u64 index = bit % this->bits_in_chunk;
+        const u64 mask  = 1ULL << (index % 64);
+
+        return (chunk[index / 64].fetch_or(mask, std::memory_order_relaxed) & mask) != 0;
+    }
+
+    inline bool test(u64 bit) const
+    {
+        Word* chunk = this->chunks[bit / this->bits_in_chunk].load(std::memory_order_acquire);
+        if (!chunk) return false;
+
+        const u64 index = bit % this->bits_in_chunk;
+        return (chunk[index / 64].load(std::memory_order_relaxed) >> (index % 64)) & 1;
+    }
+
+    inline bool chunk_allocated(u64 chunk) const { return this->chunks[chunk].load() != NULL; }
+
+  private:
+    inline Word* get_chunk(u64 chunk_index, bool allocate)
+    {
+        Word* chunk = this->chunks[chunk_index].load(std::memory_order_acquire);
+        if (chunk || !allocate) return chunk;
+
+        Word* fresh = new Word[this->bits_in_chunk / 64];
+        for (u64 i = 0; i < this->bits_in_chunk / 64; i++) fresh[i] = 0;
+
+        if (this->chunks[chunk_index].compare_exchange_strong(chunk, fresh, std::memory_order_acq_rel)) return fresh;
+
+        delete[] fresh;
+        return chunk;
+    }
+};
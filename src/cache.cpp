@@ -0,0 +1,192 @@
+#include "cache.hpp"
+
+#include "hash.hpp"
+#include "helpers.hpp"
+#include "trace.hpp"
+
+#include <algorithm>
+#include <fcntl.h>
+#include <string>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+SharedCacheDevice::SharedCacheDevice(const char* path, std::unique_ptr<BlockDevice> inner) : inner(std::move(inner))
+{
+    struct stat info;
+    if (stat(path, &info) < 0) PANIC_FROM_ERRNO("Failed to stat %s", path);
+
+    /* The superblock area, write time and free counts included, changes with every modification */
+    u8 superblock[1024] = {};
+    this->inner->read(1024, superblock, std::min<u64>(sizeof(superblock), this->size() - 1024));
+
+    const u64 identity[] = {info.st_dev, info.st_ino, (u64)info.st_size,
+                            (u64)(info.st_mtim.tv_sec * 1000000000l + info.st_mtim.tv_nsec)};
+
+    this->image = XXHash64::hash({superblock, sizeof(superblock)},
+                                 XXHash64::hash({(const u8*)identity, sizeof(identity)})) |
+                  1;
+
+    this->attach();
+}
+
+SharedCacheDevice::~SharedCacheDevice()
+{
+    if (this->segment) munmap(this->segment, this->segment_size);
+}
+
+bool SharedCacheDevice::attach()
+{
+    const std::string name = "/ext2driver-cache-" + std::to_string(geteuid());
+
+    int        fd      = shm_open(name.c_str(), O_RDWR | O_CREAT | O_EXCL, S_IRUSR | S_IWUSR);
+    const bool created = (fd >= 0);
+    if (!created && errno == EEXIST) fd = shm_open(name.c_str(), O_RDWR, 0);
+    if (fd < 0) return false;
+
+    /* The table only ever costs the pages that were touched */
+    const u64 sets        = SEGMENT_SIZE / (sizeof(Set) + WAYS * PAGE_SIZE);
+    const u64 pages_start = (64 + sets * sizeof(Set) + PAGE_SIZE - 1) / PAGE_SIZE * PAGE_SIZE;
+    const u64 size        = pages_start + sets * WAYS * PAGE_SIZE;
+
+    struct stat info;
+    bool        usable = fstat(fd, &info) == 0;
+
+    /* Someone else's segment could feed this process any data it likes */
+    if (usable && !created) usable = info.st_uid == geteuid() && (info.st_mode & 077) == 0 && (u64)info.st_size == size;
+    if (usable && created) usable = ftruncate(fd, size) == 0;
+
+    if (usable) {
+        void* mapping = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+        if (mapping != MAP_FAILED) this->segment = (u8*)mapping;
+    }
+
+    if (created && !this->segment) shm_unlink(name.c_str());
+    close(fd);
+
+    if (!this->segment) return false;
+    this->segment_size = size;
+
+    Header* header = (Header*)this->segment;
+
+    if (created) {
+        header->sets = sets;
+        header->magic.store(MAGIC, std::memory_order_release);
+    } else if (header->magic.load(std::memory_order_acquire) != MAGIC || header->sets != sets) {
+        /* Still being set up, or laid out by another version */
+        munmap(this->segment, this->segment_size);
+        this->segment = NULL;
+        return false;
+    }
+
+    this->set_count = sets;
+    this->sets      = (Set*)(this->segment + 64);
+    this->pages     = this->segment + pages_start;
+
+    return true;
+}
+
+void SharedCacheDevice::read(u64 offset, void* buffer, usize length)
+{
+    if (!this->attached() || length > MAX_CACHED) return this->inner->read(offset, buffer, length);
+    if (offset + length > this->size()) PANIC("Unexpected end of the image at offset %lu.", offset);
+
+    u8* output = (u8*)buffer;
+    u8  page[PAGE_SIZE];
+
+    while (length > 0) {
+        const u64 skip  = offset % PAGE_SIZE;
+        const u64 chunk = std::min<u64>(length, PAGE_SIZE - skip);
+
+        this->read_page(offset / PAGE_SIZE, page);
+        memcpy(output, page + skip, chunk);
+
+        output += chunk;
+        offset += chunk;
+        length -= chunk;
+    }
+}
+
+void SharedCacheDevice::write(u64 offset, const void* buffer, usize length)
+{
+    UNUSED(offset);
+    UNUSED(buffer);
+    UNUSED(length);
+
+    PANIC("Images read through the shared cache are read-only.");
+}
+
+void SharedCacheDevice::read_page(u64 page, u8* buffer)
+{
+    if (this->lookup(page, buffer)) return;
+
+    TRACE_SCOPE_ARG("SharedCacheDevice::miss", "page", page);
+
+    /* The last page of an image that isn't a multiple of the page size is cached zero-padded */
+    const u64 length = std::min(PAGE_SIZE, this->size() - page * PAGE_SIZE);
+    this->inner->read(page * PAGE_SIZE, buffer, length);
+    memset(buffer + length, 0, PAGE_SIZE - length);
+
+    this->insert(page, buffer);
+}
+
+bool SharedCacheDevice::lookup(u64 page, u8* buffer)
+{
+    const u64 set = this->set_of(page);
+
+    for (u32 way = 0; way < WAYS; way++) {
+        Slot& slot = this->sets[set].slots[way];
+
+        const u32 sequence = slot.sequence.load(std::memory_order_acquire);
+        if (sequence & 1) continue;
+        if (slot.image.load(std::memory_order_relaxed) != this->image) continue;
+        if (slot.page.load(std::memory_order_relaxed) != page) continue;
+
+        memcpy(buffer, this->page_data(set, way), PAGE_SIZE);
+
+        /* A writer that started in the meantime may have torn the copy */
+        std::atomic_thread_fence(std::memory_order_acquire);
+        if (slot.sequence.load(std::memory_order_relaxed) != sequence) continue;
+
+        if (!slot.referenced.load(std::memory_order_relaxed)) slot.referenced.store(1, std::memory_order_relaxed);
+        return true;
+    }
+
+    return false;
+}
+
+void SharedCacheDevice::insert(u64 page, const u8* buffer)
+{
+    const u64 set  = this->set_of(page);
+    Set&      ways = this->sets[set];
+
+    /* Two sweeps of the hand clear every reference bit, if all slots are still busy the page isn't cached */
+    for (u32 attempt = 0; attempt < 2 * WAYS; attempt++) {
+        const u32 way  = ways.hand.fetch_add(1, std::memory_order_relaxed) % WAYS;
+        Slot&     slot = ways.slots[way];
+
+        if (slot.referenced.exchange(0, std::memory_order_relaxed)) continue;
+
+        u32 sequence = slot.sequence.load(std::memory_order_relaxed);
+        if (sequence & 1) continue;
+        if (!slot.sequence.compare_exchange_strong(sequence, sequence + 1, std::memory_order_acquire)) continue;
+        std::atomic_thread_fence(std::memory_order_release);
+
+        slot.image.store(this->image, std::memory_order_relaxed);
+        slot.page.store(page, std::memory_order_relaxed);
+        memcpy(this->page_data(set, way), buffer, PAGE_SIZE);
+
+        slot.sequence.store(sequence + 2, std::memory_order_release);
+        return;
+    }
+}
+
+u64 SharedCacheDevice::set_of(u64 page) const
+{
+    /* splitmix64 finalizer, consecutive pages of one image spread over the whole table */
+    u64 key = this->image ^ (page * 0x9E3779B97F4A7C15ULL);
+    key     = (key ^ (key >> 30)) * 0xBF58476D1CE4E5B9ULL;
+    key     = (key ^ (key >> 27)) * 0x94D049BB133111EBULL;
+
+    return (key ^ (key >> 31)) % this->set_count;
+}
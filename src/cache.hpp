@@ -0,0 +1,74 @@
+#pragma once
+
+#include "device.hpp"
+#include "helpers.hpp"
+
+#include <atomic>
+#include <memory>
+
+/*
+ * Serves small reads of a read-only image from a POSIX shared memory segment that every process of the same
+ * user maps, so metadata one process read (group descriptors, inode tables, directories and indirect blocks)
+ * is warm for the next one. Large reads are file data and go straight to the image.
+ *
+ * The segment is a set-associative table of 4 KiB pages keyed by (image, page). The image key hashes its
+ * identity on the host and its superblock, which includes the write time, so a modified image never hits the
+ * pages of its older self, those just age out. Each set evicts with CLOCK, each slot is a seqlock: readers
+ * copy optimistically and retry elsewhere when a writer got in between, writers claim a slot with a CAS.
+ * A process killed while filling a slot leaves that one slot claimed until the segment is removed.
+ */
+class SharedCacheDevice : public BlockDevice
+{
+  private:
+    static constexpr u64   PAGE_SIZE    = 4096;
+    static constexpr u32   WAYS         = 8;
+    static constexpr usize MAX_CACHED   = 4 * PAGE_SIZE; /* Longer reads bypass the cache */
+    static constexpr u64   SEGMENT_SIZE = 64 << 20;
+    static constexpr u64   MAGIC        = 0x3145484341433245; /* "E2CACHE1" */
+
+    struct Slot {
+        std::atomic<u32> sequence;   /* Odd while a writer fills the slot */
+        std::atomic<u32> referenced; /* The CLOCK bit */
+        std::atomic<u64> image;      /* 0 for an empty slot */
+        std::atomic<u64> page;
+    };
+
+    struct Set {
+        std::atomic<u32> hand;
+        Slot             slots[WAYS];
+    };
+
+    struct Header {
+        std::atomic<u64> magic; /* Stored last by the creator, the segment is ignored until then */
+        u64              sets;
+    };
+
+    std::unique_ptr<BlockDevice> inner;
+    u64                          image        = 0;
+    u8*                          segment      = NULL;
+    u64                          segment_size = 0;
+    Set*                         sets         = NULL;
+    u8*                          pages        = NULL;
+    u64                          set_count    = 0;
+
+  public:
+    /* Without a usable segment every read goes to inner, the cache is an optimization only */
+    SharedCacheDevice(const char* path, std::unique_ptr<BlockDevice> inner);
+    ~SharedCacheDevice() override;
+
+    void read(u64 offset, void* buffer, usize length) override;
+    void write(u64 offset, const void* buffer, usize length) override;
+    u64  size() const override { return this->inner->size(); }
+    bool writable() const override { return false; }
+    i64  modification_time() const override { return this->inner->modification_time(); }
+
+    bool attached() const { return this->sets != NULL; }
+
+  private:
+    bool attach(); /* Maps /ext2driver-cache-<uid>, creating it when missing */
+    void read_page(u64 page, u8* buffer);
+    bool lookup(u64 page, u8* buffer);
+    void insert(u64 page, const u8* buffer);
+    u64  set_of(u64 page) const;
+    u8*  page_data(u64 set, u32 way) const { return this->pages + (set * WAYS + way) * PAGE_SIZE; }
+};
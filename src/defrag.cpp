@@ -0,0 +1,145 @@
+#include "defrag.hpp"
+
+#include "filesystem.hpp"
+#include "helpers.hpp"
+#include "inode.hpp"
+#include "trace.hpp"
+
+#include <algorithm>
+#include <chrono>
+
+DefragReport Defragmenter::run(const std::vector<FragmentedFile>& files, double seconds)
+{
+    const auto   deadline = std::chrono::steady_clock::now() + std::chrono::duration<double>(seconds);
+    DefragReport report;
+
+    for (const FragmentedFile& file : files) {
+        if (seconds > 0 && std::chrono::steady_clock::now() >= deadline) {
+            fprintf(this->output, "Stopping, the time budget is spent.\n");
+            break;
+        }
+
+        if (this->move_file(file)) {
+            report.moved_files++;
+            report.moved_blocks += file.blocks;
+        } else {
+            report.skipped_files++;
+        }
+    }
+
+    return report;
+}
+
+bool Defragmenter::move_file(const FragmentedFile& file)
+{
+    TRACE_SCOPE_ARG("Defragmenter::move_file", "inode", file.inode_id);
+
+    Inode inode;
+    this->fs.read_inode(file.inode_id, &inode);
+
+    std::vector<u32> data;
+    std::vector<u32> old_blocks;
+    bool             sparse = false;
+
+    this->fs.walk_block_pointers(inode, [&](u32 block, i64 logical_block) {
+        old_blocks.push_back(block);
+        if (logical_block < 0) return;
+
+        if ((u64)logical_block != data.size()) sparse = true;
+        data.push_back(block);
+    });
+
+    if (sparse) {
+        fprintf(this->output, "SKIPPED  inode %u %s: files with holes are left alone\n", file.inode_id,
+                file.path.c_str());
+        return false;
+    }
+
+    BlockLayout plan;
+    const u32   total = Filesystem::plan_layout(this->fs.block_size, data.size(), []() { return 0u; }, plan);
+
+    if (total != old_blocks.size()) {
+        fprintf(this->output, "SKIPPED  inode %u %s: unexpected indirect block layout\n", file.inode_id,
+                file.path.c_str());
+        return false;
+    }
+
+    const u32 goal_group = (file.inode_id - 1) / this->fs.superblock.inodes_in_block_group;
+    u32       first_block;
+
+    if (!this->fs.find_free_run(total, goal_group, &first_block)) {
+        fprintf(this->output, "SKIPPED  inode %u %s: no free run of %u blocks\n", file.inode_id, file.path.c_str(),
+                total);
+        return false;
+    }
+
+    u32 next_block = first_block;
+    Filesystem::plan_layout(this->fs.block_size, data.size(), [&]() { return next_block++; }, plan);
+
+    /* Claim the new run first. From here on a crash only leaks it */
+    this->fs.set_blocks_allocated(first_block, total, true);
+    this->fs.write_bgds();
+    this->fs.write_superblock();
+    this->fs.device->flush();
+
+    this->copy_run(plan, data, first_block);
+    this->fs.device->flush();
+
+    /* The single inode write is the switch from the old blocks to the new ones */
+    memcpy(inode.block_pointers, plan.pointers, sizeof(inode.block_pointers));
+    this->fs.write_inode(file.inode_id, &inode);
+    this->fs.device->flush();
+
+    /* The old blocks are released last, a crash before this leaks them */
+    std::sort(old_blocks.begin(), old_blocks.end());
+    for (usize first = 0; first < old_blocks.size();) {
+        usize last = first + 1;
+        while (last < old_blocks.size() && old_blocks[last] == old_blocks[last - 1] + 1) last++;
+
+        this->fs.set_blocks_allocated(old_blocks[first], last - first, false);
+        first = last;
+    }
+
+    this->fs.write_bgds();
+    this->fs.write_superblock();
+    this->fs.device->flush();
+
+    fprintf(this->output, "MOVED    inode %u %s: %u extents into blocks %u-%u\n", file.inode_id, file.path.c_str(),
+            file.extents, first_block, first_block + total - 1);
+    return true;
+}
+
+void Defragmenter::copy_run(const BlockLayout& plan, const std::vector<u32>& data, u32 first_block)
+{
+    const u64 block_size = this->fs.block_size;
+    const u32 total      = plan.sources.size();
+
+    u8* buffer = (u8*)smalloc(MAX_COPY_BLOCKS * block_size);
+
+    for (u32 chunk = 0; chunk < total; chunk += MAX_COPY_BLOCKS) {
+        const u32 count = std::min(MAX_COPY_BLOCKS, total - chunk);
+
+        for (u32 i = 0; i < count;) {
+            const i64 source = plan.sources[chunk + i];
+
+            if (source < 0) {
+                memcpy(buffer + i * block_size, plan.indirect[-source - 1].data(), block_size);
+                i++;
+                continue;
+            }
+
+            /* Blocks that were already consecutive are read together */
+            u32 run = 1;
+            while (i + run < count && plan.sources[chunk + i + run] >= 0 &&
+                   data[plan.sources[chunk + i + run]] == data[source] + run)
+                run++;
+
+            this->fs.device->read(this->fs.block_offset(data[source]), buffer + i * block_size, run * block_size);
+            i += run;
+        }
+
+        this->fs.device->write(this->fs.block_offset(first_block + chunk), buffer, count * block_size);
+    }
+
+    free(buffer);
+}
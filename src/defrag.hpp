@@ -0,0 +1,38 @@
+#pragma once
+
+#include "filesystem.hpp"
+#include "frag.hpp"
+#include "helpers.hpp"
+#include "inode.hpp"
+
+#include <vector>
+
+struct DefragReport {
+    usize moved_files   = 0;
+    usize skipped_files = 0;
+    u64   moved_blocks  = 0;
+};
+
+/*
+ * Rewrites fragmented files into one contiguous run of free blocks, indirect blocks included and laid out
+ * in line like the kernel does. Each move claims the new run, copies the data, switches the inode over and
+ * only then frees the old blocks, flushing in between, so a crash can leak blocks but never lose data.
+ */
+class Defragmenter
+{
+  private:
+    static constexpr u32 MAX_COPY_BLOCKS = 256;
+
+    Filesystem& fs;
+    FILE*       output;
+
+  public:
+    Defragmenter(Filesystem& fs, FILE* output) : fs(fs), output(output) {}
+
+    /* Moves the files in the given order until the budget is spent, a budget of 0 means no limit */
+    DefragReport run(const std::vector<FragmentedFile>& files, double seconds);
+
+  private:
+    bool move_file(const FragmentedFile& file);
+    void copy_run(const BlockLayout& plan, const std::vector<u32>& data, u32 first_block);
+};
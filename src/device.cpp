@@ -0,0 +1,175 @@
+#include "device.hpp"
+
+#include "helpers.hpp"
+
+#include <algorithm>
+#include <fcntl.h>
+#include <memory>
+#include <sys/stat.h>
+#include <unistd.h>
+
+FileDevice::FileDevice(const char* path, bool read_only, bool direct) : read_only(read_only), direct(direct)
+{
+    /* Aligned writes would need a read-modify-write of the partial sectors, direct I/O is left to bulk reads */
+    API_ASSERT(read_only || !direct);
+
+    this->fd = -1;
+    if (direct) {
+        this->fd = open(path, O_RDONLY | O_DIRECT);
+        if (this->fd < 0 && errno != EINVAL) PANIC_FROM_ERRNO("Failed to open %s", path);
+    }
+
+    if (this->fd < 0) {
+        this->direct = false;
+        this->fd     = open(path, (read_only) ? O_RDONLY : O_RDWR);
+    }
+    if (this->fd < 0) PANIC_FROM_ERRNO("Failed to open %s", path);
+
+    struct stat info;
+    if (fstat(this->fd, &info) < 0) PANIC_FROM_ERRNO("Failed to stat %s", path);
+
+    this->file_size = info.st_size;
+}
+
+FileDevice::~FileDevice() { close(this->fd); }
+
+i64 FileDevice::modification_time() const
+{
+    struct stat info;
+    if (fstat(this->fd, &info) < 0) PANIC_FROM_ERRNO("Failed to stat the image");
+
+    return info.st_mtim.tv_sec * 1000000000l + info.st_mtim.tv_nsec;
+}
+
+void FileDevice::read(u64 offset, void* buffer, usize length)
+{
+    u8* output = (u8*)buffer;
+
+    if (this->direct && this->read_direct(offset, output, length)) return;
+
+    while (length > 0) {
+        ssize_t result = pread(this->fd, output, length, offset);
+        if (result < 0 && errno == EINTR) continue;
+        if (result < 0) PANIC_FROM_ERRNO("Failed to read %lu bytes at offset %lu", length, offset);
+        if (result == 0) PANIC("Unexpected end of the image at offset %lu.", offset);
+
+        output += result;
+        offset += result;
+        length -= result;
+    }
+}
+
+/* Returns false when the kernel turns the direct read down, the caller then redoes it buffered */
+bool FileDevice::read_direct(u64 offset, u8* buffer, usize length)
+{
+    static thread_local std::unique_ptr<u8, decltype(&free)> bounce(NULL, free);
+
+    const bool aligned = ((uintptr_t)buffer | offset | length) % DIRECT_ALIGNMENT == 0;
+
+    if (!bounce && !aligned) {
+        bounce.reset((u8*)aligned_alloc(DIRECT_ALIGNMENT, BOUNCE_SIZE));
+        if (!bounce) PANIC("Failed to allocate required memory.");
+    }
+
+    while (length > 0) {
+        /* Aligned requests go straight into the caller's buffer, the rest is widened to whole sectors */
+        const u64   start  = (aligned) ? offset : offset & ~(u64)(DIRECT_ALIGNMENT - 1);
+        const usize skip   = offset - start;
+        const usize span   = (aligned) ? length
+                                       : std::min((skip + length + DIRECT_ALIGNMENT - 1) & ~(DIRECT_ALIGNMENT - 1),
+                                                BOUNCE_SIZE);
+        u8*         target = (aligned) ? buffer : bounce.get();
+
+        ssize_t result = pread(this->fd, target, span, start);
+        if (result < 0 && errno == EINTR) continue;
+        if (result < 0 && errno == EINVAL) {
+            this->disable_direct();
+            return false;
+        }
+        if (result < 0) PANIC_FROM_ERRNO("Failed to read %lu bytes at offset %lu", length, offset);
+
+        /* The widened span may run past the end of the image, only what was asked for has to be there */
+        if ((usize)result <= skip) PANIC("Unexpected end of the image at offset %lu.", offset);
+
+        const usize copied = std::min((usize)result - skip, length);
+        if (!aligned) memcpy(buffer, target + skip, copied);
+
+        buffer += copied;
+        offset += copied;
+        length -= copied;
+    }
+
+    return true;
+}
+
+void FileDevice::disable_direct()
+{
+    int flags = fcntl(this->fd, F_GETFL);
+    if (flags < 0 || fcntl(this->fd, F_SETFL, flags & ~O_DIRECT) < 0)
+        PANIC_FROM_ERRNO("Failed to fall back to buffered reads");
+
+    this->direct = false;
+}
+
+void FileDevice::write(u64 offset, const void* buffer, usize length)
+{
+    API_ASSERT(!this->read_only);
+
+    const u8* input = (const u8*)buffer;
+
+    while (length > 0) {
+        ssize_t result = pwrite(this->fd, input, length, offset);
+        if (result < 0 && errno == EINTR) continue;
+        if (result < 0) PANIC_FROM_ERRNO("Failed to write %lu bytes at offset %lu", length, offset);
+
+        input += result;
+        offset += result;
+        length -= result;
+    }
+
+    if (offset > this->file_size) this->file_size = offset;
+}
+
+void FileDevice::flush()
+{
+    if (!this->read_only && fsync(this->fd) < 0) PANIC_FROM_ERRNO("Failed to flush the image");
+}
+
+void MemoryDevice::read(u64 offset, void* buffer, usize length)
+{
+    if (offset + length > this->data_size) PANIC("Unexpected end of the image at offset %lu.", offset);
+
+    memcpy(buffer, this->data + offset, length);
+}
+
+void MemoryDevice::write(u64 offset, const void* buffer, usize length)
+{
+    API_ASSERT(!this->read_only);
+    if (offset + length > this->data_size) PANIC("Write past the end of the image at offset %lu.", offset);
+
+    memcpy(this->data + offset, buffer, length);
+}
+
+StreamDevice::StreamDevice(std::istream& stream) : stream(stream)
+{
+    this->stream.exceptions(std::ios::failbit | std::ios::badbit | std::ios::eofbit);
+    this->stream.seekg(0, std::ios::end);
+    this->stream_size = this->stream.tellg();
+}
+
+void StreamDevice::read(u64 offset, void* buffer, usize length)
+{
+    std::lock_guard<std::mutex> guard(this->lock);
+
+    this->stream.seekg(offset);
+    this->stream.read(reinterpret_cast<char*>(buffer), length);
+}
+
+void StreamDevice::write(u64 offset, const void* buffer, usize length)
+{
+    UNUSED(offset);
+    UNUSED(buffer);
+    UNUSED(length);
+
+    PANIC("Stream images are read-only.");
+}
@@ -0,0 +1,97 @@
+#pragma once
+
+#include "helpers.hpp"
+
+#include <atomic>
+#include <istream>
+#include <mutex>
+#include <vector>
+
+/* The storage a Filesystem is read from. Reads and writes are positional and safe to issue from multiple threads. */
+class BlockDevice
+{
+  public:
+    virtual ~BlockDevice() = default;
+
+    virtual void read(u64 offset, void* buffer, usize length)        = 0;
+    virtual void write(u64 offset, const void* buffer, usize length) = 0;
+    virtual u64  size() const                                        = 0;
+    virtual bool writable() const                                    = 0;
+    virtual void flush() {}
+    /* In nanoseconds, changes with every write to the storage. 0 when it has no such time, e.g. in memory */
+    virtual i64 modification_time() const { return 0; }
+};
+
+/*
+ * An image file, accessed with pread/pwrite. A read-only one can be opened with O_DIRECT to bypass the page
+ * cache, unaligned reads then go through an aligned bounce buffer. When the backing filesystem refuses direct
+ * I/O, either at open or at the first read, the device quietly falls back to buffered reads.
+ */
+class FileDevice : public BlockDevice
+{
+  private:
+    static constexpr usize DIRECT_ALIGNMENT = 4096; /* Satisfies any logical sector size in use */
+    static constexpr usize BOUNCE_SIZE      = 1024 * 1024;
+
+    int               fd;
+    bool              read_only;
+    std::atomic<bool> direct;
+    u64               file_size;
+
+  public:
+    FileDevice(const char* path, bool read_only, bool direct = false);
+    ~FileDevice() override;
+
+    void read(u64 offset, void* buffer, usize length) override;
+    void write(u64 offset, const void* buffer, usize length) override;
+    u64  size() const override { return this->file_size; }
+    bool writable() const override { return !this->read_only; }
+    void flush() override;
+    i64  modification_time() const override;
+    bool is_direct() const { return this->direct; }
+
+  private:
+    bool read_direct(u64 offset, u8* buffer, usize length);
+    void disable_direct();
+};
+
+/* An image already held in memory. The buffer is either owned or borrowed (e.g. from mmap) */
+class MemoryDevice : public BlockDevice
+{
+  private:
+    std::vector<u8> owned;
+    u8*             data;
+    u64             data_size;
+    bool            read_only;
+
+  public:
+    explicit MemoryDevice(std::vector<u8>&& image) : owned(std::move(image)), read_only(false)
+    {
+        this->data      = this->owned.data();
+        this->data_size = this->owned.size();
+    }
+
+    MemoryDevice(u8* image, u64 size, bool read_only) : data(image), data_size(size), read_only(read_only) {}
+
+    void read(u64 offset, void* buffer, usize length) override;
+    void write(u64 offset, const void* buffer, usize length) override;
+    u64  size() const override { return this->data_size; }
+    bool writable() const override { return !this->read_only; }
+};
+
+/* A read-only seekable stream. Accesses are serialized, as streams keep a single position */
+class StreamDevice : public BlockDevice
+{
+  private:
+    std::istream& stream;
+    std::mutex    lock;
+    u64           stream_size;
+
+  public:
+    explicit StreamDevice(std::istream& stream);
+
+    void read(u64 offset, void* buffer, usize length) override;
+    void write(u64 offset, const void* buffer, usize length) override;
+    u64  size() const override { return this->stream_size; }
+    bool writable() const override { return false; }
+};
@@ -0,0 +1,170 @@
+#include "diff.hpp"
+
+#include "filesystem.hpp"
+#include "helpers.hpp"
+#include "inode.hpp"
+
+#include <algorithm>
+#include <atomic>
+#include <mutex>
+#include <thread>
+
+std::vector<DiffEntry> ImageDiff::run(const std::filesystem::path& root)
+{
+    Inode dir_a, dir_b;
+    this->a.get_inode_from_path(root, &dir_a);
+    this->b.get_inode_from_path(root, &dir_b);
+    API_ASSERT(dir_a.is_directory() && dir_b.is_directory());
+
+    this->changes.clear();
+    this->pending.clear();
+
+    this->diff_directory(root, dir_a, dir_b);
+    this->compare_contents();
+
+    std::sort(this->changes.begin(), this->changes.end(),
+              [](const DiffEntry& x, const DiffEntry& y) { return x.path < y.path; });
+
+    return std::move(this->changes);
+}
+
+void ImageDiff::read_directory(Filesystem& fs, Inode& directory, DirectoryListing& listing)
+{
+    u8*           buffer = fs.allocate_block();
+    InodeIterator iter(&fs, directory, buffer);
+
+    for (std::span<u8> block : iter) listing.raw.insert(listing.raw.end(), block.begin(), block.end());
+
+    free(buffer);
+}
+
+void ImageDiff::parse_directory(Filesystem& fs, DirectoryListing& listing)
+{
+    DirectoryEntry* entry;
+    for (u64 offset = 0; offset + 8 <= listing.raw.size(); offset += entry->total_entry_size) {
+        entry = (DirectoryEntry*)(listing.raw.data() + offset);
+        if (entry->total_entry_size == 0) break;
+        if (entry->inode == 0) continue;
+
+        std::string_view name = entry->name(&fs);
+        if (name == "." || name == "..") continue;
+
+        listing.entries.emplace_back(name, (u32)entry->inode);
+    }
+
+    std::sort(listing.entries.begin(), listing.entries.end());
+}
+
+void ImageDiff::diff_directory(const std::filesystem::path& path, Inode& dir_a, Inode& dir_b)
+{
+    DirectoryListing listing_a, listing_b;
+    read_directory(this->a, dir_a, listing_a);
+    read_directory(this->b, dir_b, listing_b);
+    parse_directory(this->a, listing_a);
+
+    /* Identical directory blocks hold the same names and inode numbers, so only the children need a look */
+    if (listing_a.raw == listing_b.raw) {
+        for (auto& [name, inode_id] : listing_a.entries) this->diff_entry(path / name, inode_id, inode_id);
+        return;
+    }
+
+    parse_directory(this->b, listing_b);
+
+    auto it_a = listing_a.entries.begin();
+    auto it_b = listing_b.entries.begin();
+
+    while (it_a != listing_a.entries.end() || it_b != listing_b.entries.end()) {
+        if (it_b == listing_b.entries.end() || (it_a != listing_a.entries.end() && it_a->first < it_b->first)) {
+            this->changes.push_back({DiffKind::Removed, (path / it_a->first).string()});
+            it_a++;
+        } else if (it_a == listing_a.entries.end() || it_b->first < it_a->first) {
+            this->changes.push_back({DiffKind::Added, (path / it_b->first).string()});
+            it_b++;
+        } else {
+            this->diff_entry(path / it_a->first, it_a->second, it_b->second);
+            it_a++;
+            it_b++;
+        }
+    }
+}
+
+void ImageDiff::diff_entry(const std::filesystem::path& path, u32 inode_a, u32 inode_b)
+{
+    Inode file_a, file_b;
+    this->a.read_inode(inode_a, &file_a);
+    this->b.read_inode(inode_b, &file_b);
+
+    const u32 type_a = file_a.type_and_permissions & Inode::FILE_TYPE_MASK;
+    const u32 type_b = file_b.type_and_permissions & Inode::FILE_TYPE_MASK;
+
+    if (type_a != type_b) {
+        this->changes.push_back({DiffKind::Removed, path.string()});
+        this->changes.push_back({DiffKind::Added, path.string()});
+        return;
+    }
+
+    if (file_a.is_directory()) return this->diff_directory(path, file_a, file_b);
+
+    if (file_a.size_in_bytes(&this->a) != file_b.size_in_bytes(&this->b)) {
+        this->changes.push_back({DiffKind::Modified, path.string()});
+        return;
+    }
+
+    const bool same_blocks = !memcmp(file_a.block_pointers, file_b.block_pointers, sizeof(file_a.block_pointers));
+    if (same_blocks && file_a.last_modification_time == file_b.last_modification_time) return;
+
+    this->pending.push_back({path.string(), file_a, file_b});
+}
+
+void ImageDiff::compare_contents()
+{
+    std::atomic<usize> next = 0;
+    std::mutex         changes_lock;
+
+    auto worker = [&]() {
+        u8* buffer_a = this->a.allocate_blocks(COMPARE_BLOCKS);
+        u8* buffer_b = this->b.allocate_blocks(COMPARE_BLOCKS);
+
+        for (usize i = next++; i < this->pending.size(); i = next++) {
+            if (this->same_contents(this->pending[i], buffer_a, buffer_b)) continue;
+
+            std::lock_guard<std::mutex> guard(changes_lock);
+            this->changes.push_back({DiffKind::Modified, this->pending[i].path});
+        }
+
+        free(buffer_a);
+        free(buffer_b);
+    };
+
+    const u32 threads = std::max<u32>(std::min<usize>(this->threads, this->pending.size()), 1);
+
+    std::vector<std::thread> workers;
+    for (u32 i = 1; i < threads; i++) workers.emplace_back(worker);
+    worker();
+    for (std::thread& thread : workers) thread.join();
+}
+
+bool ImageDiff::same_contents(PendingCompare& files, u8* buffer_a, u8* buffer_b)
+{
+    if (this->a.block_size != this->b.block_size) PANIC("Images with different block sizes can't be compared.");
+
+    /* A short target lives in the block pointers, a long one in a block, either side may use either */
+    if (files.a.is_symbolic_link())
+        return this->a.read_link_target(files.a, buffer_a) == this->b.read_link_target(files.b, buffer_b);
+
+    /* Device numbers are kept in the block pointers, FIFOs and sockets have nothing else to compare */
+    if (!files.a.is_file())
+        return !memcmp(files.a.block_pointers, files.b.block_pointers, sizeof(files.a.block_pointers));
+
+    /* By offset, the sizes are known to match and holes read as zeros on both sides */
+    const u64 size  = files.a.size_in_bytes(&this->a);
+    const u64 chunk = COMPARE_BLOCKS * this->a.block_size;
+
+    for (u64 offset = 0; offset < size; offset += chunk) {
+        const u64 length = this->a.read_file(files.a, offset, buffer_a, chunk);
+        if (this->b.read_file(files.b, offset, buffer_b, chunk) != length || memcmp(buffer_a, buffer_b, length))
+            return false;
+    }
+
+    return true;
+}
@@ -0,0 +1,65 @@
+#pragma once
+
+#include "helpers.hpp"
+#include "inode.hpp"
+
+#include <filesystem>
+#include <string>
+#include <vector>
+
+class Filesystem;
+
+enum class DiffKind : char {
+    Added    = '+',
+    Removed  = '-',
+    Modified = 'M'
+};
+
+struct DiffEntry {
+    DiffKind    kind;
+    std::string path;
+};
+
+/*
+ * Compares two images by walking both trees in lockstep. Files are first compared by their inode
+ * metadata, data blocks are only read for files whose size matches but whose block map or mtime differ.
+ * Contents are compared as a reader sees them: holes are zeros, a symlink is its target and a device node
+ * its numbers.
+ */
+class ImageDiff
+{
+  private:
+    static constexpr u64 COMPARE_BLOCKS = 64; /* Read from each image at a time */
+
+    struct DirectoryListing {
+        std::vector<u8>                          raw;
+        std::vector<std::pair<std::string, u32>> entries; /* Sorted by name */
+    };
+
+    struct PendingCompare {
+        std::string path;
+        Inode       a;
+        Inode       b;
+    };
+
+    Filesystem&                 a;
+    Filesystem&                 b;
+    u32                         threads;
+    std::vector<DiffEntry>      changes;
+    std::vector<PendingCompare> pending;
+
+  public:
+    ImageDiff(Filesystem& a, Filesystem& b, u32 threads) : a(a), b(b), threads(threads) {}
+
+    /* Returns the changes sorted by path */
+    std::vector<DiffEntry> run(const std::filesystem::path& root);
+
+  private:
+    void diff_directory(const std::filesystem::path& path, Inode& dir_a, Inode& dir_b);
+    void diff_entry(const std::filesystem::path& path, u32 inode_a, u32 inode_b);
+    void compare_contents();
+    bool same_contents(PendingCompare& files, u8* buffer_a, u8* buffer_b);
+
+    static void read_directory(Filesystem& fs, Inode& directory, DirectoryListing& listing);
+    static void parse_directory(Filesystem& fs, DirectoryListing& listing);
+};
@@ -1,25 +1,158 @@
 #include "config.hpp"
+#include "defrag.hpp"
+#include "diff.hpp"
+#include "extract.hpp"
 #include "filesystem.hpp"
+#include "frag.hpp"
+#include "fsck.hpp"
 #include "helpers.hpp"
+#include "index.hpp"
 #include "inode.hpp"
-
+#include "manifest.hpp"
+#include "mkimage.hpp"
+#include "overlay.hpp"
+#include "remove.hpp"
+#include "resolve.hpp"
+#include "tar.hpp"
+#include "trace.hpp"
+#include "walker.hpp"
+#include "writer.hpp"
+
+#include <algorithm>
 #include <cstdio>
+#include <fcntl.h>
 #include <filesystem>
+#include <fnmatch.h>
 #include <fstream>
 #include <iostream>
+#include <mutex>
+#include <thread>
+#include <time.h>
+#include <unistd.h>
+#include <unordered_set>
 
-bool g_force = false;
+bool        g_force        = false;
+const char* g_overlay_path = NULL; /* Set by --overlay, every action then writes to the delta instead */
 
 const char* generic_help = "%s: Manipulate ext2 images - Version " VERSION_STRING "\n"
                            "USAGE:\n"
-                           "\t%s <ACTION> <ACTION ARGUMENTS>\n\n"
+                           "\t%s [--trace <FILE>] [--overlay <DELTA>] <ACTION> <ACTION ARGUMENTS>\n\n"
                            "ACTIONS:\n"
                            "\thelp \t\t\t\t\t\t - display help information\n"
-                           "\tadd <IMAGE> <FROM> <TO (defaults to /)>\t\t - add a file to the image\n"
+                           "\tadd <IMAGE> <FROM> <TO (defaults to /)>\t\t - add a file or a directory tree\n"
                            "\tmkdir <IMAGE> <PATH>\t\t\t\t - create a directory\n"
-                           "\tremove <IMAGE> <PATH>\t\t\t\t - remove a file or directory\n"
-                           "\tquery <IMAGE> <PATH TO DIRECTORY>\t\t - get the contents of the directory\n"
-                           "\tget <IMAGE> <PATH TO FILE> <OUTPUT DIR>\t\t - get the file from the image\n";
+                           "\tremove [-r] <IMAGE> <PATH>...\t\t\t - remove files, -r with whole directories\n"
+                           "\tquery [-l] <IMAGE> <PATH TO DIRECTORY>\t\t - list the directory, -l with metadata\n"
+                           "\tdu [--direct] <IMAGE> <PATH (defaults to /)>\t - disk usage of the tree, per child\n"
+                           "\tfind [--direct] <IMAGE> <PATH> <PREDICATES>\t - list by -name, -type, -size or -mtime\n"
+                           "\tstat [--direct] <IMAGE> <PATH LIST|->\t\t - metadata of the listed paths, one per line\n"
+                           "\tget [-r] [--direct] <IMAGE> <PATH>...\t\t - extract into the current directory\n"
+                           "\tget [-r] [--direct] <IMAGE> --from <LIST|->\t - extract the listed paths\n"
+                           "\thash [--direct] <IMAGE> <PATH>\t\t\t - print a content manifest of the files\n"
+                           "\tverify [--direct] <IMAGE> <MANIFEST> <PATH>\t - compare the files with a manifest\n"
+                           "\tfsck <IMAGE>\t\t\t\t\t - check the image for consistency without modifying it\n"
+                           "\tdiff <IMAGE A> <IMAGE B> <PATH (defaults to /)>\t - list changed files\n"
+                           "\texport --tar [--direct] <IMAGE> <PATH>\t\t - write the directory as a tar to stdout\n"
+                           "\tfrag <IMAGE> <WORST FILES (defaults to 10)>\t - report fragmentation\n"
+                           "\tdefrag <IMAGE> <SECONDS (defaults to no limit)>\t - make fragmented files contiguous\n"
+                           "\tindex <IMAGE>\t\t\t\t\t - build <IMAGE>.idx to speed up later lookups\n"
+                           "\tcommit <IMAGE> <DELTA> <OUTPUT>\t\t\t - write the image with an overlay applied\n"
+                           "\tmkimage <DIRECTORY> <IMAGE|-> <SIZE>\t\t - build an image from a host directory\n"
+                           "\n"
+                           "ENVIRONMENT:\n"
+                           "\tFORCE=true\t\t\t\t\t - ignore recoverable filesystem errors\n"
+                           "\tTHREADS=<N>\t\t\t\t\t - worker threads for parallel actions\n"
+                           "\tTRACE=<FILE>\t\t\t\t\t - write a Chrome trace of the I/O, same as --trace\n"
+                           "\tOVERLAY=<DELTA>\t\t\t\t\t - leave the image untouched, same as --overlay\n"
+                           "\tSHARED_CACHE=true\t\t\t\t - share read metadata between processes\n";
+
+u32 thread_count()
+{
+    char* env_threads = getenv("THREADS");
+    if (env_threads && atoi(env_threads) > 0) return atoi(env_threads);
+
+    return std::max(std::thread::hardware_concurrency(), 1u);
+}
+
+/* Removes the option wherever it appears among the action arguments, returns whether it was there */
+bool take_option(int& argc, char** argv, const char* option)
+{
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], option)) continue;
+
+        for (int j = i; j < argc - 1; j++) argv[j] = argv[j + 1];
+        argc--;
+        return true;
+    }
+
+    return false;
+}
+
+/* Removes the option and the value after it wherever they appear, NULL when the option isn't there */
+const char* take_value(int& argc, char** argv, const char* option)
+{
+    for (int i = 1; i < argc - 1; i++) {
+        if (strcmp(argv[i], option)) continue;
+
+        const char* value = argv[i + 1];
+        for (int j = i; j < argc - 2; j++) argv[j] = argv[j + 2];
+        argc -= 2;
+        return value;
+    }
+
+    return NULL;
+}
+
+/* One path per line, - reads them from stdin */
+std::vector<std::string> read_path_list(const char* list_path)
+{
+    std::ifstream file;
+    const bool    from_stdin = !strcmp(list_path, "-");
+
+    if (!from_stdin) {
+        file.open(list_path);
+        if (!file.is_open()) PANIC_FROM_ERRNO("Failed to open the list %s", list_path);
+    }
+
+    std::istream&            input = (from_stdin) ? std::cin : file;
+    std::vector<std::string> paths;
+
+    for (std::string line; std::getline(input, line);)
+        if (!line.empty()) paths.push_back(std::move(line));
+
+    return paths;
+}
+
+/* SHARED_CACHE=true lets read-only actions share the metadata they read with the other processes of the user */
+u32 shared_cache_flag()
+{
+    char* env_cache = getenv("SHARED_CACHE");
+    if (env_cache && (!strcmp(env_cache, "1") || !strcmp(env_cache, "true") || !strcmp(env_cache, "TRUE")))
+        return Filesystem::OPEN_SHARED_CACHE;
+
+    return 0;
+}
+
+/* --direct reads the image with O_DIRECT, for bulk reads that would only evict useful pages from the cache */
+u32 read_only_flags(int& argc, char** argv)
+{
+    return Filesystem::OPEN_READ_ONLY | shared_cache_flag() |
+           ((take_option(argc, argv, "--direct")) ? Filesystem::OPEN_DIRECT : 0);
+}
+
+/* Lookups go through <IMAGE>.idx once it has been built with the index action, a stale one is rebuilt */
+void load_index_if_present(Filesystem& fs, const char* image_path)
+{
+    const std::string index_path = std::string(image_path) + ".idx";
+    if (std::filesystem::exists(index_path)) fs.load_index(index_path.c_str());
+}
+
+/* Before writing, the image's timestamp alone can miss changes made within one clock tick of the index */
+void drop_index(const char* image_path)
+{
+    const std::string index_path = std::string(image_path) + ".idx";
+    if (unlink(index_path.c_str()) < 0 && errno != ENOENT) PANIC_FROM_ERRNO("Failed to remove %s", index_path.c_str());
+}
 
 int help(int argc, char** argv)
 {
@@ -36,83 +169,654 @@ int add(int argc, char** argv)
         exit(0);
     }
 
-    todo
+    const char* destination = (argc == 4) ? argv[3] : "/";
+    if (!std::filesystem::path(destination).is_absolute()) PANIC("<TO> must be absolute.");
+
+    drop_index(argv[1]);
+    Filesystem fs(argv[1], g_overlay_path, 0);
+
+    ImageWriter writer(fs);
+    writer.add(argv[2], destination);
+    writer.finish();
+
+    return 0;
 }
 
 int mkdir(int argc, char** argv)
 {
-    if (argc != 2) {
+    if (argc != 3) {
         printf("USAGE: %s mkdir <IMAGE> <PATH>\n", argv[-1]);
         exit(0);
     }
 
-    todo
+    if (!std::filesystem::path(argv[2]).is_absolute()) PANIC("<PATH> must be absolute.");
+
+    drop_index(argv[1]);
+    Filesystem fs(argv[1], g_overlay_path, 0);
+
+    ImageWriter writer(fs);
+    writer.make_directory(argv[2], 0755);
+    writer.finish();
+
+    return 0;
 }
 
 int rm(int argc, char** argv)
 {
-    if (argc != 2) {
-        printf("USAGE: %s remove <IMAGE> <PATH>\n", argv[-1]);
+    const bool recursive = take_option(argc, argv, "-r");
+
+    if (argc < 3) {
+        printf("USAGE: %s remove [-r] <IMAGE> <PATH>...\n", argv[-1]);
         exit(0);
     }
 
-    todo
+    drop_index(argv[1]);
+    Filesystem fs(argv[1], g_overlay_path, 0);
+
+    Remover remover(fs);
+
+    for (int i = 2; i < argc; i++) {
+        if (!std::filesystem::path(argv[i]).is_absolute()) PANIC("<PATH> must be absolute.");
+        remover.add(argv[i], recursive);
+    }
+
+    RemoveReport report = remover.run();
+
+    fprintf(stderr, "%lu files and %lu directories removed, %lu blocks freed.\n", report.files, report.directories,
+            report.blocks);
+
+    return 0;
+}
+
+/* ls -l style type and permission column */
+std::string format_mode(u32 type, u16 mode)
+{
+    char type_char = '-';
+    if (type == Inode::FILE_TYPE_DIRECTORY) type_char = 'd';
+    if (type == Inode::FILE_TYPE_LINK) type_char = 'l';
+    if (type == Inode::FILE_TYPE_CHAR_DEV) type_char = 'c';
+    if (type == Inode::FILE_TYPE_BLOCK_DEV) type_char = 'b';
+    if (type == Inode::FILE_TYPE_FIFO) type_char = 'p';
+    if (type == Inode::FILE_TYPE_SOCKET) type_char = 's';
+
+    std::string result(1, type_char);
+    for (int shift = 6; shift >= 0; shift -= 3) {
+        result += (mode & (04 << shift)) ? 'r' : '-';
+        result += (mode & (02 << shift)) ? 'w' : '-';
+        result += (mode & (01 << shift)) ? 'x' : '-';
+    }
+
+    if (mode & Inode::FILE_PERMISSION_SET_USER_ID) result[3] = (mode & Inode::FILE_PERMISSION_USER_EXECUTE) ? 's' : 'S';
+    if (mode & Inode::FILE_PERMISSION_SET_GROUP_ID)
+        result[6] = (mode & Inode::FILE_PERMISSION_GROUP_EXECUTE) ? 's' : 'S';
+    if (mode & Inode::FILE_PERMISSION_STICKY) result[9] = (mode & Inode::FILE_PERMISSION_OTHER_EXECUTE) ? 't' : 'T';
+
+    return result;
+}
+
+/* type is 0 when only the inode knows it */
+void print_long_entry(Filesystem& fs, Inode& inode, u32 type, const std::string& name)
+{
+    if (!type) type = inode.type_and_permissions & Inode::FILE_TYPE_MASK;
+
+    char         modified[32];
+    const time_t modification_time = inode.last_modification_time;
+    strftime(modified, sizeof(modified), "%Y-%m-%d %H:%M", localtime(&modification_time));
+
+    printf("%s %3u %5u %5u %10lu %s %s\n", format_mode(type, inode.type_and_permissions).c_str(), inode.hard_link_count,
+           inode.user_id, inode.group_id, inode.size_in_bytes(&fs), modified, name.c_str());
 }
 
 int query(int argc, char** argv)
 {
-    if (argc != 3) {
-        printf("USAGE: %s query <IMAGE> <PATH TO DIRECTORY>\n", argv[-1]);
+    const bool long_listing = (argc == 4 && !strcmp(argv[1], "-l"));
+
+    if (argc != 3 && !long_listing) {
+        printf("USAGE: %s query [-l] <IMAGE> <PATH TO DIRECTORY>\n", argv[-1]);
         exit(0);
     }
 
+    if (long_listing) {
+        argc--;
+        argv++;
+    }
+
     std::filesystem::path path(argv[2]);
 
     if (!path.is_absolute()) PANIC("<PATH TO DIRECTORY> must be absolute.");
 
-    Filesystem fs(argv[1]);
+    Filesystem fs(argv[1], g_overlay_path, Filesystem::OPEN_READ_ONLY | shared_cache_flag());
+    load_index_if_present(fs, argv[1]);
 
     Inode inode;
-    fs.get_inode_from_path(path, &inode);
-
-    u8* buffer = reinterpret_cast<u8*>(smalloc(fs.block_size));
+    u32   inode_id = fs.get_inode_from_path(path, &inode);
+    API_ASSERT(inode.is_directory());
+
+    std::vector<std::string> names;
+    std::vector<u32>         inode_ids;
+    std::vector<u32>         types; /* From the directory entries, 0 when only the inode knows */
+
+    if (fs.index) {
+        for (const IndexName& entry : fs.index->entries(inode_id)) {
+            names.emplace_back(fs.index->name(entry));
+            inode_ids.push_back(entry.inode_id);
+            types.push_back(0);
+        }
+    } else {
+        u8* buffer = reinterpret_cast<u8*>(smalloc(fs.block_size));
+
+        DirInodeIterator dir_iter(&fs, inode, buffer);
+
+        for (DirectoryEntry* entry : dir_iter) {
+            names.emplace_back(entry->name(&fs));
+            inode_ids.push_back(entry->inode);
+            types.push_back(entry->file_type(&fs));
+        }
+
+        free(buffer);
+    }
 
-    DirInodeIterator dir_iter(&fs, inode, buffer);
+    if (!long_listing) {
+        for (const std::string& name : names) std::cout << "DirEntry: " << name << std::endl;
+        return 0;
+    }
 
-    for (DirectoryEntry* entry : dir_iter) { std::cout << "DirEntry: " << entry->name(&fs) << std::endl; }
+    /* Read in inode table order rather than one random read per entry */
+    std::vector<Inode> inodes(inode_ids.size());
+    fs.read_inodes(inode_ids, inodes.data());
 
-    free(buffer);
+    for (usize i = 0; i < names.size(); i++) print_long_entry(fs, inodes[i], types[i], names[i]);
 
     return 0;
 }
 
-int get(int argc, char** argv)
+int stat_paths(int argc, char** argv)
 {
+    const u32 open_flags = read_only_flags(argc, argv);
+
     if (argc != 3) {
-        printf("USAGE: %s query <IMAGE> <PATH TO FILE>\n", argv[-1]);
+        printf("USAGE: %s stat [--direct] <IMAGE> <PATH LIST|->\n", argv[-1]);
+        exit(0);
+    }
+
+    const std::vector<std::string> paths = read_path_list(argv[2]);
+
+    Filesystem fs(argv[1], g_overlay_path, open_flags);
+    load_index_if_present(fs, argv[1]);
+
+    PathResolver resolver(fs);
+
+    for (const std::string& path : paths) {
+        if (!std::filesystem::path(path).is_absolute()) PANIC("%s is not an absolute path.", path.c_str());
+        resolver.add(path);
+    }
+
+    ResolvedPaths resolved = resolver.run();
+
+    for (usize i = 0; i < paths.size(); i++) {
+        if (!resolved.inode_ids[i]) continue;
+
+        printf("%10u ", resolved.inode_ids[i]);
+        print_long_entry(fs, resolved.inodes[i], 0, paths[i]);
+    }
+
+    for (usize i : resolved.not_found) fprintf(stderr, "%s: No such file or directory.\n", paths[i].c_str());
+
+    return (resolved.not_found.empty()) ? 0 : 1;
+}
+
+int du(int argc, char** argv)
+{
+    const u32 open_flags = read_only_flags(argc, argv);
+
+    if (argc != 2 && argc != 3) {
+        printf("USAGE: %s du [--direct] <IMAGE> <PATH (defaults to /)>\n", argv[-1]);
+        exit(0);
+    }
+
+    std::filesystem::path path((argc == 3) ? argv[2] : "/");
+
+    if (!path.is_absolute()) PANIC("<PATH> must be absolute.");
+
+    Filesystem fs(argv[1], g_overlay_path, open_flags);
+    load_index_if_present(fs, argv[1]);
+
+    ParallelWalker walker(fs, thread_count());
+
+    /* Per worker and per child of the root, summed once the walk is over */
+    std::vector<std::vector<u64>> sectors(walker.thread_count());
+    std::vector<u64>              files(walker.thread_count(), 0), directories(walker.thread_count(), 0);
+    std::vector<std::string>      tops;
+    std::unordered_set<u32>       linked; /* Hard linked files are counted once */
+    std::mutex                    lock;
+
+    walker.run(path, [&](u32 worker, const WalkEntry& entry) {
+        if (entry.depth == 1) {
+            std::lock_guard<std::mutex> guard(lock);
+            if (tops.size() <= entry.top) tops.resize(entry.top + 1);
+            tops[entry.top] = entry.path;
+        }
+
+        if (entry.inode.is_directory()) {
+            directories[worker]++;
+        } else {
+            files[worker]++;
+
+            if (entry.inode.hard_link_count > 1) {
+                std::lock_guard<std::mutex> guard(lock);
+                if (!linked.insert(entry.inode_id).second) return;
+            }
+        }
+
+        if (sectors[worker].size() <= entry.top) sectors[worker].resize(entry.top + 1, 0);
+        sectors[worker][entry.top] += entry.inode.disk_sector_count;
+    });
+
+    Inode root;
+    fs.get_inode_from_path(path, &root);
+
+    std::vector<std::pair<std::string, u64>> totals;
+    for (usize top = 0; top < tops.size(); top++) {
+        u64 total = 0;
+        for (const std::vector<u64>& worker : sectors)
+            if (top < worker.size()) total += worker[top];
+        totals.emplace_back(tops[top], total);
+    }
+    std::sort(totals.begin(), totals.end());
+
+    u64 total = root.disk_sector_count;
+    for (const auto& [top_path, top_sectors] : totals) {
+        printf("%lu\t%s\n", top_sectors / 2, top_path.c_str());
+        total += top_sectors;
+    }
+    printf("%lu\t%s\n", total / 2, path.c_str());
+
+    u64 file_count = 0, directory_count = 0;
+    for (u32 i = 0; i < walker.thread_count(); i++) {
+        file_count += files[i];
+        directory_count += directories[i];
+    }
+    fprintf(stderr, "%lu files and %lu directories, sizes in KiB.\n", file_count, directory_count);
+
+    return 0;
+}
+
+/* [+-]N with an optional k, M or G suffix, + for more than N, - for less */
+static void parse_bound(const char* text, const char* option, i64* bound, int* direction)
+{
+    *direction = (*text == '+') ? 1 : (*text == '-') ? -1 : 0;
+    if (*direction) text++;
+
+    char* end;
+    *bound = strtoll(text, &end, 10);
+    if (end == text || *bound < 0) PANIC("Invalid value %s for %s.", text, option);
+
+    if (*end == 'k') *bound <<= 10;
+    if (*end == 'M') *bound <<= 20;
+    if (*end == 'G') *bound <<= 30;
+    if (*end && (strchr("kMG", *end) == NULL || end[1])) PANIC("Invalid value %s for %s.", text, option);
+}
+
+static bool within_bound(i64 value, i64 bound, int direction)
+{
+    if (direction > 0) return value > bound;
+    if (direction < 0) return value < bound;
+    return value == bound;
+}
+
+int find(int argc, char** argv)
+{
+    const u32 open_flags = read_only_flags(argc, argv);
+
+    if (argc < 3 || argc % 2 == 0) {
+        printf("USAGE: %s find [--direct] <IMAGE> <PATH> [-name <GLOB>] [-type f|d|l] [-size [+-]N[kMG]] "
+               "[-mtime [+-]DAYS]\n",
+               argv[-1]);
         exit(0);
     }
 
     std::filesystem::path path(argv[2]);
 
-    if (!path.is_absolute()) PANIC("<PATH TO FILE> must be absolute.");
+    if (!path.is_absolute()) PANIC("<PATH> must be absolute.");
+
+    const char* name_pattern = NULL;
+    u32         type         = 0;
+    i64         size = 0, age = 0;
+    int         size_direction = 0, age_direction = 0;
+    bool        by_size = false, by_age = false;
+
+    for (int i = 3; i < argc; i += 2) {
+        if (!strcmp(argv[i], "-name")) {
+            name_pattern = argv[i + 1];
+        } else if (!strcmp(argv[i], "-type")) {
+            if (!strcmp(argv[i + 1], "f")) type = Inode::FILE_TYPE_FILE;
+            if (!strcmp(argv[i + 1], "d")) type = Inode::FILE_TYPE_DIRECTORY;
+            if (!strcmp(argv[i + 1], "l")) type = Inode::FILE_TYPE_LINK;
+            if (!type) PANIC("-type takes f, d or l.");
+        } else if (!strcmp(argv[i], "-size")) {
+            parse_bound(argv[i + 1], argv[i], &size, &size_direction);
+            by_size = true;
+        } else if (!strcmp(argv[i], "-mtime")) {
+            parse_bound(argv[i + 1], argv[i], &age, &age_direction);
+            by_age = true;
+        } else {
+            PANIC("Unknown predicate %s.", argv[i]);
+        }
+    }
+
+    Filesystem fs(argv[1], g_overlay_path, open_flags);
+    load_index_if_present(fs, argv[1]);
 
-    Filesystem fs(argv[1]);
+    ParallelWalker walker(fs, thread_count());
 
-    Inode inode;
-    fs.get_inode_from_path(path, &inode);
-    API_ASSERT(!inode.is_directory());
+    /* Every worker collects its matches and prints them in chunks, so the threads don't queue on stdout */
+    std::vector<std::string> output(walker.thread_count());
+    std::mutex               output_lock;
+    const time_t             now = time(NULL);
+
+    walker.run(path, [&](u32 worker, const WalkEntry& entry) {
+        if (type && (entry.inode.type_and_permissions & Inode::FILE_TYPE_MASK) != type) return;
+        if (by_size && !within_bound(Inode(entry.inode).size_in_bytes(&fs), size, size_direction)) return;
+        if (by_age && !within_bound((now - (i64)entry.inode.last_modification_time) / 86400, age, age_direction))
+            return;
+
+        if (name_pattern) {
+            const std::string name(entry.path.substr(entry.path.rfind('/') + 1));
+            if (fnmatch(name_pattern, name.c_str(), 0)) return;
+        }
+
+        std::string& buffer = output[worker];
+        buffer.append(entry.path);
+        buffer.push_back('\n');
+
+        if (buffer.size() >= 64 * 1024) {
+            std::lock_guard<std::mutex> lock(output_lock);
+            fwrite(buffer.data(), 1, buffer.size(), stdout);
+            buffer.clear();
+        }
+    });
+
+    for (const std::string& buffer : output) fwrite(buffer.data(), 1, buffer.size(), stdout);
+
+    return 0;
+}
+
+int get(int argc, char** argv)
+{
+    const u32   open_flags = read_only_flags(argc, argv);
+    const bool  recursive  = take_option(argc, argv, "-r");
+    const char* list_path  = take_value(argc, argv, "--from");
+
+    if (argc < 3 && !(list_path && argc == 2)) {
+        printf("USAGE: %s get [-r] [--direct] <IMAGE> <PATH>...\n", argv[-1]);
+        printf("       %s get [-r] [--direct] <IMAGE> --from <LIST|->\n", argv[-1]);
+        exit(0);
+    }
+
+    std::vector<std::string> arguments(argv + 2, argv + argc);
+    if (list_path) {
+        std::vector<std::string> listed = read_path_list(list_path);
+        arguments.insert(arguments.end(), listed.begin(), listed.end());
+    }
+
+    Filesystem fs(argv[1], g_overlay_path, open_flags);
+    load_index_if_present(fs, argv[1]);
+
+    /* All paths are resolved together first, a missing one fails the whole batch before anything is written */
+    std::vector<std::filesystem::path> paths;
+    PathResolver                       resolver(fs);
+
+    for (const std::string& argument : arguments) {
+        std::filesystem::path path = std::filesystem::path(argument).lexically_normal();
+
+        if (!path.is_absolute()) PANIC("<PATH> must be absolute.");
+
+        /* Extracted into the current directory under its own name, the root as the current directory itself */
+        if (!path.has_filename()) path = path.parent_path();
+
+        resolver.add(path);
+        paths.push_back(std::move(path));
+    }
+
+    ResolvedPaths resolved = resolver.run();
+
+    for (usize i : resolved.not_found) fprintf(stderr, "%s: No such file or directory.\n", arguments[i].c_str());
+    if (!resolved.not_found.empty())
+        PANIC("%lu of %lu paths were not found.", resolved.not_found.size(), arguments.size());
+
+    Extractor extractor(fs, thread_count());
+
+    for (usize i = 0; i < paths.size(); i++) {
+        const std::filesystem::path output = (paths[i].has_filename()) ? paths[i].filename() : ".";
+        Inode&                      inode  = resolved.inodes[i];
+
+        if (!inode.is_directory()) {
+            extractor.add_file(resolved.inode_ids[i], inode, output);
+        } else if (recursive) {
+            extractor.add_tree(paths[i], output);
+        } else {
+            PANIC("%s is a directory, use get -r.", arguments[i].c_str());
+        }
+    }
+
+    extractor.run();
+
+    return 0;
+}
+
+int hash(int argc, char** argv)
+{
+    const u32 open_flags = read_only_flags(argc, argv);
+
+    if (argc != 2 && argc != 3) {
+        printf("USAGE: %s hash [--direct] <IMAGE> <PATH (defaults to /)>\n", argv[-1]);
+        exit(0);
+    }
+
+    std::filesystem::path path((argc == 3) ? argv[2] : "/");
+
+    if (!path.is_absolute()) PANIC("<PATH> must be absolute.");
+
+    Filesystem fs(argv[1], g_overlay_path, open_flags);
+
+    Manifest manifest = Manifest::build(fs, path, thread_count());
+    manifest.write(stdout);
+
+    return 0;
+}
 
-    std::fstream file(path.filename());
-    file.exceptions(std::ios::failbit | std::ios::badbit);
+int verify(int argc, char** argv)
+{
+    const u32 open_flags = read_only_flags(argc, argv);
+
+    if (argc != 3 && argc != 4) {
+        printf("USAGE: %s verify [--direct] <IMAGE> <MANIFEST> <PATH (defaults to /)>\n", argv[-1]);
+        exit(0);
+    }
 
-    u8* buffer = reinterpret_cast<u8*>(smalloc(fs.block_size));
+    std::filesystem::path path((argc == 4) ? argv[3] : "/");
 
-    InodeIterator iter(&fs, inode, buffer);
+    if (!path.is_absolute()) PANIC("<PATH> must be absolute.");
 
-    for (std::span<u8> i : iter) { file.write(reinterpret_cast<char*>(i.data()), i.size()); }
+    Filesystem fs(argv[1], g_overlay_path, open_flags);
 
-    free(buffer);
+    Manifest expected = Manifest::read(argv[2]);
+    Manifest manifest = Manifest::build(fs, path, thread_count());
+
+    usize differences = manifest.compare(expected, stdout);
+    if (differences) {
+        fprintf(stderr, "%lu of %lu files differ from the manifest.\n", differences, expected.entries.size());
+        return 1;
+    }
+
+    fprintf(stderr, "All %lu files match the manifest.\n", expected.entries.size());
+    return 0;
+}
+
+int fsck(int argc, char** argv)
+{
+    if (argc != 2) {
+        printf("USAGE: %s fsck <IMAGE>\n", argv[-1]);
+        exit(0);
+    }
+
+    ConsistencyChecker checker(argv[1], g_overlay_path, thread_count(), stdout);
+    FsckReport         report = checker.run();
+
+    fprintf(stderr,
+            "%lu leaked, %lu orphaned, %lu doubly allocated and %lu out of range blocks, "
+            "%lu bad link counts, %lu dangling entries.\n",
+            report.leaked_blocks, report.orphaned_blocks, report.double_allocated_blocks, report.out_of_range_blocks,
+            report.bad_link_counts, report.dangling_entries);
+
+    return (report.total() == 0) ? 0 : 1;
+}
+
+int diff(int argc, char** argv)
+{
+    if (argc != 3 && argc != 4) {
+        printf("USAGE: %s diff <IMAGE A> <IMAGE B> <PATH (defaults to /)>\n", argv[-1]);
+        exit(0);
+    }
+
+    std::filesystem::path path((argc == 4) ? argv[3] : "/");
+
+    if (!path.is_absolute()) PANIC("<PATH> must be absolute.");
+
+    Filesystem fs_a(argv[1], Filesystem::OPEN_READ_ONLY | shared_cache_flag());
+    Filesystem fs_b(argv[2], Filesystem::OPEN_READ_ONLY | shared_cache_flag());
+
+    ImageDiff              image_diff(fs_a, fs_b, thread_count());
+    std::vector<DiffEntry> changes = image_diff.run(path);
+
+    for (const DiffEntry& change : changes) printf("%c %s\n", (char)change.kind, change.path.c_str());
+
+    return (changes.empty()) ? 0 : 1;
+}
+
+int export_tree(int argc, char** argv)
+{
+    const u32 open_flags = read_only_flags(argc, argv);
+
+    if ((argc != 3 && argc != 4) || strcmp(argv[1], "--tar")) {
+        printf("USAGE: %s export --tar [--direct] <IMAGE> <PATH (defaults to /)>\n", argv[-1]);
+        exit(0);
+    }
+
+    std::filesystem::path path((argc == 4) ? argv[3] : "/");
+
+    if (!path.is_absolute()) PANIC("<PATH> must be absolute.");
+    if (isatty(STDOUT_FILENO)) PANIC("Refusing to write an archive to a terminal, redirect stdout.");
+
+    Filesystem fs(argv[2], g_overlay_path, open_flags);
+
+    TarWriter writer(fs, STDOUT_FILENO);
+    writer.write_tree(path);
+
+    return 0;
+}
+
+int frag(int argc, char** argv)
+{
+    if (argc != 2 && argc != 3) {
+        printf("USAGE: %s frag <IMAGE> <WORST FILES (defaults to 10)>\n", argv[-1]);
+        exit(0);
+    }
+
+    const int worst_count = (argc == 3) ? atoi(argv[2]) : 10;
+    if (worst_count < 0) PANIC("<WORST FILES> must not be negative.");
+
+    Filesystem fs(argv[1], g_overlay_path, Filesystem::OPEN_READ_ONLY);
+
+    FragmentationScanner scanner(fs, thread_count(), worst_count);
+    FragReport           report = scanner.run();
+    report.print(stdout);
+
+    return 0;
+}
+
+int defrag(int argc, char** argv)
+{
+    if (argc != 2 && argc != 3) {
+        printf("USAGE: %s defrag <IMAGE> <SECONDS (defaults to no limit)>\n", argv[-1]);
+        exit(0);
+    }
+
+    const double seconds = (argc == 3) ? atof(argv[2]) : 0;
+    if (seconds < 0) PANIC("<SECONDS> must not be negative.");
+
+    drop_index(argv[1]);
+    Filesystem fs(argv[1], g_overlay_path, 0);
+
+    /* Every fragmented file, the worst first */
+    FragmentationScanner scanner(fs, thread_count(), SIZE_MAX);
+    FragReport           fragmentation = scanner.run();
+
+    Defragmenter defragmenter(fs, stdout);
+    DefragReport report = defragmenter.run(fragmentation.worst, seconds);
+
+    fprintf(stderr, "%lu files (%lu blocks) made contiguous, %lu skipped, %lu not reached.\n", report.moved_files,
+            report.moved_blocks, report.skipped_files,
+            fragmentation.worst.size() - report.moved_files - report.skipped_files);
+
+    return 0;
+}
+
+int build_index(int argc, char** argv)
+{
+    if (argc != 2) {
+        printf("USAGE: %s index <IMAGE>\n", argv[-1]);
+        exit(0);
+    }
+
+    Filesystem fs(argv[1], g_overlay_path, Filesystem::OPEN_READ_ONLY);
+
+    const std::string index_path = std::string(argv[1]) + ".idx";
+    SidecarIndex::build(index_path.c_str(), fs);
+
+    return 0;
+}
+
+int commit(int argc, char** argv)
+{
+    if (argc != 4) {
+        printf("USAGE: %s commit <IMAGE> <DELTA> <OUTPUT>\n", argv[-1]);
+        exit(0);
+    }
+
+    drop_index(argv[3]);
+    OverlayDevice overlay(argv[1], argv[2]);
+    overlay.commit(argv[3]);
+
+    fprintf(stderr, "%lu changed granules merged into %s.\n", overlay.delta_granules(), argv[3]);
+
+    return 0;
+}
+
+int mkimage(int argc, char** argv)
+{
+    if (argc != 3 && argc != 4) {
+        printf("USAGE: %s mkimage <DIRECTORY> <IMAGE|-> <SIZE[kMG] (defaults to fit the directory)>\n", argv[-1]);
+        exit(0);
+    }
+
+    i64 size = 0;
+    int direction = 0;
+    if (argc == 4) parse_bound(argv[3], "<SIZE>", &size, &direction);
+    if (direction) PANIC("<SIZE> must not have a sign.");
+
+    ImageBuilder builder(argv[1], size);
+
+    const bool to_stdout = !strcmp(argv[2], "-");
+    if (to_stdout && isatty(STDOUT_FILENO)) PANIC("Refusing to write an image to a terminal, redirect stdout.");
+
+    const int fd = (to_stdout) ? STDOUT_FILENO : open(argv[2], O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0) PANIC_FROM_ERRNO("Failed to create %s", argv[2]);
+
+    const u64 written = builder.write(fd);
+    if (!to_stdout && close(fd) < 0) PANIC_FROM_ERRNO("Failed to write %s", argv[2]);
+
+    fprintf(stderr, "%lu bytes written.\n", written);
 
     return 0;
 }
@@ -123,6 +827,26 @@ int main(int argc, char** argv)
     g_force =
         (env_force != NULL && (!strcmp(env_force, "1") || !strcmp(env_force, "true") || !strcmp(env_force, "TRUE")));
 
+    char* trace_path = getenv("TRACE");
+    char* overlay    = getenv("OVERLAY");
+    if (overlay && *overlay) g_overlay_path = overlay;
+
+    while (argc >= 3) {
+        if (!strcmp(argv[1], "--trace"))
+            trace_path = argv[2];
+        else if (!strcmp(argv[1], "--overlay"))
+            g_overlay_path = argv[2];
+        else
+            break;
+
+        /* Drop the option but keep the program name in front of the action */
+        argv[2] = argv[0];
+        argv += 2;
+        argc -= 2;
+    }
+
+    if (trace_path && *trace_path) Tracer::start(trace_path);
+
     if (argc < 2) {
         printf("USAGE: %s <ACTION> <FILE> <ACTION ARGUMENTS>\n", argv[0]);
         exit(1);
@@ -133,7 +857,20 @@ int main(int argc, char** argv)
     ACTION("mkdir", mkdir)
     ACTION("remove", rm)
     ACTION("query", query)
+    ACTION("du", du)
+    ACTION("find", find)
+    ACTION("stat", stat_paths)
     ACTION("get", get)
+    ACTION("hash", hash)
+    ACTION("verify", verify)
+    ACTION("fsck", fsck)
+    ACTION("diff", diff)
+    ACTION("export", export_tree)
+    ACTION("frag", frag)
+    ACTION("defrag", defrag)
+    ACTION("index", build_index)
+    ACTION("commit", commit)
+    ACTION("mkimage", mkimage)
 
     printf("USAGE: %s <ACTION> <FILE> <ACTION ARGUMENTS>\n", argv[0]);
     exit(1);
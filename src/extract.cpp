@@ -0,0 +1,304 @@
+#include "extract.hpp"
+
+#include "filesystem.hpp"
+#include "helpers.hpp"
+#include "inode.hpp"
+#include "trace.hpp"
+
+#include <algorithm>
+#include <atomic>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <thread>
+#include <unistd.h>
+
+static void write_fully(int fd, const u8* data, u64 length, u64 offset, const std::string& path)
+{
+    for (u64 written = 0; written < length;) {
+        ssize_t result = pwrite(fd, data + written, length - written, offset + written);
+        if (result < 0 && errno == EINTR) continue;
+        if (result < 0) PANIC_FROM_ERRNO("Failed to write %s", path.c_str());
+        written += result;
+    }
+}
+
+/* Only what the image maps, holes stay sparse. Host filesystems without fallocate just get a sparse file */
+static void preallocate(int fd, u64 offset, u64 length, const std::string& path)
+{
+    if (fallocate(fd, 0, offset, length) < 0 && errno != EOPNOTSUPP && errno != ENOSYS)
+        PANIC_FROM_ERRNO("Failed to allocate %s", path.c_str());
+}
+
+void Extractor::add_file(u32 inode_id, Inode& inode, const std::filesystem::path& output_path)
+{
+    if (!inode.is_file()) PANIC("%s is not a regular file.", output_path.c_str());
+
+    if (inode.hard_link_count > 1) {
+        auto [existing, inserted] = this->linked_files.try_emplace(inode_id, this->files.size());
+
+        /* Another host filesystem or too many links for it, then this name gets a copy of its own */
+        if (!inserted) {
+            const std::string& first = this->files[existing->second].path;
+            if (first == output_path) return;
+
+            if (unlink(output_path.c_str()) < 0 && errno != ENOENT)
+                PANIC_FROM_ERRNO("Failed to replace %s", output_path.c_str());
+            if (link(first.c_str(), output_path.c_str()) == 0) return;
+            if (errno != EXDEV && errno != EMLINK && errno != EPERM)
+                PANIC_FROM_ERRNO("Failed to link %s to %s", output_path.c_str(), first.c_str());
+        }
+    }
+
+    const usize file = this->files.size();
+    const u64   size = inode.size_in_bytes(&this->fs);
+
+    /* Created owner-writable and given its real mode once filled. Holes stay sparse thanks to the truncate */
+    int fd = open(output_path.c_str(), O_WRONLY | O_CREAT | O_TRUNC, S_IRUSR | S_IWUSR);
+    if (fd < 0) PANIC_FROM_ERRNO("Failed to create %s", output_path.c_str());
+    if (ftruncate(fd, size) < 0) PANIC_FROM_ERRNO("Failed to resize %s", output_path.c_str());
+
+    this->files.push_back({output_path.string(), (u16)(inode.type_and_permissions & 07777), size, 0, -1});
+
+    /* The workers allocate each range before they write it */
+    if (this->threads > 1 && size >= PARALLEL_FILE_SIZE) {
+        close(fd);
+        this->large_files.push_back({file, inode});
+        return;
+    }
+
+    const usize first_extent = this->extents.size();
+
+    if (this->fs.index) {
+        for (const BlockRun& run : this->fs.index->runs(inode_id))
+            for (u32 i = 0; i < run.length; i++) this->add_extent(file, run.physical_block + i, run.logical_block + i);
+    } else {
+        this->fs.walk_block_pointers(inode, [&](u32 block, i64 logical_block) {
+            if (logical_block >= 0) this->add_extent(file, block, logical_block);
+        });
+    }
+
+    /* Allocated up front, so the writes landing in physical block order don't leave the output fragmented */
+    for (usize i = first_extent; i < this->extents.size();) {
+        const u64 offset = this->extents[i].file_offset;
+        u64       end    = offset + this->extents[i].length;
+        for (i++; i < this->extents.size() && this->extents[i].file_offset == end; i++) end += this->extents[i].length;
+
+        preallocate(fd, offset, end - offset, output_path);
+    }
+
+    close(fd);
+}
+
+void Extractor::add_tree(const std::filesystem::path& root, const std::filesystem::path& output_path)
+{
+    if (::mkdir(output_path.c_str(), S_IRWXU) < 0 && errno != EEXIST)
+        PANIC_FROM_ERRNO("Failed to create %s", output_path.c_str());
+
+    u8* buffer = this->fs.allocate_block();
+
+    this->fs.walk(root, [&](const std::filesystem::path& path, u32 inode_id, Inode& inode) {
+        const std::filesystem::path target = output_path / path.lexically_relative(root);
+
+        if (inode.is_directory()) {
+            if (::mkdir(target.c_str(), S_IRWXU) < 0 && errno != EEXIST)
+                PANIC_FROM_ERRNO("Failed to create %s", target.c_str());
+            this->directories.emplace_back(target.string(), inode.type_and_permissions & 07777);
+        } else if (inode.is_symbolic_link()) {
+            unlink(target.c_str());
+            if (symlink(this->fs.read_link_target(inode, buffer).c_str(), target.c_str()) < 0)
+                PANIC_FROM_ERRNO("Failed to create %s", target.c_str());
+        } else if (inode.is_file()) {
+            this->add_file(inode_id, inode, target);
+        }
+
+        /* Devices, fifos and sockets are skipped, they need privileges or mean nothing outside the image */
+    });
+
+    free(buffer);
+}
+
+void Extractor::add_extent(usize file, u32 physical_block, u64 logical_block)
+{
+    const u64   block_size = this->fs.block_size;
+    OutputFile& output     = this->files[file];
+
+    const u64 file_offset = logical_block * block_size;
+    if (file_offset >= output.size) return;
+
+    const u64 length = std::min(block_size, output.size - file_offset);
+
+    if (!this->extents.empty()) {
+        Extent& last = this->extents.back();
+
+        if (last.file == file && last.physical_block + last.block_count == physical_block &&
+            last.file_offset + last.length == file_offset && last.block_count < MAX_READ_BLOCKS) {
+            last.block_count++;
+            last.length += length;
+            return;
+        }
+    }
+
+    this->extents.push_back({physical_block, 1, file, file_offset, length});
+    output.pending_extents++;
+}
+
+void Extractor::run()
+{
+    TRACE_SCOPE_ARG("Extractor::run", "extents", this->extents.size());
+
+    const u64 block_size = this->fs.block_size;
+
+    std::sort(this->extents.begin(), this->extents.end(),
+              [](const Extent& a, const Extent& b) { return a.physical_block < b.physical_block; });
+
+    u8* buffer = this->fs.allocate_blocks(MAX_READ_BLOCKS);
+
+    for (usize first = 0; first < this->extents.size();) {
+        /* Extents of different files often follow each other on disk, those are fetched with one read */
+        usize last   = first + 1;
+        u32   blocks = this->extents[first].block_count;
+
+        while (last < this->extents.size() &&
+               this->extents[last].physical_block ==
+                   this->extents[last - 1].physical_block + this->extents[last - 1].block_count &&
+               blocks + this->extents[last].block_count <= MAX_READ_BLOCKS)
+            blocks += this->extents[last++].block_count;
+
+        this->fs.device->read(this->fs.block_offset(this->extents[first].physical_block), buffer, blocks * block_size);
+
+        for (usize i = first; i < last; i++) {
+            const Extent& extent = this->extents[i];
+            const u64     skip   = extent.physical_block - this->extents[first].physical_block;
+            const u8*     data   = buffer + skip * block_size;
+            const int     fd     = this->output_fd(extent.file);
+
+            write_fully(fd, data, extent.length, extent.file_offset, this->files[extent.file].path);
+
+            if (--this->files[extent.file].pending_extents == 0) this->close_file(extent.file);
+        }
+
+        first = last;
+    }
+
+    free(buffer);
+
+    for (const LargeFile& large_file : this->large_files) this->extract_large_file(large_file);
+
+    for (OutputFile& file : this->files)
+        if (chmod(file.path.c_str(), file.mode) < 0)
+            PANIC_FROM_ERRNO("Failed to set the mode of %s", file.path.c_str());
+
+    /* Deepest first, so a read-only directory doesn't lock its children out */
+    for (auto it = this->directories.rbegin(); it != this->directories.rend(); it++)
+        if (chmod(it->first.c_str(), it->second) < 0)
+            PANIC_FROM_ERRNO("Failed to set the mode of %s", it->first.c_str());
+
+    this->files.clear();
+    this->large_files.clear();
+    this->extents.clear();
+    this->linked_files.clear();
+    this->directories.clear();
+}
+
+void Extractor::extract_large_file(const LargeFile& large_file)
+{
+    const OutputFile& output = this->files[large_file.file];
+
+    TRACE_SCOPE_ARG("Extractor::extract_large_file", "bytes", output.size);
+
+    const int fd = open(output.path.c_str(), O_WRONLY);
+    if (fd < 0) PANIC_FROM_ERRNO("Failed to open %s", output.path.c_str());
+
+    const u64 blocks       = (output.size + this->fs.block_size - 1) / this->fs.block_size;
+    const u64 range_blocks = RANGE_SIZE / this->fs.block_size;
+    const u64 ranges       = (blocks + range_blocks - 1) / range_blocks;
+
+    std::atomic<u64> next_range = 0;
+
+    auto work = [&]() {
+        u8*          buffer = this->fs.allocate_blocks(MAX_READ_BLOCKS);
+        PointerCache cache;
+        cache.buffer = this->fs.allocate_blocks(3);
+
+        /* Ranges go out in order, so together the workers still move forward through the file */
+        for (u64 range = next_range++; range < ranges; range = next_range++)
+            this->extract_range(large_file, fd, range * range_blocks, std::min(blocks, (range + 1) * range_blocks),
+                                buffer, cache);
+
+        free(buffer);
+    };
+
+    std::vector<std::thread> workers;
+    for (u32 i = 1; i < std::min<u64>(this->threads, ranges); i++) workers.emplace_back(work);
+    work();
+    for (std::thread& worker : workers) worker.join();
+
+    close(fd);
+}
+
+void Extractor::extract_range(const LargeFile& large_file, int fd, u64 first_block, u64 end_block, u8* buffer,
+                              PointerCache& cache)
+{
+    const u64         block_size = this->fs.block_size;
+    const OutputFile& output     = this->files[large_file.file];
+
+    /* Allocated before any of it is written, so the ranges other workers write meanwhile don't interleave with it */
+    for (u64 logical_block = first_block; logical_block < end_block;) {
+        const bool mapped = this->fs.physical_block(large_file.inode, logical_block, cache) != 0;
+
+        u64 count = 1;
+        while (logical_block + count < end_block &&
+               (this->fs.physical_block(large_file.inode, logical_block + count, cache) != 0) == mapped)
+            count++;
+
+        const u64 offset = logical_block * block_size;
+        if (mapped) preallocate(fd, offset, std::min(count * block_size, output.size - offset), output.path);
+
+        logical_block += count;
+    }
+
+    for (u64 logical_block = first_block; logical_block < end_block;) {
+        const u32 first = this->fs.physical_block(large_file.inode, logical_block, cache);
+
+        /* Holes are left alone, the output already reads as zeros there */
+        u32 count = 1;
+        while (logical_block + count < end_block && count < MAX_READ_BLOCKS &&
+               this->fs.physical_block(large_file.inode, logical_block + count, cache) == ((first) ? first + count : 0))
+            count++;
+
+        if (first) {
+            const u64 offset = logical_block * block_size;
+            const u64 length = std::min(count * block_size, output.size - offset);
+
+            this->fs.device->read(this->fs.block_offset(first), buffer, length);
+            write_fully(fd, buffer, length, offset, output.path);
+        }
+
+        logical_block += count;
+    }
+}
+
+int Extractor::output_fd(usize file)
+{
+    OutputFile& output = this->files[file];
+    if (output.fd >= 0) return output.fd;
+
+    if (this->open_files.size() >= MAX_OPEN_FILES) this->close_file(this->open_files.front());
+
+    output.fd = open(output.path.c_str(), O_WRONLY);
+    if (output.fd < 0) PANIC_FROM_ERRNO("Failed to open %s", output.path.c_str());
+
+    this->open_files.push_back(file);
+    return output.fd;
+}
+
+void Extractor::close_file(usize file)
+{
+    OutputFile& output = this->files[file];
+    if (output.fd < 0) return;
+
+    close(output.fd);
+    output.fd = -1;
+
+    this->open_files.erase(std::find(this->open_files.begin(), this->open_files.end(), file));
+}
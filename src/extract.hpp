@@ -0,0 +1,88 @@
+#pragma once
+
+#include "helpers.hpp"
+#include "inode.hpp"
+
+#include <algorithm>
+#include <deque>
+#include <filesystem>
+#include <string>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+class Filesystem;
+struct PointerCache;
+
+/*
+ * Extracts many files at once. The block maps of all files are resolved first, then the data is read in
+ * ascending physical block order across files and written with positional writes into each output file,
+ * so the device sees a mostly forward sweep instead of one random seek per file.
+ *
+ * Files of PARALLEL_FILE_SIZE and more are cut into ranges of logical blocks instead. Every worker resolves
+ * the blocks of the range it took straight from the pointer blocks, so no thread walks the whole map first.
+ */
+class Extractor
+{
+  private:
+    static const u32   MAX_READ_BLOCKS    = 256;
+    static const usize MAX_OPEN_FILES     = 64;
+    static const u64   PARALLEL_FILE_SIZE = 64 << 20;
+    static const u64   RANGE_SIZE         = 16 << 20; /* Bytes of a file one worker extracts at a time */
+
+    struct OutputFile {
+        std::string path;
+        u16         mode;
+        u64         size;
+        usize       pending_extents;
+        int         fd;
+    };
+
+    /* block_count blocks starting at physical_block, holding bytes file_offset..file_offset+length */
+    struct Extent {
+        u32   physical_block;
+        u32   block_count;
+        usize file;
+        u64   file_offset;
+        u64   length;
+    };
+
+    /* A file extracted in parallel ranges, files[file] has its output */
+    struct LargeFile {
+        usize file;
+        Inode inode;
+    };
+
+    Filesystem&             fs;
+    u32                     threads;
+    std::vector<OutputFile> files;
+    std::vector<LargeFile>  large_files;
+    std::vector<Extent>     extents;
+    std::deque<usize>       open_files; /* Oldest first, capped at MAX_OPEN_FILES */
+
+    /* Inodes with more than one link that already have an output, later names become host hard links */
+    std::unordered_map<u32, usize> linked_files;
+
+    /* Their modes are only applied once everything below them is written */
+    std::vector<std::pair<std::string, u16>> directories;
+
+  public:
+    explicit Extractor(Filesystem& fs, u32 threads = 1) : fs(fs), threads(std::max(threads, 1u)) {}
+
+    /*
+     * Only regular files can be added, the output is created right away and filled by run(). An inode that was
+     * added before is linked to its first output instead of being read again.
+     */
+    void add_file(u32 inode_id, Inode& inode, const std::filesystem::path& output_path);
+    /* Recreates the directory, its regular files and symlinks under output_path */
+    void add_tree(const std::filesystem::path& root, const std::filesystem::path& output_path);
+    void run();
+
+  private:
+    void add_extent(usize file, u32 physical_block, u64 logical_block);
+    void extract_large_file(const LargeFile& large_file);
+    void extract_range(const LargeFile& large_file, int fd, u64 first_block, u64 end_block, u8* buffer,
+                       PointerCache& cache);
+    int  output_fd(usize file);
+    void close_file(usize file);
+};
@@ -1,9 +1,14 @@
 #include "filesystem.hpp"
 
+#include "cache.hpp"
+#include "hash.hpp"
 #include "helpers.hpp"
 #include "inode.hpp"
 #include "math.h"
+#include "overlay.hpp"
+#include "trace.hpp"
 
+#include <algorithm>
 #include <filesystem>
 #include <time.h>
 #include <vector>
@@ -12,26 +17,73 @@
 #define EXT2_SUPERBLOCK_SIZE 1024
 #define EXT2_ROOT_INODE      2
 
-Filesystem::Filesystem(const char* path)
+Filesystem::Filesystem(const char* path, u32 open_flags) : Filesystem(path, NULL, open_flags) {}
+
+Filesystem::Filesystem(const char* path, const char* overlay_path, u32 open_flags)
+{
+    const bool direct = (open_flags & OPEN_DIRECT) != 0;
+
+    if (overlay_path)
+        this->device = std::make_unique<OverlayDevice>(path, overlay_path, direct);
+    else
+        this->device = std::make_unique<FileDevice>(path, (open_flags & OPEN_READ_ONLY) != 0, direct);
+
+    /* An overlay changes what the image reads as, so only plain read-only images are shared */
+    if ((open_flags & OPEN_SHARED_CACHE) && (open_flags & OPEN_READ_ONLY) && !overlay_path)
+        this->device = std::make_unique<SharedCacheDevice>(path, std::move(this->device));
+
+    this->init(open_flags);
+}
+
+Filesystem::Filesystem(std::unique_ptr<BlockDevice> device, u32 open_flags) : device(std::move(device))
+{
+    if (!(open_flags & OPEN_READ_ONLY)) API_ASSERT(this->device->writable());
+
+    this->init(open_flags);
+}
+
+void Filesystem::init(u32 open_flags)
 {
-    this->file.exceptions(std::ios::failbit | std::ios::badbit | std::ios::eofbit);
-    this->file.open(path, std::fstream::in | std::fstream::out | std::fstream::binary);
-    this->file.seekg(EXT2_SUPERBLOCK);
-    this->file.read((char*)&this->superblock, sizeof(SuperBlock));
+    TRACE_SCOPE("Filesystem::Filesystem");
+
+    this->device->read(EXT2_SUPERBLOCK, &this->superblock, sizeof(SuperBlock));
 
-    this->superblock.validate();
+    if (!(open_flags & OPEN_NO_VALIDATE))
+        this->superblock.validate();
+    else if (this->superblock.signature != SuperBlock::EXT2_SIGNATURE)
+        PANIC("Invalid EXT2 signature.");
 
+    this->e_superblock_present = false;
     if (this->superblock.version_major >= 1) {
-        this->file.read((char*)&this->e_superblock, sizeof(ExSuperBlock));
+        this->device->read(EXT2_SUPERBLOCK + sizeof(SuperBlock), &this->e_superblock, sizeof(ExSuperBlock));
 
         this->e_superblock_present = true;
         this->e_superblock.validate();
     }
 
+    this->directory_types =
+        this->e_superblock_present && this->e_superblock.has_required_feature(RequiredFeatures::DirectoryType);
+
+    /* Everything below divides by or shifts with the geometry, even with OPEN_NO_VALIDATE it has to make sense */
+    const SuperBlock& superblock = this->superblock;
+    if (!superblock.total_blocks || !superblock.blocks_in_block_group || !superblock.inodes_in_block_group)
+        PANIC("Corrupted superblock, %u blocks in groups of %u blocks and %u inodes.", superblock.total_blocks,
+              superblock.blocks_in_block_group, superblock.inodes_in_block_group);
+    if (superblock.block_size_logarythm > 6)
+        PANIC("Corrupted superblock, block size of 1024 << %u.", superblock.block_size_logarythm);
+
     this->block_groups = ceil((double)this->superblock.total_blocks / (double)this->superblock.blocks_in_block_group);
     this->block_size   = 1024 << this->superblock.block_size_logarythm;
     this->inode_size   = (this->e_superblock_present) ? this->e_superblock.inode_size : 128;
 
+    if (this->inode_size < sizeof(Inode) || this->inode_size > this->block_size ||
+        (this->inode_size & (this->inode_size - 1)))
+        PANIC("Corrupted superblock, inode size of %u.", this->inode_size);
+    if (superblock.total_inodes < Inode::ROOT_INODE ||
+        superblock.total_inodes > (u64)this->block_groups * superblock.inodes_in_block_group)
+        PANIC("Corrupted superblock, %u inodes in %u groups of %u.", superblock.total_inodes, this->block_groups,
+              superblock.inodes_in_block_group);
+
     this->read_bgds();
 
     this->read_inode(Inode::ROOT_INODE, &this->root_inode);
@@ -39,62 +91,725 @@ Filesystem::Filesystem(const char* path)
 
 void Filesystem::read_bgds()
 {
-    usize offset = (1 + this->superblock.superblock_block_number) * this->block_size;
+    TRACE_SCOPE("Filesystem::read_bgds");
 
-    this->bgds = reinterpret_cast<BGD*>(smalloc(this->block_groups * sizeof(BGD)));
+    usize offset = (1 + this->superblock.superblock_block_number) * this->block_size;
 
-    this->file.seekg(offset);
+    this->bgds.reset(reinterpret_cast<BGD*>(smalloc(this->block_groups * sizeof(BGD))));
 
-    this->file.read(reinterpret_cast<char*>(this->bgds), sizeof(BGD) * this->block_groups);
+    this->device->read(offset, this->bgds.get(), sizeof(BGD) * this->block_groups);
 }
 
 void Filesystem::read_inode(u32 inode_id, Inode* buffer)
 {
+    TRACE_SCOPE_ARG("Filesystem::read_inode", "inode", inode_id);
+
     usize group_index = (inode_id - 1) % this->superblock.inodes_in_block_group;
     BGD   bgd         = this->bgds[(inode_id - 1) / this->superblock.inodes_in_block_group];
 
-    usize offset = (this->superblock.superblock_block_number + bgd.inode_table_address) * this->block_size;
+    usize offset = this->block_offset(bgd.inode_table_address);
     offset += group_index * this->inode_size;
 
     if (!buffer) buffer = (Inode*)smalloc(sizeof(Inode));
 
-    this->file.seekg(offset);
-    this->file.read(reinterpret_cast<char*>(buffer), sizeof(Inode));
+    this->device->read(offset, buffer, sizeof(Inode));
+}
+
+void Filesystem::read_inodes(std::span<const u32> inode_ids, Inode* inodes)
+{
+    TRACE_SCOPE_ARG("Filesystem::read_inodes", "count", inode_ids.size());
+
+    std::unique_ptr<u8, decltype(&free)> buffer(this->allocate_block(), free);
+    u64                                  buffered_offset = UINT64_MAX;
+
+    for (usize i : this->on_disk_order(inode_ids)) {
+        const u64 offset       = this->inode_offset(inode_ids[i]);
+        const u64 block_offset = offset - offset % this->block_size;
+
+        if (block_offset != buffered_offset) {
+            this->device->read(block_offset, buffer.get(), this->block_size);
+            buffered_offset = block_offset;
+        }
+
+        memcpy(&inodes[i], buffer.get() + (offset - block_offset), sizeof(Inode));
+    }
+}
+
+u64 Filesystem::inode_offset(u32 inode_id) const
+{
+    const u32 group = (inode_id - 1) / this->superblock.inodes_in_block_group;
+    const u64 index = (inode_id - 1) % this->superblock.inodes_in_block_group;
+    return this->block_offset(this->bgds[group].inode_table_address) + index * this->inode_size;
+}
+
+/* In on-disk order, so every inode table block is visited once and the accesses go forward */
+std::vector<usize> Filesystem::on_disk_order(std::span<const u32> inode_ids) const
+{
+    std::vector<usize> order(inode_ids.size());
+    for (usize i = 0; i < order.size(); i++) order[i] = i;
+    std::sort(order.begin(), order.end(),
+              [&](usize a, usize b) { return this->inode_offset(inode_ids[a]) < this->inode_offset(inode_ids[b]); });
+
+    return order;
 }
 
 NONNULL(u8*) Filesystem::read_block(u32 block_address, u8* buffer)
 {
+    TRACE_SCOPE_ARG("Filesystem::read_block", "block", block_address);
+
     if (!buffer) buffer = this->allocate_block();
 
-    usize offset = (this->superblock.superblock_block_number + block_address) * this->block_size;
+    usize offset = this->block_offset(block_address);
 
-    this->file.seekg(offset);
-    this->file.read(reinterpret_cast<char*>(buffer), this->block_size);
+    this->device->read(offset, buffer, this->block_size);
 
     return buffer;
 }
 
-void Filesystem::get_inode_from_path(const std::filesystem::path& path, Inode* inode)
+std::string Filesystem::read_link_target(Inode& inode, u8* buffer)
 {
-    this->read_inode(Inode::ROOT_INODE, inode);
-    u8*              buffer   = this->allocate_block();
-    DirInodeIterator dir_iter = DirInodeIterator(this, *inode, buffer);
+    const u64 size          = inode.size_in_bytes(this);
+    const u64 xattr_sectors = (inode.extended_attribute_block) ? this->block_size / 512 : 0;
 
-    for (std::filesystem::path path_element : path) {
-        if (path_element == "/") continue;
-        bool found = false;
-        for (DirectoryEntry* entry : dir_iter) {
-            if (entry->name(this) == path_element) {
-                this->read_inode(entry->inode, inode);
-                found = true;
-                break;
+    /* Short targets are stored in place of the block pointers */
+    if (inode.disk_sector_count <= xattr_sectors)
+        return std::string((const char*)inode.block_pointers, std::min<u64>(size, sizeof(inode.block_pointers)));
+
+    this->read_block(inode.block_pointers[0], buffer);
+    return std::string((const char*)buffer, std::min<u64>(size, this->block_size));
+}
+
+void Filesystem::write_block(u32 block_address, const u8* buffer)
+{
+    TRACE_SCOPE_ARG("Filesystem::write_block", "block", block_address);
+
+    this->device->write(this->block_offset(block_address), buffer, this->block_size);
+}
+
+void Filesystem::write_inode(u32 inode_id, const Inode* inode)
+{
+    TRACE_SCOPE_ARG("Filesystem::write_inode", "inode", inode_id);
+
+    usize group_index = (inode_id - 1) % this->superblock.inodes_in_block_group;
+    BGD   bgd         = this->bgds[(inode_id - 1) / this->superblock.inodes_in_block_group];
+
+    usize offset = this->block_offset(bgd.inode_table_address);
+    offset += group_index * this->inode_size;
+
+    this->device->write(offset, inode, sizeof(Inode));
+}
+
+void Filesystem::write_inodes(std::span<const u32> inode_ids, const Inode* inodes)
+{
+    TRACE_SCOPE_ARG("Filesystem::write_inodes", "count", inode_ids.size());
+
+    /* Inodes share table blocks with untouched ones, each block is read, patched and written back once */
+    u8* buffer          = this->allocate_block();
+    u64 buffered_offset = UINT64_MAX;
+
+    for (usize i : this->on_disk_order(inode_ids)) {
+        const u64 offset       = this->inode_offset(inode_ids[i]);
+        const u64 block_offset = offset - offset % this->block_size;
+
+        if (block_offset != buffered_offset) {
+            if (buffered_offset != UINT64_MAX) this->device->write(buffered_offset, buffer, this->block_size);
+            this->device->read(block_offset, buffer, this->block_size);
+            buffered_offset = block_offset;
+        }
+
+        memcpy(buffer + (offset - block_offset), &inodes[i], sizeof(Inode));
+    }
+
+    if (buffered_offset != UINT64_MAX) this->device->write(buffered_offset, buffer, this->block_size);
+
+    free(buffer);
+}
+
+void Filesystem::write_bgds()
+{
+    usize offset = (1 + this->superblock.superblock_block_number) * this->block_size;
+
+    this->device->write(offset, this->bgds.get(), sizeof(BGD) * this->block_groups);
+}
+
+void Filesystem::write_superblock()
+{
+    this->superblock.last_write_time_posix = time(NULL);
+
+    this->device->write(EXT2_SUPERBLOCK, &this->superblock, sizeof(SuperBlock));
+}
+
+bool Filesystem::find_free_run(u32 length, u32 goal_group, u32* first_block)
+{
+    u8* bitmap = this->allocate_block();
+
+    /* First fit, starting at the goal group to keep related data close together */
+    for (u32 i = 0; i < this->block_groups; i++) {
+        const u32 group = (goal_group + i) % this->block_groups;
+        if (this->bgds[group].unallocated_blocks < length) continue;
+
+        this->read_block(this->bgds[group].block_bitmap, bitmap);
+
+        const u32 blocks = this->blocks_in_group(group);
+        u32       run    = 0;
+
+        for (u32 index = 0; index < blocks; index++) {
+            if ((bitmap[index / 8] >> (index % 8)) & 1) {
+                run = 0;
+                continue;
             }
+
+            if (++run < length) continue;
+
+            *first_block = this->group_first_block(group) + index + 1 - length;
+            free(bitmap);
+            return true;
+        }
+    }
+
+    free(bitmap);
+    return false;
+}
+
+void Filesystem::set_blocks_allocated(u32 first_block, u32 count, bool allocated)
+{
+    u8* bitmap = this->allocate_block();
+
+    while (count > 0) {
+        const u32 group    = this->group_of_block(first_block);
+        const u32 index    = first_block - this->group_first_block(group);
+        const u32 in_group = std::min(count, this->blocks_in_group(group) - index);
+
+        this->read_block(this->bgds[group].block_bitmap, bitmap);
+
+        for (u32 i = index; i < index + in_group; i++) {
+            if ((bool)((bitmap[i / 8] >> (i % 8)) & 1) == allocated)
+                PANIC("Block %u is already %s.", this->group_first_block(group) + i, (allocated) ? "in use" : "free");
+            bitmap[i / 8] ^= 1 << (i % 8);
+        }
+
+        this->write_block(this->bgds[group].block_bitmap, bitmap);
+
+        if (allocated) {
+            this->bgds[group].unallocated_blocks -= in_group;
+            this->superblock.unallocated_blocks -= in_group;
+        } else {
+            this->bgds[group].unallocated_blocks += in_group;
+            this->superblock.unallocated_blocks += in_group;
+        }
+
+        first_block += in_group;
+        count -= in_group;
+    }
+
+    free(bitmap);
+}
+
+u32 Filesystem::plan_layout(u64 block_size, u32 data_blocks, const std::function<u32()>& next_block,
+                            BlockLayout& layout, const std::function<bool(u32, u32)>& mapped)
+{
+    const u32 pointers_per_block = block_size / 4;
+
+    u32 logical_block = 0;
+
+    memset(layout.pointers, 0, sizeof(layout.pointers));
+    layout.blocks.clear();
+    layout.sources.clear();
+    layout.indirect.clear();
+
+    /* Skips the hole at logical_block, if the next span blocks are one */
+    auto skip_hole = [&](u64 span) -> bool {
+        const u32 count = std::min<u64>(span, data_blocks - logical_block);
+        if (!mapped || mapped(logical_block, count)) return false;
+
+        logical_block += count;
+        return true;
+    };
+
+    auto place_data = [&]() -> u32 {
+        if (skip_hole(1)) return 0;
+
+        layout.blocks.push_back(next_block());
+        layout.sources.push_back(logical_block++);
+        return layout.blocks.back();
+    };
+
+    /* The way the kernel allocates them, so reading the file sequentially never seeks back */
+    std::function<u32(u32)> place_indirect = [&](u32 depth) -> u32 {
+        u64 span = pointers_per_block;
+        for (u32 d = 0; d < depth; d++) span *= pointers_per_block;
+        if (skip_hole(span)) return 0;
+
+        const u32   block = next_block();
+        const usize slot  = layout.indirect.size();
+
+        layout.blocks.push_back(block);
+        layout.indirect.emplace_back(pointers_per_block, 0);
+        layout.sources.push_back(-(i64)slot - 1);
+
+        for (u32 i = 0; i < pointers_per_block && logical_block < data_blocks; i++) {
+            const u32 pointer        = (depth == 0) ? place_data() : place_indirect(depth - 1);
+            layout.indirect[slot][i] = pointer;
+        }
+
+        return block;
+    };
+
+    for (u32 i = 0; i < Inode::NDIR_BLOCKS && logical_block < data_blocks; i++) layout.pointers[i] = place_data();
+    for (u32 depth = 0; depth < 3 && logical_block < data_blocks; depth++)
+        layout.pointers[Inode::IND_BLOCK + depth] = place_indirect(depth);
+
+    return layout.sources.size();
+}
+
+void Filesystem::free_blocks(std::vector<u32>& blocks)
+{
+    std::sort(blocks.begin(), blocks.end());
+    blocks.erase(std::unique(blocks.begin(), blocks.end()), blocks.end());
+
+    this->clear_bitmap_bits(blocks, false);
+}
+
+void Filesystem::free_inodes(std::vector<u32>& inode_ids)
+{
+    std::sort(inode_ids.begin(), inode_ids.end());
+    inode_ids.erase(std::unique(inode_ids.begin(), inode_ids.end()), inode_ids.end());
+
+    this->clear_bitmap_bits(inode_ids, true);
+}
+
+void Filesystem::clear_bitmap_bits(const std::vector<u32>& sorted, bool inodes)
+{
+    TRACE_SCOPE_ARG("Filesystem::clear_bitmap_bits", "count", sorted.size());
+
+    const u32 inodes_in_group = this->superblock.inodes_in_block_group;
+    u8*       bitmap          = this->allocate_block();
+
+    for (usize i = 0; i < sorted.size();) {
+        const u32 group = (inodes) ? (sorted[i] - 1) / inodes_in_group : this->group_of_block(sorted[i]);
+        const u32 first = (inodes) ? group * inodes_in_group + 1 : this->group_first_block(group);
+        const u32 end   = first + ((inodes) ? inodes_in_group : this->blocks_in_group(group));
+        const u32 block = (inodes) ? this->bgds[group].inode_bitmap : this->bgds[group].block_bitmap;
+
+        this->read_block(block, bitmap);
+
+        u32 cleared = 0;
+        for (; i < sorted.size() && sorted[i] < end; i++, cleared++) {
+            const u32 index = sorted[i] - first;
+            if (!((bitmap[index / 8] >> (index % 8)) & 1))
+                PANIC("%s %u is already free.", (inodes) ? "Inode" : "Block", sorted[i]);
+            bitmap[index / 8] &= ~(1 << (index % 8));
+        }
+
+        this->write_block(block, bitmap);
+
+        if (inodes) {
+            this->bgds[group].unallocated_inodes += cleared;
+            this->superblock.unallocated_inodes += cleared;
+        } else {
+            this->bgds[group].unallocated_blocks += cleared;
+            this->superblock.unallocated_blocks += cleared;
+        }
+    }
+
+    free(bitmap);
+}
+
+u32 Filesystem::get_inode_from_path(const std::filesystem::path& path, Inode* inode)
+{
+    u32 inode_id = Inode::ROOT_INODE;
+
+    /* The index holds every reachable path, so a miss there is final */
+    if (this->index) {
+        TRACE_SCOPE("SidecarIndex::lookup");
+        if (!this->index->lookup(path, &inode_id)) PANIC("No such file or directory.");
+        this->read_inode(inode_id, inode);
+        return inode_id;
+    }
+
+    this->read_inode(inode_id, inode);
+    std::unique_ptr<u8, decltype(&free)> buffer(this->allocate_block(), free);
+
+    for (const std::filesystem::path& path_element : path) {
+        if (path_element == "/") continue;
+        TRACE_SCOPE_ARG("resolve path component", "directory", inode_id);
+
+        if (!inode->is_directory()) PANIC("No such file or directory.");
+
+        inode_id = this->find_entry(*inode, path_element.native(), buffer.get());
+        if (inode_id == 0) PANIC("No such file or directory.");
+
+        this->read_inode(inode_id, inode);
+    }
+
+    return inode_id;
+}
+
+u32 Filesystem::find_entry(Inode& directory, std::string_view name, u8* buffer)
+{
+    u32 inode_id;
+    if (this->hash_indexed(directory) && this->find_hashed_entry(directory, name, buffer, &inode_id)) return inode_id;
+
+    /* A block at a time, the entries of the ones that can't match are never looked at one by one */
+    for (InodeIterator block(this, directory, buffer); block != block.end(); ++block)
+        if (DirectoryEntry* entry = DirectoryEntry::find(*block, name, this->directory_types)) return entry->inode;
+
+    return 0;
+}
+
+bool Filesystem::hash_indexed(const Inode& directory) const
+{
+    return directory.has_hash_indexed_directory() && this->e_superblock_present &&
+           this->e_superblock.has_optional_feature(OptionalFeatures::DirectoryHashIndex);
+}
+
+u8 Filesystem::hash_version(u8 root_version) const
+{
+    if (root_version > DirectoryHash::TEA) return root_version;
+
+    /* Without either flag the image predates them, and was hashed with the chars of the machine it was made on */
+    const u32  flags       = this->e_superblock.flags;
+    const bool is_unsigned = (flags & ExSuperBlock::FLAGS_UNSIGNED_HASH) ||
+                             (!(flags & ExSuperBlock::FLAGS_SIGNED_HASH) && (char)-1 > 0);
+
+    return (is_unsigned) ? root_version + DirectoryHash::LEGACY_UNSIGNED : root_version;
+}
+
+u32 Filesystem::directory_hash(std::string_view name, u8 root_version) const
+{
+    u32 seed[4];
+    memcpy(seed, this->e_superblock.hash_seed, sizeof(seed));
+
+    return DirectoryHash::hash(name, this->hash_version(root_version), seed);
+}
+
+bool Filesystem::probe_hash_index(const Inode& directory, std::string_view name, HashProbe& probe, u8* buffer,
+                                  PointerCache& cache)
+{
+    const u64 blocks = directory.lower_size / this->block_size; /* Directories have no upper size */
+
+    u32 block = this->physical_block(directory, 0, cache);
+    if (!block) return false;
+    this->read_block(block, buffer);
+
+    const DxRootInfo* info    = (const DxRootInfo*)(buffer + DxRootInfo::OFFSET);
+    const u8          version = this->hash_version(info->hash_version);
+    if (info->reserved_zero || info->info_length != 8 || info->indirect_levels > DxRootInfo::MAX_LEVELS ||
+        version > DirectoryHash::TEA_UNSIGNED)
+        return false;
+
+    probe.hash    = this->directory_hash(name, info->hash_version);
+    probe.version = info->hash_version;
+    probe.levels  = info->indirect_levels;
+
+    u32 logical = 0;
+    u64 offset  = DxRootInfo::ROOT_ENTRIES;
+
+    for (u32 level = 0;; level++) {
+        const DxEntry*      entries = (const DxEntry*)(buffer + offset);
+        const DxCountLimit* counts  = (const DxCountLimit*)entries;
+        if (counts->count == 0 || counts->count > counts->limit ||
+            offset + counts->limit * sizeof(DxEntry) > this->block_size)
+            return false;
+
+        /* The last entry with a hash at most the one looked for, the first covers everything below the second */
+        u32 low = 1, high = counts->count;
+        while (low < high) {
+            const u32 middle = (low + high) / 2;
+            if (entries[middle].hash > probe.hash)
+                high = middle;
+            else
+                low = middle + 1;
+        }
+
+        probe.blocks[level]  = logical;
+        probe.entries[level] = low - 1;
+        logical              = entries[low - 1].block;
+
+        if (logical == 0 || logical >= blocks) return false;
+        if (level == probe.levels) break;
+
+        block = this->physical_block(directory, logical, cache);
+        if (!block) return false;
+        this->read_block(block, buffer);
+
+        offset = DxRootInfo::NODE_ENTRIES;
+    }
+
+    probe.leaf = logical;
+    return true;
+}
+
+bool Filesystem::find_hashed_entry(Inode& directory, std::string_view name, u8* buffer, u32* inode_id)
+{
+    TRACE_SCOPE("Filesystem::find_hashed_entry");
+
+    PointerCache cache;
+    if (directory.lower_size > Inode::NDIR_BLOCKS * this->block_size) cache.buffer = this->allocate_blocks(3);
+
+    HashProbe probe;
+    bool      answered = this->probe_hash_index(directory, name, probe, buffer, cache);
+
+    *inode_id = 0;
+
+    while (answered) {
+        const u32 block = this->physical_block(directory, probe.leaf, cache);
+        if (!block) {
+            answered = false;
+            break;
+        }
+
+        this->read_block(block, buffer);
+        if (DirectoryEntry* entry = DirectoryEntry::find({buffer, this->block_size}, name, this->directory_types)) {
+            *inode_id = entry->inode;
+            break;
+        }
+
+        /* Names with the same hash can go on in the following leaves */
+        if (!this->next_hashed_leaf(directory, probe, buffer, cache)) break;
+    }
+
+    return answered;
+}
+
+bool Filesystem::next_hashed_leaf(const Inode& directory, HashProbe& probe, u8* buffer, PointerCache& cache)
+{
+    /* Up to the deepest index block with an entry left, then down the first entries below it */
+    for (i32 level = probe.levels; level >= 0; level--) {
+        const u32 block = this->physical_block(directory, probe.blocks[level], cache);
+        if (!block) return false;
+        this->read_block(block, buffer);
+
+        const u64      offset  = (level) ? DxRootInfo::NODE_ENTRIES : DxRootInfo::ROOT_ENTRIES;
+        const DxEntry* entries = (const DxEntry*)(buffer + offset);
+        if (probe.entries[level] + 1 >= ((const DxCountLimit*)entries)->count) continue;
+
+        /* Only a block starting with the same hash can hold more of the name's collisions */
+        const DxEntry& next = entries[++probe.entries[level]];
+        if ((next.hash & ~1u) != probe.hash) return false;
+
+        u32 logical = next.block;
+        for (u32 deeper = level + 1; deeper <= probe.levels; deeper++) {
+            probe.blocks[deeper]  = logical;
+            probe.entries[deeper] = 0;
+
+            const u32 node = this->physical_block(directory, logical, cache);
+            if (!node) return false;
+            this->read_block(node, buffer);
+
+            logical = ((const DxEntry*)(buffer + DxRootInfo::NODE_ENTRIES))->block;
         }
 
-        if (!found) PANIC("No such file or directory.");
+        probe.leaf = logical;
+        return true;
+    }
+
+    return false;
+}
+
+void Filesystem::load_index(const char* index_path)
+{
+    this->index.reset(SidecarIndex::open(index_path, *this));
+    if (this->index) return;
+
+    /* Missing or stale, the image changed since it was built */
+    SidecarIndex::build(index_path, *this);
+    this->index.reset(SidecarIndex::open(index_path, *this));
+    if (!this->index) PANIC("Failed to load the freshly built index %s.", index_path);
+}
+
+void Filesystem::walk(const std::filesystem::path& root, const WalkCallback& callback)
+{
+    Inode directory;
+    this->get_inode_from_path(root, &directory);
+    API_ASSERT(directory.is_directory());
+
+    this->walk_directory(root, directory, callback);
+}
+
+void Filesystem::walk_directory(const std::filesystem::path& path, Inode& directory, const WalkCallback& callback)
+{
+    u8*              buffer   = this->allocate_block();
+    DirInodeIterator dir_iter = DirInodeIterator(this, directory, buffer);
+
+    for (DirectoryEntry* entry : dir_iter) {
+        std::string_view name = entry->name(this);
+        if (name == "." || name == "..") continue;
+
+        const std::filesystem::path entry_path = path / name;
+        const u32                   inode_id   = entry->inode;
+
+        Inode inode;
+        this->read_inode(inode_id, &inode);
+        callback(entry_path, inode_id, inode);
+
+        if (inode.is_directory()) this->walk_directory(entry_path, inode, callback);
     }
 
     free(buffer);
 }
 
-Filesystem::~Filesystem() { free(this->bgds); }
+void Filesystem::walk_block_pointers(const Inode& inode, const BlockCallback& callback)
+{
+    /* Device numbers and fast symlink targets live in the block pointers, they are not blocks */
+    if (inode.is_char_device() || inode.is_block_device() || inode.is_fifo() || inode.is_socket()) return;
+
+    const u64 xattr_sectors = (inode.extended_attribute_block) ? this->block_size / 512 : 0;
+    if (inode.disk_sector_count <= xattr_sectors) return;
+
+    i64 logical_block = 0;
+    for (; logical_block < Inode::NDIR_BLOCKS; logical_block++)
+        if (inode.block_pointers[logical_block]) callback(inode.block_pointers[logical_block], logical_block);
+
+    const u64 pointers_per_block = this->block_size / 4;
+    u64       span               = pointers_per_block;
+
+    for (u32 depth = 0; depth < 3; depth++, span *= pointers_per_block) {
+        const u32 block = inode.block_pointers[Inode::IND_BLOCK + depth];
+        if (block)
+            this->walk_indirect_block(block, depth, logical_block, callback);
+        else
+            logical_block += span;
+    }
+}
+
+void Filesystem::walk_indirect_block(u32 block, u32 depth, i64& logical_block, const BlockCallback& callback)
+{
+    const u64 pointers_per_block = this->block_size / 4;
+
+    callback(block, -1);
+
+    if (block >= this->superblock.total_blocks) {
+        u64 span = pointers_per_block;
+        for (u32 i = 0; i < depth; i++) span *= pointers_per_block;
+        logical_block += span;
+        return;
+    }
+
+    u32* pointers = (u32*)this->read_block(block, NULL);
+
+    for (u64 i = 0; i < pointers_per_block; i++) {
+        if (depth == 0) {
+            if (pointers[i]) callback(pointers[i], logical_block);
+            logical_block++;
+        } else if (pointers[i]) {
+            this->walk_indirect_block(pointers[i], depth - 1, logical_block, callback);
+        } else {
+            u64 span = 1;
+            for (u32 j = 0; j < depth; j++) span *= pointers_per_block;
+            logical_block += span;
+        }
+    }
+
+    free(pointers);
+}
+
+u32 Filesystem::physical_block(const Inode& inode, u64 logical_block, PointerCache& cache)
+{
+    if (logical_block < Inode::NDIR_BLOCKS) return inode.block_pointers[logical_block];
+
+    const u64 pointers_per_block = this->block_size / 4;
+
+    logical_block -= Inode::NDIR_BLOCKS;
+
+    u32 depth = 0;
+    u64 span  = 1;
+    while (logical_block >= span * pointers_per_block) {
+        logical_block -= span * pointers_per_block;
+        span *= pointers_per_block;
+        if (++depth == 3) return 0;
+    }
+
+    u32 block = inode.block_pointers[Inode::IND_BLOCK + depth];
+
+    for (u32 level = 0; block && span > 0; level++, span /= pointers_per_block) {
+        u8* pointers = cache.buffer + level * this->block_size;
+
+        if (cache.blocks[level] != block) {
+            if (block >= this->superblock.total_blocks) PANIC("Block pointer %u is outside the filesystem.", block);
+
+            this->read_block(block, pointers);
+            cache.blocks[level] = block;
+        }
+
+        block = ((u32*)pointers)[logical_block / span];
+        logical_block %= span;
+    }
+
+    return block;
+}
+
+u64 Filesystem::read_file(Inode& inode, u64 offset, u8* data, u64 length)
+{
+    TRACE_SCOPE_ARG("Filesystem::read_file", "bytes", length);
+
+    const u64 size = inode.size_in_bytes(this);
+    if (offset >= size) return 0;
+
+    length = std::min(length, size - offset);
+
+    PointerCache cache;
+    cache.buffer = this->allocate_blocks(3);
+
+    for (u64 done = 0; done < length;) {
+        const u64 logical_block = (offset + done) / this->block_size;
+        const u64 in_block      = (offset + done) % this->block_size;
+        const u32 first         = this->physical_block(inode, logical_block, cache);
+
+        /* Blocks that follow each other on disk are read together, a run of holes is zeroed together */
+        u64 run = std::min(this->block_size - in_block, length - done);
+        for (u32 next = 1; done + run < length; next++) {
+            const u32 block = this->physical_block(inode, logical_block + next, cache);
+            if (block != ((first) ? first + next : 0)) break;
+
+            run += std::min(this->block_size, length - done - run);
+        }
+
+        if (first)
+            this->device->read(this->block_offset(first) + in_block, data + done, run);
+        else
+            memset(data + done, 0, run);
+
+        done += run;
+    }
+
+    return length;
+}
+
+bool Filesystem::group_has_superblock(u32 group) const
+{
+    if (group <= 1 || !this->e_superblock_present ||
+        !this->e_superblock.has_write_feature(WriteFeatures::SparseSuperBlocks))
+        return true;
+
+    for (u32 base : {3, 5, 7}) {
+        u64 power = base;
+        while (power < group) power *= base;
+        if (power == group) return true;
+    }
+
+    return false;
+}
+
+u32 Filesystem::group_first_block(u32 group) const
+{
+    return this->superblock.superblock_block_number + group * this->superblock.blocks_in_block_group;
+}
+
+u32 Filesystem::group_of_block(u32 block) const
+{
+    return (block - this->superblock.superblock_block_number) / this->superblock.blocks_in_block_group;
+}
+
+u32 Filesystem::blocks_in_group(u32 group) const
+{
+    if (group + 1 < this->block_groups) return this->superblock.blocks_in_block_group;
+    return this->superblock.total_blocks - this->group_first_block(group);
+}
+
+u32 Filesystem::gdt_blocks() const
+{
+    return (this->block_groups * sizeof(BGD) + this->block_size - 1) / this->block_size;
+}
+
+Filesystem::~Filesystem() = default;
@@ -1,9 +1,12 @@
 #pragma once
+#include "device.hpp"
 #include "helpers.hpp"
+#include "index.hpp"
 #include "inode.hpp"
 
 #include <filesystem>
-#include <fstream>
+#include <functional>
+#include <memory>
 
 enum class FilesystemState : u16 {
     Clean     = 1,
@@ -158,11 +161,28 @@ struct ExSuperBlock {
     u32  compresion_algorythms;
     u8   blocks_to_preallocate_files;
     u8   blocks_to_preallocate_directories;
-    u16  __unused;
+    u16  reserved_gdt_blocks;
     u8   journal_id[16];
     u32  journal_inode;
     u32  journal_device;
     u32  head_of_orphan_inode_list;
+    u32  hash_seed[4];
+    u8   default_hash_version;
+    u8   journal_backup_type;
+    u16  group_descriptor_size;
+    u32  default_mount_options;
+    u32  first_meta_block_group;
+    u32  creation_time;
+    u32  journal_blocks[17];
+    u32  upper_total_blocks;
+    u32  upper_blocks_reserved_for_superuser;
+    u32  upper_unallocated_blocks;
+    u16  min_extra_inode_size;
+    u16  want_extra_inode_size;
+    u32  flags;
+
+    static const u32 FLAGS_SIGNED_HASH   = 0x1; /* How the directory hash treated chars where the image was made */
+    static const u32 FLAGS_UNSIGNED_HASH = 0x2;
 
     inline void validate() const
     {
@@ -211,7 +231,7 @@ struct ExSuperBlock {
     "\tcompression_algorythms: %s %s %s %s %s\n"                                                                   \
     "\tblocks_to_preallocate_files: %ud\n"                                                                         \
     "\tblocks_to_preallocate_directories: %ud\n"                                                                   \
-    "\t__unused: %ud\n"                                                                                            \
+    "\treserved_gdt_blocks: %ud\n"                                                                                 \
     "\tjournal_id: [%x, %x, %x, %x, %x, %x, %x, %x, %x, %x, %x, %x, %x, %x, %x, %x]\n"                             \
     "\tjournal_inode: %ud\n"                                                                                       \
     "\tjournal_device: %ud\n"                                                                                      \
@@ -238,10 +258,10 @@ struct ExSuperBlock {
         (x.is_compressed_with(CompressionAlgorithms::GZIP)) ? "GZIP" : "",                                         \
         (x.is_compressed_with(CompressionAlgorithms::BZIP2)) ? "BZIP2" : "",                                       \
         (x.is_compressed_with(CompressionAlgorithms::LZO)) ? "LZO" : "", x.blocks_to_preallocate_files,            \
-        x.blocks_to_preallocate_directories, x.__unused, x.journal_id[0], x.journal_id[1], x.journal_id[2],        \
-        x.journal_id[3], x.journal_id[4], x.journal_id[5], x.journal_id[6], x.journal_id[7], x.journal_id[8],      \
-        x.journal_id[9], x.journal_id[10], x.journal_id[11], x.journal_id[12], x.journal_id[13], x.journal_id[14], \
-        x.journal_id[15], x.journal_inode, x.journal_device, x.head_of_orphan_inode_list
+        x.blocks_to_preallocate_directories, x.reserved_gdt_blocks, x.journal_id[0], x.journal_id[1],              \
+        x.journal_id[2], x.journal_id[3], x.journal_id[4], x.journal_id[5], x.journal_id[6], x.journal_id[7],      \
+        x.journal_id[8], x.journal_id[9], x.journal_id[10], x.journal_id[11], x.journal_id[12], x.journal_id[13],  \
+        x.journal_id[14], x.journal_id[15], x.journal_inode, x.journal_device, x.head_of_orphan_inode_list
 
 typedef struct {
     u32 block_bitmap;
@@ -265,29 +285,134 @@ typedef struct {
         x.block_bitmap, x.inode_bitmap, x.inode_table_address, x.unallocated_blocks, x.unallocated_inodes, \
         x.directories_in_group
 
+/* Called for every entry below the walked directory, except for "." and ".." */
+using WalkCallback = std::function<void(const std::filesystem::path& path, u32 inode_id, Inode& inode)>;
+
+/* Called for every block referenced by an inode. Indirect blocks have a logical_block of -1 */
+using BlockCallback = std::function<void(u32 block, i64 logical_block)>;
+
+/* A file laid out over new blocks. Block i holds the logical data block sources[i], or indirect[-sources[i] - 1] */
+struct BlockLayout {
+    u32                           pointers[Inode::N_BLOCKS];
+    std::vector<u32>              blocks;
+    std::vector<i64>              sources;
+    std::vector<std::vector<u32>> indirect;
+};
+
+/* The path of an htree lookup, the root is level 0 and the deepest level points at the leaf */
+struct HashProbe {
+    u32 hash;
+    u8  version;                             /* The root's hash version, as stored */
+    u32 levels;                              /* The deepest level, the root's indirect_levels */
+    u32 blocks[DxRootInfo::MAX_LEVELS + 1];  /* Logical index block of each level, blocks[0] is 0 */
+    u32 entries[DxRootInfo::MAX_LEVELS + 1]; /* Which of its entries was followed */
+    u32 leaf;                                /* Logical block the name belongs in */
+};
+
+/* The pointer blocks last used by physical_block(), one per level, so a sequential scan reads each once */
+struct PointerCache {
+    u8* buffer    = NULL; /* 3 blocks, owned and freed with the cache */
+    u32 blocks[3] = {};
+
+    PointerCache() = default;
+    ~PointerCache() { free(this->buffer); }
+
+    PointerCache(const PointerCache&)            = delete;
+    PointerCache& operator=(const PointerCache&) = delete;
+};
+
 class Filesystem
 {
   public:
-    std::fstream file;
-    SuperBlock   superblock;
-    bool         e_superblock_present;
-    ExSuperBlock e_superblock;
-    u32          block_groups;
-    u64          block_size;
-    BGD*         bgds;
-    u16          inode_size;
-    Inode        root_inode;
+    std::unique_ptr<BlockDevice>            device;
+    SuperBlock                              superblock;
+    bool                                    e_superblock_present;
+    ExSuperBlock                            e_superblock;
+    bool                                    directory_types; /* Entries keep their type in the upper name length byte */
+    u32                                     block_groups;
+    u64                                     block_size;
+    std::unique_ptr<BGD[], decltype(&free)> bgds{nullptr, free}; /* Owned, so a panic while opening can't leak it */
+    u16                                     inode_size;
+    Inode                                   root_inode;
+    std::unique_ptr<SidecarIndex>           index; /* Answers path lookups when present */
+
+    static const u32 OPEN_READ_ONLY    = 0x1;
+    static const u32 OPEN_NO_VALIDATE  = 0x2; /* Skip the state and fsck checks, e.g. for the consistency checker */
+    static const u32 OPEN_DIRECT       = 0x4; /* Read-only, bypass the page cache with O_DIRECT where allowed */
+    static const u32 OPEN_SHARED_CACHE = 0x8; /* Read-only, metadata reads go through the cache of cache.hpp */
+
+    static const usize BUFFER_ALIGNMENT = 4096; /* Lets direct reads land in block buffers without bouncing */
 
   public:
-    explicit Filesystem(const char* path);
+    explicit Filesystem(const char* path, u32 open_flags = 0);
+    /* Writes go to the overlay delta instead of the image when an overlay_path is given */
+    Filesystem(const char* path, const char* overlay_path, u32 open_flags);
+    explicit Filesystem(std::unique_ptr<BlockDevice> device, u32 open_flags = 0);
     ~Filesystem();
-    inline u8* allocate_block() { return (u8*)smalloc(this->block_size); }
+    inline u8* allocate_block() { return this->allocate_blocks(1); }
+    inline u8* allocate_blocks(u64 count)
+    {
+        void* buffer = NULL;
+        if (posix_memalign(&buffer, BUFFER_ALIGNMENT, count * this->block_size) != 0)
+            PANIC("Failed to allocate required memory.");
+        return (u8*)buffer;
+    }
+    inline u64 block_offset(u32 block_address) const
+    {
+        return (this->superblock.superblock_block_number + (u64)block_address) * this->block_size;
+    }
     NONNULL(u8*) read_block(u32 block_number, u8* buffer);
-    void get_inode_from_path(const std::filesystem::path& path, Inode* inode);
-    void read_inode(u32 inode_id, Inode* inode);
+    u32         get_inode_from_path(const std::filesystem::path& path, Inode* inode);
+    u32         find_entry(Inode& directory, std::string_view name, u8* buffer); /* 0 when there is no such entry */
+    bool        hash_indexed(const Inode& directory) const;
+    u8          hash_version(u8 root_version) const; /* With the signedness the superblock records */
+    u32         directory_hash(std::string_view name, u8 root_version) const;
+    /* Follows the htree of directory to the leaf name belongs in. False for an index this driver can't follow */
+    bool        probe_hash_index(const Inode& directory, std::string_view name, HashProbe& probe, u8* buffer,
+                                 PointerCache& cache);
+    void        read_inode(u32 inode_id, Inode* inode);
+    void        read_inodes(std::span<const u32> inode_ids, Inode* inodes);
+    std::string read_link_target(Inode& inode, u8* buffer);
+    void        walk(const std::filesystem::path& root, const WalkCallback& callback);
+    void        walk_block_pointers(const Inode& inode, const BlockCallback& callback);
+    u32         physical_block(const Inode& inode, u64 logical_block, PointerCache& cache); /* 0 for a hole */
+    /* Clamped to the file size, holes read as zeroes. Returns the number of bytes read */
+    u64         read_file(Inode& inode, u64 offset, u8* data, u64 length);
+    void        load_index(const char* index_path);
+
+    /* Writes go straight to the device, flushing and ordering them is up to the caller */
+    void write_block(u32 block_address, const u8* buffer);
+    void write_inode(u32 inode_id, const Inode* inode);
+    void write_inodes(std::span<const u32> inode_ids, const Inode* inodes); /* Each table block rewritten once */
+    void write_bgds();
+    void write_superblock(); /* Also bumps the write time, which invalidates sidecar indexes */
+    bool find_free_run(u32 length, u32 goal_group, u32* first_block);
+    void set_blocks_allocated(u32 first_block, u32 count, bool allocated); /* Updates the in-memory counters */
+    /* Indirect blocks go in line, right before the first block they map. Returns the number of blocks used.
+     * Without a block in mapped(first, count) a span is a hole, it gets no data or indirect blocks */
+    static u32 plan_layout(u64 block_size, u32 data_blocks, const std::function<u32()>& next_block,
+                           BlockLayout& layout, const std::function<bool(u32, u32)>& mapped = nullptr);
+    /* Sorted and deduplicated in place, each bitmap block is then read and written once */
+    void free_blocks(std::vector<u32>& blocks);
+    void free_inodes(std::vector<u32>& inode_ids);
+
+    bool group_has_superblock(u32 group) const;
+    u32  group_first_block(u32 group) const;
+    u32  group_of_block(u32 block) const;
+    u32  blocks_in_group(u32 group) const;
+    u32  gdt_blocks() const;
 
   private:
+    void init(u32 open_flags);
     void read_bgds();
+    void walk_directory(const std::filesystem::path& path, Inode& directory, const WalkCallback& callback);
+    bool find_hashed_entry(Inode& directory, std::string_view name, u8* buffer, u32* inode_id);
+    bool next_hashed_leaf(const Inode& directory, HashProbe& probe, u8* buffer, PointerCache& cache);
+    void walk_indirect_block(u32 block, u32 depth, i64& logical_block, const BlockCallback& callback);
+    void clear_bitmap_bits(const std::vector<u32>& sorted, bool inodes);
+    u64  inode_offset(u32 inode_id) const;
+
+    std::vector<usize> on_disk_order(std::span<const u32> inode_ids) const;
 };
 
 #define Filesystem_dbg(x)           \
@@ -301,4 +426,4 @@ class Filesystem
     "\tinode_size: %ud\n"           \
     "\troot_inode\n"                \
     "}\n",                          \
-        x.e_superblock_present, x.block_groups, x.block_size, x.bgds, x.inode_size
+        x.e_superblock_present, x.block_groups, x.block_size, x.bgds.get(), x.inode_size
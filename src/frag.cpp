@@ -0,0 +1,260 @@
+#include "frag.hpp"
+
+#include "filesystem.hpp"
+#include "helpers.hpp"
+#include "inode.hpp"
+
+#include <algorithm>
+#include <bit>
+#include <functional>
+#include <thread>
+#include <unordered_map>
+#include <unordered_set>
+
+static bool more_fragmented(const FragmentedFile& a, const FragmentedFile& b)
+{
+    if (a.extents != b.extents) return a.extents > b.extents;
+    if (a.blocks != b.blocks) return a.blocks > b.blocks;
+    return a.inode_id < b.inode_id;
+}
+
+static void keep_worst(std::vector<FragmentedFile>& files, usize count)
+{
+    if (files.size() <= count) return;
+
+    std::nth_element(files.begin(), files.begin() + count, files.end(), more_fragmented);
+    files.resize(count);
+}
+
+void FragReport::merge(const FragReport& other)
+{
+    this->files += other.files;
+    this->data_blocks += other.data_blocks;
+    this->indirect_blocks += other.indirect_blocks;
+    this->extents += other.extents;
+
+    for (usize i = 0; i < HISTOGRAM_BUCKETS; i++) this->extent_histogram[i] += other.extent_histogram[i];
+
+    this->worst.insert(this->worst.end(), other.worst.begin(), other.worst.end());
+}
+
+void FragReport::print(FILE* output) const
+{
+    const double per_file   = (this->files) ? (double)this->extents / this->files : 0;
+    const double run_length = (this->extents) ? (double)this->data_blocks / this->extents : 0;
+    const double overhead   = (this->data_blocks) ? 100.0 * this->indirect_blocks / this->data_blocks : 0;
+
+    fprintf(output, "Files:           %lu\n", this->files);
+    fprintf(output, "Data blocks:     %lu\n", this->data_blocks);
+    fprintf(output, "Extents:         %lu (%.2f per file, %.1f blocks per extent)\n", this->extents, per_file,
+            run_length);
+    fprintf(output, "Indirect blocks: %lu (%.2f%% of the data blocks)\n", this->indirect_blocks, overhead);
+
+    fprintf(output, "\nExtents per file:\n");
+    for (usize i = 0; i < HISTOGRAM_BUCKETS; i++) {
+        if (!this->extent_histogram[i]) continue;
+
+        const u64 lower = (i == 0) ? 1 : (1ULL << (i - 1)) + 1;
+        const u64 upper = 1ULL << i;
+
+        if (i == HISTOGRAM_BUCKETS - 1)
+            fprintf(output, "\t%6lu+      %lu\n", lower, this->extent_histogram[i]);
+        else if (lower == upper)
+            fprintf(output, "\t%6lu       %lu\n", lower, this->extent_histogram[i]);
+        else
+            fprintf(output, "\t%6lu-%-6lu%lu\n", lower, upper, this->extent_histogram[i]);
+    }
+
+    fprintf(output, "\nFree space per block group:\n");
+    fprintf(output, "\t group  free blocks  free extents  largest extent  blocks per extent\n");
+    for (usize group = 0; group < this->groups.size(); group++) {
+        const GroupFreeSpace& space = this->groups[group];
+        fprintf(output, "\t%6lu  %11u  %12u  %14u  %17.1f\n", group, space.free_blocks, space.free_extents,
+                space.largest_free_extent, (space.free_extents) ? (double)space.free_blocks / space.free_extents : 0);
+    }
+
+    if (this->worst.empty()) return;
+
+    fprintf(output, "\nMost fragmented files:\n");
+    fprintf(output, "\textents     blocks      inode  path\n");
+    for (const FragmentedFile& file : this->worst)
+        fprintf(output, "\t%7u  %9lu  %9u  %s\n", file.extents, file.blocks, file.inode_id, file.path.c_str());
+}
+
+FragReport FragmentationScanner::run()
+{
+    this->report = FragReport();
+    this->report.groups.resize(this->fs.block_groups);
+    this->directories.clear();
+    this->next_group = 0;
+
+    std::vector<std::thread> workers;
+    for (u32 i = 1; i < this->threads; i++) workers.emplace_back(&FragmentationScanner::scan_groups, this);
+    this->scan_groups();
+    for (std::thread& thread : workers) thread.join();
+
+    keep_worst(this->report.worst, this->worst_count);
+    std::sort(this->report.worst.begin(), this->report.worst.end(), more_fragmented);
+
+    this->resolve_worst_paths();
+
+    return std::move(this->report);
+}
+
+void FragmentationScanner::scan_groups()
+{
+    const u32 inode_table_blocks =
+        (this->fs.superblock.inodes_in_block_group * this->fs.inode_size + this->fs.block_size - 1) /
+        this->fs.block_size;
+
+    u8* inode_table = this->fs.allocate_blocks(inode_table_blocks);
+    u8* bitmap      = this->fs.allocate_block();
+
+    FragReport       partial;
+    std::vector<u32> directories;
+
+    for (u32 group = this->next_group++; group < this->fs.block_groups; group = this->next_group++) {
+        this->scan_group(group, inode_table, bitmap, partial, directories);
+        keep_worst(partial.worst, this->worst_count);
+    }
+
+    free(inode_table);
+    free(bitmap);
+
+    std::lock_guard<std::mutex> guard(this->lock);
+    this->report.merge(partial);
+    this->directories.insert(this->directories.end(), directories.begin(), directories.end());
+}
+
+void FragmentationScanner::scan_group(u32 group, u8* inode_table, u8* bitmap, FragReport& partial,
+                                      std::vector<u32>& directories)
+{
+    const u64  block_size      = this->fs.block_size;
+    const BGD& bgd             = this->fs.bgds[group];
+    const u32  inodes_in_group = this->fs.superblock.inodes_in_block_group;
+    const u32  table_blocks    = (inodes_in_group * this->fs.inode_size + block_size - 1) / block_size;
+    const u32  first_inode = (this->fs.e_superblock_present) ? this->fs.e_superblock.first_non_reserved_inode : 11;
+
+    if (bgd.unallocated_inodes != inodes_in_group) {
+        for (u32 i = 0; i < table_blocks; i++)
+            this->fs.read_block(bgd.inode_table_address + i, inode_table + i * block_size);
+
+        this->fs.read_block(bgd.inode_bitmap, bitmap);
+
+        for (u32 index = 0; index < inodes_in_group; index++) {
+            const u32 inode_id = group * inodes_in_group + index + 1;
+            if (inode_id > this->fs.superblock.total_inodes) break;
+            if (!((bitmap[index / 8] >> (index % 8)) & 1)) continue;
+            if (inode_id < first_inode && inode_id != Inode::ROOT_INODE) continue;
+
+            const Inode& inode = *(Inode*)(inode_table + index * this->fs.inode_size);
+
+            if (inode.is_directory()) directories.push_back(inode_id);
+            if (inode.is_file()) this->scan_file(inode_id, inode, partial);
+        }
+    }
+
+    this->scan_free_space(group, bitmap);
+}
+
+void FragmentationScanner::scan_file(u32 inode_id, const Inode& inode, FragReport& partial)
+{
+    u64 data_blocks     = 0;
+    u64 indirect_blocks = 0;
+    u32 extents         = 0;
+    u64 next_block      = 0;
+
+    this->fs.walk_block_pointers(inode, [&](u32 block, i64 logical_block) {
+        if (logical_block < 0) {
+            /* Indirect blocks are normally allocated in line with the data they map, that's not a break */
+            if (block == next_block) next_block++;
+            indirect_blocks++;
+            return;
+        }
+
+        if (block != next_block) extents++;
+        next_block = (u64)block + 1;
+        data_blocks++;
+    });
+
+    if (!data_blocks) return;
+
+    partial.files++;
+    partial.data_blocks += data_blocks;
+    partial.indirect_blocks += indirect_blocks;
+    partial.extents += extents;
+
+    const usize bucket = (extents <= 1) ? 0 : std::bit_width(extents - 1);
+    partial.extent_histogram[std::min(bucket, FragReport::HISTOGRAM_BUCKETS - 1)]++;
+
+    if (extents > 1) partial.worst.push_back({inode_id, extents, data_blocks, ""});
+}
+
+void FragmentationScanner::scan_free_space(u32 group, u8* bitmap)
+{
+    this->fs.read_block(this->fs.bgds[group].block_bitmap, bitmap);
+
+    const u32      blocks = this->fs.blocks_in_group(group);
+    GroupFreeSpace space  = {0, 0, 0};
+    u32            run    = 0;
+
+    for (u32 index = 0; index <= blocks; index++) {
+        if (index < blocks && !((bitmap[index / 8] >> (index % 8)) & 1)) {
+            run++;
+            continue;
+        }
+
+        if (!run) continue;
+
+        space.free_blocks += run;
+        space.free_extents++;
+        space.largest_free_extent = std::max(space.largest_free_extent, run);
+        run                       = 0;
+    }
+
+    this->report.groups[group] = space;
+}
+
+void FragmentationScanner::resolve_worst_paths()
+{
+    if (this->report.worst.empty()) return;
+
+    std::unordered_set<u32> wanted(this->directories.begin(), this->directories.end());
+    for (const FragmentedFile& file : this->report.worst) wanted.insert(file.inode_id);
+
+    /* The directory entry naming each wanted inode, the first one wins for hard links */
+    std::unordered_map<u32, std::pair<u32, std::string>> names;
+
+    std::vector<Inode> inodes(this->directories.size());
+    this->fs.read_inodes(this->directories, inodes.data());
+
+    u8* buffer = this->fs.allocate_block();
+
+    for (usize i = 0; i < this->directories.size(); i++) {
+        DirInodeIterator dir_iter(&this->fs, inodes[i], buffer);
+
+        for (DirectoryEntry* entry : dir_iter) {
+            std::string_view name = entry->name(&this->fs);
+            if (name == "." || name == ".." || !wanted.count(entry->inode)) continue;
+
+            names.emplace((u32)entry->inode, std::make_pair(this->directories[i], std::string(name)));
+        }
+    }
+
+    free(buffer);
+
+    for (FragmentedFile& file : this->report.worst) {
+        u32 inode_id = file.inode_id;
+
+        /* Bounded, so a directory loop in a damaged image can't hang the report */
+        for (usize depth = 0; inode_id != Inode::ROOT_INODE && depth < this->directories.size() + 1; depth++) {
+            auto name = names.find(inode_id);
+            if (name == names.end()) break;
+
+            file.path = "/" + name->second.second + file.path;
+            inode_id  = name->second.first;
+        }
+
+        if (inode_id != Inode::ROOT_INODE) file.path = "<unreachable>";
+    }
+}
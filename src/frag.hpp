@@ -0,0 +1,72 @@
+#pragma once
+
+#include "helpers.hpp"
+
+#include <atomic>
+#include <mutex>
+#include <string>
+#include <vector>
+
+class Filesystem;
+struct Inode;
+
+struct FragmentedFile {
+    u32         inode_id;
+    u32         extents;
+    u64         blocks;
+    std::string path; /* Only resolved for the worst files */
+};
+
+struct GroupFreeSpace {
+    u32 free_blocks;
+    u32 free_extents;
+    u32 largest_free_extent;
+};
+
+struct FragReport {
+    static const usize HISTOGRAM_BUCKETS = 16; /* Bucket i holds files with 2^(i-1)+1 to 2^i extents */
+
+    u64 files           = 0;
+    u64 data_blocks     = 0;
+    u64 indirect_blocks = 0;
+    u64 extents         = 0;
+
+    u64 extent_histogram[HISTOGRAM_BUCKETS] = {};
+
+    std::vector<GroupFreeSpace> groups;
+    std::vector<FragmentedFile> worst; /* Most extents first */
+
+    void merge(const FragReport& other);
+    void print(FILE* output) const;
+};
+
+/*
+ * Measures how fragmented the files and the free space are. Inode tables and block bitmaps are scanned
+ * per block group in parallel, only the block pointers are walked, file data is never read.
+ */
+class FragmentationScanner
+{
+  private:
+    Filesystem&      fs;
+    u32              threads;
+    usize            worst_count;
+    std::mutex       lock;
+    std::atomic<u32> next_group = 0;
+    FragReport       report;
+    std::vector<u32> directories;
+
+  public:
+    FragmentationScanner(Filesystem& fs, u32 threads, usize worst_count)
+        : fs(fs), threads(threads), worst_count(worst_count)
+    {
+    }
+
+    FragReport run();
+
+  private:
+    void scan_groups();
+    void scan_group(u32 group, u8* inode_table, u8* bitmap, FragReport& partial, std::vector<u32>& directories);
+    void scan_file(u32 inode_id, const Inode& inode, FragReport& partial);
+    void scan_free_space(u32 group, u8* bitmap);
+    void resolve_worst_paths();
+};
@@ -0,0 +1,258 @@
+#include "fsck.hpp"
+
+#include "bitmap.hpp"
+#include "filesystem.hpp"
+#include "helpers.hpp"
+#include "inode.hpp"
+
+#include <functional>
+#include <stdarg.h>
+#include <thread>
+#include <vector>
+
+enum class BlockProblem {
+    None,
+    Leaked,
+    Orphaned
+};
+
+FsckReport ConsistencyChecker::run()
+{
+    Filesystem fs(this->image_path, this->overlay_path, Filesystem::OPEN_READ_ONLY | Filesystem::OPEN_NO_VALIDATE);
+
+    const u32 total_inodes = fs.superblock.total_inodes;
+
+    this->references       = new SparseBitmap(fs.superblock.total_blocks, fs.superblock.blocks_in_block_group);
+    this->xattr_blocks     = new SparseBitmap(fs.superblock.total_blocks, fs.superblock.blocks_in_block_group);
+    this->used_inodes      = new SparseBitmap(total_inodes + 1, fs.superblock.inodes_in_block_group);
+    this->inode_references = new std::atomic<u16>[total_inodes + 1];
+    for (u32 i = 0; i <= total_inodes; i++) this->inode_references[i] = 0;
+
+    this->mark_metadata(fs);
+    this->run_in_parallel(fs, &ConsistencyChecker::scan_groups);
+
+    FsckReport report;
+    report.dangling_entries = this->dangling;
+
+    const u32 first_inode = (fs.e_superblock_present) ? fs.e_superblock.first_non_reserved_inode : 11;
+
+    for (u32 inode_id = 1; inode_id <= total_inodes; inode_id++) {
+        const u16 references = this->inode_references[inode_id];
+
+        if (!this->used_inodes->test(inode_id)) {
+            if (references) {
+                this->report("DANGLING %u directory entries point to the unused inode %u\n", references, inode_id);
+                report.dangling_entries += references;
+            }
+            continue;
+        }
+
+        if (inode_id < first_inode && inode_id != Inode::ROOT_INODE) continue;
+
+        Inode inode;
+        fs.read_inode(inode_id, &inode);
+
+        if (inode.hard_link_count != references) {
+            this->report("LINKS    inode %u has a link count of %u, but %u directory entries\n", inode_id,
+                         inode.hard_link_count, references);
+            report.bad_link_counts++;
+        }
+    }
+
+    this->run_in_parallel(fs, &ConsistencyChecker::compare_bitmaps);
+
+    report.leaked_blocks           = this->leaked;
+    report.orphaned_blocks         = this->orphaned;
+    report.double_allocated_blocks = this->double_allocated;
+    report.out_of_range_blocks     = this->out_of_range;
+
+    delete this->references;
+    delete this->xattr_blocks;
+    delete this->used_inodes;
+    delete[] this->inode_references;
+
+    return report;
+}
+
+void ConsistencyChecker::run_in_parallel(Filesystem& fs, void (ConsistencyChecker::*stage)(Filesystem&))
+{
+    this->next_group = 0;
+
+    std::vector<std::thread> workers;
+    for (u32 i = 1; i < this->threads; i++) workers.emplace_back(stage, this, std::ref(fs));
+    (this->*stage)(fs);
+    for (std::thread& thread : workers) thread.join();
+}
+
+void ConsistencyChecker::mark_metadata(Filesystem& fs)
+{
+    const u32 inode_table_blocks =
+        (fs.superblock.inodes_in_block_group * fs.inode_size + fs.block_size - 1) / fs.block_size;
+    const bool resizing = fs.e_superblock_present && fs.e_superblock.has_optional_feature(OptionalFeatures::Resizing);
+    const u32  reserved_gdt = (resizing) ? fs.e_superblock.reserved_gdt_blocks : 0;
+
+    for (u32 group = 0; group < fs.block_groups; group++) {
+        if (fs.group_has_superblock(group)) {
+            const u32 first = fs.group_first_block(group);
+            for (u32 i = 0; i < 1 + fs.gdt_blocks() + reserved_gdt; i++) this->mark_block(fs, first + i, 0);
+        }
+
+        const BGD& bgd = fs.bgds[group];
+        this->mark_block(fs, bgd.block_bitmap, 0);
+        this->mark_block(fs, bgd.inode_bitmap, 0);
+        for (u32 i = 0; i < inode_table_blocks; i++) this->mark_block(fs, bgd.inode_table_address + i, 0);
+    }
+}
+
+void ConsistencyChecker::mark_block(Filesystem& fs, u32 block, u32 owner)
+{
+    if (block < fs.superblock.superblock_block_number || block >= fs.superblock.total_blocks) {
+        this->report("RANGE    inode %u references the invalid block %u\n", owner, block);
+        this->out_of_range++;
+        return;
+    }
+
+    if (this->references->test_and_set(block)) {
+        if (owner)
+            this->report("DOUBLE   block %u of inode %u is already in use\n", block, owner);
+        else
+            this->report("DOUBLE   metadata block %u is already in use\n", block);
+        this->double_allocated++;
+    }
+}
+
+void ConsistencyChecker::scan_groups(Filesystem& fs)
+{
+    const u32 inode_table_blocks =
+        (fs.superblock.inodes_in_block_group * fs.inode_size + fs.block_size - 1) / fs.block_size;
+
+    u8* inode_table = (u8*)smalloc(inode_table_blocks * fs.block_size);
+    u8* buffer      = fs.allocate_block();
+
+    for (u32 group = this->next_group++; group < fs.block_groups; group = this->next_group++)
+        this->scan_group(fs, group, inode_table, buffer);
+
+    free(inode_table);
+    free(buffer);
+}
+
+void ConsistencyChecker::scan_group(Filesystem& fs, u32 group, u8* inode_table, u8* buffer)
+{
+    const BGD& bgd                = fs.bgds[group];
+    const u32  inodes_in_group    = fs.superblock.inodes_in_block_group;
+    const u32  inode_table_blocks = (inodes_in_group * fs.inode_size + fs.block_size - 1) / fs.block_size;
+
+    if (bgd.unallocated_inodes == inodes_in_group) return;
+
+    /* The whole table is read up front, in the on-disk order */
+    for (u32 i = 0; i < inode_table_blocks; i++)
+        fs.read_block(bgd.inode_table_address + i, inode_table + i * fs.block_size);
+
+    fs.read_block(bgd.inode_bitmap, buffer);
+
+    std::vector<u32> directories;
+
+    for (u32 index = 0; index < inodes_in_group; index++) {
+        const u32 inode_id = group * inodes_in_group + index + 1;
+        if (inode_id > fs.superblock.total_inodes) break;
+        if (!((buffer[index / 8] >> (index % 8)) & 1)) continue;
+
+        this->used_inodes->test_and_set(inode_id);
+
+        Inode* inode = (Inode*)(inode_table + index * fs.inode_size);
+
+        if (inode_id == Inode::RESIZE_INODE) {
+            /* Its indirect blocks are the reserved GDT blocks, which are already accounted for */
+            if (inode->block_pointers[Inode::DIND_BLOCK])
+                this->mark_block(fs, inode->block_pointers[Inode::DIND_BLOCK], inode_id);
+            continue;
+        }
+
+        if (inode->extended_attribute_block && !this->xattr_blocks->test_and_set(inode->extended_attribute_block))
+            this->mark_block(fs, inode->extended_attribute_block, inode_id);
+
+        fs.walk_block_pointers(*inode, [&](u32 block, i64 logical_block) {
+            UNUSED(logical_block);
+            this->mark_block(fs, block, inode_id);
+        });
+
+        if (inode->is_directory()) directories.push_back(index);
+    }
+
+    /* Directory blocks are read last, the inode bitmap buffer is no longer needed */
+    for (u32 index : directories) {
+        Inode inode = *(Inode*)(inode_table + index * fs.inode_size);
+        this->scan_directory(fs, group * inodes_in_group + index + 1, inode, buffer);
+    }
+}
+
+void ConsistencyChecker::scan_directory(Filesystem& fs, u32 inode_id, Inode& inode, u8* buffer)
+{
+    DirInodeIterator dir_iter(&fs, inode, buffer);
+
+    for (DirectoryEntry* entry : dir_iter) {
+        if (entry->inode > fs.superblock.total_inodes) {
+            this->report("DANGLING directory %u has an entry pointing to the invalid inode %u\n", inode_id,
+                         entry->inode);
+            this->dangling++;
+            continue;
+        }
+
+        this->inode_references[entry->inode]++;
+    }
+}
+
+void ConsistencyChecker::compare_bitmaps(Filesystem& fs)
+{
+    u8* bitmap = fs.allocate_block();
+
+    for (u32 group = this->next_group++; group < fs.block_groups; group = this->next_group++)
+        this->compare_group_bitmap(fs, group, bitmap);
+
+    free(bitmap);
+}
+
+void ConsistencyChecker::compare_group_bitmap(Filesystem& fs, u32 group, u8* bitmap)
+{
+    fs.read_block(fs.bgds[group].block_bitmap, bitmap);
+
+    const u32 first  = fs.group_first_block(group);
+    const u32 blocks = fs.blocks_in_group(group);
+
+    /* Problems are reported as runs of consecutive blocks */
+    BlockProblem run_kind  = BlockProblem::None;
+    u32          run_start = 0;
+
+    for (u32 index = 0; index <= blocks; index++) {
+        BlockProblem kind = BlockProblem::None;
+
+        if (index < blocks) {
+            const bool allocated  = (bitmap[index / 8] >> (index % 8)) & 1;
+            const bool referenced = this->references->test(first + index);
+
+            if (allocated && !referenced) kind = BlockProblem::Leaked;
+            if (!allocated && referenced) kind = BlockProblem::Orphaned;
+        }
+
+        if (kind == run_kind) continue;
+
+        if (run_kind != BlockProblem::None) {
+            this->report("%s blocks %u-%u (group %u)\n", (run_kind == BlockProblem::Leaked) ? "LEAKED  " : "ORPHANED",
+                         first + run_start, first + index - 1, group);
+            ((run_kind == BlockProblem::Leaked) ? this->leaked : this->orphaned) += index - run_start;
+        }
+
+        run_kind  = kind;
+        run_start = index;
+    }
+}
+
+void ConsistencyChecker::report(const char* format, ...)
+{
+    std::lock_guard<std::mutex> lock(this->output_lock);
+
+    va_list args;
+    va_start(args, format);
+    vfprintf(this->output, format, args);
+    va_end(args);
+}
@@ -0,0 +1,75 @@
+#pragma once
+
+#include "helpers.hpp"
+
+#include <atomic>
+#include <mutex>
+
+class Filesystem;
+class SparseBitmap;
+struct Inode;
+
+struct FsckReport {
+    usize leaked_blocks           = 0; /* Allocated in the bitmaps, but not referenced by anything */
+    usize orphaned_blocks         = 0; /* Referenced, but free in the bitmaps */
+    usize double_allocated_blocks = 0; /* Referenced more than once */
+    usize out_of_range_blocks     = 0;
+    usize bad_link_counts         = 0;
+    usize dangling_entries        = 0; /* Directory entries pointing to unused inodes */
+
+    inline usize total() const
+    {
+        return this->leaked_blocks + this->orphaned_blocks + this->double_allocated_blocks +
+               this->out_of_range_blocks + this->bad_link_counts + this->dangling_entries;
+    }
+};
+
+/*
+ * A read-only consistency checker. Inode tables are scanned per block group in parallel to build
+ * a reference bitmap, which is then compared with the on-disk block bitmaps.
+ */
+class ConsistencyChecker
+{
+  private:
+    const char* image_path;
+    const char* overlay_path;
+    u32         threads;
+    FILE*       output;
+    std::mutex  output_lock;
+
+    SparseBitmap*     references       = NULL;
+    SparseBitmap*     xattr_blocks     = NULL;
+    SparseBitmap*     used_inodes      = NULL;
+    std::atomic<u16>* inode_references = NULL;
+    std::atomic<u32>  next_group       = 0;
+
+    std::atomic<usize> double_allocated = 0;
+    std::atomic<usize> out_of_range     = 0;
+    std::atomic<usize> leaked           = 0;
+    std::atomic<usize> orphaned         = 0;
+    std::atomic<usize> dangling         = 0;
+
+  public:
+    ConsistencyChecker(const char* image_path, u32 threads, FILE* output)
+        : ConsistencyChecker(image_path, NULL, threads, output)
+    {
+    }
+    /* Checks the image as the overlay delta changed it when an overlay_path is given */
+    ConsistencyChecker(const char* image_path, const char* overlay_path, u32 threads, FILE* output)
+        : image_path(image_path), overlay_path(overlay_path), threads(threads), output(output)
+    {
+    }
+
+    FsckReport run();
+
+  private:
+    void mark_metadata(Filesystem& fs);
+    void mark_block(Filesystem& fs, u32 block, u32 owner);
+    void scan_groups(Filesystem& fs);
+    void scan_group(Filesystem& fs, u32 group, u8* inode_table, u8* buffer);
+    void scan_directory(Filesystem& fs, u32 inode_id, Inode& inode, u8* buffer);
+    void compare_bitmaps(Filesystem& fs);
+    void compare_group_bitmap(Filesystem& fs, u32 group, u8* bitmap);
+    void report(const char* format, ...) __attribute__((format(printf, 2, 3)));
+    void run_in_parallel(Filesystem& fs, void (ConsistencyChecker::*stage)(Filesystem&));
+};
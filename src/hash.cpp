@@ -0,0 +1,242 @@
+#include "hash.hpp"
+
+#include "helpers.hpp"
+
+#include <algorithm>
+
+static inline u64 read_u64(const u8* data)
+{
+    u64 value;
+    memcpy(&value, data, sizeof(u64));
+    return value;
+}
+
+static inline u32 read_u32(const u8* data)
+{
+    u32 value;
+    memcpy(&value, data, sizeof(u32));
+    return value;
+}
+
+void XXHash64::clear()
+{
+    this->lanes[0]      = this->seed + PRIME_1 + PRIME_2;
+    this->lanes[1]      = this->seed + PRIME_2;
+    this->lanes[2]      = this->seed;
+    this->lanes[3]      = this->seed - PRIME_1;
+    this->stripe_length = 0;
+    this->total_length  = 0;
+}
+
+void XXHash64::consume_stripe(const u8* data)
+{
+    this->lanes[0] = round(this->lanes[0], read_u64(data));
+    this->lanes[1] = round(this->lanes[1], read_u64(data + 8));
+    this->lanes[2] = round(this->lanes[2], read_u64(data + 16));
+    this->lanes[3] = round(this->lanes[3], read_u64(data + 24));
+}
+
+void XXHash64::append(std::span<const u8> data)
+{
+    const u8* input  = data.data();
+    usize     length = data.size();
+
+    this->total_length += length;
+
+    if (this->stripe_length + length < STRIPE_SIZE) {
+        memcpy(this->stripe + this->stripe_length, input, length);
+        this->stripe_length += length;
+        return;
+    }
+
+    if (this->stripe_length) {
+        const usize missing = STRIPE_SIZE - this->stripe_length;
+        memcpy(this->stripe + this->stripe_length, input, missing);
+        this->consume_stripe(this->stripe);
+
+        input += missing;
+        length -= missing;
+        this->stripe_length = 0;
+    }
+
+    /* The four lanes are independent, so this loop pipelines well without explicit SIMD */
+    for (; length >= STRIPE_SIZE; input += STRIPE_SIZE, length -= STRIPE_SIZE) this->consume_stripe(input);
+
+    memcpy(this->stripe, input, length);
+    this->stripe_length = length;
+}
+
+u64 XXHash64::digest() const
+{
+    u64 result;
+
+    if (this->total_length >= STRIPE_SIZE) {
+        result = rotl(this->lanes[0], 1) + rotl(this->lanes[1], 7) + rotl(this->lanes[2], 12) +
+                 rotl(this->lanes[3], 18);
+        for (int i = 0; i < 4; i++) result = merge_round(result, this->lanes[i]);
+    } else {
+        result = this->seed + PRIME_5;
+    }
+
+    result += this->total_length;
+
+    const u8* tail   = this->stripe;
+    u32       length = this->stripe_length;
+
+    for (; length >= 8; tail += 8, length -= 8)
+        result = rotl(result ^ round(0, read_u64(tail)), 27) * PRIME_1 + PRIME_4;
+
+    if (length >= 4) {
+        result ^= (u64)read_u32(tail) * PRIME_1;
+        result = rotl(result, 23) * PRIME_2 + PRIME_3;
+        tail += 4;
+        length -= 4;
+    }
+
+    for (; length > 0; tail++, length--) result = rotl(result ^ (*tail * PRIME_5), 11) * PRIME_1;
+
+    result ^= result >> 33;
+    result *= PRIME_2;
+    result ^= result >> 29;
+    result *= PRIME_3;
+    result ^= result >> 32;
+
+    return result;
+}
+
+u32 DirectoryHash::hash(std::string_view name, u8 version, const u32 seed[4])
+{
+    u32 state[4] = {0x67452301, 0xefcdab89, 0x98badcfe, 0x10325476};
+    if (seed[0] || seed[1] || seed[2] || seed[3]) memcpy(state, seed, sizeof(state));
+
+    const bool is_unsigned = version >= LEGACY_UNSIGNED;
+    u32        result      = 0;
+    u32        words[8];
+
+    switch (version) {
+    case LEGACY:
+    case LEGACY_UNSIGNED: result = legacy(name, is_unsigned); break;
+    case HALF_MD4:
+    case HALF_MD4_UNSIGNED:
+        for (usize offset = 0; offset < name.size(); offset += 32) {
+            to_words(name.substr(std::min(offset, name.size())), words, 8, is_unsigned);
+            half_md4_transform(state, words);
+        }
+        result = state[1];
+        break;
+    case TEA:
+    case TEA_UNSIGNED:
+        for (usize offset = 0; offset < name.size(); offset += 16) {
+            to_words(name.substr(std::min(offset, name.size())), words, 4, is_unsigned);
+            tea_transform(state, words);
+        }
+        result = state[0];
+        break;
+    default: PANIC("Unknown directory hash version %u.", version);
+    }
+
+    /* The largest hash marks the end of the index, a name must never get it */
+    result &= ~1u;
+    if (result == 0x7fffffffu << 1) result = 0x7ffffffeu << 1;
+
+    return result;
+}
+
+u32 DirectoryHash::legacy(std::string_view name, bool is_unsigned)
+{
+    u32 previous = 0x37abe8f9, current = 0x12a3fe2d;
+
+    for (const char c : name) {
+        const int value = (is_unsigned) ? (int)(unsigned char)c : (int)(signed char)c;
+
+        u32 next = previous + (current ^ (u32)(value * 7152373));
+        if (next & 0x80000000) next -= 0x7fffffff;
+
+        previous = current;
+        current  = next;
+    }
+
+    return current << 1;
+}
+
+/* Packs up to count * 4 bytes of the name big-endian into words, padded with the length */
+void DirectoryHash::to_words(std::string_view name, u32* words, usize count, bool is_unsigned)
+{
+    u32 padding = (u32)name.size() | ((u32)name.size() << 8);
+    padding |= padding << 16;
+
+    const usize length = std::min(name.size(), count * 4);
+    u32         value  = padding;
+    usize       filled = 0;
+
+    for (usize i = 0; i < length; i++) {
+        const int c = (is_unsigned) ? (int)(unsigned char)name[i] : (int)(signed char)name[i];
+        value       = (u32)c + (value << 8);
+
+        if (i % 4 == 3) {
+            words[filled++] = value;
+            value           = padding;
+        }
+    }
+
+    if (filled < count) words[filled++] = value;
+    while (filled < count) words[filled++] = padding;
+}
+
+void DirectoryHash::half_md4_transform(u32 state[4], const u32 input[8])
+{
+    auto rotl = [](u32 x, int r) { return (x << r) | (x >> (32 - r)); };
+    auto f    = [](u32 x, u32 y, u32 z) { return z ^ (x & (y ^ z)); };
+    auto g    = [](u32 x, u32 y, u32 z) { return (x & y) + ((x ^ y) & z); };
+    auto h    = [](u32 x, u32 y, u32 z) { return x ^ y ^ z; };
+
+    const u32 k2 = 013240474631, k3 = 015666365641;
+
+    u32 a = state[0], b = state[1], c = state[2], d = state[3];
+
+    a = rotl(a + f(b, c, d) + input[0], 3);
+    d = rotl(d + f(a, b, c) + input[1], 7);
+    c = rotl(c + f(d, a, b) + input[2], 11);
+    b = rotl(b + f(c, d, a) + input[3], 19);
+    a = rotl(a + f(b, c, d) + input[4], 3);
+    d = rotl(d + f(a, b, c) + input[5], 7);
+    c = rotl(c + f(d, a, b) + input[6], 11);
+    b = rotl(b + f(c, d, a) + input[7], 19);
+
+    a = rotl(a + g(b, c, d) + input[1] + k2, 3);
+    d = rotl(d + g(a, b, c) + input[3] + k2, 5);
+    c = rotl(c + g(d, a, b) + input[5] + k2, 9);
+    b = rotl(b + g(c, d, a) + input[7] + k2, 13);
+    a = rotl(a + g(b, c, d) + input[0] + k2, 3);
+    d = rotl(d + g(a, b, c) + input[2] + k2, 5);
+    c = rotl(c + g(d, a, b) + input[4] + k2, 9);
+    b = rotl(b + g(c, d, a) + input[6] + k2, 13);
+
+    a = rotl(a + h(b, c, d) + input[3] + k3, 3);
+    d = rotl(d + h(a, b, c) + input[7] + k3, 9);
+    c = rotl(c + h(d, a, b) + input[2] + k3, 11);
+    b = rotl(b + h(c, d, a) + input[6] + k3, 15);
+    a = rotl(a + h(b, c, d) + input[1] + k3, 3);
+    d = rotl(d + h(a, b, c) + input[5] + k3, 9);
+    c = rotl(c + h(d, a, b) + input[0] + k3, 11);
+    b = rotl(b + h(c, d, a) + input[4] + k3, 15);
+
+    state[0] += a;
+    state[1] += b;
+    state[2] += c;
+    state[3] += d;
+}
+
+void DirectoryHash::tea_transform(u32 state[4], const u32 input[4])
+{
+    u32 sum = 0, b0 = state[0], b1 = state[1];
+
+    for (int round = 0; round < 16; round++) {
+        sum += 0x9E3779B9;
+        b0 += ((b1 << 4) + input[0]) ^ (b1 + sum) ^ ((b1 >> 5) + input[1]);
+        b1 += ((b0 << 4) + input[2]) ^ (b0 + sum) ^ ((b0 >> 5) + input[3]);
+    }
+
+    state[0] += b0;
+    state[1] += b1;
+}
@@ -0,0 +1,68 @@
+#pragma once
+
+#include "helpers.hpp"
+
+#include <span>
+#include <string_view>
+
+/* Streaming XXH64, used for content manifests. Not cryptographic. */
+class XXHash64
+{
+  private:
+    static const u64 PRIME_1 = 0x9E3779B185EBCA87ULL;
+    static const u64 PRIME_2 = 0xC2B2AE3D27D4EB4FULL;
+    static const u64 PRIME_3 = 0x165667B19E3779F9ULL;
+    static const u64 PRIME_4 = 0x85EBCA77C2B2AE63ULL;
+    static const u64 PRIME_5 = 0x27D4EB2F165667C5ULL;
+
+    static const usize STRIPE_SIZE = 32;
+
+    u64 seed;
+    u64 lanes[4];
+    u8  stripe[STRIPE_SIZE];
+    u32 stripe_length;
+    u64 total_length;
+
+  public:
+    explicit XXHash64(u64 seed = 0) : seed(seed) { this->clear(); }
+
+    void clear();
+    void append(std::span<const u8> data);
+    u64  digest() const;
+
+    static inline u64 hash(std::span<const u8> data, u64 seed = 0)
+    {
+        XXHash64 hasher(seed);
+        hasher.append(data);
+        return hasher.digest();
+    }
+
+  private:
+    static inline u64 rotl(u64 x, int r) { return (x << r) | (x >> (64 - r)); }
+    static inline u64 round(u64 acc, u64 input) { return rotl(acc + input * PRIME_2, 31) * PRIME_1; }
+    static inline u64 merge_round(u64 acc, u64 lane) { return (acc ^ round(0, lane)) * PRIME_1 + PRIME_4; }
+
+    void consume_stripe(const u8* data);
+};
+
+/* The name hash of htree directories, bit for bit what the Linux ext2/3/4 drivers compute */
+class DirectoryHash
+{
+  public:
+    /* The values directories and the superblock store, the unsigned ones are only ever derived from the flags */
+    static const u8 LEGACY            = 0;
+    static const u8 HALF_MD4          = 1;
+    static const u8 TEA               = 2;
+    static const u8 LEGACY_UNSIGNED   = 3;
+    static const u8 HALF_MD4_UNSIGNED = 4;
+    static const u8 TEA_UNSIGNED      = 5;
+
+    /* The low bit is always clear, index entries use it to mark a hash that goes on in the next block */
+    static u32 hash(std::string_view name, u8 version, const u32 seed[4]);
+
+  private:
+    static u32  legacy(std::string_view name, bool is_unsigned);
+    static void to_words(std::string_view name, u32* words, usize count, bool is_unsigned);
+    static void half_md4_transform(u32 state[4], const u32 input[8]);
+    static void tea_transform(u32 state[4], const u32 input[4]);
+};
@@ -1,3 +1,5 @@
+#pragma once
+
 #include <errno.h>
 #include <stdbool.h>
 #include <stdint.h>
@@ -45,15 +47,30 @@ typedef intmax_t  isize;
     std::unreachable();
 #endif
 
-#define PANIC_CUSTOM(x, e)          \
-    do {                            \
-        fprintf(stderr, "ERROR: "); \
-        x;                          \
-        _PRINT_DEBUGGING;           \
-        fprintf(stderr, "\n");      \
-        e;                          \
+#if defined(EXT2_LIBRARY) && defined(__cplusplus)
+/* Embedded, a panic unwinds to the C API, which turns it into an error code instead of ending the host process */
+struct PanicError {
+    enum Kind { GENERIC, ERRNO, API };
+
+    Kind kind;
+    int  error_number;
+};
+
+#define PANIC_EXIT(kind) throw PanicError{PanicError::kind, panic_errno}
+#else
+#define PANIC_EXIT(kind) exit(1)
+#endif
+
+#define PANIC_CUSTOM(x, e)                              \
+    do {                                                \
+        [[maybe_unused]] const int panic_errno = errno; \
+        fprintf(stderr, "ERROR: ");                     \
+        x;                                              \
+        _PRINT_DEBUGGING;                               \
+        fprintf(stderr, "\n");                          \
+        e;                                              \
     } while (0)
-#define PANIC(...) PANIC_CUSTOM(fprintf(stderr, __VA_ARGS__), exit(1))
+#define PANIC(...) PANIC_CUSTOM(fprintf(stderr, __VA_ARGS__), PANIC_EXIT(GENERIC))
 #define PANIC_FORCABLE(...)                                                                                      \
     PANIC_CUSTOM(                                                                                                \
         fprintf(stderr, __VA_ARGS__),                                                                            \
@@ -63,13 +80,15 @@ typedef intmax_t  isize;
                          (!strcmp(env_force, "1") || !strcmp(env_force, "true") || !strcmp(env_force, "TRUE"))); \
             }()) {                                                                                               \
             fprintf(stderr, "(Use FORCE=true to bypass this error)\n");                                          \
-            exit(1);                                                                                             \
+            PANIC_EXIT(GENERIC);                                                                                 \
         })
-#define PANIC_FROM_ERRNO(...) \
-    PANIC_CUSTOM(fprintf(stderr, __VA_ARGS__); fprintf(stderr, ": %s (errno=%d)", strerror(errno), errno), exit(1))
-#define API_ASSERT(x) \
-    if (!(x))         \
-    PANIC_CUSTOM(fprintf(stderr, "API Abuse found at function %s. Assertion %s failed.\n", __func__, #x), exit(1))
+#define PANIC_FROM_ERRNO(...)                                                                                          \
+    PANIC_CUSTOM(fprintf(stderr, __VA_ARGS__); fprintf(stderr, ": %s (errno=%d)", strerror(panic_errno), panic_errno), \
+                 PANIC_EXIT(ERRNO))
+#define API_ASSERT(x)                                                                                     \
+    if (!(x))                                                                                             \
+    PANIC_CUSTOM(fprintf(stderr, "API Abuse found at function %s. Assertion %s failed.\n", __func__, #x), \
+                 PANIC_EXIT(API))
 #define todo PANIC("function %s was not yet implemented.", __func__);
 
 #ifdef __cplusplus
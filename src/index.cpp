@@ -0,0 +1,260 @@
+#include "index.hpp"
+
+#include "filesystem.hpp"
+#include "helpers.hpp"
+#include "inode.hpp"
+
+#include <algorithm>
+#include <deque>
+#include <fcntl.h>
+#include <string>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <unordered_map>
+#include <vector>
+
+SidecarIndex::~SidecarIndex() { munmap((void*)this->data, this->data_size); }
+
+SidecarIndex* SidecarIndex::open(const char* index_path, const Filesystem& fs)
+{
+    int fd = ::open(index_path, O_RDONLY);
+    if (fd < 0) return NULL;
+
+    struct stat info;
+    if (fstat(fd, &info) < 0 || (usize)info.st_size < sizeof(IndexHeader)) {
+        close(fd);
+        return NULL;
+    }
+
+    void* data = mmap(NULL, info.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (data == MAP_FAILED) PANIC_FROM_ERRNO("Failed to map the index %s", index_path);
+
+    SidecarIndex* index = new SidecarIndex((const u8*)data, info.st_size);
+    if (!index->matches(fs)) {
+        delete index;
+        return NULL;
+    }
+
+    return index;
+}
+
+bool SidecarIndex::matches(const Filesystem& fs) const
+{
+    const IndexHeader& header = *this->header;
+
+    if (memcmp(header.magic, MAGIC, strlen(MAGIC) + 1) || header.version != VERSION) return false;
+
+    /* A truncated or damaged file is stale as well, every table has to lie within the mapping */
+    auto fits = [this](u64 offset, u64 count, u64 record_size) {
+        return offset <= this->data_size && count <= (this->data_size - offset) / record_size;
+    };
+    if (!fits(header.paths_offset, header.path_count, sizeof(IndexName)) ||
+        !fits(header.entries_offset, header.entry_count, sizeof(IndexName)) ||
+        !fits(header.inodes_offset, header.inode_count, sizeof(IndexInode)) ||
+        !fits(header.runs_offset, header.run_count, sizeof(BlockRun)) ||
+        !fits(header.strings_offset, header.strings_size, 1))
+        return false;
+
+    if (header.image_size != fs.device->size() || header.image_modification_time != fs.device->modification_time())
+        return false;
+
+    if (header.last_write_time_posix != fs.superblock.last_write_time_posix ||
+        header.number_of_mounts_since_fsck != fs.superblock.number_of_mounts_since_fsck ||
+        header.unallocated_blocks != fs.superblock.unallocated_blocks ||
+        header.unallocated_inodes != fs.superblock.unallocated_inodes)
+        return false;
+
+    return !fs.e_superblock_present || !memcmp(header.fsid, fs.e_superblock.fsid, sizeof(header.fsid));
+}
+
+bool SidecarIndex::lookup(const std::filesystem::path& path, u32* inode_id) const
+{
+    std::string normal = (std::filesystem::path("/") / path).lexically_normal().string();
+    if (normal.size() > 1 && normal.back() == '/') normal.pop_back();
+
+    const IndexName* paths = (const IndexName*)(this->data + this->header->paths_offset);
+    const IndexName* end   = paths + this->header->path_count;
+
+    const IndexName* found = std::lower_bound(
+        paths, end, normal, [this](const IndexName& entry, const std::string& key) { return this->name(entry) < key; });
+
+    if (found == end || this->name(*found) != normal) return false;
+
+    *inode_id = found->inode_id;
+    return true;
+}
+
+const IndexInode* SidecarIndex::find_inode(u32 inode_id) const
+{
+    const IndexInode* inodes = (const IndexInode*)(this->data + this->header->inodes_offset);
+    const IndexInode* end    = inodes + this->header->inode_count;
+
+    const IndexInode* found = std::lower_bound(
+        inodes, end, inode_id, [](const IndexInode& inode, u32 key) { return inode.inode_id < key; });
+
+    return (found != end && found->inode_id == inode_id) ? found : NULL;
+}
+
+std::span<const IndexName> SidecarIndex::entries(u32 inode_id) const
+{
+    const IndexInode* inode = this->find_inode(inode_id);
+    if (!inode) return {};
+
+    if (inode->first_entry > this->header->entry_count ||
+        inode->entry_count > this->header->entry_count - inode->first_entry)
+        return {};
+
+    const IndexName* entries = (const IndexName*)(this->data + this->header->entries_offset);
+    return std::span<const IndexName>(entries + inode->first_entry, inode->entry_count);
+}
+
+std::span<const BlockRun> SidecarIndex::runs(u32 inode_id) const
+{
+    const IndexInode* inode = this->find_inode(inode_id);
+    if (!inode) return {};
+
+    if (inode->first_run > this->header->run_count || inode->run_count > this->header->run_count - inode->first_run)
+        return {};
+
+    const BlockRun* runs = (const BlockRun*)(this->data + this->header->runs_offset);
+    return std::span<const BlockRun>(runs + inode->first_run, inode->run_count);
+}
+
+void SidecarIndex::build(const char* index_path, Filesystem& fs)
+{
+    std::string             strings;
+    std::vector<IndexName>  paths;
+    std::vector<IndexName>  entries;
+    std::vector<IndexInode> inodes;
+    std::vector<BlockRun>   runs;
+
+    std::unordered_map<u32, usize>          inode_records;
+    std::deque<std::pair<std::string, u32>> directories;
+
+    auto add_string = [&](std::string_view string) -> IndexName {
+        IndexName name = {strings.size(), (u32)string.size(), 0};
+        strings.append(string);
+        return name;
+    };
+
+    auto add_inode = [&](u32 inode_id, Inode& inode) -> IndexInode& {
+        auto existing = inode_records.find(inode_id);
+        if (existing != inode_records.end()) return inodes[existing->second];
+
+        IndexInode record = {inode_id, 0, 0, runs.size(), 0};
+
+        fs.walk_block_pointers(inode, [&](u32 block, i64 logical_block) {
+            if (logical_block < 0) return;
+
+            BlockRun* last = (runs.size() > record.first_run) ? &runs.back() : NULL;
+            if (last && last->logical_block + last->length == logical_block &&
+                last->physical_block + last->length == block) {
+                last->length++;
+                return;
+            }
+
+            runs.push_back({(u32)logical_block, block, 1});
+        });
+
+        record.run_count = runs.size() - record.first_run;
+
+        inode_records[inode_id] = inodes.size();
+        inodes.push_back(record);
+        return inodes.back();
+    };
+
+    IndexName root = add_string("/");
+    root.inode_id  = Inode::ROOT_INODE;
+    paths.push_back(root);
+    directories.emplace_back("/", (u32)Inode::ROOT_INODE);
+
+    u8* buffer = fs.allocate_block();
+
+    while (!directories.empty()) {
+        auto [path, directory_id] = directories.front();
+        directories.pop_front();
+
+        Inode directory;
+        fs.read_inode(directory_id, &directory);
+
+        const u64 first_entry = entries.size();
+
+        DirInodeIterator dir_iter(&fs, directory, buffer);
+        for (DirectoryEntry* entry : dir_iter) {
+            std::string_view name = entry->name(&fs);
+
+            IndexName record = add_string(name);
+            record.inode_id  = entry->inode;
+            entries.push_back(record);
+
+            if (name == "." || name == "..") continue;
+
+            const std::string child_path = (path == "/") ? "/" + std::string(name) : path + "/" + std::string(name);
+
+            IndexName path_record = add_string(child_path);
+            path_record.inode_id  = entry->inode;
+            paths.push_back(path_record);
+
+            Inode child;
+            fs.read_inode(entry->inode, &child);
+            if (child.is_directory())
+                directories.emplace_back(child_path, (u32)entry->inode);
+            else
+                add_inode(entry->inode, child);
+        }
+
+        IndexInode& record = add_inode(directory_id, directory);
+        record.first_entry = first_entry;
+        record.entry_count = entries.size() - first_entry;
+    }
+
+    free(buffer);
+
+    std::sort(paths.begin(), paths.end(), [&](const IndexName& a, const IndexName& b) {
+        return std::string_view(strings.data() + a.name_offset, a.name_length) <
+               std::string_view(strings.data() + b.name_offset, b.name_length);
+    });
+    std::sort(inodes.begin(), inodes.end(),
+              [](const IndexInode& a, const IndexInode& b) { return a.inode_id < b.inode_id; });
+
+    IndexHeader header;
+    memset(&header, 0, sizeof(IndexHeader));
+    memcpy(header.magic, MAGIC, strlen(MAGIC) + 1);
+    header.version                     = VERSION;
+    header.last_write_time_posix       = fs.superblock.last_write_time_posix;
+    header.number_of_mounts_since_fsck = fs.superblock.number_of_mounts_since_fsck;
+    header.unallocated_blocks          = fs.superblock.unallocated_blocks;
+    header.unallocated_inodes          = fs.superblock.unallocated_inodes;
+    if (fs.e_superblock_present) memcpy(header.fsid, fs.e_superblock.fsid, sizeof(header.fsid));
+    header.image_size              = fs.device->size();
+    header.image_modification_time = fs.device->modification_time();
+
+    header.path_count     = paths.size();
+    header.paths_offset   = sizeof(IndexHeader);
+    header.entry_count    = entries.size();
+    header.entries_offset = header.paths_offset + paths.size() * sizeof(IndexName);
+    header.inode_count    = inodes.size();
+    header.inodes_offset  = header.entries_offset + entries.size() * sizeof(IndexName);
+    header.run_count      = runs.size();
+    header.runs_offset    = header.inodes_offset + inodes.size() * sizeof(IndexInode);
+    header.strings_offset = header.runs_offset + runs.size() * sizeof(BlockRun);
+    header.strings_size   = strings.size();
+
+    /* Written next to the final path and renamed over it, so readers never map a partial index */
+    const std::string temporary_path = std::string(index_path) + ".tmp";
+
+    FILE* file = fopen(temporary_path.c_str(), "wb");
+    if (!file) PANIC_FROM_ERRNO("Failed to create the index %s", temporary_path.c_str());
+
+    fwrite(&header, sizeof(IndexHeader), 1, file);
+    fwrite(paths.data(), sizeof(IndexName), paths.size(), file);
+    fwrite(entries.data(), sizeof(IndexName), entries.size(), file);
+    fwrite(inodes.data(), sizeof(IndexInode), inodes.size(), file);
+    fwrite(runs.data(), sizeof(BlockRun), runs.size(), file);
+    fwrite(strings.data(), 1, strings.size(), file);
+
+    if (ferror(file) || fclose(file)) PANIC_FROM_ERRNO("Failed to write the index %s", temporary_path.c_str());
+    if (rename(temporary_path.c_str(), index_path) < 0) PANIC_FROM_ERRNO("Failed to replace the index %s", index_path);
+}
@@ -0,0 +1,96 @@
+#pragma once
+
+#include "helpers.hpp"
+
+#include <filesystem>
+#include <span>
+#include <string_view>
+
+class Filesystem;
+
+struct IndexHeader {
+    char magic[8];
+    u32  version;
+    u32  last_write_time_posix;
+    u16  number_of_mounts_since_fsck;
+    u16  __padding;
+    u32  unallocated_blocks;
+    u32  unallocated_inodes;
+    u8   fsid[16];
+    u64  image_size;
+    i64  image_modification_time; /* Nanoseconds, catches changes the superblock counters miss */
+    u64  path_count;
+    u64  paths_offset;
+    u64  entry_count;
+    u64  entries_offset;
+    u64  inode_count;
+    u64  inodes_offset;
+    u64  run_count;
+    u64  runs_offset;
+    u64  strings_offset;
+    u64  strings_size;
+} __attribute__((packed));
+
+/* A name and the inode it points to. In the path table the name is the full path */
+struct IndexName {
+    u64 name_offset;
+    u32 name_length;
+    u32 inode_id;
+} __attribute__((packed));
+
+struct IndexInode {
+    u32 inode_id;
+    u32 entry_count; /* Directory entries, "." and ".." included */
+    u64 first_entry;
+    u64 first_run;
+    u64 run_count;
+} __attribute__((packed));
+
+/* physical_block..physical_block+length hold logical_block..logical_block+length of the file */
+struct BlockRun {
+    u32 logical_block;
+    u32 physical_block;
+    u32 length;
+} __attribute__((packed));
+
+/*
+ * A mmap-able sidecar file (<IMAGE>.idx) with the path table, the directory listings and the block runs of
+ * every inode reachable from the root. It is tied to the image's size and modification time as well as the
+ * superblock write time, mount count and free counts, so any change to the image makes it stale.
+ */
+class SidecarIndex
+{
+  private:
+    static constexpr const char* MAGIC   = "EXT2IDX";
+    static const u32             VERSION = 2;
+
+    const u8*          data;
+    usize              data_size;
+    const IndexHeader* header;
+
+  public:
+    ~SidecarIndex();
+
+    /* Returns NULL if the index is missing or doesn't describe the image anymore */
+    static SidecarIndex* open(const char* index_path, const Filesystem& fs);
+    static void          build(const char* index_path, Filesystem& fs);
+
+    bool                       lookup(const std::filesystem::path& path, u32* inode_id) const;
+    std::span<const IndexName> entries(u32 inode_id) const;
+    std::span<const BlockRun>  runs(u32 inode_id) const;
+
+    inline std::string_view name(const IndexName& entry) const
+    {
+        return std::string_view((const char*)this->data + this->header->strings_offset + entry.name_offset,
+                                entry.name_length);
+    }
+
+  private:
+    SidecarIndex(const u8* data, usize data_size)
+        : data(data), data_size(data_size), header((const IndexHeader*)data)
+    {
+    }
+
+    const IndexInode* find_inode(u32 inode_id) const;
+    bool              matches(const Filesystem& fs) const;
+};
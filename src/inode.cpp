@@ -2,6 +2,14 @@
 
 #include "filesystem.hpp"
 #include "helpers.hpp"
+#include "trace.hpp"
+
+#include <algorithm>
+#include <cstring>
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
 
 u64 Inode::size_in_bytes(Filesystem* fs)
 {
@@ -12,6 +20,8 @@ u64 Inode::size_in_bytes(Filesystem* fs)
 
 void InodeIterator::increment()
 {
+    TRACE_SCOPE_ARG("InodeIterator::increment", "logical_block", this->counter);
+
     const u64 inode_size = this->inode.disk_sector_count * 512 / this->fs->block_size;
     if ((usize)this->counter >= inode_size) {
         this->counter = -1;
@@ -91,40 +101,107 @@ void DirInodeIterator::increment()
 {
     if (this->counter == -1) return;
 
-    if (this->current_block_offset >= this->fs->block_size) {
-        ++this->iter;
-        if (this->iter == this->iter.end()) {
-            this->counter = -1;
-            return;
-        }
+    /* Deleted entries (inode 0) are skipped in place, a directory full of them must not grow the stack */
+    while (true) {
+        if (this->current_block_offset >= this->fs->block_size) {
+            ++this->iter;
+            if (this->iter == this->iter.end()) {
+                this->counter = -1;
+                return;
+            }
 
-        this->current_block_offset = 0;
-    }
+            this->current_block_offset = 0;
+        }
 
-    const u32 inode      = *(u32*)(this->buffer + this->current_block_offset);
-    const u16 entry_size = *(u16*)(this->buffer + this->current_block_offset + 4);
+        const u32 inode      = *(u32*)(this->buffer + this->current_block_offset);
+        const u16 entry_size = *(u16*)(this->buffer + this->current_block_offset + 4);
 
-    if (inode == 0) {
         if (entry_size == 0) {
             this->counter = -1;
             return;
         }
 
-        this->current_block_offset += entry_size;
+        if (inode != 0) break;
 
-        return this->increment();
+        this->current_block_offset += entry_size;
     }
 
     this->current = (DirectoryEntry*)(this->buffer + this->current_block_offset);
-    this->current_block_offset += entry_size;
+    this->current_block_offset += this->current->total_entry_size;
     this->counter++;
 }
 
 std::string_view DirectoryEntry::name(Filesystem* fs)
 {
     u16 name_length = this->lower_name_length;
-    if (!(fs->e_superblock_present && fs->e_superblock.has_required_feature(RequiredFeatures::DirectoryType)))
-        name_length |= this->upper_name_length_or_type << 8;
+    if (!fs->directory_types) name_length |= this->upper_name_length_or_type << 8;
 
     return std::string_view(this->name_data, name_length);
 }
+
+u32 DirectoryEntry::file_type(Filesystem* fs)
+{
+    static const u32 types[] = {0,
+                                Inode::FILE_TYPE_FILE,
+                                Inode::FILE_TYPE_DIRECTORY,
+                                Inode::FILE_TYPE_CHAR_DEV,
+                                Inode::FILE_TYPE_BLOCK_DEV,
+                                Inode::FILE_TYPE_FIFO,
+                                Inode::FILE_TYPE_SOCKET,
+                                Inode::FILE_TYPE_LINK};
+
+    if (!fs->directory_types) return 0;
+    if (this->upper_name_length_or_type >= sizeof(types) / sizeof(types[0])) return 0;
+
+    return types[this->upper_name_length_or_type];
+}
+
+DirectoryEntry* DirectoryEntry::find(std::span<u8> block, std::string_view name, bool directory_types)
+{
+    const usize length = name.size();
+    if (length == 0 || length > 255) return NULL;
+
+    /* With the filetype feature the upper byte is the type, not part of the name length */
+    const u16 length_mask = (directory_types) ? 0xff : 0xffff;
+
+#ifdef __SSE2__
+    /* The first 16 bytes of the name are compared at once, only longer names need a memcmp of the rest */
+    const usize prefix_length = std::min<usize>(length, 16);
+    const u32   prefix_mask   = (1u << prefix_length) - 1;
+
+    alignas(16) char prefix[16] = {};
+    memcpy(prefix, name.data(), prefix_length);
+    const __m128i needle = _mm_load_si128((const __m128i*)prefix);
+#endif
+
+    u8* const end = block.data() + block.size();
+
+    for (u8* cursor = block.data(); cursor + sizeof(DirectoryEntry) <= end;) {
+        DirectoryEntry* entry      = (DirectoryEntry*)cursor;
+        const u16       entry_size = entry->total_entry_size;
+        if (entry_size < sizeof(DirectoryEntry)) return NULL; /* Corrupted, the walk can't go on */
+
+        cursor += entry_size;
+
+        /* Both name length bytes are read as one, the length is the cheapest filter so it goes first */
+        const u16 entry_length = *(u16*)&entry->lower_name_length & length_mask;
+        if (entry_length != length || entry->inode == 0) continue;
+
+        u8* const data = (u8*)entry->name_data;
+        if (data + length > end) return NULL;
+
+#ifdef __SSE2__
+        /* The last entry of a block may end less than 16 bytes before it, that one is compared bytewise */
+        if (data + 16 <= end) {
+            const __m128i candidate = _mm_loadu_si128((const __m128i*)data);
+            if (((u32)_mm_movemask_epi8(_mm_cmpeq_epi8(candidate, needle)) & prefix_mask) != prefix_mask) continue;
+            if (length <= 16 || !memcmp(data + 16, name.data() + 16, length - 16)) return entry;
+            continue;
+        }
+#endif
+
+        if (!memcmp(data, name.data(), length)) return entry;
+    }
+
+    return NULL;
+}
@@ -5,6 +5,7 @@
 #include <cstddef>
 #include <iterator>
 #include <span>
+#include <string_view>
 
 class Filesystem;
 
@@ -15,6 +16,7 @@ struct Inode {
     static const int ACL_DATA_INODE     = 4;
     static const int BOOT_LOADER_INODE  = 5;
     static const int UNDELETE_DIR_INODE = 6;
+    static const int RESIZE_INODE       = 7;
 
     static const int NDIR_BLOCKS = 12;
     static const int IND_BLOCK   = NDIR_BLOCKS;
@@ -92,9 +94,9 @@ struct Inode {
     static const u32 FLAGS_APPEND_ONLY             = 0x20;
     static const u32 FLAGS_DUMP_NOT_INCLUDED       = 0x40;
     static const u32 FLAGS_DONT_UPDATE_LAST_ACCESS = 0x80;
-    static const u32 FLAGS_HASH_INDEXED_DIRECTORY  = 0x10000;
-    static const u32 FLAGS_AFS_DIRECTORY           = 0x20000;
-    static const u32 FLAGS_JOURNAL_FILE_DATA       = 0x40000;
+    static const u32 FLAGS_HASH_INDEXED_DIRECTORY  = 0x1000;
+    static const u32 FLAGS_AFS_DIRECTORY           = 0x2000;
+    static const u32 FLAGS_JOURNAL_FILE_DATA       = 0x4000;
 
     inline bool delete_securely() const { return (this->flags & FLAGS_SECURE_DELETION) != 0; }
     inline bool keep_copy_on_delete() const { return (this->flags & FLAGS_KEEP_COPY_ON_DELETE) != 0; }
@@ -195,9 +197,9 @@ struct Inode {
 #define FS_INODE_FLAGS_APPEND_ONLY             0x20
 #define FS_INODE_FLAGS_DUMP_NOT_INCLUDED       0x40
 #define FS_INODE_FLAGS_DONT_UPDATE_LAST_ACCESS 0x80
-#define FS_INODE_FLAGS_HASH_INDEXED_DIRECTORY  0x10000
-#define FS_INODE_FLAGS_AFS_DIRECTORY           0x20000
-#define FS_INODE_FALGS_JOURNAL_FILE_DATA       0x40000
+#define FS_INODE_FLAGS_HASH_INDEXED_DIRECTORY  0x1000
+#define FS_INODE_FLAGS_AFS_DIRECTORY           0x2000
+#define FS_INODE_FALGS_JOURNAL_FILE_DATA       0x4000
 
 struct DirectoryEntry {
     u32  inode;
@@ -207,6 +209,12 @@ struct DirectoryEntry {
     char name_data[]; /* Not NULL-terminated */
 
     std::string_view name(Filesystem* fs);
+    u32              file_type(Filesystem* fs); /* One of Inode::FILE_TYPE_*, or 0 if only the inode knows it */
+
+    /* Scans a whole directory block for the live entry called name, NULL if it isn't there */
+    static DirectoryEntry* find(std::span<u8> block, std::string_view name, bool directory_types);
+    /* The space an entry with this name takes, the name follows the 8 byte header and entries are 4-byte aligned */
+    static u16 length(usize name_length) { return (sizeof(DirectoryEntry) + name_length + 3) & ~3; }
 } __attribute__((packed));
 
 #define DirectoryEntry_dbg(fs, x)                                                                                  \
@@ -222,6 +230,35 @@ struct DirectoryEntry {
             ((fs.has_required_feature(RequiredFeatures::DirectoryType)) ? 0 : (x.upper_name_length_or_type << 8)), \
         x.name
 
+/*
+ * The htree index of a directory lives in blocks that read as empty to anything walking the entries: block 0
+ * holds "." and a ".." spanning the rest, the index sits in that slack, and deeper index blocks are one unused
+ * entry as long as the block. Entries of an index block are sorted by hash and the first has no hash, its
+ * place holds the limit and count of entries instead.
+ */
+struct DxEntry {
+    u32 hash; /* Names hashing to at least this and below the next entry's hash are in block */
+    u32 block;
+} __attribute__((packed));
+
+struct DxCountLimit {
+    u16 limit;
+    u16 count;
+} __attribute__((packed));
+
+struct DxRootInfo {
+    u32 reserved_zero;
+    u8  hash_version;
+    u8  info_length;
+    u8  indirect_levels; /* Index blocks between the root and the leaves */
+    u8  unused_flags;
+
+    static const u64 OFFSET       = 24; /* After the "." and ".." entries */
+    static const u64 ROOT_ENTRIES = 32;
+    static const u64 NODE_ENTRIES = 8; /* After the empty entry */
+    static const u32 MAX_LEVELS   = 1; /* Deeper trees need the largedir feature */
+} __attribute__((packed));
+
 class InodeIterator
 {
   public:
@@ -0,0 +1,195 @@
+#include "ext2driver.h"
+
+#include "filesystem.hpp"
+#include "helpers.hpp"
+#include "inode.hpp"
+#include "resolve.hpp"
+
+#include <algorithm>
+#include <filesystem>
+#include <memory>
+#include <new>
+
+struct ext2_image {
+    Filesystem fs;
+
+    ext2_image(const char* path, u32 open_flags) : fs(path, open_flags) {}
+};
+
+/* Runs body, anything that would have ended the CLI becomes an error code */
+template <typename Body> static auto guarded(Body body) -> decltype(body())
+{
+#ifdef EXT2_LIBRARY
+    try {
+        return body();
+    } catch (const PanicError& error) {
+        if (error.kind == PanicError::ERRNO) {
+            errno = error.error_number;
+            return EXT2_ERROR_IO;
+        }
+
+        return (error.kind == PanicError::API) ? EXT2_ERROR_INVALID : EXT2_ERROR_CORRUPTED;
+    } catch (const std::bad_alloc&) {
+        return EXT2_ERROR_NO_MEMORY;
+    }
+#else
+    return body();
+#endif
+}
+
+static bool valid_inode(ext2_image* image, u32 inode_id)
+{
+    const SuperBlock& superblock = image->fs.superblock;
+    return inode_id != 0 && inode_id <= superblock.total_inodes &&
+           inode_id <= (u64)image->fs.block_groups * superblock.inodes_in_block_group;
+}
+
+uint32_t ext2_api_version(void) { return EXT2_API_VERSION; }
+
+const char* ext2_strerror(int error)
+{
+    switch (error) {
+    case EXT2_OK: return "Success";
+    case EXT2_ERROR_IO: return "I/O error";
+    case EXT2_ERROR_NOT_FOUND: return "No such file or directory";
+    case EXT2_ERROR_NOT_DIRECTORY: return "Not a directory";
+    case EXT2_ERROR_IS_DIRECTORY: return "Is a directory";
+    case EXT2_ERROR_INVALID: return "Invalid argument";
+    case EXT2_ERROR_CORRUPTED: return "Corrupted or unsupported image";
+    case EXT2_ERROR_NO_MEMORY: return "Out of memory";
+    }
+
+    return "Unknown error";
+}
+
+int ext2_open(const char* path, uint32_t flags, ext2_image** image)
+{
+    if (!path || !image || (flags & ~(EXT2_OPEN_DIRECT | EXT2_OPEN_SHARED_CACHE))) return EXT2_ERROR_INVALID;
+
+    u32 open_flags = Filesystem::OPEN_READ_ONLY;
+    if (flags & EXT2_OPEN_DIRECT) open_flags |= Filesystem::OPEN_DIRECT;
+    if (flags & EXT2_OPEN_SHARED_CACHE) open_flags |= Filesystem::OPEN_SHARED_CACHE;
+
+    return guarded([&]() -> int {
+        *image = new ext2_image(path, open_flags);
+        return EXT2_OK;
+    });
+}
+
+void ext2_close(ext2_image* image) { delete image; }
+
+int ext2_lookup(ext2_image* image, const char* path, uint32_t* inode)
+{
+    if (!image || !path || !inode || path[0] != '/') return EXT2_ERROR_INVALID;
+
+    return guarded([&]() -> int {
+        Filesystem& fs = image->fs;
+
+        u32   inode_id = Inode::ROOT_INODE;
+        Inode current  = fs.root_inode;
+        int   result   = EXT2_OK;
+
+        std::unique_ptr<u8, decltype(&free)> buffer(fs.allocate_block(), free);
+
+        /* Component by component, so a missing name is an answer and not a panic */
+        for (const std::filesystem::path& component : std::filesystem::path(path).relative_path()) {
+            if (component.empty()) continue;
+
+            if (!current.is_directory()) {
+                result = EXT2_ERROR_NOT_DIRECTORY;
+                break;
+            }
+
+            inode_id = fs.find_entry(current, component.native(), buffer.get());
+            if (!inode_id) {
+                result = EXT2_ERROR_NOT_FOUND;
+                break;
+            }
+
+            fs.read_inode(inode_id, &current);
+        }
+
+        if (result == EXT2_OK) *inode = inode_id;
+        return result;
+    });
+}
+
+int ext2_lookup_paths(ext2_image* image, const char* const* paths, size_t count, uint32_t* inodes)
+{
+    if (!image || (count && (!paths || !inodes))) return EXT2_ERROR_INVALID;
+    for (size_t i = 0; i < count; i++)
+        if (!paths[i] || paths[i][0] != '/') return EXT2_ERROR_INVALID;
+
+    return guarded([&]() -> int {
+        PathResolver resolver(image->fs);
+        for (size_t i = 0; i < count; i++) resolver.add(paths[i]);
+
+        const ResolvedPaths resolved = resolver.run();
+        std::copy(resolved.inode_ids.begin(), resolved.inode_ids.end(), inodes);
+
+        return EXT2_OK;
+    });
+}
+
+int ext2_stat(ext2_image* image, uint32_t inode, struct ext2_stat* stat)
+{
+    if (!image || !stat || !valid_inode(image, inode)) return EXT2_ERROR_INVALID;
+
+    return guarded([&]() -> int {
+        Inode entry;
+        image->fs.read_inode(inode, &entry);
+
+        stat->inode             = inode;
+        stat->mode              = entry.type_and_permissions;
+        stat->links             = entry.hard_link_count;
+        stat->uid               = entry.user_id;
+        stat->gid               = entry.group_id;
+        stat->size              = entry.size_in_bytes(&image->fs);
+        stat->sectors           = entry.disk_sector_count;
+        stat->access_time       = entry.last_access_time;
+        stat->modification_time = entry.last_modification_time;
+        stat->change_time       = entry.creation_time;
+
+        return EXT2_OK;
+    });
+}
+
+int64_t ext2_read(ext2_image* image, uint32_t inode, uint64_t offset, void* buffer, uint64_t length)
+{
+    if (!image || (!buffer && length) || !valid_inode(image, inode)) return EXT2_ERROR_INVALID;
+
+    return guarded([&]() -> int64_t {
+        Inode entry;
+        image->fs.read_inode(inode, &entry);
+
+        if (entry.is_directory()) return EXT2_ERROR_IS_DIRECTORY;
+        if (!entry.is_file()) return EXT2_ERROR_INVALID;
+
+        return image->fs.read_file(entry, offset, (u8*)buffer, std::min<u64>(length, INT64_MAX));
+    });
+}
+
+int ext2_iterate_directory(ext2_image* image, uint32_t inode, ext2_directory_callback callback, void* context)
+{
+    if (!image || !callback || !valid_inode(image, inode)) return EXT2_ERROR_INVALID;
+
+    return guarded([&]() -> int {
+        Filesystem& fs = image->fs;
+
+        Inode directory;
+        fs.read_inode(inode, &directory);
+        if (!directory.is_directory()) return EXT2_ERROR_NOT_DIRECTORY;
+
+        std::unique_ptr<u8, decltype(&free)> buffer(fs.allocate_block(), free);
+
+        int result = EXT2_OK;
+        for (DirectoryEntry* entry : DirInodeIterator(&fs, directory, buffer.get())) {
+            const std::string_view name = entry->name(&fs);
+
+            result = callback(name.data(), name.size(), entry->inode, context);
+            if (result) break;
+        }
+
+        return result;
+    });
+}
@@ -0,0 +1,132 @@
+#include "manifest.hpp"
+
+#include "filesystem.hpp"
+#include "hash.hpp"
+#include "helpers.hpp"
+#include "inode.hpp"
+
+#include <algorithm>
+#include <atomic>
+#include <fstream>
+#include <thread>
+
+static const u64 CHUNK_BLOCKS = 64; /* Read per call, consecutive blocks go out as one read */
+
+struct PendingFile {
+    std::string path;
+    u32         inode_id;
+};
+
+Manifest Manifest::build(Filesystem& fs, const std::filesystem::path& root, u32 threads)
+{
+    std::vector<PendingFile> pending;
+
+    fs.walk(root, [&](const std::filesystem::path& path, u32 inode_id, Inode& inode) {
+        if (inode.is_file()) pending.push_back({path.string(), inode_id});
+    });
+
+    std::sort(pending.begin(), pending.end(),
+              [](const PendingFile& a, const PendingFile& b) { return a.path < b.path; });
+
+    Manifest manifest;
+    manifest.entries.resize(pending.size());
+
+    std::atomic<usize> next = 0;
+
+    auto worker = [&]() {
+        u8* buffer = fs.allocate_blocks(CHUNK_BLOCKS);
+
+        for (usize i = next++; i < pending.size(); i = next++) {
+            Inode inode;
+            fs.read_inode(pending[i].inode_id, &inode);
+
+            /* By offset up to the size, holes hash as the zeros a reader of the file gets */
+            const u64 size = inode.size_in_bytes(&fs);
+            XXHash64  hasher;
+
+            for (u64 offset = 0; offset < size;) {
+                const u64 length = fs.read_file(inode, offset, buffer, CHUNK_BLOCKS * fs.block_size);
+                hasher.append({buffer, length});
+                offset += length;
+            }
+
+            manifest.entries[i] = {pending[i].path, size, hasher.digest()};
+        }
+
+        free(buffer);
+    };
+
+    if (threads == 0) threads = 1;
+    if (threads > pending.size()) threads = std::max<usize>(pending.size(), 1);
+
+    std::vector<std::thread> workers;
+    for (u32 i = 1; i < threads; i++) workers.emplace_back(worker);
+    worker();
+    for (std::thread& thread : workers) thread.join();
+
+    return manifest;
+}
+
+Manifest Manifest::read(const char* manifest_path)
+{
+    std::ifstream file(manifest_path);
+    if (!file.is_open()) PANIC_FROM_ERRNO("Failed to open the manifest %s", manifest_path);
+
+    Manifest    manifest;
+    std::string line;
+
+    while (std::getline(file, line)) {
+        if (line.empty()) continue;
+
+        ManifestEntry entry;
+        int           path_offset = 0;
+
+        if (sscanf(line.c_str(), "%16lx %lu %n", &entry.hash, &entry.size, &path_offset) != 2 || path_offset == 0)
+            PANIC("Malformed manifest line: %s", line.c_str());
+
+        entry.path = line.substr(path_offset);
+        manifest.entries.push_back(std::move(entry));
+    }
+
+    std::sort(manifest.entries.begin(), manifest.entries.end(),
+              [](const ManifestEntry& a, const ManifestEntry& b) { return a.path < b.path; });
+
+    return manifest;
+}
+
+void Manifest::write(FILE* output) const
+{
+    for (const ManifestEntry& entry : this->entries)
+        fprintf(output, "%016lx %lu %s\n", entry.hash, entry.size, entry.path.c_str());
+}
+
+usize Manifest::compare(const Manifest& expected, FILE* output) const
+{
+    usize differences = 0;
+    usize i = 0, j = 0;
+
+    /* Both manifests are sorted by path, so this is a plain merge */
+    while (i < this->entries.size() || j < expected.entries.size()) {
+        const ManifestEntry* got  = (i < this->entries.size()) ? &this->entries[i] : NULL;
+        const ManifestEntry* want = (j < expected.entries.size()) ? &expected.entries[j] : NULL;
+
+        if (got && (!want || got->path < want->path)) {
+            fprintf(output, "EXTRA    %s\n", got->path.c_str());
+            differences++;
+            i++;
+        } else if (want && (!got || want->path < got->path)) {
+            fprintf(output, "MISSING  %s\n", want->path.c_str());
+            differences++;
+            j++;
+        } else {
+            if (got->hash != want->hash || got->size != want->size) {
+                fprintf(output, "CHANGED  %s\n", got->path.c_str());
+                differences++;
+            }
+            i++;
+            j++;
+        }
+    }
+
+    return differences;
+}
@@ -0,0 +1,35 @@
+#pragma once
+
+#include "helpers.hpp"
+
+#include <filesystem>
+#include <string>
+#include <vector>
+
+class Filesystem;
+
+struct ManifestEntry {
+    std::string path;
+    u64         size;
+    u64         hash;
+};
+
+/*
+ * A content manifest of every regular file below a directory of an image.
+ * The text format is one "<XXH64 hex> <size> <path>" line per file, sorted by path.
+ */
+class Manifest
+{
+  public:
+    std::vector<ManifestEntry> entries;
+
+  public:
+    /* Hashes the files straight from the image blocks, spread over the given number of threads */
+    static Manifest build(Filesystem& fs, const std::filesystem::path& root, u32 threads);
+    static Manifest read(const char* manifest_path);
+
+    void write(FILE* output) const;
+
+    /* Reports every difference to output, returns the number of differences */
+    usize compare(const Manifest& expected, FILE* output) const;
+};
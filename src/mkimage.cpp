@@ -0,0 +1,734 @@
+#include "mkimage.hpp"
+
+#include "helpers.hpp"
+#include "trace.hpp"
+
+#include <algorithm>
+#include <fcntl.h>
+#include <map>
+#include <random>
+#include <sys/sysmacros.h>
+#include <time.h>
+#include <unistd.h>
+
+static u8 entry_type(mode_t mode)
+{
+    if (S_ISREG(mode)) return 1;
+    if (S_ISDIR(mode)) return 2;
+    if (S_ISCHR(mode)) return 3;
+    if (S_ISBLK(mode)) return 4;
+    if (S_ISFIFO(mode)) return 5;
+    if (S_ISSOCK(mode)) return 6;
+    if (S_ISLNK(mode)) return 7;
+
+    return 0;
+}
+
+/* Data blocks plus the indirect blocks mapping them */
+static u64 layout_blocks(u64 data_blocks, u64 pointers_per_block)
+{
+    u64 total = data_blocks;
+    if (data_blocks <= Inode::NDIR_BLOCKS) return total;
+
+    u64 rest = data_blocks - Inode::NDIR_BLOCKS;
+    u64 span = 1;
+
+    for (u32 depth = 0; depth < 3 && rest > 0; depth++) {
+        span *= pointers_per_block;
+
+        const u64 mapped = std::min(rest, span);
+        for (u64 level = 1; level <= span; level *= pointers_per_block) total += (mapped + level - 1) / level;
+        total -= mapped;
+
+        rest -= mapped;
+    }
+
+    return total;
+}
+
+/* Buffers the image and writes it out in large sequential chunks, free space becomes holes where it can */
+class StreamWriter
+{
+  private:
+    int             fd;
+    bool            sparse;
+    std::vector<u8> buffer;
+    u64             written = 0;
+
+  public:
+    StreamWriter(int fd, usize capacity) : fd(fd)
+    {
+        struct stat output;
+        this->sparse = fstat(fd, &output) == 0 && S_ISREG(output.st_mode) && output.st_size == 0 &&
+                       lseek(fd, 0, SEEK_CUR) == 0;
+        this->buffer.reserve(capacity);
+    }
+
+    void write(const void* data, usize length)
+    {
+        const u8* bytes = (const u8*)data;
+
+        while (length > 0) {
+            const usize chunk = std::min(length, this->buffer.capacity() - this->buffer.size());
+            this->buffer.insert(this->buffer.end(), bytes, bytes + chunk);
+
+            if (this->buffer.size() == this->buffer.capacity()) this->flush();
+
+            bytes += chunk;
+            length -= chunk;
+        }
+    }
+
+    void zeros(u64 length)
+    {
+        if (!this->sparse || length < 64 * 1024) {
+            for (; length > 0;) {
+                const usize chunk = std::min<u64>(length, this->buffer.capacity() - this->buffer.size());
+                this->buffer.resize(this->buffer.size() + chunk, 0);
+                if (this->buffer.size() == this->buffer.capacity()) this->flush();
+                length -= chunk;
+            }
+            return;
+        }
+
+        this->flush();
+        if (lseek(this->fd, length, SEEK_CUR) < 0) PANIC_FROM_ERRNO("Failed to seek in the output");
+        this->written += length;
+    }
+
+    u64 finish()
+    {
+        this->flush();
+
+        /* Trailing free space is only a hole so far, the file has to reach the end of the image */
+        if (this->sparse && ftruncate(this->fd, this->written) < 0) PANIC_FROM_ERRNO("Failed to size the output");
+
+        return this->written;
+    }
+
+  private:
+    void flush()
+    {
+        const u8* data   = this->buffer.data();
+        usize     length = this->buffer.size();
+
+        while (length > 0) {
+            const ssize_t result = ::write(this->fd, data, length);
+            if (result < 0 && errno == EINTR) continue;
+            if (result < 0) PANIC_FROM_ERRNO("Failed to write the image");
+
+            data += result;
+            length -= result;
+        }
+
+        this->written += this->buffer.size();
+        this->buffer.clear();
+    }
+};
+
+ImageBuilder::ImageBuilder(const std::filesystem::path& root, u64 size)
+{
+    TRACE_SCOPE("ImageBuilder::ImageBuilder");
+
+    this->scan(root);
+    this->plan_geometry(size);
+    this->allocate();
+    this->fill_superblock();
+}
+
+void ImageBuilder::scan(const std::filesystem::path& root)
+{
+    Node top;
+    if (lstat(root.c_str(), &top.host) < 0) PANIC_FROM_ERRNO("Failed to stat %s", root.c_str());
+    if (!S_ISDIR(top.host.st_mode)) PANIC("%s is not a directory.", root.c_str());
+
+    top.path     = root.string();
+    top.parent   = 0;
+    top.inode_id = Inode::ROOT_INODE;
+    this->nodes.push_back(std::move(top));
+
+    this->links.assign(FIRST_INODE + 1, 0);
+    this->links[Inode::ROOT_INODE] = 2;
+
+    std::map<std::pair<dev_t, ino_t>, u32> hard_links;
+    u32                                    next_inode = FIRST_INODE + 1;
+
+    /* Appending children while walking the vector numbers the inodes breadth first */
+    for (usize i = 0; i < this->nodes.size(); i++) {
+        if (!S_ISDIR(this->nodes[i].host.st_mode) || this->nodes[i].path.empty()) continue;
+
+        std::vector<std::string> names;
+        std::error_code          error;
+        for (const std::filesystem::directory_entry& child :
+             std::filesystem::directory_iterator(this->nodes[i].path, error))
+            names.push_back(child.path().filename().string());
+        if (error) PANIC("Failed to list %s: %s", this->nodes[i].path.c_str(), error.message().c_str());
+
+        std::sort(names.begin(), names.end());
+
+        this->nodes[i].first_child = this->nodes.size();
+
+        if (i == 0 && !std::binary_search(names.begin(), names.end(), "lost+found")) {
+            Node lost_found;
+            memset(&lost_found.host, 0, sizeof(lost_found.host));
+            lost_found.host.st_mode  = S_IFDIR | 0700;
+            lost_found.host.st_atime = lost_found.host.st_mtime = lost_found.host.st_ctime = time(NULL);
+            lost_found.name                                                               = "lost+found";
+            lost_found.inode_id                                                           = FIRST_INODE;
+            this->nodes.push_back(std::move(lost_found));
+        }
+
+        for (std::string& name : names) {
+            Node child;
+            child.path = this->nodes[i].path + "/" + name;
+            if (lstat(child.path.c_str(), &child.host) < 0) PANIC_FROM_ERRNO("Failed to stat %s", child.path.c_str());
+            if (name.size() > 255) PANIC("%s has a name too long for ext2.", child.path.c_str());
+
+            child.name   = std::move(name);
+            child.parent = i;
+
+            if (i == 0 && child.name == "lost+found" && S_ISDIR(child.host.st_mode)) {
+                child.inode_id = FIRST_INODE;
+            } else if (!S_ISDIR(child.host.st_mode) && child.host.st_nlink > 1) {
+                auto [existing, inserted] = hard_links.try_emplace({child.host.st_dev, child.host.st_ino}, next_inode);
+                child.inode_id            = existing->second;
+                child.link                = !inserted;
+                if (inserted) next_inode++;
+            } else {
+                child.inode_id = next_inode++;
+            }
+
+            if (S_ISREG(child.host.st_mode)) {
+                child.data_blocks = (child.host.st_size + BLOCK_SIZE - 1) / BLOCK_SIZE;
+                if (child.host.st_size >= (1LL << 31)) this->large_files = true;
+                if (child.host.st_blocks * 512 < child.host.st_size) this->find_data(child);
+            }
+
+            /* Fast symlinks keep the target in the block pointers */
+            if (S_ISLNK(child.host.st_mode) && child.host.st_size >= (off_t)sizeof(Inode::block_pointers))
+                child.data_blocks = 1;
+
+            this->nodes.push_back(std::move(child));
+        }
+
+        this->nodes[i].children = this->nodes.size() - this->nodes[i].first_child;
+        this->links.resize(next_inode, 0);
+
+        for (u32 c = this->nodes[i].first_child; c < this->nodes.size(); c++) {
+            const Node& child = this->nodes[c];
+
+            if (S_ISDIR(child.host.st_mode)) {
+                this->links[child.inode_id] = 2;
+                this->links[this->nodes[i].inode_id]++;
+            } else {
+                this->links[child.inode_id]++;
+            }
+
+            if (this->links[child.inode_id] > 65000) PANIC("%s has too many links for ext2.", child.path.c_str());
+        }
+    }
+
+    this->used_inodes = next_inode - 1;
+
+    BlockLayout layout;
+
+    for (Node& node : this->nodes) {
+        if (S_ISDIR(node.host.st_mode)) node.data_blocks = this->directory_blocks(node, NULL);
+        if (node.link) continue;
+
+        this->content_blocks += (node.sparse) ? Filesystem::plan_layout(BLOCK_SIZE, node.data_blocks,
+                                                                         []() { return 0u; }, layout,
+                                                                         this->mapped_blocks(node))
+                                              : layout_blocks(node.data_blocks, BLOCK_SIZE / 4);
+    }
+}
+
+void ImageBuilder::plan_geometry(u64 size)
+{
+    const u64 inodes_per_block = BLOCK_SIZE / INODE_SIZE;
+
+    /* Unsized images get a little room to grow, sized ones an inode per 16 KiB like mke2fs would give them */
+    u64 total_blocks  = size / BLOCK_SIZE;
+    u64 wanted_blocks = this->content_blocks + this->content_blocks / 16 + 64;
+    u64 wanted_inodes = (size) ? std::max<u64>(this->used_inodes, total_blocks / 4)
+                               : this->used_inodes + this->used_inodes / 16 + 16;
+
+    this->groups = std::max<u64>((total_blocks + BLOCKS_PER_GROUP - 1) / BLOCKS_PER_GROUP, 1);
+
+    while (true) {
+        u64 per_group = (wanted_inodes + this->groups - 1) / this->groups;
+        per_group     = std::min<u64>((per_group + inodes_per_block - 1) / inodes_per_block * inodes_per_block,
+                                      BLOCKS_PER_GROUP);
+
+        this->superblock.inodes_in_block_group = per_group;
+        this->gdt_blocks         = (this->groups * sizeof(BGD) + BLOCK_SIZE - 1) / BLOCK_SIZE;
+        this->inode_table_blocks = per_group / inodes_per_block;
+
+        u64 overhead = 0;
+        for (u32 group = 0; group < this->groups; group++) overhead += this->group_overhead(group);
+
+        if (!size) total_blocks = overhead + wanted_blocks;
+
+        const u64 groups = std::max<u64>((total_blocks + BLOCKS_PER_GROUP - 1) / BLOCKS_PER_GROUP, 1);
+        if (groups != this->groups) {
+            this->groups = groups;
+            continue;
+        }
+
+        /* The last group needs room for its own metadata, a sized image drops it like mke2fs does */
+        const u64 last_group = total_blocks - (u64)(this->groups - 1) * BLOCKS_PER_GROUP;
+        if (last_group <= this->group_overhead(this->groups - 1)) {
+            if (!size) {
+                total_blocks += this->group_overhead(this->groups - 1) + 1 - last_group;
+            } else if (this->groups > 1) {
+                total_blocks = (u64)(this->groups - 1) * BLOCKS_PER_GROUP;
+                this->groups--;
+                continue;
+            }
+        }
+
+        if (total_blocks < overhead + this->content_blocks)
+            PANIC("The tree needs %lu blocks of %lu bytes, but only %lu fit in the image.",
+                  overhead + this->content_blocks, BLOCK_SIZE, total_blocks);
+        if (per_group * this->groups < this->used_inodes)
+            PANIC("The tree needs %u inodes, but only %lu fit in the image.", this->used_inodes,
+                  per_group * this->groups);
+        if (total_blocks > UINT32_MAX) PANIC("The image would have more than 2^32 blocks.");
+
+        break;
+    }
+
+    this->superblock.total_blocks          = total_blocks;
+    this->superblock.total_inodes          = this->superblock.inodes_in_block_group * this->groups;
+    this->superblock.blocks_in_block_group = BLOCKS_PER_GROUP;
+}
+
+void ImageBuilder::allocate()
+{
+    TRACE_SCOPE_ARG("ImageBuilder::allocate", "inodes", this->used_inodes);
+
+    this->inodes.resize(this->used_inodes + 1);
+    memset((void*)this->inodes.data(), 0, this->inodes.size() * sizeof(Inode));
+
+    /* Blocks are handed out in order, group metadata is stepped over */
+    u32 group  = 0;
+    u32 cursor = this->group_data_start(0);
+
+    auto next_block = [&]() -> u32 {
+        while (cursor == group * BLOCKS_PER_GROUP + this->group_blocks(group)) {
+            if (++group == this->groups) PANIC("Ran out of blocks while laying out the image.");
+            cursor = this->group_data_start(group);
+        }
+
+        return cursor++;
+    };
+
+    BlockLayout     layout;
+    std::vector<u8> content;
+
+    for (u32 i = 0; i < this->nodes.size(); i++) {
+        const Node& node = this->nodes[i];
+        if (node.link) continue;
+
+        u32 source_node = i;
+        u64 base        = 0;
+
+        if (S_ISDIR(node.host.st_mode)) {
+            content.assign(node.data_blocks * BLOCK_SIZE, 0);
+            this->directory_blocks(node, content.data());
+
+            source_node = NO_NODE;
+            base        = this->append_metadata(content.data(), content.size());
+        } else if (S_ISLNK(node.host.st_mode)) {
+            std::error_code   error;
+            const std::string target = std::filesystem::read_symlink(node.path, error).string();
+            if (error) PANIC("Failed to read the link %s: %s", node.path.c_str(), error.message().c_str());
+
+            /* The size was taken from lstat, a different target now would not match it */
+            if ((off_t)target.size() != node.host.st_size) PANIC("%s changed while it was scanned.", node.path.c_str());
+
+            if (node.data_blocks) {
+                source_node = NO_NODE;
+                base        = this->append_metadata(target.data(), target.size());
+            } else {
+                memcpy(this->inodes[node.inode_id].block_pointers, target.data(), target.size());
+            }
+        } else if (S_ISCHR(node.host.st_mode) || S_ISBLK(node.host.st_mode)) {
+            const u32 device_major = major(node.host.st_rdev);
+            const u32 device_minor = minor(node.host.st_rdev);
+            Inode&    device       = this->inodes[node.inode_id];
+
+            /* The old encoding in the first pointer while it fits, the one Linux uses otherwise in the second */
+            if (device_major < 256 && device_minor < 256)
+                device.block_pointers[0] = (device_major << 8) | device_minor;
+            else
+                device.block_pointers[1] = (device_minor & 0xff) | (device_major << 8) | ((device_minor & ~0xff) << 12);
+        }
+
+        const u32 blocks =
+            Filesystem::plan_layout(BLOCK_SIZE, node.data_blocks, next_block, layout, this->mapped_blocks(node));
+
+        for (u32 b = 0; b < blocks; b++) {
+            const i64 source = layout.sources[b];
+
+            if (source < 0)
+                this->add_extent(layout.blocks[b], NO_NODE,
+                                 this->append_metadata(layout.indirect[-source - 1].data(), BLOCK_SIZE));
+            else
+                this->add_extent(layout.blocks[b], source_node, base + source);
+        }
+
+        if (node.data_blocks)
+            memcpy(this->inodes[node.inode_id].block_pointers, layout.pointers, sizeof(layout.pointers));
+
+        this->init_inode(node, blocks);
+    }
+
+    this->data_end = cursor;
+}
+
+void ImageBuilder::fill_superblock()
+{
+    const u32 now = time(NULL);
+    const u32 ipg = this->superblock.inodes_in_block_group;
+
+    this->bgds.assign(this->groups, BGD{});
+
+    u32 free_blocks = 0, free_inodes = 0;
+
+    for (u32 group = 0; group < this->groups; group++) {
+        BGD&      bgd   = this->bgds[group];
+        const u32 first = group * BLOCKS_PER_GROUP;
+        const u32 start = this->group_data_start(group);
+        const u32 end   = first + this->group_blocks(group);
+
+        bgd.block_bitmap        = first + ((this->has_superblock(group)) ? 1 + this->gdt_blocks : 0);
+        bgd.inode_bitmap        = bgd.block_bitmap + 1;
+        bgd.inode_table_address = bgd.block_bitmap + 2;
+        bgd.unallocated_blocks  = end - std::clamp(this->data_end, start, end);
+
+        for (u32 inode_id = group * ipg + 1; inode_id <= (group + 1) * ipg; inode_id++) {
+            if (inode_id > this->used_inodes)
+                bgd.unallocated_inodes++;
+            else if (this->inodes[inode_id].is_directory())
+                bgd.directories_in_group++;
+        }
+
+        free_blocks += bgd.unallocated_blocks;
+        free_inodes += bgd.unallocated_inodes;
+    }
+
+    SuperBlock& sb = this->superblock;
+
+    sb.blocks_reserved_for_superuser       = 0;
+    sb.unallocated_blocks                  = free_blocks;
+    sb.unallocated_inodes                  = free_inodes;
+    sb.superblock_block_number             = 0;
+    sb.block_size_logarythm                = 2; /* 1024 << 2 */
+    sb.fragment_size_logarythm             = 2;
+    sb.fragments_in_block_group            = BLOCKS_PER_GROUP;
+    sb.last_mount_time_posix               = 0;
+    sb.last_write_time_posix               = now;
+    sb.number_of_mounts_since_fsck         = 0;
+    sb.number_of_mounts_since_fsck_allowed = 0xFFFF;
+    sb.signature                           = SuperBlock::EXT2_SIGNATURE;
+    sb.filesystem_state                    = FilesystemState::Clean;
+    sb.onerror_action                      = OnErrorAction::Ignore;
+    sb.version_minor                       = 0;
+    sb.last_fsck_posix                     = now;
+    sb.time_between_forced_fsck_posix      = 0;
+    sb.os_id                               = OSID::Linux;
+    sb.version_major                       = 1;
+    sb.user_id_for_reserved                = 0;
+    sb.group_id_for_reserved               = 0;
+
+    ExSuperBlock& esb = this->e_superblock;
+    memset((void*)&esb, 0, sizeof(esb));
+
+    esb.first_non_reserved_inode = FIRST_INODE;
+    esb.inode_size               = INODE_SIZE;
+    esb.required_features        = (u32)RequiredFeatures::DirectoryType;
+    esb.write_features           = (u32)WriteFeatures::SparseSuperBlocks;
+    if (this->large_files) esb.write_features |= (u32)WriteFeatures::_64BIT; /* Large files, despite the name */
+
+    std::random_device random;
+    for (u8& byte : esb.fsid) byte = random();
+    esb.fsid[6] = (esb.fsid[6] & 0x0F) | 0x40; /* A version 4 UUID */
+    esb.fsid[8] = (esb.fsid[8] & 0x3F) | 0x80;
+}
+
+u64 ImageBuilder::write(int fd)
+{
+    TRACE_SCOPE_ARG("ImageBuilder::write", "blocks", this->superblock.total_blocks);
+
+    StreamWriter output(fd, COPY_SIZE);
+
+    const u32 ipg = this->superblock.inodes_in_block_group;
+
+    std::vector<u8> block(BLOCK_SIZE);
+    u8*             copy = (u8*)smalloc(COPY_SIZE);
+
+    usize next_extent = 0;
+    u32   open_node   = NO_NODE;
+    int   file        = -1;
+
+    for (u32 group = 0; group < this->groups; group++) {
+        const u32 first = group * BLOCKS_PER_GROUP;
+        const u32 start = this->group_data_start(group);
+        const u32 end   = first + this->group_blocks(group);
+
+        if (this->has_superblock(group)) {
+            /* The primary copy sits after the boot sector, the backups at the start of their block */
+            const u64 padding = (group == 0) ? 1024 : 0;
+
+            std::fill(block.begin(), block.end(), 0);
+            memcpy(block.data() + padding, &this->superblock, sizeof(SuperBlock));
+            memcpy(block.data() + padding + sizeof(SuperBlock), &this->e_superblock, sizeof(ExSuperBlock));
+            ((ExSuperBlock*)(block.data() + padding + sizeof(SuperBlock)))->block_group_of_superblock = group;
+            output.write(block.data(), BLOCK_SIZE);
+
+            output.write(this->bgds.data(), this->bgds.size() * sizeof(BGD));
+            output.zeros((u64)this->gdt_blocks * BLOCK_SIZE - this->bgds.size() * sizeof(BGD));
+        }
+
+        /* Bits past the end of the group are set, so nothing is ever allocated there */
+        std::fill(block.begin(), block.end(), 0);
+        for (u32 b = first; b < first + BLOCKS_PER_GROUP; b++)
+            if (b < start || b >= end || b < this->data_end) block[(b - first) / 8] |= 1 << ((b - first) % 8);
+        output.write(block.data(), BLOCK_SIZE);
+
+        std::fill(block.begin(), block.end(), 0);
+        for (u32 i = 0; i < BLOCK_SIZE * 8; i++)
+            if (i >= ipg || group * ipg + i + 1 <= this->used_inodes) block[i / 8] |= 1 << (i % 8);
+        output.write(block.data(), BLOCK_SIZE);
+
+        /* The on-disk inode is larger than the fields this driver knows about, the rest stays zero */
+        const u32 used = std::min(ipg, this->used_inodes - std::min(this->used_inodes, group * ipg));
+        for (u32 i = 0; i < used; i++) {
+            output.write(&this->inodes[group * ipg + 1 + i], sizeof(Inode));
+            output.zeros(INODE_SIZE - sizeof(Inode));
+        }
+        output.zeros((u64)this->inode_table_blocks * BLOCK_SIZE - (u64)used * INODE_SIZE);
+
+        for (u32 b = start; b < end;) {
+            if (next_extent == this->extents.size() || this->extents[next_extent].first_block >= end) {
+                output.zeros((u64)(end - b) * BLOCK_SIZE);
+                break;
+            }
+
+            const Extent& extent = this->extents[next_extent++];
+            output.zeros((u64)(extent.first_block - b) * BLOCK_SIZE);
+            b = extent.first_block + extent.count;
+
+            if (extent.node == NO_NODE) {
+                output.write(this->metadata.data() + extent.source * BLOCK_SIZE, extent.count * BLOCK_SIZE);
+                continue;
+            }
+
+            const Node& node = this->nodes[extent.node];
+            if (open_node != extent.node) {
+                if (file >= 0) close(file);
+
+                file = open(node.path.c_str(), O_RDONLY);
+                if (file < 0) PANIC_FROM_ERRNO("Failed to open %s", node.path.c_str());
+                open_node = extent.node;
+            }
+
+            /* The last block of the file is padded, a file that shrank since the scan can't be */
+            const u64 offset = extent.source * BLOCK_SIZE;
+            const u64 length = std::min<u64>(extent.count * BLOCK_SIZE, node.host.st_size - offset);
+
+            for (u64 done = 0; done < length;) {
+                const ssize_t result = pread(file, copy, std::min(COPY_SIZE, length - done), offset + done);
+                if (result < 0 && errno == EINTR) continue;
+                if (result < 0) PANIC_FROM_ERRNO("Failed to read %s", node.path.c_str());
+                if (result == 0) PANIC("%s shrank while the image was being written.", node.path.c_str());
+
+                output.write(copy, result);
+                done += result;
+            }
+
+            output.zeros(extent.count * BLOCK_SIZE - length);
+        }
+    }
+
+    if (file >= 0) close(file);
+    free(copy);
+
+    return output.finish();
+}
+
+u32 ImageBuilder::directory_blocks(const Node& directory, u8* output) const
+{
+    if (directory.path.empty() && output == NULL) return LOST_FOUND_BLOCKS;
+
+    const u32 parent_id = this->nodes[directory.parent].inode_id;
+
+    u32             blocks   = 1;
+    u32             offset   = 0;
+    DirectoryEntry* previous = NULL;
+
+    auto add = [&](std::string_view name, u32 inode_id, mode_t mode) {
+        const u16 length = DirectoryEntry::length(name.size());
+
+        if (offset + length > BLOCK_SIZE) {
+            if (previous) previous->total_entry_size += BLOCK_SIZE - offset;
+            blocks++;
+            offset   = 0;
+            previous = NULL;
+        }
+
+        if (output) {
+            DirectoryEntry* entry            = (DirectoryEntry*)(output + (u64)(blocks - 1) * BLOCK_SIZE + offset);
+            entry->inode                     = inode_id;
+            entry->total_entry_size          = length;
+            entry->lower_name_length         = name.size();
+            entry->upper_name_length_or_type = entry_type(mode);
+            memcpy(entry->name_data, name.data(), name.size());
+            previous = entry;
+        }
+
+        offset += length;
+    };
+
+    add(".", directory.inode_id, S_IFDIR);
+    add("..", parent_id, S_IFDIR);
+
+    for (u32 i = directory.first_child; i < directory.first_child + directory.children; i++)
+        add(this->nodes[i].name, this->nodes[i].inode_id, this->nodes[i].host.st_mode);
+
+    if (output) {
+        previous->total_entry_size += BLOCK_SIZE - offset;
+
+        /* Spare blocks of a new lost+found hold a single unused entry */
+        for (u32 b = blocks; b < directory.data_blocks; b++)
+            ((DirectoryEntry*)(output + (u64)b * BLOCK_SIZE))->total_entry_size = BLOCK_SIZE;
+    }
+
+    return blocks;
+}
+
+/* Holes stay holes in the image, only files taking less space than their size can have any */
+void ImageBuilder::find_data(Node& file) const
+{
+    const int fd = open(file.path.c_str(), O_RDONLY);
+    if (fd < 0) PANIC_FROM_ERRNO("Failed to open %s", file.path.c_str());
+
+    std::vector<std::pair<u32, u32>> runs;
+
+    for (off_t offset = 0; offset < file.host.st_size;) {
+        const off_t data = lseek(fd, offset, SEEK_DATA);
+        if (data < 0 && errno == ENXIO) break;
+
+        /* The host filesystem can't tell, the file is copied whole */
+        if (data < 0) {
+            close(fd);
+            return;
+        }
+
+        const off_t hole = lseek(fd, data, SEEK_HOLE);
+        if (hole < 0) PANIC_FROM_ERRNO("Failed to find the holes of %s", file.path.c_str());
+
+        const u32 first = data / BLOCK_SIZE;
+        const u32 end   = std::min<u64>((hole + BLOCK_SIZE - 1) / BLOCK_SIZE, file.data_blocks);
+
+        if (!runs.empty() && runs.back().second >= first)
+            runs.back().second = std::max(runs.back().second, end);
+        else if (first < end)
+            runs.emplace_back(first, end);
+
+        offset = hole;
+    }
+
+    close(fd);
+
+    file.sparse = true;
+    file.runs   = std::move(runs);
+}
+
+std::function<bool(u32, u32)> ImageBuilder::mapped_blocks(const Node& file) const
+{
+    if (!file.sparse) return nullptr;
+
+    return [&file](u32 first, u32 count) {
+        /* The first run ending after first, the span has data if that run starts inside it */
+        const auto run = std::upper_bound(file.runs.begin(), file.runs.end(), first,
+                                          [](u32 block, const std::pair<u32, u32>& run) { return block < run.second; });
+        return run != file.runs.end() && run->first < first + count;
+    };
+}
+
+void ImageBuilder::add_extent(u32 block, u32 node, u64 source)
+{
+    if (!this->extents.empty()) {
+        Extent& last = this->extents.back();
+        if (last.node == node && last.first_block + last.count == block && last.source + last.count == source) {
+            last.count++;
+            return;
+        }
+    }
+
+    this->extents.push_back({block, 1, node, source});
+}
+
+u32 ImageBuilder::append_metadata(const void* data, usize length)
+{
+    const u32 index = this->metadata.size() / BLOCK_SIZE;
+    const u32 count = (length + BLOCK_SIZE - 1) / BLOCK_SIZE;
+
+    this->metadata.resize(this->metadata.size() + (u64)count * BLOCK_SIZE, 0);
+    memcpy(this->metadata.data() + (u64)index * BLOCK_SIZE, data, length);
+
+    return index;
+}
+
+void ImageBuilder::init_inode(const Node& node, u32 blocks)
+{
+    Inode& inode = this->inodes[node.inode_id];
+
+    /* Linux uses the ext2 values for the file type and permission bits */
+    inode.type_and_permissions   = node.host.st_mode;
+    inode.user_id                = node.host.st_uid;
+    inode.group_id               = node.host.st_gid;
+    inode.last_access_time       = node.host.st_atime;
+    inode.creation_time          = node.host.st_ctime;
+    inode.last_modification_time = node.host.st_mtime;
+    inode.hard_link_count        = this->links[node.inode_id];
+    inode.disk_sector_count      = blocks * (BLOCK_SIZE / 512);
+
+    const u64 size = (S_ISDIR(node.host.st_mode)) ? (u64)node.data_blocks * BLOCK_SIZE
+                     : (S_ISREG(node.host.st_mode) || S_ISLNK(node.host.st_mode)) ? node.host.st_size
+                                                                                   : 0;
+
+    inode.lower_size = size;
+    if (S_ISREG(node.host.st_mode)) inode.upper_size_or_dir_acl = size >> 32;
+}
+
+bool ImageBuilder::has_superblock(u32 group) const
+{
+    if (group <= 1) return true;
+
+    for (u32 base : {3, 5, 7}) {
+        u64 power = base;
+        while (power < group) power *= base;
+        if (power == group) return true;
+    }
+
+    return false;
+}
+
+u32 ImageBuilder::group_overhead(u32 group) const
+{
+    return ((this->has_superblock(group)) ? 1 + this->gdt_blocks : 0) + 2 + this->inode_table_blocks;
+}
+
+u32 ImageBuilder::group_data_start(u32 group) const
+{
+    return group * BLOCKS_PER_GROUP + this->group_overhead(group);
+}
+
+u32 ImageBuilder::group_blocks(u32 group) const
+{
+    if (group + 1 < this->groups) return BLOCKS_PER_GROUP;
+    return this->superblock.total_blocks - group * BLOCKS_PER_GROUP;
+}
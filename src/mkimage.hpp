@@ -0,0 +1,97 @@
+#pragma once
+
+#include "filesystem.hpp"
+#include "helpers.hpp"
+#include "inode.hpp"
+
+#include <filesystem>
+#include <functional>
+#include <string>
+#include <sys/stat.h>
+#include <vector>
+
+/*
+ * Builds a new image from a host directory without mounting anything. The tree is scanned and the whole
+ * layout planned in memory first: inodes are numbered breadth first, so the entries of a directory are
+ * neighbours in the inode table, and every file gets one run of blocks with its indirect blocks in line.
+ * The image is then written front to back in a single pass, which also works into a pipe. A regular output
+ * file is left sparse where the image is free.
+ *
+ * The image uses 4 KiB blocks, 128 byte inodes, sparse superblocks and typed directory entries.
+ */
+class ImageBuilder
+{
+  private:
+    static constexpr u64 BLOCK_SIZE        = 4096;
+    static constexpr u32 BLOCKS_PER_GROUP  = BLOCK_SIZE * 8;
+    static constexpr u32 INODE_SIZE        = 128;
+    static constexpr u32 FIRST_INODE       = 11; /* lost+found, the ones before are reserved */
+    static constexpr u32 LOST_FOUND_BLOCKS = 4;  /* As mke2fs makes it, fsck can reconnect files without allocating */
+    static constexpr u64 COPY_SIZE         = 1 << 20;
+    static constexpr u32 NO_NODE           = UINT32_MAX;
+
+    struct Node {
+        std::string path; /* On the host, empty for a lost+found that is created here */
+        std::string name;
+        struct stat host;
+        u32         parent;
+        u32         inode_id;
+        u32         first_child = 0;
+        u32         children    = 0;
+        u32         data_blocks = 0; /* Contents only, without indirect blocks */
+        bool        link        = false; /* Another name of an inode an earlier node owns */
+        bool        sparse      = false;
+
+        std::vector<std::pair<u32, u32>> runs; /* The blocks [first, end) holding data, when sparse */
+    };
+
+    /* Blocks with consecutive sources, either a host file or this->metadata when node is NO_NODE */
+    struct Extent {
+        u32 first_block;
+        u32 count;
+        u32 node;
+        u64 source;
+    };
+
+    std::vector<Node>   nodes;
+    std::vector<u32>    links;  /* Indexed by inode number, like inodes */
+    std::vector<Inode>  inodes; /* Only the used ones, the rest of the inode tables is written as zeros */
+    std::vector<Extent> extents;
+    std::vector<u8>     metadata; /* Directory, indirect and symlink blocks, built while planning */
+    u64                 content_blocks = 0;
+    u32                 used_inodes    = 0;
+    bool                large_files    = false;
+
+    SuperBlock       superblock;
+    ExSuperBlock     e_superblock;
+    std::vector<BGD> bgds;
+    u32              groups;
+    u32              gdt_blocks;
+    u32              inode_table_blocks;
+    u32              data_end; /* Every block before it that isn't group metadata is in use */
+
+  public:
+    /* size is the image size in bytes, 0 sizes it to the contents with a little room to spare */
+    ImageBuilder(const std::filesystem::path& root, u64 size);
+
+    /* Returns the number of bytes written */
+    u64 write(int fd);
+
+  private:
+    void scan(const std::filesystem::path& root);
+    void plan_geometry(u64 size);
+    void allocate();
+    void fill_superblock();
+
+    void find_data(Node& file) const;
+    std::function<bool(u32, u32)> mapped_blocks(const Node& file) const;
+    u32  directory_blocks(const Node& directory, u8* output) const;
+    void add_extent(u32 block, u32 node, u64 source);
+    u32  append_metadata(const void* data, usize length);
+    void init_inode(const Node& node, u32 blocks);
+
+    bool has_superblock(u32 group) const;
+    u32  group_overhead(u32 group) const;
+    u32  group_data_start(u32 group) const;
+    u32  group_blocks(u32 group) const;
+};
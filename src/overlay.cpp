@@ -0,0 +1,182 @@
+#include "overlay.hpp"
+
+#include "helpers.hpp"
+
+#include <algorithm>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+OverlayDevice::OverlayDevice(const char* base_path, const char* delta_path, bool direct_base)
+    : base(std::make_unique<FileDevice>(base_path, true, direct_base))
+{
+    struct stat base_info;
+    if (stat(base_path, &base_info) < 0) PANIC_FROM_ERRNO("Failed to stat %s", base_path);
+    const i64 base_modification_time = base_info.st_mtim.tv_sec * 1000000000l + base_info.st_mtim.tv_nsec;
+
+    const u64 granules = (this->base->size() + GRANULE_SIZE - 1) / GRANULE_SIZE;
+    this->present      = std::vector<std::atomic<u8>>((granules + 7) / 8);
+    this->data_offset  = (sizeof(Header) + this->present.size() + DATA_ALIGNMENT - 1) / DATA_ALIGNMENT * DATA_ALIGNMENT;
+
+    /* Truncating only reserves the address space, nothing is written until a block is */
+    int fd = open(delta_path, O_RDWR | O_CREAT, S_IRUSR | S_IWUSR | S_IRGRP | S_IROTH);
+    if (fd < 0) PANIC_FROM_ERRNO("Failed to open %s", delta_path);
+
+    struct stat delta_info;
+    if (fstat(fd, &delta_info) < 0) PANIC_FROM_ERRNO("Failed to stat %s", delta_path);
+
+    const bool created = (delta_info.st_size == 0);
+    if (created && ftruncate(fd, this->data_offset + this->base->size()) < 0)
+        PANIC_FROM_ERRNO("Failed to resize %s", delta_path);
+    close(fd);
+
+    this->delta = std::make_unique<FileDevice>(delta_path, false);
+
+    Header header;
+
+    if (created) {
+        memcpy(header.magic, MAGIC, sizeof(MAGIC));
+        header.granule_size           = GRANULE_SIZE;
+        header.base_size              = this->base->size();
+        header.base_modification_time = base_modification_time;
+
+        this->delta->write(0, &header, sizeof(Header));
+        this->delta->flush();
+        return;
+    }
+
+    this->delta->read(0, &header, sizeof(Header));
+
+    if (memcmp(header.magic, MAGIC, sizeof(MAGIC))) PANIC("%s is not an overlay delta.", delta_path);
+    if (header.granule_size != GRANULE_SIZE || header.base_size != this->base->size())
+        PANIC("%s was created for a different base image.", delta_path);
+    if (header.base_modification_time != base_modification_time)
+        PANIC("%s changed since the overlay %s was created.", base_path, delta_path);
+
+    std::vector<u8> bitmap(this->present.size());
+    this->delta->read(sizeof(Header), bitmap.data(), bitmap.size());
+    for (usize i = 0; i < bitmap.size(); i++) this->present[i] = bitmap[i];
+}
+
+OverlayDevice::~OverlayDevice()
+{
+    /* Unflushed writes would otherwise stay invisible to the next session */
+    if (this->bitmap_dirty) this->flush();
+}
+
+void OverlayDevice::read(u64 offset, void* buffer, usize length)
+{
+    if (offset + length > this->size()) PANIC("Unexpected end of the image at offset %lu.", offset);
+
+    u8* output = (u8*)buffer;
+
+    while (length > 0) {
+        /* As many granules as possible that live on the same side, in one read */
+        const u64  granule      = offset / GRANULE_SIZE;
+        const u64  last_granule = (offset + length - 1) / GRANULE_SIZE;
+        const bool in_delta     = this->is_present(granule);
+
+        u64 last = granule;
+        while (last < last_granule && this->is_present(last + 1) == in_delta) last++;
+
+        const usize span = std::min<u64>(length, (last + 1) * GRANULE_SIZE - offset);
+
+        if (in_delta)
+            this->delta->read(this->data_offset + offset, output, span);
+        else
+            this->base->read(offset, output, span);
+
+        output += span;
+        offset += span;
+        length -= span;
+    }
+}
+
+void OverlayDevice::write(u64 offset, const void* buffer, usize length)
+{
+    if (length == 0) return;
+    if (offset + length > this->size()) PANIC("Write past the end of the image at offset %lu.", offset);
+
+    std::lock_guard<std::mutex> guard(this->write_lock);
+
+    /* Only the granules at either end can be partially covered, those need their old contents first */
+    const u64 first = offset / GRANULE_SIZE;
+    const u64 last  = (offset + length - 1) / GRANULE_SIZE;
+
+    if (!this->is_present(first) && offset % GRANULE_SIZE != 0) this->copy_up(first);
+    if (!this->is_present(last) && (offset + length) % GRANULE_SIZE != 0 && offset + length != this->size() &&
+        (last != first || offset % GRANULE_SIZE == 0))
+        this->copy_up(last);
+
+    /* The delta mirrors the image layout, so the whole write is a single one no matter what it spans */
+    this->delta->write(this->data_offset + offset, buffer, length);
+
+    for (u64 granule = first; granule <= last; granule++) {
+        if (this->is_present(granule)) continue;
+
+        this->set_present(granule);
+        this->bitmap_dirty = true;
+    }
+}
+
+void OverlayDevice::copy_up(u64 granule)
+{
+    const u64   start  = granule * GRANULE_SIZE;
+    const usize length = std::min(GRANULE_SIZE, this->size() - start);
+
+    u8 data[GRANULE_SIZE];
+    this->base->read(start, data, length);
+    this->delta->write(this->data_offset + start, data, length);
+}
+
+void OverlayDevice::flush()
+{
+    std::lock_guard<std::mutex> guard(this->write_lock);
+
+    this->delta->flush();
+    if (!this->bitmap_dirty) return;
+
+    std::vector<u8> bitmap(this->present.size());
+    for (usize i = 0; i < bitmap.size(); i++) bitmap[i] = this->present[i];
+
+    this->delta->write(sizeof(Header), bitmap.data(), bitmap.size());
+    this->delta->flush();
+
+    this->bitmap_dirty = false;
+}
+
+void OverlayDevice::commit(const char* output_path)
+{
+    /* Never truncates an existing file, which could well be the base itself */
+    int fd = open(output_path, O_WRONLY | O_CREAT | O_EXCL, S_IRUSR | S_IWUSR | S_IRGRP | S_IROTH);
+    if (fd < 0) PANIC_FROM_ERRNO("Failed to create %s", output_path);
+    if (ftruncate(fd, this->size()) < 0) PANIC_FROM_ERRNO("Failed to resize %s", output_path);
+    close(fd);
+
+    FileDevice output(output_path, false);
+
+    const usize chunk_size = 1024 * 1024;
+    u8*         buffer     = NULL;
+    if (posix_memalign((void**)&buffer, DATA_ALIGNMENT, chunk_size) != 0) PANIC("Failed to allocate required memory.");
+
+    for (u64 offset = 0; offset < this->size(); offset += chunk_size) {
+        const usize length = std::min<u64>(chunk_size, this->size() - offset);
+        this->read(offset, buffer, length);
+
+        /* Zeroes are left as holes, an image is mostly free space */
+        if (buffer[0] == 0 && !memcmp(buffer, buffer + 1, length - 1)) continue;
+
+        output.write(offset, buffer, length);
+    }
+
+    free(buffer);
+    output.flush();
+}
+
+u64 OverlayDevice::delta_granules() const
+{
+    u64 count = 0;
+    for (const std::atomic<u8>& bits : this->present) count += __builtin_popcount(bits);
+
+    return count;
+}
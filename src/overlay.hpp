@@ -0,0 +1,68 @@
+#pragma once
+
+#include "device.hpp"
+#include "helpers.hpp"
+
+#include <algorithm>
+#include <atomic>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+
+/*
+ * A writable view of a read-only base image. Writes land in a sparse delta file at the same offset they
+ * would have in the image, a bitmap records which granules the delta holds and reads are served from
+ * whichever side has the data. Creating a delta only truncates an empty file, so a session starts in
+ * constant time no matter how large the base is.
+ *
+ * Delta layout: the header, the granule bitmap padded to DATA_ALIGNMENT, then the image-sized data area.
+ */
+class OverlayDevice : public BlockDevice
+{
+  private:
+    static constexpr u64 GRANULE_SIZE   = 4096; /* Unit of copy-on-write, a block of any ext2 block size fits */
+    static constexpr u64 DATA_ALIGNMENT = 4096;
+
+    struct Header {
+        char magic[8];
+        u64  granule_size;
+        u64  base_size;
+        i64  base_modification_time; /* Nanoseconds, the delta is meaningless once the base changed */
+    };
+
+    static constexpr char MAGIC[8] = {'E', 'X', 'T', '2', 'D', 'L', 'T', '1'};
+
+    std::unique_ptr<FileDevice>  base;
+    std::unique_ptr<FileDevice>  delta;
+    std::vector<std::atomic<u8>> present; /* One bit per granule, set when the delta holds it */
+    u64                          data_offset;
+    bool                         bitmap_dirty = false;
+    std::mutex                   write_lock;
+
+  public:
+    /* The delta is created when missing, the base is only ever read */
+    OverlayDevice(const char* base_path, const char* delta_path, bool direct_base = false);
+    ~OverlayDevice() override;
+
+    void read(u64 offset, void* buffer, usize length) override;
+    void write(u64 offset, const void* buffer, usize length) override;
+    u64  size() const override { return this->base->size(); }
+    bool writable() const override { return true; }
+    /* Syncs the data before the bitmap that makes it visible, so a crash only loses unflushed writes */
+    void flush() override;
+    /* Whichever changed last, writes only ever touch the delta but the base may still change underneath */
+    i64 modification_time() const override
+    {
+        return std::max(this->base->modification_time(), this->delta->modification_time());
+    }
+
+    /* Writes the base with the delta applied as a new, sparse image */
+    void commit(const char* output_path);
+    u64  delta_granules() const;
+
+  private:
+    inline bool is_present(u64 granule) const { return this->present[granule / 8] & (1 << (granule % 8)); }
+    inline void set_present(u64 granule) { this->present[granule / 8] |= 1 << (granule % 8); }
+    void        copy_up(u64 granule);
+};
@@ -0,0 +1,209 @@
+#include "remove.hpp"
+
+#include "filesystem.hpp"
+#include "helpers.hpp"
+#include "inode.hpp"
+#include "trace.hpp"
+
+#include <time.h>
+#include <unordered_set>
+
+/* Whether path is inside directory, or is directory itself */
+static bool is_within(const std::filesystem::path& path, const std::filesystem::path& directory)
+{
+    const std::string& inner = path.native();
+    const std::string& outer = directory.native();
+
+    return inner == outer || (inner.size() > outer.size() && inner.starts_with(outer) && inner[outer.size()] == '/');
+}
+
+void Remover::add(const std::filesystem::path& path, bool recursive)
+{
+    std::filesystem::path target = path.lexically_normal();
+    if (!target.has_filename()) target = target.parent_path();
+
+    if (!target.has_filename()) PANIC("Refusing to remove the root directory.");
+
+    for (const std::filesystem::path& other : this->targets)
+        if (is_within(target, other) || is_within(other, target))
+            PANIC("%s and %s overlap, remove only one of them.", other.c_str(), target.c_str());
+
+    Inode     parent;
+    const u32 parent_id = this->fs.get_inode_from_path(target.parent_path(), &parent);
+
+    Inode     inode;
+    const u32 inode_id = this->fs.get_inode_from_path(target, &inode);
+
+    if (inode.is_directory()) {
+        if (!recursive) PANIC("%s is a directory, use remove -r.", target.c_str());
+
+        this->directories.push_back(inode_id);
+        this->removed_dirs[parent_id]++;
+
+        this->fs.walk(target, [this](const std::filesystem::path&, u32 child_id, Inode& child) {
+            if (child.is_directory())
+                this->directories.push_back(child_id);
+            else
+                this->unlinked[child_id]++;
+        });
+    } else {
+        this->unlinked[inode_id]++;
+    }
+
+    this->entries[parent_id].push_back(target.filename().string());
+    this->targets.push_back(target);
+}
+
+RemoveReport Remover::run()
+{
+    TRACE_SCOPE_ARG("Remover::run", "targets", this->targets.size());
+
+    RemoveReport report;
+    const u32    now = time(NULL);
+
+    for (const auto& [directory_id, names] : this->entries) this->unlink_entries(directory_id, names, now);
+    this->fs.device->flush();
+
+    /* A file keeps its inode while links to it remain outside of what is removed */
+    std::vector<u32> linked_ids;
+    for (const auto& [inode_id, links] : this->unlinked) linked_ids.push_back(inode_id);
+
+    std::vector<Inode> linked(linked_ids.size());
+    this->fs.read_inodes(linked_ids, linked.data());
+
+    std::vector<u32>   kept_ids;
+    std::vector<Inode> kept;
+    std::vector<u32>   freed_ids = this->directories;
+
+    for (usize i = 0; i < linked_ids.size(); i++) {
+        const u32 links = this->unlinked[linked_ids[i]];
+
+        if (linked[i].hard_link_count > links) {
+            linked[i].hard_link_count -= links;
+            kept_ids.push_back(linked_ids[i]);
+            kept.push_back(linked[i]);
+        } else {
+            freed_ids.push_back(linked_ids[i]);
+        }
+    }
+
+    std::vector<Inode> freed(freed_ids.size());
+    this->fs.read_inodes(freed_ids, freed.data());
+
+    std::vector<u32>   blocks;
+    std::map<u32, u32> xattr_references;
+
+    for (usize i = 0; i < freed_ids.size(); i++) {
+        Inode& inode = freed[i];
+
+        this->fs.walk_block_pointers(inode, [&](u32 block, i64) { blocks.push_back(block); });
+        if (inode.extended_attribute_block) xattr_references[inode.extended_attribute_block]++;
+
+        if (inode.is_directory()) {
+            this->fs.bgds[(freed_ids[i] - 1) / this->fs.superblock.inodes_in_block_group].directories_in_group--;
+            report.directories++;
+        } else {
+            report.files++;
+        }
+
+        inode.hard_link_count = 0;
+        inode.deletion_time   = now;
+    }
+
+    this->release_xattr_blocks(xattr_references, blocks);
+
+    this->fs.write_inodes(kept_ids, kept.data());
+    this->fs.write_inodes(freed_ids, freed.data());
+
+    this->fs.free_inodes(freed_ids);
+    this->fs.free_blocks(blocks);
+    report.blocks = blocks.size();
+
+    this->fs.write_bgds();
+    this->fs.write_superblock();
+    this->fs.device->flush();
+
+    this->targets.clear();
+    this->entries.clear();
+    this->removed_dirs.clear();
+    this->directories.clear();
+    this->unlinked.clear();
+
+    return report;
+}
+
+void Remover::unlink_entries(u32 directory_id, const std::vector<std::string>& names, u32 now)
+{
+    Inode directory;
+    this->fs.read_inode(directory_id, &directory);
+
+    std::vector<u32> data_blocks;
+    this->fs.walk_block_pointers(directory, [&](u32 block, i64 logical_block) {
+        if (logical_block >= 0) data_blocks.push_back(block);
+    });
+
+    std::unordered_set<std::string_view> remaining(names.begin(), names.end());
+    u8*                                  buffer = this->fs.allocate_block();
+
+    for (u32 block : data_blocks) {
+        if (remaining.empty()) break;
+
+        this->fs.read_block(block, buffer);
+
+        DirectoryEntry* previous = NULL;
+        bool            changed  = false;
+
+        for (u64 offset = 0; offset < this->fs.block_size;) {
+            DirectoryEntry* entry = (DirectoryEntry*)(buffer + offset);
+            if (entry->total_entry_size < sizeof(DirectoryEntry)) PANIC("Corrupted directory block %u.", block);
+
+            offset += entry->total_entry_size;
+
+            if (entry->inode == 0 || !remaining.erase(entry->name(&this->fs))) {
+                previous = entry;
+                continue;
+            }
+
+            /* Its space goes to the entry in front, the first entry of a block can only be marked unused */
+            if (previous)
+                previous->total_entry_size += entry->total_entry_size;
+            else
+                entry->inode = 0;
+
+            changed = true;
+        }
+
+        if (changed) this->fs.write_block(block, buffer);
+    }
+
+    free(buffer);
+
+    if (!remaining.empty()) PANIC("Directory inode %u changed while removing from it.", directory_id);
+
+    auto lost_links = this->removed_dirs.find(directory_id);
+    if (lost_links != this->removed_dirs.end()) directory.hard_link_count -= lost_links->second;
+
+    directory.last_modification_time = now;
+    this->fs.write_inode(directory_id, &directory);
+}
+
+void Remover::release_xattr_blocks(const std::map<u32, u32>& references, std::vector<u32>& blocks)
+{
+    /* Inodes with identical attributes share one block, it is only freed along with its last user */
+    u8* buffer = this->fs.allocate_block();
+
+    for (const auto& [block, count] : references) {
+        this->fs.read_block(block, buffer);
+
+        u32* reference_count = (u32*)(buffer + 4);
+        if (*reference_count <= count) {
+            blocks.push_back(block);
+            continue;
+        }
+
+        *reference_count -= count;
+        this->fs.write_block(block, buffer);
+    }
+
+    free(buffer);
+}
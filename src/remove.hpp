@@ -0,0 +1,45 @@
+#pragma once
+
+#include "helpers.hpp"
+
+#include <filesystem>
+#include <map>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+class Filesystem;
+
+struct RemoveReport {
+    usize files       = 0; /* Inodes freed, a hard link that survives elsewhere only loses a link */
+    usize directories = 0;
+    u64   blocks      = 0;
+};
+
+/*
+ * Removes files and whole trees in one batch. Everything to drop is collected first, then each affected
+ * directory block, inode table block and bitmap block is rewritten once, and the group descriptors and the
+ * superblock once at the end. The entries are unlinked and flushed before anything is freed, so a crash
+ * can leak the removed inodes and blocks but never leave an entry pointing at a freed inode.
+ */
+class Remover
+{
+  private:
+    Filesystem&                             fs;
+    std::vector<std::filesystem::path>      targets;
+    std::map<u32, std::vector<std::string>> entries;      /* Per parent directory, the names to unlink */
+    std::map<u32, u32>                      removed_dirs; /* Per parent directory, its lost ".." links */
+    std::vector<u32>                        directories;
+    std::unordered_map<u32, u32>            unlinked; /* Other inodes, with the number of links dropped */
+
+  public:
+    explicit Remover(Filesystem& fs) : fs(fs) {}
+
+    /* Directories need recursive, they go with everything below them */
+    void         add(const std::filesystem::path& path, bool recursive);
+    RemoveReport run();
+
+  private:
+    void unlink_entries(u32 directory_id, const std::vector<std::string>& names, u32 now);
+    void release_xattr_blocks(const std::map<u32, u32>& references, std::vector<u32>& blocks);
+};
@@ -0,0 +1,156 @@
+#include "resolve.hpp"
+
+#include "filesystem.hpp"
+#include "index.hpp"
+#include "trace.hpp"
+
+#include <algorithm>
+#include <memory>
+#include <numeric>
+#include <string_view>
+#include <unordered_map>
+
+usize PathResolver::add(const std::filesystem::path& path)
+{
+    API_ASSERT(path.is_absolute());
+
+    this->paths.push_back(path);
+    return this->paths.size() - 1;
+}
+
+ResolvedPaths PathResolver::run()
+{
+    TRACE_SCOPE_ARG("PathResolver::run", "paths", this->paths.size());
+
+    ResolvedPaths result;
+    result.inode_ids.assign(this->paths.size(), 0);
+    result.inodes.resize(this->paths.size());
+
+    if (this->fs.index) {
+        /* The sidecar index answers a whole path in one lookup, there are no scans to share */
+        for (usize i = 0; i < this->paths.size(); i++) this->fs.index->lookup(this->paths[i], &result.inode_ids[i]);
+
+        std::vector<u32>   found_ids;
+        std::vector<usize> found;
+        for (usize i = 0; i < this->paths.size(); i++) {
+            if (!result.inode_ids[i]) continue;
+            found_ids.push_back(result.inode_ids[i]);
+            found.push_back(i);
+        }
+
+        std::vector<Inode> inodes(found.size());
+        this->fs.read_inodes(found_ids, inodes.data());
+        for (usize i = 0; i < found.size(); i++) result.inodes[found[i]] = inodes[i];
+    } else {
+        std::vector<Node> nodes;
+        std::vector<u32>  ends;
+        this->build_trie(nodes, ends);
+
+        std::vector<Inode> inodes(nodes.size());
+        std::vector<u32>   level = {0};
+        nodes[0].inode_id        = Inode::ROOT_INODE;
+
+        std::unique_ptr<u8, decltype(&free)> buffer(this->fs.allocate_block(), free);
+
+        while (!level.empty()) {
+            std::vector<u32> inode_ids(level.size());
+            std::vector<u32> next;
+
+            for (usize i = 0; i < level.size(); i++) inode_ids[i] = nodes[level[i]].inode_id;
+
+            std::vector<Inode> read(level.size());
+            this->fs.read_inodes(inode_ids, read.data());
+
+            for (usize i = 0; i < level.size(); i++) {
+                inodes[level[i]] = read[i];
+                if (nodes[level[i]].children.empty() || !read[i].is_directory()) continue;
+
+                this->scan(read[i], nodes, level[i], buffer.get());
+
+                for (u32 child : nodes[level[i]].children)
+                    if (nodes[child].inode_id) next.push_back(child);
+            }
+
+            level = std::move(next);
+        }
+
+        for (usize i = 0; i < this->paths.size(); i++) {
+            result.inode_ids[i] = nodes[ends[i]].inode_id;
+            result.inodes[i]    = inodes[ends[i]];
+        }
+    }
+
+    for (usize i = 0; i < this->paths.size(); i++)
+        if (!result.inode_ids[i]) result.not_found.push_back(i);
+
+    return result;
+}
+
+void PathResolver::build_trie(std::vector<Node>& nodes, std::vector<u32>& ends) const
+{
+    std::vector<std::vector<std::string>> components(this->paths.size());
+
+    for (usize i = 0; i < this->paths.size(); i++)
+        for (const std::filesystem::path& component : this->paths[i].relative_path())
+            if (!component.empty()) components[i].push_back(component.native());
+
+    /* Sorted, paths sharing a prefix are neighbours and the trie is built walking from one to the next */
+    std::vector<usize> order(this->paths.size());
+    std::iota(order.begin(), order.end(), 0);
+    std::sort(order.begin(), order.end(), [&](usize a, usize b) { return components[a] < components[b]; });
+
+    nodes.assign(1, Node{});
+    ends.assign(this->paths.size(), 0);
+
+    std::vector<u32>                chain    = {0}; /* The nodes of the previous path, the root first */
+    const std::vector<std::string>* previous = NULL;
+
+    for (usize i : order) {
+        const std::vector<std::string>& parts = components[i];
+
+        usize shared = 0;
+        while (previous && shared < parts.size() && shared < previous->size() && parts[shared] == (*previous)[shared])
+            shared++;
+
+        chain.resize(shared + 1);
+
+        for (usize depth = shared; depth < parts.size(); depth++) {
+            const u32 node_id = nodes.size();
+            nodes.emplace_back().name = parts[depth];
+            nodes[chain.back()].children.push_back(node_id);
+            chain.push_back(node_id);
+        }
+
+        ends[i]  = chain.back();
+        previous = &parts;
+    }
+}
+
+void PathResolver::scan(Inode& directory, std::vector<Node>& nodes, u32 node_id, u8* buffer)
+{
+    TRACE_SCOPE_ARG("PathResolver::scan", "names", nodes[node_id].children.size());
+
+    const std::vector<u32>& children = nodes[node_id].children;
+    const u64               blocks   = directory.lower_size / this->fs.block_size;
+
+    /* A few names in a large htree are cheaper to probe one at a time than to find in a full scan */
+    if (this->fs.hash_indexed(directory) && children.size() * PROBE_BLOCKS < blocks) {
+        for (u32 child : children) nodes[child].inode_id = this->fs.find_entry(directory, nodes[child].name, buffer);
+        return;
+    }
+
+    std::unordered_map<std::string_view, u32> wanted;
+    for (u32 child : children) wanted.emplace(nodes[child].name, child);
+
+    usize remaining = wanted.size();
+
+    for (DirectoryEntry* entry : DirInodeIterator(&this->fs, directory, buffer)) {
+        if (!entry->inode) continue;
+
+        auto found = wanted.find(entry->name(&this->fs));
+        if (found == wanted.end() || nodes[found->second].inode_id) continue;
+
+        nodes[found->second].inode_id = entry->inode;
+        if (--remaining == 0) break;
+    }
+}
@@ -0,0 +1,52 @@
+#pragma once
+
+#include "helpers.hpp"
+#include "inode.hpp"
+
+#include <filesystem>
+#include <string>
+#include <vector>
+
+class Filesystem;
+
+struct ResolvedPaths {
+    std::vector<u32>   inode_ids; /* In the order the paths were added, 0 for a path that wasn't found */
+    std::vector<Inode> inodes;    /* Only meaningful where the inode id isn't 0 */
+    std::vector<usize> not_found; /* Indices of the missing paths, ascending */
+};
+
+/*
+ * Resolves many absolute paths at once. The paths are sorted into a trie, so a directory shared by several of
+ * them is looked up once, and the trie is resolved a level at a time: the inodes of a level are read together
+ * in on-disk order, then every directory is scanned once for all the children asked of it. A large htree
+ * asked for only a few names is probed for each of them instead. The cost follows the number of distinct
+ * directories rather than paths times depth.
+ *
+ * Like get_inode_from_path the components are looked up literally and symlinks are not followed, a path
+ * going through anything but a directory is not found.
+ */
+class PathResolver
+{
+  private:
+    static constexpr u64 PROBE_BLOCKS = 3; /* Root, node and leaf, what looking up one name in an htree reads */
+
+    struct Node {
+        std::string      name;
+        u32              inode_id = 0;
+        std::vector<u32> children;
+    };
+
+    Filesystem&                        fs;
+    std::vector<std::filesystem::path> paths;
+
+  public:
+    explicit PathResolver(Filesystem& fs) : fs(fs) {}
+
+    /* Returns the index of the path in the results */
+    usize         add(const std::filesystem::path& path);
+    ResolvedPaths run();
+
+  private:
+    void build_trie(std::vector<Node>& nodes, std::vector<u32>& ends) const;
+    void scan(Inode& directory, std::vector<Node>& nodes, u32 node_id, u8* buffer);
+};
@@ -0,0 +1,254 @@
+#include "tar.hpp"
+
+#include "filesystem.hpp"
+#include "helpers.hpp"
+#include "inode.hpp"
+
+#include <thread>
+#include <unistd.h>
+
+#define TAR_BLOCKING_FACTOR 20
+#define TAR_MAX_OCTAL_SIZE  077777777777ULL
+
+struct TarHeader {
+    char name[100];
+    char mode[8];
+    char uid[8];
+    char gid[8];
+    char size[12];
+    char mtime[12];
+    char checksum[8];
+    char type;
+    char link_name[100];
+    char magic[6];
+    char version[2];
+    char user_name[32];
+    char group_name[32];
+    char device_major[8];
+    char device_minor[8];
+    char prefix[155];
+    char __padding[12];
+} __attribute__((packed));
+
+static_assert(sizeof(TarHeader) == 512);
+
+static void write_octal(char* field, usize field_size, u64 value)
+{
+    snprintf(field, field_size, "%0*lo", (int)field_size - 1, value);
+}
+
+static void append_pax_record(std::string& records, const char* key, const std::string& value)
+{
+    /* The length prefix counts itself, so it is found by iterating until it stops growing */
+    const usize base   = strlen(key) + value.size() + 3;
+    usize       length = base + 1;
+    while (length != base + std::to_string(length).size()) length = base + std::to_string(length).size();
+
+    records += std::to_string(length) + " " + key + "=" + value + "\n";
+}
+
+void TarWriter::write_tree(const std::filesystem::path& root)
+{
+    for (usize i = 0; i < CHUNK_COUNT; i++) this->free_chunks.push_back({(u8*)smalloc(CHUNK_SIZE), 0});
+
+    std::thread producer(&TarWriter::produce, this, root);
+
+    std::unique_lock<std::mutex> guard(this->lock);
+
+    while (true) {
+        this->changed.wait(guard, [this] { return !this->full_chunks.empty() || this->finished; });
+        if (this->full_chunks.empty()) break;
+
+        Chunk chunk = this->full_chunks.front();
+        this->full_chunks.pop_front();
+        guard.unlock();
+
+        for (usize written = 0; written < chunk.length;) {
+            ssize_t result = write(this->output_fd, chunk.data + written, chunk.length - written);
+            if (result < 0 && errno == EINTR) continue;
+            if (result < 0) PANIC_FROM_ERRNO("Failed to write the archive");
+            written += result;
+        }
+
+        guard.lock();
+        chunk.length = 0;
+        this->free_chunks.push_back(chunk);
+        this->changed.notify_all();
+    }
+
+    guard.unlock();
+    producer.join();
+
+    for (Chunk& chunk : this->free_chunks) free(chunk.data);
+    this->free_chunks.clear();
+}
+
+void TarWriter::produce(const std::filesystem::path& root)
+{
+    u8* buffer = this->fs.allocate_block();
+
+    this->fs.walk(root, [&](const std::filesystem::path& path, u32 inode_id, Inode& inode) {
+        std::string name = path.lexically_relative(root).string();
+        if (inode.is_directory()) name += "/";
+
+        this->add_entry(name, inode_id, inode, buffer);
+    });
+
+    free(buffer);
+
+    /* Two zero records end the archive, which is then padded to a whole number of tar blocks */
+    this->append(NULL, 2 * RECORD_SIZE);
+
+    const u64 used = this->archive_size % (RECORD_SIZE * TAR_BLOCKING_FACTOR);
+    if (used) this->append(NULL, RECORD_SIZE * TAR_BLOCKING_FACTOR - used);
+
+    this->flush_chunk();
+
+    std::lock_guard<std::mutex> guard(this->lock);
+    this->finished = true;
+    this->changed.notify_all();
+}
+
+void TarWriter::add_entry(const std::string& name, u32 inode_id, Inode& inode, u8* buffer)
+{
+    if (!inode.is_directory() && inode.hard_link_count > 1) {
+        auto linked = this->linked_inodes.find(inode_id);
+        if (linked != this->linked_inodes.end()) return this->add_header(name, inode, '1', 0, linked->second);
+
+        this->linked_inodes[inode_id] = name;
+    }
+
+    if (inode.is_directory()) return this->add_header(name, inode, '5', 0, "");
+    if (inode.is_symbolic_link())
+        return this->add_header(name, inode, '2', 0, this->fs.read_link_target(inode, buffer));
+    if (inode.is_char_device()) return this->add_header(name, inode, '3', 0, "");
+    if (inode.is_block_device()) return this->add_header(name, inode, '4', 0, "");
+    if (inode.is_fifo()) return this->add_header(name, inode, '6', 0, "");
+    if (inode.is_socket()) return; /* Sockets can't be archived */
+
+    const u64 size = inode.size_in_bytes(&this->fs);
+    this->add_header(name, inode, '0', size, "");
+    this->add_file_data(inode, size, buffer);
+}
+
+void TarWriter::add_header(const std::string& name, Inode& inode, char type, u64 size, const std::string& link_name)
+{
+    std::string pax_records;
+    if (name.size() > sizeof(TarHeader::name)) append_pax_record(pax_records, "path", name);
+    if (link_name.size() > sizeof(TarHeader::link_name)) append_pax_record(pax_records, "linkpath", link_name);
+    if (size > TAR_MAX_OCTAL_SIZE) append_pax_record(pax_records, "size", std::to_string(size));
+
+    if (!pax_records.empty()) {
+        this->add_header("PaxHeaders/" + name.substr(0, 80), inode, 'x', pax_records.size(), "");
+        this->append(pax_records.data(), pax_records.size());
+        this->pad_record();
+    }
+
+    TarHeader header;
+    memset(&header, 0, sizeof(TarHeader));
+
+    strncpy(header.name, name.c_str(), sizeof(header.name));
+    strncpy(header.link_name, link_name.c_str(), sizeof(header.link_name));
+    write_octal(header.mode, sizeof(header.mode), inode.type_and_permissions & 07777);
+    write_octal(header.uid, sizeof(header.uid), inode.user_id);
+    write_octal(header.gid, sizeof(header.gid), inode.group_id);
+    write_octal(header.size, sizeof(header.size), (size > TAR_MAX_OCTAL_SIZE) ? 0 : size);
+    write_octal(header.mtime, sizeof(header.mtime), inode.last_modification_time);
+    memcpy(header.magic, "ustar", 6);
+    memcpy(header.version, "00", 2);
+    header.type = type;
+
+    if (type == '3' || type == '4') {
+        /* Old style device numbers live in the first block pointer, new style ones in the second */
+        u32 major, minor;
+        if (inode.block_pointers[0]) {
+            major = (inode.block_pointers[0] >> 8) & 0xff;
+            minor = inode.block_pointers[0] & 0xff;
+        } else {
+            major = (inode.block_pointers[1] & 0xfff00) >> 8;
+            minor = (inode.block_pointers[1] & 0xff) | ((inode.block_pointers[1] >> 12) & 0xfff00);
+        }
+        write_octal(header.device_major, sizeof(header.device_major), major);
+        write_octal(header.device_minor, sizeof(header.device_minor), minor);
+    }
+
+    memset(header.checksum, ' ', sizeof(header.checksum));
+    u32 checksum = 0;
+    for (usize i = 0; i < sizeof(TarHeader); i++) checksum += ((u8*)&header)[i];
+    snprintf(header.checksum, sizeof(header.checksum), "%06o", checksum);
+    header.checksum[7] = ' ';
+
+    this->append(&header, sizeof(TarHeader));
+}
+
+void TarWriter::add_file_data(Inode& inode, u64 size, u8* buffer)
+{
+    const u64 block_size = this->fs.block_size;
+    u64       written    = 0;
+
+    /* Holes have no block pointer, they are written out as zeroes */
+    this->fs.walk_block_pointers(inode, [&](u32 block, i64 logical_block) {
+        if (logical_block < 0) return;
+
+        const u64 start = logical_block * block_size;
+        if (start >= size) return;
+
+        this->append(NULL, start - written);
+
+        const u64 length = (size - start < block_size) ? size - start : block_size;
+        this->fs.read_block(block, buffer);
+        this->append(buffer, length);
+
+        written = start + length;
+    });
+
+    this->append(NULL, size - written);
+    this->pad_record();
+}
+
+void TarWriter::append(const void* data, usize length)
+{
+    const u8* input = (const u8*)data;
+
+    while (length > 0) {
+        if (!this->current.data) {
+            std::unique_lock<std::mutex> guard(this->lock);
+            this->changed.wait(guard, [this] { return !this->free_chunks.empty(); });
+
+            this->current = this->free_chunks.front();
+            this->free_chunks.pop_front();
+        }
+
+        const usize space = CHUNK_SIZE - this->current.length;
+        const usize count = (length < space) ? length : space;
+
+        if (input) {
+            memcpy(this->current.data + this->current.length, input, count);
+            input += count;
+        } else {
+            memset(this->current.data + this->current.length, 0, count);
+        }
+
+        this->current.length += count;
+        this->archive_size += count;
+        length -= count;
+
+        if (this->current.length == CHUNK_SIZE) this->flush_chunk();
+    }
+}
+
+void TarWriter::pad_record()
+{
+    const usize used = this->archive_size % RECORD_SIZE;
+    if (used) this->append(NULL, RECORD_SIZE - used);
+}
+
+void TarWriter::flush_chunk()
+{
+    if (!this->current.data) return;
+
+    std::lock_guard<std::mutex> guard(this->lock);
+    this->full_chunks.push_back(this->current);
+    this->current = {NULL, 0};
+    this->changed.notify_all();
+}
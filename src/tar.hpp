@@ -0,0 +1,59 @@
+#pragma once
+
+#include "helpers.hpp"
+#include "inode.hpp"
+
+#include <condition_variable>
+#include <deque>
+#include <filesystem>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+class Filesystem;
+
+/*
+ * Streams a subtree of the image as a POSIX (pax) tar archive. A reader thread renders the archive into
+ * a fixed pool of chunks while the calling thread writes them out, so memory use doesn't depend on the tree.
+ */
+class TarWriter
+{
+  private:
+    static const usize RECORD_SIZE = 512;
+    static const usize CHUNK_SIZE  = 1024 * 1024;
+    static const usize CHUNK_COUNT = 8;
+
+    struct Chunk {
+        u8*   data;
+        usize length;
+    };
+
+    Filesystem& fs;
+    int         output_fd;
+
+    std::mutex              lock;
+    std::condition_variable changed;
+    std::deque<Chunk>       free_chunks;
+    std::deque<Chunk>       full_chunks;
+    bool                    finished     = false;
+    Chunk                   current      = {NULL, 0};
+    u64                     archive_size = 0;
+
+    /* Hard-linked inodes already in the archive, by the path they were written as */
+    std::unordered_map<u32, std::string> linked_inodes;
+
+  public:
+    TarWriter(Filesystem& fs, int output_fd) : fs(fs), output_fd(output_fd) {}
+
+    void write_tree(const std::filesystem::path& root);
+
+  private:
+    void produce(const std::filesystem::path& root);
+    void add_entry(const std::string& name, u32 inode_id, Inode& inode, u8* buffer);
+    void add_header(const std::string& name, Inode& inode, char type, u64 size, const std::string& link_name);
+    void add_file_data(Inode& inode, u64 size, u8* buffer);
+    void append(const void* data, usize length);
+    void pad_record();
+    void flush_chunk();
+};
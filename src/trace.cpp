@@ -0,0 +1,84 @@
+#include "trace.hpp"
+
+#include "helpers.hpp"
+
+#include <chrono>
+#include <mutex>
+#include <string>
+#include <unistd.h>
+#include <vector>
+
+/* The lock is only contended while finish drains the buffer */
+struct TraceBuffer {
+    std::mutex              lock;
+    std::vector<TraceEvent> events;
+};
+
+static std::mutex                            g_trace_lock;
+static std::vector<TraceBuffer*>             g_trace_buffers; /* One per thread, the index is the tid */
+static std::string                           g_trace_path;
+static std::chrono::steady_clock::time_point g_trace_epoch;
+
+static thread_local TraceBuffer* t_trace_buffer = NULL;
+
+void Tracer::start(const char* output_path)
+{
+    API_ASSERT(!Tracer::enabled);
+
+    g_trace_path  = output_path;
+    g_trace_epoch = std::chrono::steady_clock::now();
+
+    atexit(Tracer::finish);
+    Tracer::enabled = true;
+}
+
+u64 Tracer::now_us()
+{
+    return std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - g_trace_epoch)
+        .count();
+}
+
+void Tracer::record(const TraceEvent& event)
+{
+    if (!t_trace_buffer) {
+        t_trace_buffer = new TraceBuffer();
+
+        std::lock_guard<std::mutex> guard(g_trace_lock);
+        g_trace_buffers.push_back(t_trace_buffer);
+    }
+
+    /* Threads still running during exit keep recording, once finish took the buffer their events are dropped */
+    std::lock_guard<std::mutex> guard(t_trace_buffer->lock);
+    if (Tracer::enabled.load(std::memory_order_relaxed)) t_trace_buffer->events.push_back(event);
+}
+
+void Tracer::finish()
+{
+    Tracer::enabled.store(false, std::memory_order_relaxed);
+
+    /* Taking each buffer's lock waits out a push in flight, every later one sees enabled cleared */
+    std::lock_guard<std::mutex> guard(g_trace_lock);
+    for (TraceBuffer* buffer : g_trace_buffers) std::lock_guard<std::mutex> drained(buffer->lock);
+
+    FILE* output = fopen(g_trace_path.c_str(), "w");
+    if (!output) {
+        fprintf(stderr, "Failed to write the trace to %s: %s\n", g_trace_path.c_str(), strerror(errno));
+        return;
+    }
+
+    fprintf(output, "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[");
+
+    bool first = true;
+    for (usize tid = 0; tid < g_trace_buffers.size(); tid++) {
+        for (const TraceEvent& event : g_trace_buffers[tid]->events) {
+            fprintf(output, "%s\n{\"name\":\"%s\",\"ph\":\"X\",\"pid\":%d,\"tid\":%lu,\"ts\":%lu,\"dur\":%lu",
+                    (first) ? "" : ",", event.name, getpid(), tid, event.start_us, event.duration_us);
+            if (event.arg_name) fprintf(output, ",\"args\":{\"%s\":%lu}", event.arg_name, event.arg_value);
+            fprintf(output, "}");
+            first = false;
+        }
+    }
+
+    fprintf(output, "\n]}\n");
+    fclose(output);
+}
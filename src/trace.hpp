@@ -0,0 +1,64 @@
+#pragma once
+
+#include "helpers.hpp"
+
+#include <atomic>
+
+/* Spans are only recorded once Tracer::start was called, otherwise a scope costs one branch */
+#define TRACE_CONCAT_INNER(a, b) a##b
+#define TRACE_CONCAT(a, b)       TRACE_CONCAT_INNER(a, b)
+#define TRACE_SCOPE(name)        TraceScope TRACE_CONCAT(trace_scope_, __LINE__)(name)
+#define TRACE_SCOPE_ARG(name, arg_name, arg_value) \
+    TraceScope TRACE_CONCAT(trace_scope_, __LINE__)(name, arg_name, arg_value)
+
+struct TraceEvent {
+    const char* name; /* Must outlive the tracer, in practice a string literal */
+    const char* arg_name;
+    u64         arg_value;
+    u64         start_us;
+    u64         duration_us;
+};
+
+/*
+ * Collects spans into per-thread buffers and writes them out as a Chrome trace-event JSON file (which
+ * Perfetto reads as well) when the process exits, including exits through PANIC.
+ */
+class Tracer
+{
+  public:
+    static inline std::atomic<bool> enabled = false; /* Only a hint, record checks it again under a lock */
+
+    static void start(const char* output_path);
+    static void record(const TraceEvent& event);
+    static u64  now_us();
+
+  private:
+    static void finish();
+};
+
+class TraceScope
+{
+  private:
+    const char* name;
+    const char* arg_name;
+    u64         arg_value;
+    u64         start_us = 0;
+
+  public:
+    inline explicit TraceScope(const char* name, const char* arg_name = NULL, u64 arg_value = 0)
+        : name(name), arg_name(arg_name), arg_value(arg_value)
+    {
+        if (Tracer::enabled.load(std::memory_order_relaxed)) [[unlikely]]
+            this->start_us = Tracer::now_us();
+    }
+
+    inline ~TraceScope()
+    {
+        if (Tracer::enabled.load(std::memory_order_relaxed)) [[unlikely]]
+            Tracer::record({this->name, this->arg_name, this->arg_value, this->start_us,
+                            Tracer::now_us() - this->start_us});
+    }
+
+    TraceScope(const TraceScope&)            = delete;
+    TraceScope& operator=(const TraceScope&) = delete;
+};
@@ -0,0 +1,137 @@
+#include "walker.hpp"
+
+#include "filesystem.hpp"
+#include "helpers.hpp"
+#include "trace.hpp"
+
+#include <thread>
+#include <vector>
+
+void ParallelWalker::run(const std::filesystem::path& root, const ParallelWalkCallback& callback)
+{
+    TRACE_SCOPE("ParallelWalker::run");
+
+    Inode     inode;
+    const u32 inode_id = this->fs.get_inode_from_path(root, &inode);
+    if (!inode.is_directory()) PANIC("%s is not a directory.", root.c_str());
+
+    this->queues = std::make_unique<WorkQueue[]>(this->threads);
+
+    std::string path = root.lexically_normal().string();
+    while (path.size() > 1 && path.back() == '/') path.pop_back();
+
+    this->push(0, {path, inode_id, 0, 0});
+
+    std::vector<std::thread> workers;
+    for (u32 i = 1; i < this->threads; i++) workers.emplace_back(&ParallelWalker::work, this, i, std::cref(callback));
+    this->work(0, callback);
+    for (std::thread& thread : workers) thread.join();
+
+    this->queues.reset();
+}
+
+void ParallelWalker::work(u32 worker, const ParallelWalkCallback& callback)
+{
+    u8* buffer = this->fs.allocate_block();
+    u32 idle   = 0;
+
+    Directory directory;
+    while (this->pending > 0) {
+        if (!this->take(worker, directory)) {
+            /* Someone is still scanning and may push more, back off the longer nothing turns up */
+            if (++idle < 64)
+                std::this_thread::yield();
+            else
+                std::this_thread::sleep_for(std::chrono::microseconds(50));
+            continue;
+        }
+
+        idle = 0;
+        this->scan(worker, directory, buffer, callback);
+        this->pending--;
+    }
+
+    free(buffer);
+}
+
+bool ParallelWalker::take(u32 worker, Directory& directory)
+{
+    {
+        WorkQueue&                  own = this->queues[worker];
+        std::lock_guard<std::mutex> lock(own.lock);
+
+        if (!own.directories.empty()) {
+            directory = std::move(own.directories.back());
+            own.directories.pop_back();
+            return true;
+        }
+    }
+
+    for (u32 i = 1; i < this->threads; i++) {
+        WorkQueue&                  victim = this->queues[(worker + i) % this->threads];
+        std::lock_guard<std::mutex> lock(victim.lock);
+
+        if (!victim.directories.empty()) {
+            directory = std::move(victim.directories.front());
+            victim.directories.pop_front();
+            return true;
+        }
+    }
+
+    return false;
+}
+
+void ParallelWalker::push(u32 worker, Directory&& directory)
+{
+    /* Counted before it is visible, so pending can't drop to 0 while the tree still has work */
+    this->pending++;
+
+    WorkQueue&                  own = this->queues[worker];
+    std::lock_guard<std::mutex> lock(own.lock);
+    own.directories.push_back(std::move(directory));
+}
+
+void ParallelWalker::scan(u32 worker, const Directory& directory, u8* buffer, const ParallelWalkCallback& callback)
+{
+    TRACE_SCOPE_ARG("ParallelWalker::scan", "inode", directory.inode_id);
+
+    Inode inode;
+    this->fs.read_inode(directory.inode_id, &inode);
+
+    const std::string prefix = (directory.path == "/") ? directory.path : directory.path + "/";
+
+    std::vector<std::string> names;
+    std::vector<u32>         inode_ids;
+    std::vector<Inode>       inodes;
+    u32                      next_top = 0;
+
+    auto flush = [&]() {
+        inodes.resize(inode_ids.size());
+        this->fs.read_inodes(inode_ids, inodes.data());
+
+        for (usize i = 0; i < inode_ids.size(); i++) {
+            std::string path  = prefix + names[i];
+            const u32   depth = directory.depth + 1;
+            const u32   top   = (directory.depth == 0) ? next_top++ : directory.top;
+
+            callback(worker, {path, inode_ids[i], inodes[i], depth, top});
+
+            if (inodes[i].is_directory()) this->push(worker, {std::move(path), inode_ids[i], depth, top});
+        }
+
+        names.clear();
+        inode_ids.clear();
+    };
+
+    for (DirectoryEntry* entry : DirInodeIterator(&this->fs, inode, buffer)) {
+        const std::string_view name = entry->name(&this->fs);
+        if (name == "." || name == "..") continue;
+
+        names.emplace_back(name);
+        inode_ids.push_back(entry->inode);
+
+        if (inode_ids.size() == BATCH_SIZE) flush();
+    }
+
+    flush();
+}
@@ -0,0 +1,70 @@
+#pragma once
+
+#include "helpers.hpp"
+#include "inode.hpp"
+
+#include <algorithm>
+#include <atomic>
+#include <deque>
+#include <filesystem>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <string_view>
+
+class Filesystem;
+
+struct WalkEntry {
+    std::string_view path;
+    u32              inode_id;
+    const Inode&     inode;
+    u32              depth; /* 1 for the children of the root */
+    u32              top;   /* Which child of the root the entry is below, in the order the root lists them */
+};
+
+/* Called concurrently, worker identifies the calling thread so results can be gathered without locking */
+using ParallelWalkCallback = std::function<void(u32 worker, const WalkEntry& entry)>;
+
+/*
+ * Visits a whole tree with a pool of threads. Every worker owns a deque of directories still to scan. It
+ * takes the newest one from the back, so it stays deep in the tree it just read, and an idle worker steals
+ * the oldest from the front of another deque, which is the directory closest to the root and likely the
+ * largest piece of work left. The inodes of each batch of entries are read together in on-disk order.
+ * Symlinks are not followed and the order of the callbacks is unspecified.
+ */
+class ParallelWalker
+{
+  private:
+    static constexpr usize BATCH_SIZE = 1024; /* Entries whose inodes are read at once, subdirectories go out after */
+
+    struct Directory {
+        std::string path;
+        u32         inode_id;
+        u32         depth;
+        u32         top;
+    };
+
+    struct alignas(64) WorkQueue {
+        std::mutex            lock;
+        std::deque<Directory> directories;
+    };
+
+    Filesystem&                  fs;
+    u32                          threads;
+    std::unique_ptr<WorkQueue[]> queues;
+    std::atomic<usize>           pending = 0; /* Directories queued or being scanned */
+
+  public:
+    ParallelWalker(Filesystem& fs, u32 threads) : fs(fs), threads(std::max(threads, 1u)) {}
+
+    /* The root has to be a directory, it is not passed to the callback itself */
+    void run(const std::filesystem::path& root, const ParallelWalkCallback& callback);
+    u32  thread_count() const { return this->threads; }
+
+  private:
+    void work(u32 worker, const ParallelWalkCallback& callback);
+    bool take(u32 worker, Directory& directory);
+    void push(u32 worker, Directory&& directory);
+    void scan(u32 worker, const Directory& directory, u8* buffer, const ParallelWalkCallback& callback);
+};
@@ -0,0 +1,869 @@
+#include "writer.hpp"
+
+#include "filesystem.hpp"
+#include "hash.hpp"
+#include "helpers.hpp"
+#include "trace.hpp"
+
+#include <algorithm>
+#include <fcntl.h>
+#include <span>
+#include <time.h>
+#include <unistd.h>
+
+static u8 entry_type(u32 file_type)
+{
+    switch (file_type) {
+    case Inode::FILE_TYPE_FILE: return 1;
+    case Inode::FILE_TYPE_DIRECTORY: return 2;
+    case Inode::FILE_TYPE_CHAR_DEV: return 3;
+    case Inode::FILE_TYPE_BLOCK_DEV: return 4;
+    case Inode::FILE_TYPE_FIFO: return 5;
+    case Inode::FILE_TYPE_SOCKET: return 6;
+    case Inode::FILE_TYPE_LINK: return 7;
+    }
+
+    return 0;
+}
+
+/* A live entry of a leaf being redistributed, pointing into the old copy of the block */
+struct HashedEntry {
+    u32             hash;
+    DirectoryEntry* entry;
+};
+
+static std::vector<HashedEntry> hashed_entries(Filesystem& fs, std::span<u8> block, u8 version)
+{
+    std::vector<HashedEntry> entries;
+
+    for (u64 offset = 0; offset < block.size();) {
+        DirectoryEntry* entry = (DirectoryEntry*)(block.data() + offset);
+        if (entry->total_entry_size < sizeof(DirectoryEntry)) break;
+
+        if (entry->inode) entries.push_back({fs.directory_hash(entry->name(&fs), version), entry});
+        offset += entry->total_entry_size;
+    }
+
+    return entries;
+}
+
+/* Packs entries from the start of block, the last one takes the rest */
+static void write_leaf(Filesystem& fs, u8* block, std::span<const HashedEntry> entries)
+{
+    memset(block, 0, fs.block_size);
+
+    u64             offset = 0;
+    DirectoryEntry* last   = (DirectoryEntry*)block;
+
+    for (const HashedEntry& hashed : entries) {
+        const u16 length = DirectoryEntry::length(hashed.entry->name(&fs).size());
+
+        memcpy(block + offset, hashed.entry, length);
+        last                   = (DirectoryEntry*)(block + offset);
+        last->total_entry_size = length;
+        offset += length;
+    }
+
+    last->total_entry_size += fs.block_size - offset;
+}
+
+/* The caller made sure there is room, position is never 0 as that entry's hash is the count and limit */
+static void insert_dx_entry(DxEntry* entries, u32 position, u32 hash, u32 block)
+{
+    DxCountLimit* counts = (DxCountLimit*)entries;
+
+    memmove(entries + position + 1, entries + position, (counts->count - position) * sizeof(DxEntry));
+    entries[position] = {hash, block};
+    counts->count++;
+}
+
+/* An index node is an empty entry over the whole block with the index inside */
+static DxEntry* init_dx_node(u8* block, u64 block_size)
+{
+    memset(block, 0, block_size);
+    ((DirectoryEntry*)block)->total_entry_size = block_size;
+
+    DxEntry* entries                = (DxEntry*)(block + DxRootInfo::NODE_ENTRIES);
+    ((DxCountLimit*)entries)->limit = (block_size - DxRootInfo::NODE_ENTRIES) / sizeof(DxEntry);
+
+    return entries;
+}
+
+static void read_host(int fd, u8* buffer, usize length, u64 offset, const std::filesystem::path& path)
+{
+    while (length > 0) {
+        ssize_t result = pread(fd, buffer, length, offset);
+        if (result < 0 && errno == EINTR) continue;
+        if (result < 0) PANIC_FROM_ERRNO("Failed to read %s", path.c_str());
+        if (result == 0) PANIC("%s shrank while it was being added.", path.c_str());
+
+        buffer += result;
+        offset += result;
+        length -= result;
+    }
+}
+
+void ImageWriter::add(const std::filesystem::path& host_path, const std::filesystem::path& destination)
+{
+    std::filesystem::path source = host_path.lexically_normal();
+    if (!source.has_filename()) source = source.parent_path();
+
+    std::filesystem::path target = destination.lexically_normal();
+    if (!target.has_filename()) target = target.parent_path();
+
+    u32         parent_id = Inode::ROOT_INODE;
+    std::string name      = source.filename().string();
+
+    if (target.has_filename()) {
+        Inode parent;
+        parent_id = this->fs.get_inode_from_path(target.parent_path(), &parent);
+        if (!parent.is_directory()) PANIC("%s is not a directory.", target.parent_path().c_str());
+
+        u8* buffer   = this->fs.allocate_block();
+        u32 existing = this->fs.find_entry(parent, target.filename().native(), buffer);
+        free(buffer);
+
+        Inode inode;
+        if (existing) this->fs.read_inode(existing, &inode);
+
+        if (existing && inode.is_directory()) {
+            parent_id = existing;
+        } else {
+            name = target.filename().string();
+        }
+    }
+
+    if (name.empty() || name == "." || name == "..")
+        PANIC("Can't name %s in the image, give a full destination.", host_path.c_str());
+
+    this->add_host_path(source, parent_id, name);
+}
+
+u32 ImageWriter::make_directory(const std::filesystem::path& path, u16 mode)
+{
+    std::filesystem::path target = path.lexically_normal();
+    if (!target.has_filename()) target = target.parent_path();
+    if (!target.has_filename()) PANIC("The root directory already exists.");
+
+    Inode     parent;
+    const u32 parent_id = this->fs.get_inode_from_path(target.parent_path(), &parent);
+    if (!parent.is_directory()) PANIC("%s is not a directory.", target.parent_path().c_str());
+
+    return this->add_directory(parent_id, target.filename().native(), mode, NULL);
+}
+
+void ImageWriter::finish()
+{
+    this->fs.write_bgds();
+    this->fs.write_superblock();
+    this->fs.device->flush();
+}
+
+u32 ImageWriter::add_host_path(const std::filesystem::path& host_path, u32 parent_id, std::string_view name)
+{
+    struct stat host;
+    if (lstat(host_path.c_str(), &host) < 0) PANIC_FROM_ERRNO("Failed to stat %s", host_path.c_str());
+
+    if (S_ISREG(host.st_mode)) return this->add_file(host_path, host, parent_id, name);
+
+    if (S_ISLNK(host.st_mode)) {
+        std::error_code             error;
+        const std::filesystem::path target = std::filesystem::read_symlink(host_path, error);
+        if (error) PANIC("Failed to read the link %s: %s", host_path.c_str(), error.message().c_str());
+
+        return this->add_symlink(target.string(), host, parent_id, name);
+    }
+
+    if (S_ISDIR(host.st_mode)) {
+        const u32 inode_id = this->add_directory(parent_id, name, host.st_mode & 07777, &host);
+
+        std::error_code error;
+        for (const std::filesystem::directory_entry& child : std::filesystem::directory_iterator(host_path, error))
+            this->add_host_path(child.path(), inode_id, child.path().filename().native());
+        if (error) PANIC("Failed to list %s: %s", host_path.c_str(), error.message().c_str());
+
+        return inode_id;
+    }
+
+    fprintf(stderr, "Skipping %s, only files, directories and symlinks can be added.\n", host_path.c_str());
+    return 0;
+}
+
+u32 ImageWriter::add_file(const std::filesystem::path& host_path, const struct stat& host, u32 parent_id,
+                          std::string_view name)
+{
+    TRACE_SCOPE_ARG("ImageWriter::add_file", "bytes", host.st_size);
+
+    this->check_new_name(parent_id, name);
+
+    const u64 block_size  = this->fs.block_size;
+    const u64 size        = host.st_size;
+    const u32 data_blocks = (size + block_size - 1) / block_size;
+    const u32 goal_group  = (parent_id - 1) / this->fs.superblock.inodes_in_block_group;
+
+    int fd = open(host_path.c_str(), O_RDONLY);
+    if (fd < 0) PANIC_FROM_ERRNO("Failed to open %s", host_path.c_str());
+
+    /* Sized first, then laid out over whatever runs the allocator found */
+    BlockLayout      layout;
+    const u32        total  = Filesystem::plan_layout(this->fs.block_size, data_blocks, []() { return 0u; }, layout);
+    std::vector<u32> blocks = this->allocate_blocks(total, goal_group);
+
+    usize next = 0;
+    Filesystem::plan_layout(this->fs.block_size, data_blocks, [&]() { return blocks[next++]; }, layout);
+
+    u8* buffer = this->fs.allocate_blocks(MAX_WRITE_BLOCKS);
+
+    for (usize first = 0; first < total;) {
+        usize count = 0;
+
+        while (first + count < total && count < MAX_WRITE_BLOCKS &&
+               layout.blocks[first + count] == layout.blocks[first] + count) {
+            u8*       data   = buffer + count * block_size;
+            const i64 source = layout.sources[first + count];
+
+            if (source < 0) {
+                memcpy(data, layout.indirect[-source - 1].data(), block_size);
+            } else {
+                const u64 offset = source * block_size;
+                const u64 length = std::min(block_size, size - offset);
+
+                read_host(fd, data, length, offset, host_path);
+                memset(data + length, 0, block_size - length);
+            }
+
+            count++;
+        }
+
+        this->fs.device->write(this->fs.block_offset(layout.blocks[first]), buffer, count * block_size);
+        first += count;
+    }
+
+    free(buffer);
+    close(fd);
+
+    Inode inode;
+    this->init_inode(inode, Inode::FILE_TYPE_FILE | (host.st_mode & 07777), &host);
+    inode.lower_size            = size;
+    inode.upper_size_or_dir_acl = size >> 32;
+    inode.disk_sector_count     = total * block_size / 512;
+    memcpy(inode.block_pointers, layout.pointers, sizeof(inode.block_pointers));
+
+    const u32 inode_id = this->allocate_inode(goal_group, false);
+    this->fs.write_inode(inode_id, &inode);
+
+    this->insert_entry(parent_id, name, inode_id, Inode::FILE_TYPE_FILE);
+    return inode_id;
+}
+
+u32 ImageWriter::add_symlink(const std::string& target, const struct stat& host, u32 parent_id,
+                             std::string_view name)
+{
+    this->check_new_name(parent_id, name);
+
+    const u32 goal_group = (parent_id - 1) / this->fs.superblock.inodes_in_block_group;
+
+    Inode inode;
+    this->init_inode(inode, Inode::FILE_TYPE_LINK | 0777, &host);
+    inode.lower_size = target.size();
+
+    /* Short targets live in place of the block pointers, like the kernel stores them */
+    if (target.size() < sizeof(inode.block_pointers)) {
+        memcpy(inode.block_pointers, target.data(), target.size());
+    } else {
+        if (target.size() >= this->fs.block_size) PANIC("The link target %s is too long.", target.c_str());
+
+        const u32 block  = this->allocate_blocks(1, goal_group)[0];
+        u8*       buffer = this->fs.allocate_block();
+
+        memset(buffer, 0, this->fs.block_size);
+        memcpy(buffer, target.data(), target.size());
+        this->fs.write_block(block, buffer);
+        free(buffer);
+
+        inode.block_pointers[0] = block;
+        inode.disk_sector_count = this->fs.block_size / 512;
+    }
+
+    const u32 inode_id = this->allocate_inode(goal_group, false);
+    this->fs.write_inode(inode_id, &inode);
+
+    this->insert_entry(parent_id, name, inode_id, Inode::FILE_TYPE_LINK);
+    return inode_id;
+}
+
+u32 ImageWriter::add_directory(u32 parent_id, std::string_view name, u16 mode, const struct stat* host)
+{
+    this->check_new_name(parent_id, name);
+
+    const u32 inodes_in_group = this->fs.superblock.inodes_in_block_group;
+    const u32 inode_id        = this->allocate_inode((parent_id - 1) / inodes_in_group, true);
+    const u32 block           = this->allocate_blocks(1, (inode_id - 1) / inodes_in_group)[0];
+    const u8  type            = (this->fs.directory_types) ? entry_type(Inode::FILE_TYPE_DIRECTORY) : 0;
+
+    u8* buffer = this->fs.allocate_block();
+    memset(buffer, 0, this->fs.block_size);
+
+    DirectoryEntry* dot            = (DirectoryEntry*)buffer;
+    dot->inode                     = inode_id;
+    dot->total_entry_size          = DirectoryEntry::length(1);
+    dot->lower_name_length         = 1;
+    dot->upper_name_length_or_type = type;
+    memcpy(dot->name_data, ".", 1);
+
+    DirectoryEntry* dot_dot            = (DirectoryEntry*)(buffer + dot->total_entry_size);
+    dot_dot->inode                     = parent_id;
+    dot_dot->total_entry_size          = this->fs.block_size - dot->total_entry_size;
+    dot_dot->lower_name_length         = 2;
+    dot_dot->upper_name_length_or_type = type;
+    memcpy(dot_dot->name_data, "..", 2);
+
+    this->fs.write_block(block, buffer);
+
+    /* Nothing needs reading to index a directory that was just made */
+    DirectorySlots& slots = this->directories[inode_id];
+    slots.blocks.push_back(block);
+    slots.space.push_back(0);
+    slots.names.insert(".");
+    slots.names.insert("..");
+    this->update_space(slots, 0, buffer);
+
+    free(buffer);
+
+    Inode inode;
+    this->init_inode(inode, Inode::FILE_TYPE_DIRECTORY | mode, host);
+    inode.hard_link_count   = 2;
+    inode.lower_size        = this->fs.block_size;
+    inode.disk_sector_count = this->fs.block_size / 512;
+    inode.block_pointers[0] = block;
+    this->fs.write_inode(inode_id, &inode);
+
+    this->insert_entry(parent_id, name, inode_id, Inode::FILE_TYPE_DIRECTORY);
+
+    /* For the new ".." */
+    Inode parent;
+    this->fs.read_inode(parent_id, &parent);
+    parent.hard_link_count++;
+    this->fs.write_inode(parent_id, &parent);
+
+    return inode_id;
+}
+
+void ImageWriter::check_new_name(u32 directory_id, std::string_view name)
+{
+    if (name.size() > 255) PANIC("The name %.*s is too long.", (int)name.size(), name.data());
+
+    if (this->slots_of(directory_id).names.contains(std::string(name)))
+        PANIC("%.*s already exists.", (int)name.size(), name.data());
+}
+
+void ImageWriter::insert_entry(u32 directory_id, std::string_view name, u32 inode_id, u32 file_type)
+{
+    DirectorySlots& slots  = this->slots_of(directory_id);
+    const u16       needed = DirectoryEntry::length(name.size());
+
+    if (!slots.indexed && slots.blocks.size() == 1 && slots.space[0] < needed) this->make_indexed(directory_id, slots);
+
+    if (!slots.indexed || !this->insert_hashed(directory_id, slots, name, inode_id, file_type)) {
+        /* The smallest gap that fits, so the large ones stay free for long names */
+        auto      fit     = slots.by_space.lower_bound({needed, 0});
+        const u32 logical = (fit != slots.by_space.end()) ? fit->second : this->grow_directory(directory_id, slots);
+
+        u8* buffer = this->fs.read_block(slots.blocks[logical], NULL);
+        if (!this->place_entry(buffer, name, inode_id, file_type))
+            PANIC("The free space index of directory inode %u is out of date.", directory_id);
+
+        this->fs.write_block(slots.blocks[logical], buffer);
+        this->update_space(slots, logical, buffer);
+        free(buffer);
+    }
+
+    slots.names.emplace(name);
+}
+
+bool ImageWriter::place_entry(u8* block, std::string_view name, u32 inode_id, u32 file_type)
+{
+    const u16 needed = DirectoryEntry::length(name.size());
+
+    for (u64 offset = 0; offset < this->fs.block_size;) {
+        DirectoryEntry* entry = (DirectoryEntry*)(block + offset);
+        if (entry->total_entry_size < sizeof(DirectoryEntry)) break;
+
+        const u16 used = (entry->inode) ? DirectoryEntry::length(entry->name(&this->fs).size()) : 0;
+
+        if (entry->total_entry_size - used < needed) {
+            offset += entry->total_entry_size;
+            continue;
+        }
+
+        /* A live entry gives up its slack, an unused one is taken over whole */
+        DirectoryEntry* target = entry;
+        if (used) {
+            target                   = (DirectoryEntry*)(block + offset + used);
+            target->total_entry_size = entry->total_entry_size - used;
+            entry->total_entry_size  = used;
+        }
+
+        target->inode                     = inode_id;
+        target->lower_name_length         = name.size();
+        target->upper_name_length_or_type = (this->fs.directory_types) ? entry_type(file_type) : 0;
+        memcpy(target->name_data, name.data(), name.size());
+
+        return true;
+    }
+
+    return false;
+}
+
+void ImageWriter::make_indexed(u32 directory_id, DirectorySlots& slots)
+{
+    const u64 block_size = this->fs.block_size;
+    const u8  version    = this->fs.e_superblock.default_hash_version;
+
+    if (!this->fs.e_superblock_present || version > DirectoryHash::TEA ||
+        !this->fs.e_superblock.has_optional_feature(OptionalFeatures::DirectoryHashIndex))
+        return;
+
+    TRACE_SCOPE_ARG("ImageWriter::make_indexed", "inode", directory_id);
+
+    u8*             root    = this->fs.read_block(slots.blocks[0], NULL);
+    DirectoryEntry* dot     = (DirectoryEntry*)root;
+    DirectoryEntry* dot_dot = (DirectoryEntry*)(root + dot->total_entry_size);
+
+    if (dot->total_entry_size < DirectoryEntry::length(1) ||
+        dot->total_entry_size > block_size - DirectoryEntry::length(2) || dot->name(&this->fs) != "." ||
+        dot_dot->name(&this->fs) != "..") {
+        free(root);
+        return;
+    }
+
+    /* Everything but "." and ".." moves to the first leaf, splitting it is left to the insertion */
+    const u64                first   = dot->total_entry_size + dot_dot->total_entry_size;
+    std::vector<HashedEntry> entries = hashed_entries(this->fs, {root + first, block_size - first}, version);
+
+    u8* leaf = this->fs.allocate_block();
+    write_leaf(this->fs, leaf, entries);
+
+    const u32 logical = this->grow_directory(directory_id, slots);
+    this->fs.write_block(slots.blocks[logical], leaf);
+    this->update_space(slots, logical, leaf);
+
+    /* The root is ".." spanning the block with the index after its name, linear readers skip over it */
+    memmove(root + DirectoryEntry::length(1), dot_dot, DirectoryEntry::length(2));
+    dot_dot                   = (DirectoryEntry*)(root + DirectoryEntry::length(1));
+    dot->total_entry_size     = DirectoryEntry::length(1);
+    dot_dot->total_entry_size = block_size - DirectoryEntry::length(1);
+    memset(root + DxRootInfo::OFFSET, 0, block_size - DxRootInfo::OFFSET);
+
+    DxRootInfo* info   = (DxRootInfo*)(root + DxRootInfo::OFFSET);
+    info->hash_version = version;
+    info->info_length  = sizeof(DxRootInfo);
+
+    DxEntry*      index  = (DxEntry*)(root + DxRootInfo::ROOT_ENTRIES);
+    DxCountLimit* counts = (DxCountLimit*)index;
+    counts->limit        = (block_size - DxRootInfo::ROOT_ENTRIES) / sizeof(DxEntry);
+    counts->count        = 1;
+    index[0].block       = logical;
+
+    this->fs.write_block(slots.blocks[0], root);
+    this->update_space(slots, 0, root);
+
+    Inode directory;
+    this->fs.read_inode(directory_id, &directory);
+    directory.flags |= Inode::FLAGS_HASH_INDEXED_DIRECTORY;
+    this->fs.write_inode(directory_id, &directory);
+
+    slots.indexed = true;
+
+    free(leaf);
+    free(root);
+}
+
+bool ImageWriter::insert_hashed(u32 directory_id, DirectorySlots& slots, std::string_view name, u32 inode_id,
+                                u32 file_type)
+{
+    Inode directory;
+    this->fs.read_inode(directory_id, &directory);
+
+    PointerCache cache;
+    cache.buffer = this->fs.allocate_blocks(3);
+    u8* leaf     = this->fs.allocate_block();
+
+    HashProbe  probe;
+    const bool probed = this->fs.probe_hash_index(directory, name, probe, leaf, cache);
+
+    if (!probed) {
+        /* Without the flag the index blocks read as empty entries, the directory stays valid */
+        directory.flags &= ~Inode::FLAGS_HASH_INDEXED_DIRECTORY;
+        this->fs.write_inode(directory_id, &directory);
+        slots.indexed = false;
+
+        free(leaf);
+        return false;
+    }
+
+    this->fs.read_block(slots.blocks[probe.leaf], leaf);
+
+    if (this->place_entry(leaf, name, inode_id, file_type)) {
+        this->fs.write_block(slots.blocks[probe.leaf], leaf);
+        this->update_space(slots, probe.leaf, leaf);
+    } else {
+        this->split_leaf(directory_id, slots, probe, leaf, name, inode_id, file_type);
+    }
+
+    free(leaf);
+    return true;
+}
+
+void ImageWriter::split_leaf(u32 directory_id, DirectorySlots& slots, HashProbe& probe, u8* leaf,
+                             std::string_view name, u32 inode_id, u32 file_type)
+{
+    TRACE_SCOPE_ARG("ImageWriter::split_leaf", "inode", directory_id);
+
+    const u64                block_size = this->fs.block_size;
+    std::vector<HashedEntry> entries    = hashed_entries(this->fs, {leaf, block_size}, probe.version);
+    if (entries.size() < 2) PANIC("Directory inode %u has a full leaf that can't be split.", directory_id);
+
+    std::sort(entries.begin(), entries.end(),
+              [](const HashedEntry& a, const HashedEntry& b) { return a.hash < b.hash; });
+
+    /* The lower half by bytes stays */
+    usize split = 0;
+    for (u64 bytes = 0; split < entries.size() - 1; split++) {
+        bytes += DirectoryEntry::length(entries[split].entry->name(&this->fs).size());
+        if (bytes > block_size / 2) break;
+    }
+    split = std::max<usize>(split, 1);
+
+    /* Equal hashes on both sides mark the upper leaf as a continuation, lookups go on into it */
+    u32 split_hash = entries[split].hash;
+    if (entries[split - 1].hash == split_hash) split_hash |= 1;
+
+    u8* lower = this->fs.allocate_block();
+    u8* upper = this->fs.allocate_block();
+    write_leaf(this->fs, lower, {entries.data(), split});
+    write_leaf(this->fs, upper, {entries.data() + split, entries.size() - split});
+
+    if (!this->place_entry((probe.hash >= split_hash) ? upper : lower, name, inode_id, file_type))
+        PANIC("No room for %.*s in directory inode %u.", (int)name.size(), name.data(), directory_id);
+
+    const u32 logical = this->grow_directory(directory_id, slots);
+
+    this->fs.write_block(slots.blocks[probe.leaf], lower);
+    this->fs.write_block(slots.blocks[logical], upper);
+    this->update_space(slots, probe.leaf, lower);
+    this->update_space(slots, logical, upper);
+
+    free(lower);
+    free(upper);
+
+    this->insert_index(directory_id, slots, probe, split_hash, logical);
+}
+
+void ImageWriter::insert_index(u32 directory_id, DirectorySlots& slots, HashProbe& probe, u32 hash, u32 logical_block)
+{
+    const u64 block_size = this->fs.block_size;
+
+    u8* root = this->fs.read_block(slots.blocks[0], NULL);
+    u8* node = this->fs.allocate_block();
+    if (probe.levels) this->fs.read_block(slots.blocks[probe.blocks[1]], node);
+
+    DxEntry*      root_entries = (DxEntry*)(root + DxRootInfo::ROOT_ENTRIES);
+    DxCountLimit* root_counts  = (DxCountLimit*)root_entries;
+
+    /* A full root hands all its entries to a new node and keeps only the pointer to it */
+    if (probe.levels == 0 && root_counts->count == root_counts->limit) {
+        const u32 moved   = this->grow_directory(directory_id, slots);
+        DxEntry*  entries = init_dx_node(node, block_size);
+        const u16 limit   = ((DxCountLimit*)entries)->limit;
+
+        memcpy(entries, root_entries, root_counts->count * sizeof(DxEntry));
+        ((DxCountLimit*)entries)->limit = limit;
+
+        root_counts->count    = 1;
+        root_entries[0].block = moved;
+        ((DxRootInfo*)(root + DxRootInfo::OFFSET))->indirect_levels = 1;
+
+        probe.levels     = 1;
+        probe.blocks[1]  = moved;
+        probe.entries[1] = probe.entries[0];
+        probe.entries[0] = 0;
+    }
+
+    if (probe.levels == 0) {
+        insert_dx_entry(root_entries, probe.entries[0] + 1, hash, logical_block);
+    } else {
+        DxEntry*      entries = (DxEntry*)(node + DxRootInfo::NODE_ENTRIES);
+        DxCountLimit* counts  = (DxCountLimit*)entries;
+
+        /* A full node moves its upper half to a new one, which the root then points at */
+        if (counts->count == counts->limit) {
+            if (root_counts->count == root_counts->limit)
+                PANIC("Directory inode %u has too many entries for a two level index.", directory_id);
+
+            const u32 half    = counts->count / 2;
+            const u32 sibling = this->grow_directory(directory_id, slots);
+            u8*       other   = this->fs.allocate_block();
+            DxEntry*  moved   = init_dx_node(other, block_size);
+
+            memcpy(moved + 1, entries + half + 1, (counts->count - half - 1) * sizeof(DxEntry));
+            moved[0].block                = entries[half].block;
+            ((DxCountLimit*)moved)->count = counts->count - half;
+            counts->count                 = half;
+
+            insert_dx_entry(root_entries, probe.entries[0] + 1, entries[half].hash, sibling);
+
+            if (probe.entries[1] >= half) {
+                this->fs.write_block(slots.blocks[probe.blocks[1]], node);
+                std::swap(node, other);
+
+                probe.entries[0]++;
+                probe.blocks[1] = sibling;
+                probe.entries[1] -= half;
+            } else {
+                this->fs.write_block(slots.blocks[sibling], other);
+            }
+
+            free(other);
+            entries = (DxEntry*)(node + DxRootInfo::NODE_ENTRIES);
+        }
+
+        insert_dx_entry(entries, probe.entries[1] + 1, hash, logical_block);
+        this->fs.write_block(slots.blocks[probe.blocks[1]], node);
+    }
+
+    this->fs.write_block(slots.blocks[0], root);
+
+    free(node);
+    free(root);
+}
+
+ImageWriter::DirectorySlots& ImageWriter::slots_of(u32 directory_id)
+{
+    auto found = this->directories.find(directory_id);
+    if (found != this->directories.end()) return found->second;
+
+    TRACE_SCOPE_ARG("ImageWriter::index directory", "inode", directory_id);
+
+    DirectorySlots& slots = this->directories[directory_id];
+
+    Inode directory;
+    this->fs.read_inode(directory_id, &directory);
+    API_ASSERT(directory.is_directory());
+    slots.indexed = this->fs.hash_indexed(directory);
+
+    this->fs.walk_block_pointers(directory, [&](u32 block, i64 logical_block) {
+        if (logical_block < 0) return;
+        if ((u64)logical_block != slots.blocks.size()) PANIC("Directory inode %u has holes.", directory_id);
+        slots.blocks.push_back(block);
+    });
+
+    /* The one full pass over the directory, every insertion after it touches a single block */
+    u8* buffer = this->fs.allocate_block();
+
+    for (u32 logical_block = 0; logical_block < slots.blocks.size(); logical_block++) {
+        this->fs.read_block(slots.blocks[logical_block], buffer);
+
+        for (u64 offset = 0; offset < this->fs.block_size;) {
+            DirectoryEntry* entry = (DirectoryEntry*)(buffer + offset);
+            if (entry->total_entry_size < sizeof(DirectoryEntry)) break;
+
+            if (entry->inode) slots.names.emplace(entry->name(&this->fs));
+            offset += entry->total_entry_size;
+        }
+
+        slots.space.push_back(0);
+        this->update_space(slots, logical_block, buffer);
+    }
+
+    free(buffer);
+    return slots;
+}
+
+u32 ImageWriter::grow_directory(u32 directory_id, DirectorySlots& slots)
+{
+    Inode directory;
+    this->fs.read_inode(directory_id, &directory);
+
+    const u32 logical_block = slots.blocks.size();
+    const u32 goal_group    = (slots.blocks.empty()) ? (directory_id - 1) / this->fs.superblock.inodes_in_block_group
+                                                     : this->fs.group_of_block(slots.blocks.back());
+    const u32 block         = this->allocate_blocks(1, goal_group)[0];
+
+    this->map_block(directory, logical_block, block);
+
+    u8* buffer = this->fs.allocate_block();
+    memset(buffer, 0, this->fs.block_size);
+    ((DirectoryEntry*)buffer)->total_entry_size = this->fs.block_size;
+
+    this->fs.write_block(block, buffer);
+
+    directory.lower_size += this->fs.block_size;
+    directory.disk_sector_count += this->fs.block_size / 512;
+    this->fs.write_inode(directory_id, &directory);
+
+    slots.blocks.push_back(block);
+    slots.space.push_back(0);
+    this->update_space(slots, logical_block, buffer);
+
+    free(buffer);
+    return logical_block;
+}
+
+void ImageWriter::update_space(DirectorySlots& slots, u32 logical_block, const u8* buffer)
+{
+    u16 largest = 0;
+
+    for (u64 offset = 0; offset < this->fs.block_size;) {
+        DirectoryEntry* entry = (DirectoryEntry*)(buffer + offset);
+        if (entry->total_entry_size < sizeof(DirectoryEntry)) break;
+
+        const u16 used = (entry->inode) ? DirectoryEntry::length(entry->name(&this->fs).size()) : 0;
+        largest        = std::max<u16>(largest, entry->total_entry_size - used);
+        offset += entry->total_entry_size;
+    }
+
+    slots.by_space.erase({slots.space[logical_block], logical_block});
+    slots.space[logical_block] = largest;
+    if (largest >= DirectoryEntry::length(1)) slots.by_space.insert({largest, logical_block});
+}
+
+u32 ImageWriter::allocate_inode(u32 goal_group, bool directory)
+{
+    const u32 inodes_in_group = this->fs.superblock.inodes_in_block_group;
+    const u32 first_usable    = (this->fs.e_superblock_present) ? this->fs.e_superblock.first_non_reserved_inode : 11;
+
+    u8* bitmap = this->fs.allocate_block();
+
+    for (u32 i = 0; i < this->fs.block_groups; i++) {
+        const u32 group = (goal_group + i) % this->fs.block_groups;
+        BGD&      bgd   = this->fs.bgds[group];
+        if (bgd.unallocated_inodes == 0) continue;
+
+        this->fs.read_block(bgd.inode_bitmap, bitmap);
+
+        for (u32 index = 0; index < inodes_in_group; index++) {
+            const u32 inode_id = group * inodes_in_group + index + 1;
+            if (inode_id < first_usable || (bitmap[index / 8] >> (index % 8)) & 1) continue;
+
+            bitmap[index / 8] |= 1 << (index % 8);
+            this->fs.write_block(bgd.inode_bitmap, bitmap);
+            free(bitmap);
+
+            bgd.unallocated_inodes--;
+            this->fs.superblock.unallocated_inodes--;
+            if (directory) bgd.directories_in_group++;
+
+            return inode_id;
+        }
+    }
+
+    PANIC("No free inodes left on the image.");
+}
+
+std::vector<u32> ImageWriter::allocate_blocks(u32 count, u32 goal_group)
+{
+    std::vector<u32> blocks;
+    blocks.reserve(count);
+
+    /* As few runs as the free space allows, the request is halved until one fits */
+    u32 length = count;
+
+    while (blocks.size() < count) {
+        length = std::min<u32>(length, count - blocks.size());
+
+        u32 first;
+        while (!this->fs.find_free_run(length, goal_group, &first)) {
+            length /= 2;
+            if (length == 0) PANIC("No space left on the image.");
+        }
+
+        this->fs.set_blocks_allocated(first, length, true);
+        for (u32 i = 0; i < length; i++) blocks.push_back(first + i);
+
+        goal_group = this->fs.group_of_block(first + length - 1);
+    }
+
+    return blocks;
+}
+
+void ImageWriter::map_block(Inode& inode, u32 logical_block, u32 block)
+{
+    if (logical_block < Inode::NDIR_BLOCKS) {
+        inode.block_pointers[logical_block] = block;
+        return;
+    }
+
+    const u32 pointers_per_block = this->fs.block_size / 4;
+
+    /* Which tree the block falls in, and how many blocks each of its top level pointers covers */
+    u64 index = logical_block - Inode::NDIR_BLOCKS;
+    u64 span  = 1;
+    u32 depth = 0;
+
+    while (index >= span * pointers_per_block) {
+        index -= span * pointers_per_block;
+        span *= pointers_per_block;
+        if (++depth == 3) PANIC("The file is too large for its block size.");
+    }
+
+    /* Missing pointer blocks are allocated next to the block they lead to */
+    auto new_pointer_block = [&]() {
+        const u32 pointer_block = this->allocate_blocks(1, this->fs.group_of_block(block))[0];
+
+        u8* zeroes = this->fs.allocate_block();
+        memset(zeroes, 0, this->fs.block_size);
+        this->fs.write_block(pointer_block, zeroes);
+        free(zeroes);
+
+        inode.disk_sector_count += this->fs.block_size / 512;
+        return pointer_block;
+    };
+
+    const u32 root = Inode::IND_BLOCK + depth;
+    if (!inode.block_pointers[root]) inode.block_pointers[root] = new_pointer_block();
+
+    u32* pointers      = (u32*)this->fs.allocate_block();
+    u32  pointer_block = inode.block_pointers[root];
+
+    for (;; span /= pointers_per_block) {
+        this->fs.read_block(pointer_block, (u8*)pointers);
+
+        const u64 slot = index / span;
+        index %= span;
+
+        if (span == 1) {
+            pointers[slot] = block;
+            this->fs.write_block(pointer_block, (u8*)pointers);
+            break;
+        }
+
+        if (!pointers[slot]) {
+            pointers[slot] = new_pointer_block();
+            this->fs.write_block(pointer_block, (u8*)pointers);
+        }
+
+        pointer_block = pointers[slot];
+    }
+
+    free(pointers);
+}
+
+void ImageWriter::init_inode(Inode& inode, u32 type_and_permissions, const struct stat* host)
+{
+    const u32 now = time(NULL);
+
+    memset(&inode, 0, sizeof(Inode));
+    inode.type_and_permissions   = type_and_permissions;
+    inode.hard_link_count        = 1;
+    inode.last_access_time       = now;
+    inode.creation_time          = now;
+    inode.last_modification_time = now;
+
+    if (host) {
+        inode.user_id                = host->st_uid;
+        inode.group_id               = host->st_gid;
+        inode.last_access_time       = host->st_atime;
+        inode.last_modification_time = host->st_mtime;
+    }
+}
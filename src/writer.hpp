@@ -0,0 +1,80 @@
+#pragma once
+
+#include "helpers.hpp"
+#include "inode.hpp"
+
+#include <filesystem>
+#include <set>
+#include <string>
+#include <string_view>
+#include <sys/stat.h>
+#include <unordered_map>
+#include <unordered_set>
+#include <utility>
+#include <vector>
+
+class Filesystem;
+struct HashProbe;
+
+/*
+ * Creates files, directories and symlinks. Every directory that receives entries gets a free-space index on
+ * its first insertion, the largest gap of each of its blocks ordered by size, so any later insertion goes
+ * straight to a block with room and reads and writes that block only. Filling a directory stays linear.
+ *
+ * On images with the dir_index feature a directory about to outgrow its first block becomes an htree
+ * instead, like the kernel makes them: the first block turns into the root of a hash index and entries go
+ * to the leaf their name hashes to. A full leaf is split at its median hash, a full root gets a level of
+ * index nodes below it. An existing htree this driver can't follow is dropped, which leaves a valid
+ * linear directory.
+ *
+ * Counters are updated in memory, finish() writes them out.
+ */
+class ImageWriter
+{
+  private:
+    static const usize MAX_WRITE_BLOCKS = 256;
+
+    struct DirectorySlots {
+        std::vector<u32>                blocks; /* Physical block of each logical one */
+        std::vector<u16>                space;  /* Largest gap a new entry fits in, per logical block */
+        std::set<std::pair<u16, u32>>   by_space;
+        std::unordered_set<std::string> names;
+        bool                            indexed = false; /* An htree, insertions go by hash instead */
+    };
+
+    Filesystem&                             fs;
+    std::unordered_map<u32, DirectorySlots> directories;
+
+  public:
+    explicit ImageWriter(Filesystem& fs) : fs(fs) {}
+
+    /* A host file, symlink or whole directory. An existing directory as destination receives it by its name */
+    void add(const std::filesystem::path& host_path, const std::filesystem::path& destination);
+    u32  make_directory(const std::filesystem::path& path, u16 mode);
+    void finish();
+
+  private:
+    /* The host metadata is only used for the owner and the times, NULL for a fresh root-owned entry */
+    u32 add_host_path(const std::filesystem::path& host_path, u32 parent_id, std::string_view name);
+    u32 add_file(const std::filesystem::path& host_path, const struct stat& host, u32 parent_id, std::string_view name);
+    u32 add_symlink(const std::string& target, const struct stat& host, u32 parent_id, std::string_view name);
+    u32 add_directory(u32 parent_id, std::string_view name, u16 mode, const struct stat* host);
+
+    void            check_new_name(u32 directory_id, std::string_view name);
+    void            insert_entry(u32 directory_id, std::string_view name, u32 inode_id, u32 file_type);
+    DirectorySlots& slots_of(u32 directory_id);
+    u32             grow_directory(u32 directory_id, DirectorySlots& slots);
+    void            update_space(DirectorySlots& slots, u32 logical_block, const u8* buffer);
+    bool            place_entry(u8* block, std::string_view name, u32 inode_id, u32 file_type);
+
+    void make_indexed(u32 directory_id, DirectorySlots& slots);
+    bool insert_hashed(u32 directory_id, DirectorySlots& slots, std::string_view name, u32 inode_id, u32 file_type);
+    void split_leaf(u32 directory_id, DirectorySlots& slots, HashProbe& probe, u8* leaf, std::string_view name,
+                    u32 inode_id, u32 file_type);
+    void insert_index(u32 directory_id, DirectorySlots& slots, HashProbe& probe, u32 hash, u32 logical_block);
+
+    u32              allocate_inode(u32 goal_group, bool directory);
+    std::vector<u32> allocate_blocks(u32 count, u32 goal_group);
+    void             map_block(Inode& inode, u32 logical_block, u32 block);
+    void             init_inode(Inode& inode, u32 type_and_permissions, const struct stat* host);
+};
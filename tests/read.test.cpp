@@ -1,8 +1,10 @@
+#include <algorithm>
 #include <atomic>
 #include <cstdlib>
 #include <gtest/gtest.h>
 #include <filesystem>
 #include <iterator>
+#include <map>
 #include <ctime>
 #include <cstdint>
 #include <fstream>
@@ -10,11 +12,36 @@
 #include <string>
 #include <random>
 #include <optional>
+#include <thread>
 #include <unordered_set>
 #include <nlohmann/json.hpp>
 #include <iostream>
-
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+#include "async.hpp"
+#include "defrag.hpp"
+#include "ext2driver.h"
+#include "device.hpp"
+#include "diff.hpp"
+#include "extract.hpp"
 #include "filesystem.hpp"
+#include "frag.hpp"
+#include "fsck.hpp"
+#include "hash.hpp"
+#include "index.hpp"
+#include "manifest.hpp"
+#include "mkimage.hpp"
+#include "overlay.hpp"
+#include "remove.hpp"
+#include "resolve.hpp"
+#include "tar.hpp"
+#include "trace.hpp"
+#include "walker.hpp"
+#include "writer.hpp"
 
 std::filesystem::path image_dir; // A temporary dir for image generation
 std::filesystem::path log_dir;   // A directory for failed output
@@ -270,6 +297,34 @@ void Hasher::build(uint8_t output[16]) {
     }
 }
 
+/* A small image with the host directory copied in by mke2fs, which keeps the holes of sparse files */
+static void make_small_image(const std::filesystem::path& host, const std::filesystem::path& image)
+{
+  const char* mke2fs = std::getenv("MKE2FS");
+  std::filesystem::remove(image);
+
+  const std::string cmd = std::string(mke2fs ? mke2fs : "mke2fs") + " -q -F -t ext2 -b 4096 -d " + host.string() +
+                          " " + image.string() + " 16M";
+  ASSERT_EQ(std::system(cmd.c_str()), 0) << cmd;
+}
+
+/* size bytes of zeros except for data at offset, the blocks in between are a hole */
+static void write_sparse_file(const std::filesystem::path& path, off_t size, off_t offset, const std::string& data)
+{
+  const int fd = open(path.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+  ASSERT_GE(fd, 0);
+  ASSERT_EQ(pwrite(fd, "head", 4, 0), 4);
+  ASSERT_EQ(pwrite(fd, data.data(), data.size(), offset), (ssize_t)data.size());
+  ASSERT_EQ(ftruncate(fd, size), 0);
+  close(fd);
+}
+
+static std::string read_host_file(const std::filesystem::path& path)
+{
+  std::ifstream file(path, std::ios::binary);
+  return std::string(std::istreambuf_iterator<char>(file), std::istreambuf_iterator<char>());
+}
+
 TEST_F(ReadTest, ReadTest)
 {
   std::ifstream json_file(static_cast<std::string>(image_dir) + "/index.json");
@@ -383,3 +438,1328 @@ TEST_F(ReadTest, QueryTest)
 
   free(buffer);
 }
+
+TEST_F(ReadTest, ManifestTest)
+{
+  std::ifstream json_file(static_cast<std::string>(image_dir) + "/index.json");
+  const auto data = nlohmann::json::parse(json_file);
+
+  Filesystem fs((static_cast<std::string>(image_dir) + "/test.img").c_str());
+  Manifest manifest = Manifest::build(fs, "/", 4);
+
+  std::unordered_set<std::string> expected;
+  std::unordered_set<std::string> got;
+
+  for (auto f : data["files"]) {
+    const int dir_index = f["root_index"].template get<int>();
+    const std::string dir = data["directories"][dir_index]["name"].template get<std::string>();
+    expected.insert((dir.empty() ? "/" : "/" + dir + "/") + f["file"].template get<std::string>());
+  }
+
+  for (const ManifestEntry& entry : manifest.entries) {
+    if (entry.path.starts_with("/lost+found")) continue;
+    got.insert(entry.path);
+  }
+
+  if (expected != got) {
+    FAIL() << "The manifest doesn't list the files of the image.";
+  }
+
+  FILE* null_output = fopen("/dev/null", "w");
+  EXPECT_EQ(manifest.compare(manifest, null_output), 0);
+  fclose(null_output);
+}
+
+TEST_F(ReadTest, SparseManifestTest)
+{
+  const std::filesystem::path host = image_dir / "sparse_source";
+  const std::filesystem::path image = image_dir / "sparse.img";
+  std::filesystem::remove_all(host);
+  std::filesystem::create_directories(host);
+
+  /* Data after a hole in the middle, the two files only differ in their last byte */
+  write_sparse_file(host / "a", 400 * 1024, 400 * 1024 - 1, "a");
+  write_sparse_file(host / "b", 400 * 1024, 400 * 1024 - 1, "b");
+  make_small_image(host, image);
+
+  Filesystem fs(image.c_str(), Filesystem::OPEN_READ_ONLY);
+  Manifest manifest = Manifest::build(fs, "/", 2);
+
+  std::map<std::string, u64> digests;
+  for (const ManifestEntry& entry : manifest.entries) digests[entry.path] = entry.hash;
+
+  for (const char* name : {"a", "b"}) {
+    const std::string contents = read_host_file(host / name);
+    EXPECT_EQ(digests["/" + std::string(name)], XXHash64::hash({(const u8*)contents.data(), contents.size()})) << name;
+  }
+  EXPECT_NE(digests["/a"], digests["/b"]);
+
+  std::filesystem::remove_all(host);
+  std::filesystem::remove(image);
+}
+
+TEST_F(ReadTest, DiffTest)
+{
+  const std::filesystem::path host_a = image_dir / "diff_source_a";
+  const std::filesystem::path host_b = image_dir / "diff_source_b";
+  const std::filesystem::path image_a = image_dir / "diff_a.img";
+  const std::filesystem::path image_b = image_dir / "diff_b.img";
+  const std::string long_target(100, 't');
+
+  for (const std::filesystem::path& host : {host_a, host_b}) {
+    std::filesystem::remove_all(host);
+    std::filesystem::create_directories(host / "dir");
+    write_sparse_file(host / "same_sparse", 400 * 1024, 400 * 1024 - 1, "s");
+    std::filesystem::create_symlink(long_target, host / "long_link");
+  }
+
+  std::ofstream(host_a / "removed.txt") << "removed";
+  std::ofstream(host_b / "added.txt") << "added";
+  std::ofstream(host_a / "dir" / "modified.txt") << "one";
+  std::ofstream(host_b / "dir" / "modified.txt") << "two";
+  write_sparse_file(host_a / "sparse", 400 * 1024, 400 * 1024 - 1, "a");
+  write_sparse_file(host_b / "sparse", 400 * 1024, 400 * 1024 - 1, "b");
+  std::filesystem::create_symlink("targetAA", host_a / "link");
+  std::filesystem::create_symlink("targetBB", host_b / "link");
+
+  /* Different mtimes on every B entry, so equal sizes always go down to a content compare */
+  const timespec later[2] = {{2000000000, 0}, {2000000000, 0}};
+  for (const std::filesystem::directory_entry& entry : std::filesystem::recursive_directory_iterator(host_b))
+    ASSERT_EQ(utimensat(AT_FDCWD, entry.path().c_str(), later, AT_SYMLINK_NOFOLLOW), 0);
+
+  make_small_image(host_a, image_a);
+  make_small_image(host_b, image_b);
+
+  Filesystem fs_a(image_a.c_str(), Filesystem::OPEN_READ_ONLY);
+  Filesystem fs_b(image_b.c_str(), Filesystem::OPEN_READ_ONLY);
+  ImageDiff image_diff(fs_a, fs_b, 2);
+
+  std::vector<std::string> changes;
+  for (const DiffEntry& change : image_diff.run("/"))
+    changes.push_back(std::string(1, (char)change.kind) + " " + change.path);
+
+  const std::vector<std::string> expected = {
+      "+ /added.txt", "M /dir/modified.txt", "M /link", "- /removed.txt", "M /sparse",
+  };
+  EXPECT_EQ(changes, expected);
+
+  for (const std::filesystem::path& host : {host_a, host_b}) std::filesystem::remove_all(host);
+  std::filesystem::remove(image_a);
+  std::filesystem::remove(image_b);
+}
+
+TEST_F(ReadTest, FsckTest)
+{
+  const std::string image = static_cast<std::string>(image_dir) + "/test.img";
+
+  ConsistencyChecker checker(image.c_str(), 4, stdout);
+  FsckReport report = checker.run();
+
+  if (report.total() != 0) {
+    FAIL() << "The consistency checker found " << report.total() << " problems in a freshly generated image.";
+  }
+}
+
+TEST_F(ReadTest, FsckCorruptionTest)
+{
+  const std::filesystem::path host = image_dir / "fsck_source";
+  const std::string image = static_cast<std::string>(image_dir) + "/fsck.img";
+  const std::string delta = static_cast<std::string>(image_dir) + "/fsck.delta";
+  std::filesystem::remove_all(host);
+  std::filesystem::remove(delta);
+  std::filesystem::create_directories(host);
+  std::ofstream(host / "file") << std::string(3 * 4096, 'x');
+  make_small_image(host, image);
+
+  /* Each problem is made once through the overlay, the base stays a clean image to compare with */
+  {
+    Filesystem fs(image.c_str(), delta.c_str(), 0);
+
+    Inode inode;
+    const u32 inode_id = fs.get_inode_from_path("/file", &inode);
+    inode.hard_link_count++;
+    fs.write_inode(inode_id, &inode);
+
+    u32 free_block;
+    ASSERT_TRUE(fs.find_free_run(1, 0, &free_block));
+    fs.set_blocks_allocated(free_block, 1, true);
+    fs.set_blocks_allocated(inode.block_pointers[0], 1, false);
+    fs.write_bgds();
+    fs.device->flush();
+  }
+
+  ConsistencyChecker corrupted(image.c_str(), delta.c_str(), 4, stdout);
+  const FsckReport report = corrupted.run();
+  EXPECT_EQ(report.bad_link_counts, 1);
+  EXPECT_EQ(report.leaked_blocks, 1);
+  EXPECT_EQ(report.orphaned_blocks, 1);
+  EXPECT_EQ(report.total(), 3);
+
+  ConsistencyChecker clean(image.c_str(), 4, stdout);
+  EXPECT_EQ(clean.run().total(), 0);
+
+  std::filesystem::remove_all(host);
+  std::filesystem::remove(image);
+  std::filesystem::remove(delta);
+}
+
+TEST_F(ReadTest, IndexTest)
+{
+  const std::string image = static_cast<std::string>(image_dir) + "/test.img";
+  const std::string index_path = image + ".idx";
+
+  Filesystem fs(image.c_str(), Filesystem::OPEN_READ_ONLY);
+  Filesystem indexed(image.c_str(), Filesystem::OPEN_READ_ONLY);
+  indexed.load_index(index_path.c_str());
+  ASSERT_TRUE(indexed.index);
+
+  u8* buffer = fs.allocate_block();
+
+  fs.walk("/", [&](const std::filesystem::path& path, u32 inode_id, Inode& inode) {
+    Inode indexed_inode;
+    if (indexed.get_inode_from_path(path, &indexed_inode) != inode_id) {
+      FAIL() << "The index maps " << path << " to the wrong inode.";
+    }
+
+    u64 data_blocks = 0, run_blocks = 0;
+    fs.walk_block_pointers(inode, [&](u32, i64 logical_block) { if (logical_block >= 0) data_blocks++; });
+    for (const BlockRun& run : indexed.index->runs(inode_id)) run_blocks += run.length;
+    EXPECT_EQ(data_blocks, run_blocks) << "Block runs of " << path;
+
+    if (!inode.is_directory()) return;
+
+    usize entry_count = 0;
+    DirInodeIterator dir_iter(&fs, inode, buffer);
+    for (DirectoryEntry* entry : dir_iter) { UNUSED(entry); entry_count++; }
+    EXPECT_EQ(entry_count, indexed.index->entries(inode_id).size()) << "Listing of " << path;
+  });
+
+  free(buffer);
+}
+
+TEST_F(ReadTest, StaleIndexTest)
+{
+  const std::filesystem::path host = image_dir / "index_source";
+  const std::filesystem::path image = image_dir / "index.img";
+  const std::string index_path = image.string() + ".idx";
+  std::filesystem::remove_all(host);
+  std::filesystem::create_directories(host / "tree");
+  std::ofstream(host / "tree" / "one") << "1111";
+  std::ofstream(host / "two") << "2222";
+  make_small_image(host / "tree", image);
+
+  Filesystem fs(image.c_str(), 0);
+  SidecarIndex::build(index_path.c_str(), fs);
+  ASSERT_TRUE(std::unique_ptr<SidecarIndex>(SidecarIndex::open(index_path.c_str(), fs)));
+
+  /* File timestamps only move with the kernel's clock tick */
+  std::this_thread::sleep_for(std::chrono::milliseconds(20));
+
+  /* Same free counts and, within the second, the same superblock write time as before */
+  Remover remover(fs);
+  remover.add("/one", false);
+  remover.run();
+  ImageWriter writer(fs);
+  writer.add(host / "two", "/two");
+  writer.finish();
+
+  EXPECT_FALSE(std::unique_ptr<SidecarIndex>(SidecarIndex::open(index_path.c_str(), fs)));
+
+  fs.load_index(index_path.c_str());
+  Inode inode;
+  EXPECT_NE(fs.get_inode_from_path("/two", &inode), 0);
+  u32 inode_id = 0;
+  EXPECT_FALSE(fs.index->lookup("/one", &inode_id));
+
+  /* Cut off in the middle of its tables, an index is stale and not read past its end */
+  std::filesystem::resize_file(index_path, sizeof(IndexHeader) + 16);
+  EXPECT_FALSE(std::unique_ptr<SidecarIndex>(SidecarIndex::open(index_path.c_str(), fs)));
+
+  std::filesystem::remove_all(host);
+  std::filesystem::remove(image);
+  std::filesystem::remove(index_path);
+}
+
+TEST_F(ReadTest, BatchedInodeTest)
+{
+  const std::string image = static_cast<std::string>(image_dir) + "/test.img";
+
+  Filesystem fs(image.c_str(), Filesystem::OPEN_READ_ONLY);
+
+  std::vector<u32> inode_ids;
+  fs.walk("/", [&](const std::filesystem::path&, u32 inode_id, Inode&) { inode_ids.push_back(inode_id); });
+  std::shuffle(inode_ids.begin(), inode_ids.end(), std::mt19937(std::random_device()()));
+
+  std::vector<Inode> inodes(inode_ids.size());
+  fs.read_inodes(inode_ids, inodes.data());
+
+  for (usize i = 0; i < inode_ids.size(); i++) {
+    Inode expected;
+    fs.read_inode(inode_ids[i], &expected);
+    if (memcmp(&expected, &inodes[i], sizeof(Inode))) {
+      FAIL() << "Batched read of inode " << inode_ids[i] << " differs from a single read.";
+    }
+  }
+}
+
+TEST_F(ReadTest, ExtractTest)
+{
+  std::ifstream json_file(static_cast<std::string>(image_dir) + "/index.json");
+  const auto data = nlohmann::json::parse(json_file);
+
+  const std::filesystem::path output = image_dir / "extracted";
+
+  Filesystem fs((static_cast<std::string>(image_dir) + "/test.img").c_str(), Filesystem::OPEN_READ_ONLY);
+
+  Extractor extractor(fs);
+  extractor.add_tree("/", output);
+  extractor.run();
+
+  std::vector<uint8_t> contents;
+
+  for (auto f : data["files"]) {
+    const std::string file = f["file"].template get<std::string>();
+    const int dir_index = f["root_index"].template get<int>();
+    const std::string md5 = f["md5"].template get<std::string>();
+    const std::filesystem::path host_path = output / data["directories"][dir_index]["name"].template get<std::string>() / file;
+
+    std::ifstream host_file(host_path, std::ios::binary);
+    contents.assign(std::istreambuf_iterator<char>(host_file), std::istreambuf_iterator<char>());
+
+    Hasher hasher;
+    uint8_t output_buf[16];
+    hasher.append(contents);
+    hasher.build(output_buf);
+
+    std::string rep;
+    for (int i = 0; i < 16; i++) {
+      rep += std::format("{:02x}", output_buf[i]);
+    }
+
+    if (rep != md5) {
+      FAIL() << "Failed to verify the extracted " << host_path << ". The hashes don't match.";
+    }
+  }
+}
+
+/* Streams root of the image to a file and unpacks it with the host tar */
+static void export_and_untar(const std::filesystem::path& image, const std::filesystem::path& root,
+                             const std::filesystem::path& archive, const std::filesystem::path& output)
+{
+  {
+    Filesystem fs(image.c_str(), Filesystem::OPEN_READ_ONLY);
+    const int fd = open(archive.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    ASSERT_GE(fd, 0);
+    TarWriter writer(fs, fd);
+    writer.write_tree(root);
+    close(fd);
+  }
+
+  std::filesystem::remove_all(output);
+  std::filesystem::create_directories(output);
+  const std::string cmd = "tar -xf " + archive.string() + " -C " + output.string();
+  ASSERT_EQ(std::system(cmd.c_str()), 0) << cmd;
+}
+
+TEST_F(ReadTest, TarExportTest)
+{
+  std::ifstream json_file(static_cast<std::string>(image_dir) + "/index.json");
+  const auto data = nlohmann::json::parse(json_file);
+
+  const std::filesystem::path archive = image_dir / "export.tar";
+  const std::filesystem::path output = image_dir / "untarred";
+  export_and_untar(image_dir / "test.img", "/", archive, output);
+
+  std::vector<uint8_t> contents;
+
+  for (auto f : data["files"]) {
+    const int dir_index = f["root_index"].template get<int>();
+    const std::filesystem::path host_path =
+        output / data["directories"][dir_index]["name"].template get<std::string>() / f["file"].template get<std::string>();
+    std::ifstream host_file(host_path, std::ios::binary);
+    contents.assign(std::istreambuf_iterator<char>(host_file), std::istreambuf_iterator<char>());
+
+    Hasher hasher;
+    uint8_t output_buf[16];
+    hasher.append(contents);
+    hasher.build(output_buf);
+
+    std::string rep;
+    for (int i = 0; i < 16; i++) {
+      rep += std::format("{:02x}", output_buf[i]);
+    }
+    EXPECT_EQ(rep, f["md5"].template get<std::string>()) << host_path;
+  }
+
+  std::filesystem::remove_all(output);
+  std::filesystem::remove(archive);
+}
+
+TEST_F(ReadTest, TarPaxTest)
+{
+  const std::filesystem::path host = image_dir / "tar_source";
+  const std::filesystem::path image = image_dir / "tar.img";
+  const std::filesystem::path archive = image_dir / "tar.tar";
+  const std::filesystem::path output = image_dir / "tar_output";
+
+  /* Past the 100 bytes of the ustar name and link name fields, only a pax record can hold them */
+  const std::filesystem::path long_dir = std::filesystem::path(std::string(60, 'd')) / std::string(60, 'e');
+  const std::string long_target(150, 't');
+
+  std::filesystem::remove_all(host);
+  std::filesystem::create_directories(host / long_dir);
+  std::ofstream(host / "plain.txt") << "plain";
+  std::ofstream(host / long_dir / "long.txt") << "long";
+  std::filesystem::create_hard_link(host / long_dir / "long.txt", host / "hard.txt");
+  std::filesystem::create_symlink(long_target, host / "symlink");
+  write_sparse_file(host / "sparse", 400 * 1024, 400 * 1024 - 1, "s");
+  make_small_image(host, image);
+
+  export_and_untar(image, "/", archive, output);
+
+  for (const std::filesystem::path& name : {std::filesystem::path("plain.txt"), long_dir / "long.txt",
+                                            std::filesystem::path("hard.txt"), std::filesystem::path("sparse")})
+    EXPECT_EQ(read_host_file(output / name), read_host_file(host / name)) << name;
+
+  /* Whichever of the two names came first, the other is a link to it */
+  EXPECT_TRUE(std::filesystem::equivalent(output / "hard.txt", output / long_dir / "long.txt"));
+  EXPECT_EQ(std::filesystem::read_symlink(output / "symlink"), long_target);
+
+  std::filesystem::remove_all(host);
+  std::filesystem::remove_all(output);
+  std::filesystem::remove(image);
+  std::filesystem::remove(archive);
+}
+
+TEST_F(ReadTest, TraceTest)
+{
+  const std::filesystem::path trace = image_dir / "trace.json";
+  const std::filesystem::path output = image_dir / "traced";
+
+  /* The trace is written by the atexit handler, so the traced work runs in a child that exits normally */
+  const pid_t child = fork();
+  ASSERT_GE(child, 0);
+  if (child == 0) {
+    Tracer::start(trace.c_str());
+
+    /* Still recording while the process exits, finish has to stop taking its events before it writes */
+    std::thread([] {
+      while (true) {
+        TRACE_SCOPE("TraceTest::spin");
+        std::this_thread::sleep_for(std::chrono::microseconds(50));
+      }
+    }).detach();
+
+    Filesystem fs((image_dir / "test.img").c_str(), Filesystem::OPEN_READ_ONLY);
+    Extractor extractor(fs, 4);
+    extractor.add_tree("/", output);
+    extractor.run();
+    exit(0);
+  }
+
+  int status = 0;
+  ASSERT_EQ(waitpid(child, &status, 0), child);
+  ASSERT_TRUE(WIFEXITED(status) && WEXITSTATUS(status) == 0);
+
+  std::ifstream trace_file(trace);
+  const auto data = nlohmann::json::parse(trace_file);
+
+  std::unordered_set<std::string> names;
+  for (const auto& event : data["traceEvents"]) {
+    EXPECT_EQ(event["ph"], "X");
+    EXPECT_TRUE(event["ts"].is_number_unsigned() && event["dur"].is_number_unsigned());
+    names.insert(event["name"].template get<std::string>());
+  }
+  EXPECT_TRUE(names.contains("Extractor::run"));
+
+  std::filesystem::remove_all(output);
+  std::filesystem::remove(trace);
+}
+
+TEST_F(ReadTest, FragTest)
+{
+  const std::string image = static_cast<std::string>(image_dir) + "/test.img";
+
+  Filesystem fs(image.c_str(), Filesystem::OPEN_READ_ONLY);
+
+  u64 files = 0, data_blocks = 0;
+  fs.walk("/", [&](const std::filesystem::path&, u32, Inode& inode) {
+    if (!inode.is_file()) return;
+
+    u64 blocks = 0;
+    fs.walk_block_pointers(inode, [&](u32, i64 logical_block) { if (logical_block >= 0) blocks++; });
+    if (blocks) files++;
+    data_blocks += blocks;
+  });
+
+  FragmentationScanner scanner(fs, 4, 5);
+  FragReport report = scanner.run();
+
+  EXPECT_EQ(report.files, files);
+  EXPECT_EQ(report.data_blocks, data_blocks);
+  EXPECT_GE(report.extents, report.files);
+  EXPECT_LE(report.worst.size(), 5);
+
+  u64 free_blocks = 0;
+  for (const GroupFreeSpace& space : report.groups) free_blocks += space.free_blocks;
+  EXPECT_EQ(free_blocks, fs.superblock.unallocated_blocks);
+}
+
+TEST_F(ReadTest, DefragTest)
+{
+  const std::filesystem::path host = image_dir / "defrag_source";
+  const std::filesystem::path image = image_dir / "defrag.img";
+  const std::filesystem::path delta = image_dir / "defrag.delta";
+  std::filesystem::remove_all(host);
+  std::filesystem::remove(delta);
+  std::filesystem::create_directories(host / "empty");
+  make_small_image(host / "empty", image);
+
+  std::mt19937 random(42);
+  std::string big(64 * 4096 + 123, '\0');
+  for (char& c : big) c = random();
+  std::ofstream(host / "big", std::ios::binary) << big;
+
+  /* Same as the scanner, indirect blocks in line with the data don't break an extent */
+  auto count_extents = [](Filesystem& fs, const Inode& inode) {
+    u32 extents = 0;
+    u64 next_block = 0;
+    fs.walk_block_pointers(inode, [&](u32 block, i64 logical_block) {
+      if (logical_block >= 0 && block != next_block) extents++;
+      if (logical_block >= 0 || block == next_block) next_block = (u64)block + 1;
+    });
+    return extents;
+  };
+
+  {
+    /* Through an overlay, like a defrag that can be thrown away */
+    Filesystem fs(image.c_str(), delta.c_str(), 0);
+
+    /* Every other free block taken while the file is written, so it gets no two blocks in a row */
+    std::vector<u32> comb;
+    u32 block;
+    while (fs.find_free_run(1, 0, &block)) {
+      fs.set_blocks_allocated(block, 1, true);
+      comb.push_back(block);
+    }
+    for (usize i = 0; i < comb.size(); i += 2) fs.set_blocks_allocated(comb[i], 1, false);
+
+    ImageWriter writer(fs);
+    writer.add(host / "big", "/big");
+    for (usize i = 1; i < comb.size(); i += 2) fs.set_blocks_allocated(comb[i], 1, false);
+    writer.finish();
+
+    Inode inode;
+    fs.get_inode_from_path("/big", &inode);
+    ASSERT_GT(count_extents(fs, inode), 1);
+
+    FragmentationScanner scanner(fs, 1, SIZE_MAX);
+    FragReport fragmentation = scanner.run();
+    ASSERT_EQ(fragmentation.worst.size(), 1);
+
+    Defragmenter defragmenter(fs, stdout);
+    DefragReport report = defragmenter.run(fragmentation.worst, 0);
+    EXPECT_EQ(report.moved_files, 1);
+
+    fs.get_inode_from_path("/big", &inode);
+    EXPECT_EQ(count_extents(fs, inode), 1);
+  }
+
+  Filesystem fs(image.c_str(), delta.c_str(), Filesystem::OPEN_READ_ONLY);
+  Inode inode;
+  fs.get_inode_from_path("/big", &inode);
+  std::string contents(big.size(), '\0');
+  EXPECT_EQ(fs.read_file(inode, 0, (u8*)contents.data(), contents.size()), big.size());
+  EXPECT_EQ(contents, big);
+
+  ConsistencyChecker checker(image.c_str(), delta.c_str(), 4, stdout);
+  EXPECT_EQ(checker.run().total(), 0);
+
+  std::filesystem::remove_all(host);
+  std::filesystem::remove(image);
+  std::filesystem::remove(delta);
+}
+
+TEST_F(ReadTest, DeviceTest)
+{
+  const std::string image = static_cast<std::string>(image_dir) + "/test.img";
+
+  Filesystem file_fs(image.c_str(), Filesystem::OPEN_READ_ONLY);
+  Manifest expected = Manifest::build(file_fs, "/", 1);
+
+  int fd = open(image.c_str(), O_RDONLY);
+  ASSERT_GE(fd, 0);
+  const off_t size = lseek(fd, 0, SEEK_END);
+  u8* data = (u8*)mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+  ASSERT_NE(data, MAP_FAILED);
+
+  {
+    Filesystem memory_fs(std::make_unique<MemoryDevice>(data, size, true), Filesystem::OPEN_READ_ONLY);
+    Manifest got = Manifest::build(memory_fs, "/", 4);
+
+    FILE* null_output = fopen("/dev/null", "w");
+    EXPECT_EQ(got.compare(expected, null_output), 0);
+    fclose(null_output);
+  }
+
+  munmap(data, size);
+  close(fd);
+
+  std::ifstream stream(image, std::ios::binary);
+  Filesystem stream_fs(std::make_unique<StreamDevice>(stream), Filesystem::OPEN_READ_ONLY);
+  Manifest got = Manifest::build(stream_fs, "/", 4);
+
+  FILE* null_output = fopen("/dev/null", "w");
+  EXPECT_EQ(got.compare(expected, null_output), 0);
+
+  /* Whether the host allows O_DIRECT or not, the contents must not change */
+  Filesystem direct_fs(image.c_str(), Filesystem::OPEN_READ_ONLY | Filesystem::OPEN_DIRECT);
+  Manifest direct = Manifest::build(direct_fs, "/", 4);
+  EXPECT_EQ(direct.compare(expected, null_output), 0);
+
+  fclose(null_output);
+}
+
+Task hash_file_async(IoLoop& loop, Filesystem& fs, u32 inode_id, u64* output)
+{
+  Inode inode;
+  fs.read_inode(inode_id, &inode);
+
+  std::vector<u8> buffer(fs.block_size);
+  XXHash64 hasher;
+
+  AsyncGenerator<std::span<u8>> blocks = async_blocks(loop, fs, inode, buffer.data());
+  while (std::optional<std::span<u8>> block = co_await blocks.next()) hasher.append(*block);
+
+  *output = hasher.digest();
+}
+
+Task list_directory_async(IoLoop& loop, Filesystem& fs, Inode inode, std::unordered_set<std::string>* output)
+{
+  std::vector<u8> buffer(fs.block_size);
+
+  AsyncGenerator<DirectoryEntry*> entries = async_dir_entries(loop, fs, inode, buffer.data());
+  while (std::optional<DirectoryEntry*> entry = co_await entries.next()) output->insert(std::string{(*entry)->name(&fs)});
+}
+
+TEST_F(ReadTest, AsyncTest)
+{
+  Filesystem fs((static_cast<std::string>(image_dir) + "/test.img").c_str(), Filesystem::OPEN_READ_ONLY);
+  Manifest expected = Manifest::build(fs, "/", 1);
+
+  std::unordered_map<std::string, u32> inodes;
+  fs.walk("/", [&](const std::filesystem::path& path, u32 inode_id, Inode& inode) {
+    if (inode.is_file()) inodes[path.string()] = inode_id;
+  });
+
+  std::vector<u64> hashes(expected.entries.size());
+  IoLoop loop(16);
+
+  for (size_t i = 0; i < expected.entries.size(); i++)
+    loop.spawn(hash_file_async(loop, fs, inodes[expected.entries[i].path], &hashes[i]));
+
+  std::unordered_set<std::string> expected_names;
+  std::unordered_set<std::string> got_names;
+
+  u8* buffer = (u8*)malloc(fs.block_size);
+  DirInodeIterator dir_iter(&fs, fs.root_inode, buffer);
+  for (DirectoryEntry* entry : dir_iter) expected_names.insert(std::string{entry->name(&fs)});
+  free(buffer);
+
+  loop.spawn(list_directory_async(loop, fs, fs.root_inode, &got_names));
+  loop.run();
+
+  EXPECT_EQ(expected_names, got_names);
+
+  for (size_t i = 0; i < expected.entries.size(); i++) {
+    if (hashes[i] != expected.entries[i].hash) {
+      FAIL() << "Failed to verify " << expected.entries[i].path << " through the async API.";
+    }
+  }
+}
+
+TEST_F(ReadTest, LookupTest)
+{
+  Filesystem fs((static_cast<std::string>(image_dir) + "/test.img").c_str(), Filesystem::OPEN_READ_ONLY);
+  u8* buffer = fs.allocate_block();
+  u8* search_buffer = fs.allocate_block();
+
+  Inode root = fs.root_inode;
+  usize found = 0;
+
+  for (DirectoryEntry* entry : DirInodeIterator(&fs, root, buffer)) {
+    const std::string name{entry->name(&fs)};
+    EXPECT_EQ(fs.find_entry(root, name, search_buffer), entry->inode) << name;
+
+    /* Same length and a differing last byte, so the first 16 bytes alone must not be trusted */
+    std::string other = name;
+    other.back() ^= 1;
+    EXPECT_NE(fs.find_entry(root, other, search_buffer), entry->inode) << name;
+
+    found++;
+  }
+
+  EXPECT_GT(found, 2);
+  EXPECT_EQ(fs.find_entry(root, "does not exist", search_buffer), 0);
+
+  free(search_buffer);
+  free(buffer);
+}
+
+TEST_F(ReadTest, ResolveTest)
+{
+  std::ifstream json_file(static_cast<std::string>(image_dir) + "/index.json");
+  const auto data = nlohmann::json::parse(json_file);
+
+  Filesystem fs((static_cast<std::string>(image_dir) + "/test.img").c_str(), Filesystem::OPEN_READ_ONLY);
+  PathResolver resolver(fs);
+
+  std::vector<std::string> paths;
+  for (auto f : data["files"]) {
+    const int dir_index = f["root_index"].template get<int>();
+    paths.push_back("/" + data["directories"][dir_index]["name"].template get<std::string>() + "/" +
+                    f["file"].template get<std::string>());
+  }
+  ASSERT_FALSE(paths.empty());
+
+  /* A duplicate, the root, a missing name, a path through a file and one through a missing directory */
+  const usize existing = paths.size();
+  paths.push_back(paths.front());
+  paths.push_back("/");
+  paths.push_back("/lost+found/missing");
+  paths.push_back(paths.front() + "/below_a_file");
+  paths.push_back("/missing/lost+found");
+
+  for (const std::string& path : paths) resolver.add(path);
+  ResolvedPaths resolved = resolver.run();
+
+  ASSERT_EQ(resolved.inode_ids.size(), paths.size());
+  EXPECT_EQ(resolved.not_found, (std::vector<usize>{existing + 2, existing + 3, existing + 4}));
+
+  for (usize i = 0; i < existing + 2; i++) {
+    Inode inode;
+    ASSERT_EQ(resolved.inode_ids[i], fs.get_inode_from_path(paths[i], &inode)) << paths[i];
+    EXPECT_EQ(memcmp(&resolved.inodes[i], &inode, sizeof(Inode)), 0) << paths[i];
+  }
+}
+
+TEST_F(ReadTest, OverlayTest)
+{
+  const std::string image = static_cast<std::string>(image_dir) + "/test.img";
+  const std::string delta = static_cast<std::string>(image_dir) + "/test.delta";
+  std::filesystem::remove(delta);
+
+  Filesystem base(image.c_str(), Filesystem::OPEN_READ_ONLY);
+  std::vector<u8> original(base.block_size), written(base.block_size, 0x5a), read(base.block_size);
+
+  u32 block;
+  ASSERT_TRUE(base.find_free_run(1, 0, &block));
+  base.read_block(block, original.data());
+
+  {
+    Filesystem fs(image.c_str(), delta.c_str(), 0);
+    fs.write_block(block, written.data());
+
+    /* Straddles a granule boundary, both partial granules must keep their other bytes */
+    fs.device->write(fs.block_offset(block) + fs.block_size - 3, "abcdef", 6);
+    fs.device->flush();
+  }
+
+  memcpy(written.data() + base.block_size - 3, "abc", 3);
+
+  Filesystem overlay(image.c_str(), delta.c_str(), Filesystem::OPEN_READ_ONLY);
+  overlay.read_block(block, read.data());
+  EXPECT_EQ(read, written);
+
+  overlay.read_block(block + 1, read.data());
+  EXPECT_EQ(memcmp(read.data(), "def", 3), 0);
+
+  base.read_block(block, read.data());
+  EXPECT_EQ(read, original);
+
+  std::filesystem::remove(delta);
+}
+
+TEST_F(ReadTest, CommitTest)
+{
+  const std::filesystem::path host = image_dir / "commit_source";
+  const std::string image = static_cast<std::string>(image_dir) + "/commit.img";
+  const std::string delta = static_cast<std::string>(image_dir) + "/commit.delta";
+  const std::string output = static_cast<std::string>(image_dir) + "/committed.img";
+  std::filesystem::remove_all(host);
+  std::filesystem::remove(delta);
+  std::filesystem::remove(output);
+
+  /* A small image, commit copies all of it */
+  std::filesystem::create_directories(host);
+  std::ofstream(host / "file") << "contents";
+  make_small_image(host, image);
+
+  Filesystem base(image.c_str(), Filesystem::OPEN_READ_ONLY);
+  std::vector<u8> changed(base.block_size), unchanged(base.block_size), read(base.block_size);
+
+  u32 block;
+  ASSERT_TRUE(base.find_free_run(2, 0, &block));
+  base.read_block(block, changed.data());
+  base.read_block(block + 1, unchanged.data());
+
+  /* Within a single granule, its other bytes must come from the base */
+  memcpy(changed.data() + 100, "changed", 7);
+
+  OverlayDevice overlay(image.c_str(), delta.c_str());
+  overlay.write(base.block_offset(block) + 100, "changed", 7);
+  EXPECT_EQ(overlay.delta_granules(), 1);
+
+  overlay.commit(output.c_str());
+
+  Filesystem committed(output.c_str(), Filesystem::OPEN_READ_ONLY);
+  committed.read_block(block, read.data());
+  EXPECT_EQ(read, changed);
+  committed.read_block(block + 1, read.data());
+  EXPECT_EQ(read, unchanged);
+  EXPECT_EQ(std::filesystem::file_size(output), std::filesystem::file_size(image));
+
+  /* An existing file is never overwritten, least of all the base under the overlay */
+  EXPECT_THROW(overlay.commit(image.c_str()), PanicError);
+  base.read_block(block, read.data());
+  EXPECT_NE(read, changed);
+
+  std::filesystem::remove_all(host);
+  std::filesystem::remove(image);
+  std::filesystem::remove(delta);
+  std::filesystem::remove(output);
+}
+
+TEST_F(ReadTest, RemoveTest)
+{
+  const std::string image = static_cast<std::string>(image_dir) + "/test.img";
+  const std::string delta = static_cast<std::string>(image_dir) + "/remove.delta";
+  std::filesystem::remove(delta);
+
+  /* Through an overlay, the image is shared with the other tests */
+  Filesystem fs(image.c_str(), delta.c_str(), 0);
+  u8* buffer = fs.allocate_block();
+
+  std::string directory;
+  for (DirectoryEntry* entry : DirInodeIterator(&fs, fs.root_inode, buffer)) {
+    const std::string name{entry->name(&fs)};
+    if (entry->file_type(&fs) == Inode::FILE_TYPE_DIRECTORY && name != "." && name != ".." && name != "lost+found") {
+      directory = name;
+      break;
+    }
+  }
+  ASSERT_FALSE(directory.empty());
+
+  u64 blocks = 0, inodes = 0;
+  fs.walk("/" + directory, [&](const std::filesystem::path&, u32, Inode& inode) {
+    inodes++;
+    fs.walk_block_pointers(inode, [&](u32, i64) { blocks++; });
+  });
+
+  Inode inode;
+  fs.get_inode_from_path("/" + directory, &inode);
+  fs.walk_block_pointers(inode, [&](u32, i64) { blocks++; });
+
+  const u32 free_blocks = fs.superblock.unallocated_blocks;
+  const u32 free_inodes = fs.superblock.unallocated_inodes;
+
+  Remover remover(fs);
+  remover.add("/" + directory, true);
+  RemoveReport report = remover.run();
+
+  /* The generated images have no hard links, so everything below is freed */
+  EXPECT_EQ(report.files + report.directories, inodes + 1);
+  EXPECT_EQ(report.blocks, blocks);
+  EXPECT_EQ(fs.superblock.unallocated_blocks, free_blocks + blocks);
+  EXPECT_EQ(fs.superblock.unallocated_inodes, free_inodes + inodes + 1);
+
+  Inode root;
+  fs.read_inode(Inode::ROOT_INODE, &root);
+  EXPECT_EQ(fs.find_entry(root, directory, buffer), 0);
+
+  free(buffer);
+  std::filesystem::remove(delta);
+}
+
+TEST_F(ReadTest, WriteTest)
+{
+  const std::string image = static_cast<std::string>(image_dir) + "/test.img";
+  const std::string delta = static_cast<std::string>(image_dir) + "/write.delta";
+  const std::filesystem::path host = image_dir / "write_source";
+  const std::filesystem::path output = image_dir / "write_output";
+  std::filesystem::remove(delta);
+  std::filesystem::remove_all(host);
+  std::filesystem::remove_all(output);
+
+  /* Enough entries to grow the directory over several blocks, and a file that needs an indirect block */
+  std::filesystem::create_directories(host / "many");
+  for (int i = 0; i < 600; i++) std::ofstream(host / "many" / ("entry_with_a_longer_name_" + std::to_string(i))) << i;
+
+  std::mt19937 random(42);
+  std::string big(200 * 1024 + 123, '\0');
+  for (char& c : big) c = random();
+  std::ofstream(host / "big", std::ios::binary) << big;
+
+  /* Through an overlay, the image is shared with the other tests */
+  Filesystem fs(image.c_str(), delta.c_str(), 0);
+  const u32 free_inodes = fs.superblock.unallocated_inodes;
+
+  ImageWriter writer(fs);
+  writer.make_directory("/written", 0755);
+  writer.add(host, "/written/tree");
+  writer.finish();
+
+  EXPECT_EQ(fs.superblock.unallocated_inodes, free_inodes - 604);
+
+  Inode inode;
+  fs.get_inode_from_path("/written/tree/many", &inode);
+  u8* buffer = fs.allocate_block();
+  EXPECT_NE(fs.find_entry(inode, "entry_with_a_longer_name_599", buffer), 0);
+  free(buffer);
+
+  Extractor extractor(fs);
+  extractor.add_tree("/written/tree", output);
+  extractor.run();
+
+  std::ifstream big_file(output / "big", std::ios::binary);
+  EXPECT_EQ(std::string(std::istreambuf_iterator<char>(big_file), std::istreambuf_iterator<char>()), big);
+
+  for (int i = 0; i < 600; i++) {
+    std::ifstream file(output / "many" / ("entry_with_a_longer_name_" + std::to_string(i)));
+    std::string contents((std::istreambuf_iterator<char>(file)), std::istreambuf_iterator<char>());
+    ASSERT_EQ(contents, std::to_string(i));
+  }
+
+  std::filesystem::remove_all(host);
+  std::filesystem::remove_all(output);
+  std::filesystem::remove(delta);
+}
+
+TEST_F(ReadTest, HashIndexTest)
+{
+  const std::string image = static_cast<std::string>(image_dir) + "/test.img";
+  const std::string delta = static_cast<std::string>(image_dir) + "/hash.delta";
+  std::filesystem::remove(delta);
+
+  Filesystem fs(image.c_str(), delta.c_str(), 0);
+  ASSERT_TRUE(fs.e_superblock.has_optional_feature(OptionalFeatures::DirectoryHashIndex));
+
+  /* Enough names for many leaf splits, added one at a time like a bulk import does */
+  const std::filesystem::path host = image_dir / "hash_source";
+  std::filesystem::remove_all(host);
+  std::filesystem::create_directories(host);
+  std::ofstream(host / "file") << "contents";
+
+  ImageWriter writer(fs);
+  writer.make_directory("/hashed", 0755);
+  for (int i = 0; i < 3000; i++) writer.add(host / "file", "/hashed/name_" + std::to_string(i));
+  writer.finish();
+
+  Inode directory;
+  fs.get_inode_from_path("/hashed", &directory);
+  EXPECT_TRUE(directory.has_hash_indexed_directory());
+  EXPECT_GT(directory.lower_size / fs.block_size, 2);
+
+  u8* buffer = fs.allocate_block();
+  usize listed = 0;
+  for (DirectoryEntry* entry : DirInodeIterator(&fs, directory, buffer)) listed += entry->inode != 0;
+  EXPECT_EQ(listed, 3002);
+
+  for (int i = 0; i < 3000; i++) ASSERT_NE(fs.find_entry(directory, "name_" + std::to_string(i), buffer), 0) << i;
+  EXPECT_EQ(fs.find_entry(directory, "name_3000", buffer), 0);
+  free(buffer);
+
+  std::filesystem::remove_all(host);
+  std::filesystem::remove(delta);
+}
+
+TEST_F(ReadTest, LibraryTest)
+{
+  std::ifstream json_file(static_cast<std::string>(image_dir) + "/index.json");
+  const auto data = nlohmann::json::parse(json_file);
+
+  ext2_image* image = NULL;
+  ASSERT_EQ(ext2_open((static_cast<std::string>(image_dir) + "/test.img").c_str(), 0, &image), EXT2_OK);
+
+  std::vector<uint8_t> contents;
+  int checked = 0;
+
+  for (auto f : data["files"]) {
+    if (checked++ == 50) break;
+
+    const int dir_index = f["root_index"].template get<int>();
+    const std::string path = "/" + data["directories"][dir_index]["name"].template get<std::string>() + "/" +
+                             f["file"].template get<std::string>();
+
+    uint32_t inode = 0;
+    ASSERT_EQ(ext2_lookup(image, path.c_str(), &inode), EXT2_OK) << path;
+
+    struct ext2_stat stat;
+    ASSERT_EQ(ext2_stat(image, inode, &stat), EXT2_OK);
+
+    /* One byte more than the file, the read has to stop at its end */
+    contents.resize(stat.size + 1);
+    ASSERT_EQ(ext2_read(image, inode, 0, contents.data(), contents.size()), (int64_t)stat.size);
+    contents.resize(stat.size);
+
+    Hasher hasher;
+    uint8_t output_buf[16];
+    hasher.append(contents);
+    hasher.build(output_buf);
+
+    std::string rep;
+    for (int i = 0; i < 16; i++) {
+      rep += std::format("{:02x}", output_buf[i]);
+    }
+    EXPECT_EQ(rep, f["md5"].template get<std::string>()) << path;
+  }
+
+  std::vector<std::string> names;
+  auto collect = [](const char* name, size_t length, uint32_t, void* context) -> int {
+    static_cast<std::vector<std::string>*>(context)->emplace_back(name, length);
+    return 0;
+  };
+  ASSERT_EQ(ext2_iterate_directory(image, EXT2_ROOT_INODE, collect, &names), EXT2_OK);
+  EXPECT_NE(std::find(names.begin(), names.end(), "lost+found"), names.end());
+
+  const char* batch[] = {"/lost+found", "/lost+found/missing", "/"};
+  uint32_t inodes[3];
+  ASSERT_EQ(ext2_lookup_paths(image, batch, 3, inodes), EXT2_OK);
+  EXPECT_NE(inodes[0], 0);
+  EXPECT_EQ(inodes[1], 0);
+  EXPECT_EQ(inodes[2], EXT2_ROOT_INODE);
+
+  uint32_t inode = 0;
+  EXPECT_EQ(ext2_lookup(image, "/lost+found/missing", &inode), EXT2_ERROR_NOT_FOUND);
+  EXPECT_EQ(ext2_lookup(image, "relative", &inode), EXT2_ERROR_INVALID);
+  EXPECT_EQ(ext2_read(image, EXT2_ROOT_INODE, 0, contents.data(), 1), EXT2_ERROR_IS_DIRECTORY);
+  EXPECT_EQ(ext2_stat(image, 0, NULL), EXT2_ERROR_INVALID);
+
+  ext2_close(image);
+}
+
+TEST_F(ReadTest, LibraryErrorTest)
+{
+  const std::filesystem::path host = image_dir / "library_source";
+  const std::filesystem::path image = image_dir / "library.img";
+  const std::filesystem::path broken = image_dir / "library_broken.img";
+  std::filesystem::remove_all(host);
+  std::filesystem::create_directories(host);
+  make_small_image(host, image);
+
+  /* Each of these ended the process before, now they have to come back as an error code */
+  ext2_image* opened = NULL;
+  EXPECT_EQ(ext2_open((image_dir / "missing.img").c_str(), 0, &opened), EXT2_ERROR_IO);
+  EXPECT_EQ(errno, ENOENT);
+  EXPECT_EQ(opened, nullptr);
+
+  std::mt19937 random(42);
+  std::string garbage(64 * 1024, '\0');
+  for (char& c : garbage) c = random();
+  std::ofstream(broken, std::ios::binary) << garbage;
+  EXPECT_EQ(ext2_open(broken.c_str(), 0, &opened), EXT2_ERROR_CORRUPTED);
+
+  /* A valid image with one superblock field overwritten, offsets from the start of the superblock */
+  auto open_with = [&](u64 offset, const void* value, usize length) {
+    std::filesystem::copy_file(image, broken, std::filesystem::copy_options::overwrite_existing);
+    const int fd = open(broken.c_str(), O_WRONLY);
+    EXPECT_EQ(pwrite(fd, value, length, 1024 + offset), (ssize_t)length);
+    close(fd);
+
+    ext2_image* corrupted = NULL;
+    const int result = ext2_open(broken.c_str(), 0, &corrupted);
+    if (corrupted) ext2_close(corrupted);
+    return result;
+  };
+
+  const u32 zero = 0, huge = 0xffffff00;
+  const u16 odd_inode_size = 100;
+  EXPECT_EQ(open_with(offsetof(SuperBlock, inodes_in_block_group), &zero, 4), EXT2_ERROR_CORRUPTED);
+  EXPECT_EQ(open_with(offsetof(SuperBlock, blocks_in_block_group), &zero, 4), EXT2_ERROR_CORRUPTED);
+  EXPECT_EQ(open_with(offsetof(SuperBlock, block_size_logarythm), &huge, 4), EXT2_ERROR_CORRUPTED);
+  EXPECT_EQ(open_with(offsetof(SuperBlock, total_inodes), &huge, 4), EXT2_ERROR_CORRUPTED);
+  EXPECT_EQ(open_with(sizeof(SuperBlock) + offsetof(ExSuperBlock, inode_size), &odd_inode_size, 2),
+            EXT2_ERROR_CORRUPTED);
+
+  /* Still usable after all of the above */
+  ASSERT_EQ(ext2_open(image.c_str(), 0, &opened), EXT2_OK);
+  uint32_t inode = 0;
+  EXPECT_EQ(ext2_lookup(opened, "/lost+found", &inode), EXT2_OK);
+  ext2_close(opened);
+
+  std::filesystem::remove_all(host);
+  std::filesystem::remove(image);
+  std::filesystem::remove(broken);
+}
+
+TEST_F(ReadTest, WalkerTest)
+{
+  Filesystem fs((static_cast<std::string>(image_dir) + "/test.img").c_str(), Filesystem::OPEN_READ_ONLY);
+
+  std::map<std::string, u32> expected;
+  fs.walk("/", [&](const std::filesystem::path& path, u32 inode_id, Inode&) { expected[path.string()] = inode_id; });
+
+  const u32 threads = 8;
+  std::vector<std::map<std::string, u32>> found(threads);
+
+  ParallelWalker walker(fs, threads);
+  walker.run("/", [&](u32 worker, const WalkEntry& entry) {
+    ASSERT_LT(worker, threads);
+    ASSERT_TRUE(found[worker].emplace(std::string(entry.path), entry.inode_id).second) << entry.path;
+  });
+
+  std::map<std::string, u32> merged;
+  for (const auto& worker : found) merged.insert(worker.begin(), worker.end());
+
+  EXPECT_EQ(merged, expected);
+}
+
+TEST_F(ReadTest, MkimageTest)
+{
+  const std::filesystem::path host = image_dir / "mkimage_source";
+  const std::filesystem::path image = image_dir / "mkimage.img";
+  const std::filesystem::path output = image_dir / "mkimage_output";
+  std::filesystem::remove_all(host);
+  std::filesystem::remove_all(output);
+
+  /* A directory over several blocks, a file with a double indirect block, links of both kinds */
+  std::filesystem::create_directories(host / "many" / "nested");
+  for (int i = 0; i < 600; i++) std::ofstream(host / "many" / ("entry_with_a_longer_name_" + std::to_string(i))) << i;
+
+  std::mt19937 random(42);
+  std::string big(6 * 1024 * 1024 + 123, '\0');
+  for (char& c : big) c = random();
+  std::ofstream(host / "big", std::ios::binary) << big;
+
+  std::filesystem::create_symlink("big", host / "short_link");
+  std::filesystem::create_symlink(std::string(100, 'x'), host / "long_link");
+  std::filesystem::create_hard_link(host / "big", host / "many" / "nested" / "big");
+
+  /* Holes stay holes, the image is sized without them */
+  write_sparse_file(host / "sparse", 64 * 1024 * 1024, 40 * 1024 * 1024 + 5, "data");
+
+  ImageBuilder builder(host, 0);
+  const int fd = open(image.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+  ASSERT_GE(fd, 0);
+  const u64 written = builder.write(fd);
+  close(fd);
+  EXPECT_EQ(written, std::filesystem::file_size(image));
+  EXPECT_LT(written, 32 * 1024 * 1024);
+
+  ConsistencyChecker checker(image.c_str(), 4, stdout);
+  EXPECT_EQ(checker.run().total(), 0);
+
+  Filesystem fs(image.c_str(), Filesystem::OPEN_READ_ONLY);
+
+  Inode inode;
+  const u32 big_id = fs.get_inode_from_path("/big", &inode);
+  EXPECT_EQ(inode.hard_link_count, 2);
+  EXPECT_EQ(fs.get_inode_from_path("/many/nested/big", &inode), big_id);
+  fs.get_inode_from_path("/long_link", &inode);
+  EXPECT_TRUE(inode.is_symbolic_link());
+  fs.get_inode_from_path("/sparse", &inode);
+  EXPECT_EQ(inode.disk_sector_count, 4 * (4096 / 512)); /* Two data blocks, an indirect and a double indirect */
+
+  Extractor extractor(fs);
+  extractor.add_tree("/", output);
+  extractor.run();
+
+  std::ifstream big_file(output / "big", std::ios::binary);
+  EXPECT_EQ(std::string(std::istreambuf_iterator<char>(big_file), std::istreambuf_iterator<char>()), big);
+  EXPECT_TRUE(std::filesystem::equivalent(output / "big", output / "many" / "nested" / "big"));
+  EXPECT_EQ(std::filesystem::read_symlink(output / "long_link"), std::string(100, 'x'));
+  EXPECT_EQ(read_host_file(output / "sparse"), read_host_file(host / "sparse"));
+
+  for (int i = 0; i < 600; i++) {
+    std::ifstream file(output / "many" / ("entry_with_a_longer_name_" + std::to_string(i)));
+    std::string contents((std::istreambuf_iterator<char>(file)), std::istreambuf_iterator<char>());
+    EXPECT_EQ(contents, std::to_string(i));
+  }
+}
+
+TEST_F(ReadTest, SharedCacheTest)
+{
+  const std::string image = static_cast<std::string>(image_dir) + "/test.img";
+
+  auto listing = [&](u32 open_flags) {
+    Filesystem fs(image.c_str(), open_flags);
+
+    std::map<std::string, std::string> entries;
+    fs.walk("/", [&](const std::filesystem::path& path, u32, Inode& inode) {
+      entries[path.string()] = std::string((const char*)&inode, sizeof(Inode));
+    });
+    return entries;
+  };
+
+  /* The second cached open is served from what the first one left in the segment */
+  const auto expected = listing(Filesystem::OPEN_READ_ONLY);
+  EXPECT_EQ(listing(Filesystem::OPEN_READ_ONLY | Filesystem::OPEN_SHARED_CACHE), expected);
+  EXPECT_EQ(listing(Filesystem::OPEN_READ_ONLY | Filesystem::OPEN_SHARED_CACHE), expected);
+}
+
+TEST_F(ReadTest, ParallelExtractTest)
+{
+  const std::filesystem::path host = image_dir / "parallel_source";
+  const std::filesystem::path image = image_dir / "parallel.img";
+  const std::filesystem::path output = image_dir / "parallel_output";
+  std::filesystem::remove_all(host);
+  std::filesystem::remove_all(output);
+  std::filesystem::create_directories(host);
+  std::filesystem::create_directories(output);
+
+  /* Past the parallel threshold and not a whole number of ranges or blocks */
+  std::mt19937 random(7);
+  std::string big(70 * 1024 * 1024 + 4321, '\0');
+  for (usize i = 0; i + 4 <= big.size(); i += 4) {
+    const u32 word = random();
+    memcpy(&big[i], &word, 4);
+  }
+  std::ofstream(host / "big", std::ios::binary) << big;
+
+  ImageBuilder builder(host, 0);
+  const int fd = open(image.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+  ASSERT_GE(fd, 0);
+  builder.write(fd);
+  close(fd);
+
+  Filesystem fs(image.c_str(), Filesystem::OPEN_READ_ONLY);
+
+  Inode inode;
+  const u32 inode_id = fs.get_inode_from_path("/big", &inode);
+
+  Extractor extractor(fs, 4);
+  extractor.add_file(inode_id, inode, output / "big");
+  extractor.run();
+
+  std::ifstream big_file(output / "big", std::ios::binary);
+  EXPECT_EQ(std::string(std::istreambuf_iterator<char>(big_file), std::istreambuf_iterator<char>()), big);
+}
+
+TEST_F(ReadTest, SparseExtractTest)
+{
+  const std::filesystem::path host = image_dir / "sparse_extract_source";
+  const std::filesystem::path image = image_dir / "sparse_extract.img";
+  const std::filesystem::path output = image_dir / "sparse_extract_output";
+  std::filesystem::remove_all(host);
+  std::filesystem::remove_all(output);
+  std::filesystem::create_directories(host);
+
+  /* One below and one past the parallel threshold, each with a couple of blocks of data */
+  write_sparse_file(host / "small", 20 << 20, (20 << 20) - 1, "s");
+  write_sparse_file(host / "large", 80 << 20, (80 << 20) - 1, "l");
+  make_small_image(host, image);
+
+  Filesystem fs(image.c_str(), Filesystem::OPEN_READ_ONLY);
+  Extractor extractor(fs, 4);
+  extractor.add_tree("/", output);
+  extractor.run();
+
+  for (const char* name : {"small", "large"}) {
+    EXPECT_EQ(read_host_file(output / name), read_host_file(host / name)) << name;
+
+    /* Only the mapped blocks are allocated, the holes stay holes on the host */
+    struct stat info;
+    ASSERT_EQ(stat((output / name).c_str(), &info), 0);
+    EXPECT_LT(info.st_blocks * 512, 1 << 20) << name;
+  }
+
+  std::filesystem::remove_all(host);
+  std::filesystem::remove_all(output);
+  std::filesystem::remove(image);
+}
+
+/* Counts the bytes read from the blocks [first, end) */
+class CountingDevice : public BlockDevice
+{
+public:
+  FileDevice inner;
+  u64 first = 0, end = 0;
+  std::atomic<u64> bytes = 0;
+
+  explicit CountingDevice(const char* path) : inner(path, true) {}
+
+  void read(u64 offset, void* buffer, usize length) override
+  {
+    const u64 from = std::max(offset, this->first), to = std::min(offset + length, this->end);
+    if (from < to) this->bytes += to - from;
+    this->inner.read(offset, buffer, length);
+  }
+  void write(u64 offset, const void* buffer, usize length) override { this->inner.write(offset, buffer, length); }
+  u64 size() const override { return this->inner.size(); }
+  bool writable() const override { return false; }
+};
+
+TEST_F(ReadTest, HardLinkExtractTest)
+{
+  const std::filesystem::path host = image_dir / "hard_link_source";
+  const std::filesystem::path image = image_dir / "hard_link.img";
+  const std::filesystem::path output = image_dir / "hard_link_output";
+  std::filesystem::remove_all(host);
+  std::filesystem::remove_all(output);
+  std::filesystem::create_directories(host / "sub");
+
+  std::mt19937 random(7);
+  std::string data(10 * 4096, '\0');
+  for (char& c : data) c = random();
+  std::ofstream(host / "data", std::ios::binary) << data;
+  std::filesystem::create_hard_link(host / "data", host / "sub" / "link");
+  make_small_image(host, image);
+
+  auto device = std::make_unique<CountingDevice>(image.c_str());
+  CountingDevice& counter = *device;
+  Filesystem fs(std::move(device), Filesystem::OPEN_READ_ONLY);
+
+  Inode inode;
+  const u32 inode_id = fs.get_inode_from_path("/data", &inode);
+  ASSERT_EQ(inode.hard_link_count, 2);
+
+  /* mke2fs lays the ten direct blocks out in one run */
+  for (u32 i = 1; i < 10; i++) ASSERT_EQ(inode.block_pointers[i], inode.block_pointers[0] + i);
+  counter.first = fs.block_offset(inode.block_pointers[0]);
+  counter.end = counter.first + data.size();
+
+  {
+    Extractor extractor(fs, 4);
+    extractor.add_tree("/", output);
+    extractor.run();
+  }
+
+  /* One read of the data for both names, the second one is a host hard link */
+  EXPECT_EQ(counter.bytes, data.size());
+  EXPECT_TRUE(std::filesystem::equivalent(output / "data", output / "sub" / "link"));
+  EXPECT_EQ(read_host_file(output / "sub" / "link"), data);
+
+  /* Linking across host filesystems fails with EXDEV, that name then gets a copy of its own */
+  std::filesystem::path other;
+  struct stat output_info, other_info;
+  ASSERT_EQ(stat(output.c_str(), &output_info), 0);
+  for (const char* candidate : {"/dev/shm", "/tmp", "/var/tmp"})
+    if (stat(candidate, &other_info) == 0 && other_info.st_dev != output_info.st_dev) {
+      other = std::filesystem::path(candidate) / ("hard_link_copy_" + std::to_string(getpid()));
+      break;
+    }
+
+  if (other.empty()) {
+    std::filesystem::remove_all(host);
+    std::filesystem::remove_all(output);
+    std::filesystem::remove(image);
+    GTEST_SKIP() << "No second host filesystem to link across.";
+  }
+
+  counter.bytes = 0;
+  {
+    Extractor extractor(fs);
+    extractor.add_file(inode_id, inode, output / "again");
+    extractor.add_file(inode_id, inode, other);
+    extractor.run();
+  }
+
+  EXPECT_EQ(read_host_file(other), data);
+  EXPECT_EQ(read_host_file(output / "again"), data);
+  EXPECT_EQ(counter.bytes, 2 * data.size());
+
+  std::filesystem::remove(other);
+  std::filesystem::remove_all(host);
+  std::filesystem::remove_all(output);
+  std::filesystem::remove(image);
+}